@@ -1,101 +1,203 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "address_alloc.h"
 
+/*** Macros **************************************************************/
+
+#define INITIAL_SLOTS	64
+
+/*
+ * A pool of the addresses in a private prefix, kept as offsets from its
+ * base.  Offsets from first up to next have been handed out at some
+ * point; those given back since sit on the free stack.  The bitmap has
+ * one bit per offset below next, set while that address is in use.
+ */
 typedef struct address_alloc {
-	char class;
-	long counter;
+	unsigned long base;		/* The prefix, as a host order number */
+	unsigned long first;	/* The lowest offset handed out */
+	unsigned long last;		/* The highest offset handed out */
+	unsigned long next;		/* The lowest offset never handed out */
+	unsigned long used;		/* The number of addresses in use */
+	unsigned long *free_stack;
+	unsigned long free_count;
+	unsigned long free_cap;
+	unsigned char *in_use;
+	unsigned long in_use_cap;	/* The number of offsets in_use covers */
 } address_alloc_t;
 
 /*** Helper Function Prototypes ******************************************/
 
+unsigned long address_to_number(unsigned char *address);
+void number_to_address(unsigned long number, unsigned char *address);
+int grow_in_use(address_alloc_t *pool, unsigned long offset);
 
 /*** Functions ***********************************************************/
 
-unsigned char *allocate_address(address_alloc_ptr addresses) 
+/**
+ * Allocate a pool over the default private prefix, 10.0.0.0/8.
+ *
+ * @return The new pool, NULL on failure.
+ */
+address_alloc_t *new_address_allocator() 
+{
+	unsigned char base[4] = {10, 0, 0, 0};
+
+	return new_address_pool(base, DEFAULT_POOL_PREFIX);
+}
+
+/**
+ * Allocate a pool over a private prefix.  The network and broadcast
+ * addresses of the prefix are never handed out, unless it is a /31 or
+ * a /32.
+ *
+ * @param[in] base:			The first address of the prefix.  The bits 
+ *							past the prefix length are ignored.
+ * @param[in] prefix_len:	The length of the prefix, 8 to 32.
+ *
+ * @return The new pool, NULL on failure or if the prefix is not private.
+ */
+address_alloc_t *new_address_pool(unsigned char *base, int prefix_len)
 {
-	int class;
-	unsigned char *ret_address = NULL;
-	if (!addresses) {
+	unsigned long size;
+	unsigned long mask;
+	unsigned char last_address[4];
+	address_alloc_t *pool = NULL;
+
+	if ((prefix_len < 8) || (prefix_len > 32)) {
+		printf("invalid pool prefix length %d\n", prefix_len);
+		return NULL;
+	}
+	size = 1UL << (32 - prefix_len);
+	mask = (0xffffffffUL << (32 - prefix_len)) & 0xffffffffUL;
+
+	/* both ends of the prefix must be private */
+	number_to_address((address_to_number(base) & mask) + size - 1, 
+			last_address);
+	if ((!is_private_address(base)) || (!is_private_address(last_address))) {
+		printf("the address pool must be a private prefix\n");
 		return NULL;
 	}
-	ret_address = malloc(4);
-	if (!ret_address) {
+
+	pool = malloc(sizeof(address_alloc_t));
+	if (!pool) {
 		printf("Memory error\n");
 		return NULL;
 	}
+	pool->base = address_to_number(base) & mask;
+	if (prefix_len <= 30) {
+		pool->first = 1;
+		pool->last = size - 2;
+	} else {
+		pool->first = 0;
+		pool->last = size - 1;
+	}
+	pool->next = pool->first;
+	pool->used = 0;
+	pool->free_stack = NULL;
+	pool->free_count = 0;
+	pool->free_cap = 0;
+	pool->in_use = NULL;
+	pool->in_use_cap = 0;
 
-	class = (int)addresses->class;
-
-	switch (class) {
-CASE_A:
-		case A:
-			if (addresses->counter > A_MAX) {
-				addresses->class = (addresses->class + 1) % 3;
-				addresses->counter = 0;
-			} else {
-				ret_address[0] = (unsigned char)10;
-				ret_address[1] = 
-					(unsigned char)((LEFT_BITS & addresses->counter) >> 16);
-				ret_address[2] = 
-					(unsigned char)((MIDDLE_BITS & addresses->counter) >> 8);
-				ret_address[3] = 
-					(unsigned char)(RIGHT_BITS & addresses->counter);
-				break;
-			}
-			/* Fall through */
-		case B:
-			if (addresses->counter > B_MAX) {
-				addresses->class = (addresses->class + 1) % 3;
-				addresses->counter = 0;
-			} else {
-				ret_address[0] = (unsigned char)172;
-				ret_address[1] = 
-					(unsigned char)(16 + ((LEFT_BITS & addresses->counter) >> 16));
-				ret_address[2] = 
-					(unsigned char)((MIDDLE_BITS & addresses->counter) >> 8);
-				ret_address[3] = 
-					(unsigned char)(RIGHT_BITS & addresses->counter);
-				break;
-			}
-			/* Fall through */
-		case C:
-			if (addresses->counter > C_MAX) {
-				addresses->class = (addresses->class + 1) % 3;
-				addresses->counter = 0;
-				goto CASE_A;
-			} else {
-				ret_address[0] = (unsigned char)192;
-				ret_address[1] = (unsigned char)168;
-				ret_address[2] = 
-					(unsigned char)((MIDDLE_BITS & addresses->counter) >> 8);
-				ret_address[3] = 
-					(unsigned char)(RIGHT_BITS & addresses->counter);
-				break;
-			}
-		default:
-			printf("big fault in updating class number\n");
-	}
-	addresses->counter++;
-	return ret_address;
+	return pool;
 }
 
+void free_address_allocator(address_alloc_ptr allocator)
+{
+	if (!allocator) {
+		return;
+	}
+	free(allocator->free_stack);
+	free(allocator->in_use);
+	free(allocator);
+}
 
-address_alloc_t *new_address_allocator() 
+/**
+ * Hand out an address of the pool that is not in use, in constant time.
+ * Released addresses are handed out again before fresh ones.  Not
+ * thread safe, the caller locks.
+ *
+ * @param[in] pool:		The pool.
+ * @param[out] address:	The 4 bytes to write the address to.
+ *
+ * @return TRUE(1) on success, FALSE(0) if every address is in use.
+ */
+int allocate_address(address_alloc_ptr pool, unsigned char *address) 
+{
+	unsigned long offset;
+
+	if (!pool) {
+		return FALSE;
+	}
+	if (pool->free_count > 0) {
+		offset = pool->free_stack[--pool->free_count];
+	} else if (pool->next <= pool->last) {
+		if (!grow_in_use(pool, pool->next)) {
+			return FALSE;
+		}
+		offset = pool->next++;
+	} else {
+		return FALSE;
+	}
+
+	pool->in_use[offset / 8] |= (unsigned char)(1 << (offset % 8));
+	pool->used++;
+	number_to_address(pool->base + offset, address);
+	return TRUE;
+}
+
+/**
+ * Give back an address handed out by allocate_address.  Addresses that
+ * are not in use are ignored.  Not thread safe, the caller locks.
+ *
+ * @param[in] pool:		The pool.
+ * @param[in] address:	The address.
+ *
+ * @return TRUE(1) if the address went back into the pool, FALSE(0) if it
+ * was not in use.
+ */
+int release_address(address_alloc_ptr pool, unsigned char *address)
 {
-	address_alloc_t *addresses = malloc(sizeof(address_alloc_t));
+	unsigned long offset;
+	unsigned long cap;
+	unsigned long *grown = NULL;
 
-	if (addresses) {
-		addresses->class = (char)0;
-		addresses->counter = 0;
+	if ((!pool) || (!address)) {
+		return FALSE;
+	}
+	offset = address_to_number(address) - pool->base;
+	if ((address_to_number(address) < pool->base) || (offset < pool->first) 
+			|| (offset >= pool->next) 
+			|| (!(pool->in_use[offset / 8] & (1 << (offset % 8))))) {
+		return FALSE;
 	}
 
-	return addresses;
+	/* the stack never holds more than next - first offsets */
+	if (pool->free_count == pool->free_cap) {
+		cap = pool->free_cap ? 2 * pool->free_cap : INITIAL_SLOTS;
+		grown = realloc(pool->free_stack, cap * sizeof(unsigned long));
+		if (!grown) {
+			printf("Memory error\n");
+			return FALSE;
+		}
+		pool->free_stack = grown;
+		pool->free_cap = cap;
+	}
+	pool->in_use[offset / 8] &= (unsigned char)~(1 << (offset % 8));
+	pool->free_stack[pool->free_count++] = offset;
+	pool->used--;
+	return TRUE;
 }
 
-void free_address_allocator(address_alloc_ptr allocator)
+/**
+ * The number of addresses of the pool that are in use.
+ *
+ * @param[in] pool: The pool.
+ */
+unsigned long address_pool_used(address_alloc_ptr pool)
 {
-	free(allocator);
+	return pool ? pool->used : 0;
 }
 
 void print_address(unsigned char *address)
@@ -135,20 +237,43 @@ int is_private_address(unsigned char *address)
 	return result;
 }
 
-#ifdef DEBUG
 
-void set_counter(address_alloc_ptr addresses, long count) 
+/*** Helper Functions ****************************************************/
+
+unsigned long address_to_number(unsigned char *address)
 {
-	addresses->counter = count;
+	return ((unsigned long)address[0] << 24) | ((unsigned long)address[1] << 16) 
+		| ((unsigned long)address[2] << 8) | (unsigned long)address[3];
 }
 
-void set_class(address_alloc_ptr addresses, char class) 
+void number_to_address(unsigned long number, unsigned char *address)
 {
-	addresses->class = class;
+	address[0] = (unsigned char)((number >> 24) & 255);
+	address[1] = (unsigned char)((number >> 16) & 255);
+	address[2] = (unsigned char)((number >> 8) & 255);
+	address[3] = (unsigned char)(number & 255);
 }
 
-#endif
-
-
+/* make the bitmap cover offset, doubling it so that handing out fresh
+ * addresses stays constant time on average */
+int grow_in_use(address_alloc_t *pool, unsigned long offset)
+{
+	unsigned long cap = pool->in_use_cap ? pool->in_use_cap : 8 * INITIAL_SLOTS;
+	unsigned char *grown = NULL;
 
-/*** Helper Functions ****************************************************/
+	if (offset < pool->in_use_cap) {
+		return TRUE;
+	}
+	while (cap <= offset) {
+		cap *= 2;
+	}
+	grown = realloc(pool->in_use, cap / 8);
+	if (!grown) {
+		printf("Memory error\n");
+		return FALSE;
+	}
+	memset(grown + (pool->in_use_cap / 8), 0, (cap - pool->in_use_cap) / 8);
+	pool->in_use = grown;
+	pool->in_use_cap = cap;
+	return TRUE;
+}
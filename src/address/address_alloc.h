@@ -1,38 +1,68 @@
 #ifndef ADDRESS_ALLOC_H
 #define ADDRESS_ALLOC_H
 
-#define RIGHT_BITS	255
-#define MIDDLE_BITS (255 << 8)
-#define LEFT_BITS	(255 << 16)
-#define A 0
-#define B 1
-#define C 2
-#define A_MAX ((long)RIGHT_BITS + (long)MIDDLE_BITS + (long)LEFT_BITS)
-#define B_MAX ((long)RIGHT_BITS + (long)MIDDLE_BITS + (long)(15 << 16))
-#define C_MAX ((long)RIGHT_BITS + (long)MIDDLE_BITS)
+#define DEFAULT_POOL_PREFIX	8	/* The default pool is 10.0.0.0/8 */
 
 #define TRUE  1
 #define FALSE 0
 
 typedef struct address_alloc *address_alloc_ptr;
 
-unsigned char *allocate_address(address_alloc_ptr);
-
+/**
+ * Allocate a pool over the default private prefix, 10.0.0.0/8.
+ *
+ * @return The new pool, NULL on failure.
+ */
 address_alloc_ptr new_address_allocator();
 
-void free_address_allocator(address_alloc_ptr allocator);
+/**
+ * Allocate a pool over a private prefix.  The network and broadcast
+ * addresses of the prefix are never handed out, unless it is a /31 or
+ * a /32.
+ *
+ * @param[in] base:			The first address of the prefix.  The bits 
+ *							past the prefix length are ignored.
+ * @param[in] prefix_len:	The length of the prefix, 8 to 32.
+ *
+ * @return The new pool, NULL on failure or if the prefix is not private.
+ */
+address_alloc_ptr new_address_pool(unsigned char *base, int prefix_len);
 
-void print_address(unsigned char *address);
-
-int is_private_address(unsigned char *address);
+void free_address_allocator(address_alloc_ptr allocator);
 
-#ifdef DEBUG 
+/**
+ * Hand out an address of the pool that is not in use, in constant time.
+ * Released addresses are handed out again before fresh ones.  Not
+ * thread safe, the caller locks.
+ *
+ * @param[in] pool:		The pool.
+ * @param[out] address:	The 4 bytes to write the address to.
+ *
+ * @return TRUE(1) on success, FALSE(0) if every address is in use.
+ */
+int allocate_address(address_alloc_ptr pool, unsigned char *address);
 
-void set_counter(address_alloc_ptr addresses, long count);
+/**
+ * Give back an address handed out by allocate_address.  Addresses that
+ * are not in use are ignored.  Not thread safe, the caller locks.
+ *
+ * @param[in] pool:		The pool.
+ * @param[in] address:	The address.
+ *
+ * @return TRUE(1) if the address went back into the pool, FALSE(0) if it
+ * was not in use.
+ */
+int release_address(address_alloc_ptr pool, unsigned char *address);
 
-void set_class(address_alloc_ptr addresses, char class);
+/**
+ * The number of addresses of the pool that are in use.
+ *
+ * @param[in] pool: The pool.
+ */
+unsigned long address_pool_used(address_alloc_ptr pool);
 
-#endif
+void print_address(unsigned char *address);
 
+int is_private_address(unsigned char *address);
 
 #endif
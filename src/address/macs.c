@@ -1,21 +1,57 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "macs.h"
 
+/*** Macros **************************************************************/
+
+#define HALF_BITS		(MAC_BITS / 2)
+#define HALF_MASK		((1UL << HALF_BITS) - 1)
+#define MAC_MASK		((HALF_MASK << HALF_BITS) | HALF_MASK)
+#define ROUNDS			4
+#define RELEASED_START	16
+
 /*
 typedef struct mac_list {
 	pthread_mutex_t *lockq;
-	mac_hashset_ptr q;
+	unsigned long next;
+	unsigned long key;
+	unsigned long *released;
+	int released_count;
+	int released_cap;
 } mac_list_t;
 */
 
-void random_mac(unsigned char *mac);
-unsigned char random_char();
+/*** Helper Function Prototypes ******************************************/
+
+unsigned long permute(unsigned long key, unsigned long counter);
+unsigned long round_function(unsigned long key, int round, unsigned long half);
+void mac_from_bits(unsigned long bits, unsigned char *mac);
+unsigned long bits_from_mac(unsigned char *mac);
+
+/*** Functions ***********************************************************/
 
+/**
+ * Allocate a mac allocator, with a permutation picked by the time.
+ *
+ * @return The new allocator, NULL on failure.
+ */
 mac_list_t *new_mac_list()
 {
-	mac_hashset_ptr hs = NULL;
+	return new_mac_list_seeded((unsigned long)time(NULL));
+}
+
+/**
+ * Allocate a mac allocator that hands out the same addresses, in the
+ * same order, every time it is made with the same seed.
+ *
+ * @param[in] seed: Picks the permutation.
+ *
+ * @return The new allocator, NULL on failure.
+ */
+mac_list_t *new_mac_list_seeded(unsigned long seed)
+{
 	mac_list_t *list = malloc(sizeof(mac_list_t));
 
 	if (!list) {
@@ -23,23 +59,27 @@ mac_list_t *new_mac_list()
 	}
 
 	list->lockq = malloc(sizeof(pthread_mutex_t));
-	mac_hashset_init_defaults(&hs);
-	list->hs = hs;
+	list->released = NULL;
+	list->released_count = 0;
+	list->released_cap = 0;
+	list->next = 0;
+	list->key = seed;
 
 	if (list->lockq) {
 		pthread_mutex_init(list->lockq, NULL);
-	}
-	
-	if ((!list->hs) || (!list->lockq)) {
+	} else {
 		free_mac_list(list);
 		return NULL;
 	}
 
-	srand((int)time(NULL));
-
 	return list;
 }
 
+/**
+ * Free the allocator.
+ *
+ * @param[in] list: The allocator to be free'd.
+ */
 void free_mac_list(mac_list_t *list)
 {
 	if (!list) {
@@ -51,46 +91,119 @@ void free_mac_list(mac_list_t *list)
 		free(list->lockq);
 		list->lockq = NULL;
 	}
-	if (list->hs) {
-		free_mac_hashset(list->hs);
-		list->hs = NULL;
-	}
+	free(list->released);
+	list->released = NULL;
 	
 	free(list);
 }
 
-unsigned char *gen_mac(mac_list_t *list)
+/**
+ * Hand out a mac address that is not in use.  Addresses that were
+ * released are handed out again first.  Safe to call from several
+ * threads.
+ *
+ * @param[in] list:	The allocator.
+ * @param[out] mac:	The 6 bytes to write the address to.
+ *
+ * @return 1 on success, 0 if all 2^40 addresses are in use.
+ */
+int gen_mac(mac_list_t *list, unsigned char *mac)
 {
-	unsigned char *mac = malloc(6);
+	unsigned long bits;
+
+	pthread_mutex_lock(list->lockq);
+	if (list->released_count > 0) {
+		bits = list->released[--list->released_count];
+	} else if (list->next <= MAC_MASK) {
+		bits = permute(list->key, list->next++);
+	} else {
+		pthread_mutex_unlock(list->lockq);
+		fprintf(stderr, "out of mac addresses\n");
+		return 0;
+	}
+	pthread_mutex_unlock(list->lockq);
 
-	random_mac(mac);
+	mac_from_bits(bits, mac);
+	return 1;
+}
 
-	while(!mac_hashset_insert(list->hs, mac, 1)) {
-		random_mac(mac);
+/**
+ * Give back a mac address handed out by gen_mac, once its user has gone.
+ * Releasing is optional: an allocator that never gets addresses back
+ * just keeps counting.
+ *
+ * @param[in] list:	The allocator that handed out the address.
+ * @param[in] mac:	The address.
+ */
+void release_mac(mac_list_t *list, unsigned char *mac)
+{
+	int cap;
+	unsigned long *grown = NULL;
+
+	pthread_mutex_lock(list->lockq);
+	if (list->released_count == list->released_cap) {
+		cap = list->released_cap ? 2 * list->released_cap : RELEASED_START;
+		grown = realloc(list->released, cap * sizeof(unsigned long));
+		if (!grown) {
+			/* the address is just not handed out again */
+			pthread_mutex_unlock(list->lockq);
+			return;
+		}
+		list->released = grown;
+		list->released_cap = cap;
 	}
-
-	/* remember, this will be free'd n mac_hashset */
-	return mac;
+	list->released[list->released_count++] = bits_from_mac(mac);
+	pthread_mutex_unlock(list->lockq);
 }
 
 
 /*** Helper Functions ****************************************************/
 
-void random_mac(unsigned char *mac) 
+/* a feistel network over the two 20 bit halves of the counter, which is
+ * a bijection on 40 bits whatever the round function */
+unsigned long permute(unsigned long key, unsigned long counter)
 {
 	int i;
-
-	for (i = 0; i < 6; i++) {
-		mac[i] = random_char();
+	unsigned long left = (counter >> HALF_BITS) & HALF_MASK;
+	unsigned long right = counter & HALF_MASK;
+	unsigned long temp;
+
+	for (i = 0; i < ROUNDS; i++) {
+		temp = right;
+		right = left ^ round_function(key, i, right);
+		left = temp;
 	}
+	return (left << HALF_BITS) | right;
 }
 
-unsigned char random_char()
+unsigned long round_function(unsigned long key, int round, unsigned long half)
 {
-	unsigned char c;
-	int r = rand();
+	unsigned long x = (half ^ (key >> (round * 8))) & 0xffffffffUL;
 
-	c = (unsigned char)(r % 256);
-	return c;
+	x = (x * 0x9e3779b1UL) & 0xffffffffUL;
+	x ^= x >> 15;
+	x = (x + key + (unsigned long)round) & 0xffffffffUL;
+	return (x ^ (x >> 13)) & HALF_MASK;
 }
 
+void mac_from_bits(unsigned long bits, unsigned char *mac)
+{
+	int i;
+
+	mac[0] = MAC_PREFIX;
+	for (i = 5; i > 0; i--) {
+		mac[i] = (unsigned char)(bits & 0xff);
+		bits >>= 8;
+	}
+}
+
+unsigned long bits_from_mac(unsigned char *mac)
+{
+	int i;
+	unsigned long bits = 0;
+
+	for (i = 1; i < 6; i++) {
+		bits = (bits << 8) | mac[i];
+	}
+	return bits;
+}
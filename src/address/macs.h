@@ -2,17 +2,70 @@
 #define MACS_H
 
 #include <pthread.h>
-#include "../hashset/mac_hashset.h"
 
+#define MAC_PREFIX	0x02	/* Locally administered, unicast */
+#define MAC_BITS	40		/* The bits after the prefix byte */
+
+/*
+ * Hands out the mac addresses of the users.  Each address is the prefix
+ * byte followed by a 40 bit counter, scrambled by a keyed permutation
+ * so that consecutive users don't get consecutive addresses.  Being a
+ * permutation, no two counter values give the same address, so nothing
+ * has to be remembered to avoid handing one out twice.
+ */
 typedef struct mac_list {
 	pthread_mutex_t *lockq;
-	mac_hashset_ptr hs;
+	unsigned long next;			/* The counter value of the next address */
+	unsigned long key;			/* Picks the permutation */
+	unsigned long *released;	/* Addresses given back, to hand out again */
+	int released_count;
+	int released_cap;
 } mac_list_t;
 
+/**
+ * Allocate a mac allocator, with a permutation picked by the time.
+ *
+ * @return The new allocator, NULL on failure.
+ */
 mac_list_t *new_mac_list();
 
+/**
+ * Allocate a mac allocator that hands out the same addresses, in the
+ * same order, every time it is made with the same seed.
+ *
+ * @param[in] seed: Picks the permutation.
+ *
+ * @return The new allocator, NULL on failure.
+ */
+mac_list_t *new_mac_list_seeded(unsigned long seed);
+
+/**
+ * Free the allocator.
+ *
+ * @param[in] list: The allocator to be free'd.
+ */
 void free_mac_list(mac_list_t *list);
 
-unsigned char *gen_mac(mac_list_t *list);
+/**
+ * Hand out a mac address that is not in use.  Addresses that were
+ * released are handed out again first.  Safe to call from several
+ * threads.
+ *
+ * @param[in] list:	The allocator.
+ * @param[out] mac:	The 6 bytes to write the address to.
+ *
+ * @return 1 on success, 0 if all 2^40 addresses are in use.
+ */
+int gen_mac(mac_list_t *list, unsigned char *mac);
+
+/**
+ * Give back a mac address handed out by gen_mac, once its user has gone.
+ * Releasing is optional: an allocator that never gets addresses back
+ * just keeps counting.
+ *
+ * @param[in] list:	The allocator that handed out the address.
+ * @param[in] mac:	The address.
+ */
+void release_mac(mac_list_t *list, unsigned char *mac);
 
 #endif
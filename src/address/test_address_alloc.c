@@ -3,29 +3,38 @@
 
 #include "address_alloc.h"
 
-void test_class(address_alloc_ptr addresses, char class);
+int test_pool(unsigned char *base, int prefix_len, int expected);
+int test_reuse();
 
 int main(void) 
 {
-	address_alloc_ptr addresses = new_address_allocator();
 	unsigned char address[4];
+	unsigned char base[4];
+	int fails = 0;
 
-	if(!addresses) {
-		printf("not allocated\n");
-		return 1;
-	}
-#ifndef DEBUG 
-	free(addresses);
-	printf("Please compile testing suite with flag -DDEBUG\n");
-	exit(2);
-#endif 
+	printf("10.0.0.0/30\n");
+	base[0] = 10; base[1] = 0; base[2] = 0; base[3] = 0;
+	fails += test_pool(base, 30, 2);
+	printf("172.16.5.0/24\n");
+	base[0] = 172; base[1] = 16; base[2] = 5; base[3] = 0;
+	fails += test_pool(base, 24, 254);
+	printf("192.168.7.8/31\n");
+	base[0] = 192; base[1] = 168; base[2] = 7; base[3] = 8;
+	fails += test_pool(base, 31, 2);
+	printf("Reuse\n");
+	fails += test_reuse();
 
-	printf("Class A\n");
-	test_class(addresses, (char)A);
-	printf("Class B\n");
-	test_class(addresses, (char)B);
-	printf("Class C\n");
-	test_class(addresses, (char)C);
+	printf("Public prefix\n");
+	base[0] = 121; base[1] = 0; base[2] = 0; base[3] = 0;
+	if (new_address_pool(base, 8)) {
+		printf("a public prefix was accepted\n");
+		fails++;
+	}
+	base[0] = 172; base[1] = 16; base[2] = 0; base[3] = 0;
+	if (new_address_pool(base, 8)) {
+		printf("a partly public prefix was accepted\n");
+		fails++;
+	}
 
 	printf("\n");
 	address[0] = (unsigned char)121;
@@ -73,43 +82,84 @@ int main(void)
 	}
 
 
-	free(addresses);
-	return 0;
+	printf("%d failures\n", fails);
+	return fails ? 1 : 0;
 }
 
-void test_class(address_alloc_ptr addresses, char class)
+/* hand out the whole pool, check it runs dry, and give it all back */
+int test_pool(unsigned char *base, int prefix_len, int expected)
 {
-	unsigned char *address = NULL;
+	address_alloc_ptr pool = new_address_pool(base, prefix_len);
+	unsigned char *addresses = NULL;
+	int fails = 0;
 	int i;
-	set_class(addresses, class);
-	switch (class) {
-		case A:
-			set_counter(addresses, A_MAX - 1);
-			break;
-		case B:
-			set_counter(addresses, B_MAX - 1);
-			break;
-		case C:
-			set_counter(addresses, C_MAX - 1);
+
+	if (!pool) {
+		printf("not allocated\n");
+		return 1;
+	}
+	addresses = malloc(4 * (expected + 1));
+	for (i = 0; allocate_address(pool, addresses + (4 * i)); i++) {
+		if (i == expected) {
+			printf("more addresses than expected\n");
+			fails++;
 			break;
-		default:
-			return;
+		}
+		if (!is_private_address(addresses + (4 * i))) {
+			printf("That was somehow a public address\n");
+			fails++;
+		}
+	}
+	if (i != expected) {
+		printf("%d addresses handed out, expected %d\n", i, expected);
+		fails++;
 	}
-	for (i = 0; i < 4; i++) {
-		address = allocate_address(addresses);
-		if (address) {
-			printf("address %d: ", i + 1);
-			print_address(address);
-			if (is_private_address(address)) {
-			} else {
-				printf("That was somehow a public address\n");
-			}
-		} else {
-			printf("error allocating address\n");
+	print_address(addresses);
+	print_address(addresses + (4 * (i - 1)));
+	while (i-- > 0) {
+		if (!release_address(pool, addresses + (4 * i))) {
+			printf("failed to release ");
+			print_address(addresses + (4 * i));
+			fails++;
 		}
-		free(address);
-		address = NULL;
 	}
-	
+	if (address_pool_used(pool) != 0) {
+		printf("addresses still in use after releasing them all\n");
+		fails++;
+	}
+	free(addresses);
+	free_address_allocator(pool);
+	return fails;
 }
 
+/* released addresses come back, and double releases are ignored */
+int test_reuse()
+{
+	address_alloc_ptr pool = new_address_allocator();
+	unsigned char a[4], b[4], c[4];
+	int fails = 0;
+
+	allocate_address(pool, a);
+	allocate_address(pool, b);
+	print_address(a);
+	print_address(b);
+	if (!release_address(pool, a)) {
+		printf("release failed\n");
+		fails++;
+	}
+	if (release_address(pool, a)) {
+		printf("double release accepted\n");
+		fails++;
+	}
+	allocate_address(pool, c);
+	if ((c[0] != a[0]) || (c[1] != a[1]) || (c[2] != a[2]) || (c[3] != a[3])) {
+		printf("released address was not handed out again\n");
+		fails++;
+	}
+	if (address_pool_used(pool) != 2) {
+		printf("wrong count of addresses in use\n");
+		fails++;
+	}
+	free_address_allocator(pool);
+	return fails;
+}
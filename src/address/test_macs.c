@@ -1,29 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "macs.h"
 
+#define MAC_COUNT	10000
+
 void print_mac(unsigned char *address);
+int cmp_macs(const void *a, const void *b);
 
 int main(void)
 {
 	int i;
-	unsigned char *address = NULL;
-	mac_list_t *list = new_mac_list();
+	int fails = 0;
+	unsigned char *addresses = malloc(6 * MAC_COUNT);
+	unsigned char again[6];
+	mac_list_t *list = new_mac_list_seeded(42);
+
+	if ((!addresses) || (!list)) {
+		fprintf(stderr, "failed to set up the test\n");
+		return 1;
+	}
 
-	for (i = 0; i < 10000; i++) {
+	for (i = 0; i < MAC_COUNT; i++) {
 		printf("%d) ", i + 1);
-		address = gen_mac(list);
-		print_mac(address);
-		address = NULL;
+		gen_mac(list, addresses + (6 * i));
+		print_mac(addresses + (6 * i));
+		if (addresses[6 * i] != MAC_PREFIX) {
+			printf("wrong prefix\n");
+			fails++;
+		}
+	}
+
+	/* a released address is the next one handed out */
+	release_mac(list, addresses + (6 * 17));
+	gen_mac(list, again);
+	if (memcmp(again, addresses + (6 * 17), 6)) {
+		printf("released address was not handed out again\n");
+		fails++;
 	}
 
+	qsort(addresses, MAC_COUNT, 6, cmp_macs);
+	for (i = 1; i < MAC_COUNT; i++) {
+		if (!cmp_macs(addresses + (6 * (i - 1)), addresses + (6 * i))) {
+			printf("duplicate: ");
+			print_mac(addresses + (6 * i));
+			fails++;
+		}
+	}
+
+	printf("%d failures\n", fails);
+
+	free(addresses);
 	free_mac_list(list);
 	list = NULL;
 
-	return 0;
+	return fails ? 1 : 0;
 }
 
+int cmp_macs(const void *a, const void *b)
+{
+	return memcmp(a, b, 6);
+}
 
 void print_mac(unsigned char *address)
 {
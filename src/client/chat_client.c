@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "chat_client.h"
 #include "../packet/packet.h"
@@ -183,6 +184,11 @@ CONNECT:
 
 		printf("receiving details from server\n");
 		packet = receive_packet(sd);
+		if (!packet) {
+			printf("Server went offline\n");
+			close(sd);
+			exit(1);
+		}
 		printf("received details from server\n");
 		if (client->internal) {
 			client_ip[0] = packet->header.dst_ip[0];
@@ -269,6 +275,7 @@ CONNECT:
 		} else if (strcmp(line, "help") == 0) {
 			printf("The following commands are supported:\n");
 			printf("\t\x1b[1;34msend\x1b[0m: \t\tSend a message.\n");
+			printf("\t\x1b[1;34msendfile\x1b[0m: \tSend the contents of a file.\n");
 			printf("\t\x1b[1;34mbroadcast\x1b[0m: \tBroadcast a message to all users.\n");
 			printf("\t\x1b[1;34mecho\x1b[0m: \t\tEcho a message to yourself.\n");
 			printf("\t\x1b[1;34mlistusers\x1b[0m: \t\tList the users currently online.\n");
@@ -315,6 +322,42 @@ CONNECT:
 			}
 			free(message);
 			message = NULL;
+		} else if (strcmp(line, "sendfile") == 0) {
+			printf("Type the user ip of your recipient: \n");
+			printf(">> ");
+			read_line(stdin, line);
+
+			sscanf(line, "%d.%d.%d.%d", dst_ip_int, dst_ip_int + 1,
+					dst_ip_int + 2, dst_ip_int + 3);
+			
+			dst_ip[0] = dst_ip_int[0];
+			dst_ip[1] = dst_ip_int[1];
+			dst_ip[2] = dst_ip_int[2];
+			dst_ip[3] = dst_ip_int[3];
+
+			printf("Type the path of the file to be sent: \n");
+			printf(">> ");
+			read_line(stdin, line);
+			
+			message = client_strdup(line);
+			if (!message) {
+				printf("some error copying the path\n");
+				continue;
+			}
+
+			printf("Type the target port to be sent to: \n");
+			printf(">> ");
+			read_line(stdin, line);
+			sscanf(line, "%d", &port);
+			if (send_file(client->speaker, message, dst_ip, port)) {
+				printf("%s sent to %d.%d.%d.%d\n", message, 
+						(int)dst_ip[0], (int)dst_ip[1], 
+						(int)dst_ip[2], (int)dst_ip[3]);
+			} else {
+				printf("Some error sending %s\n", message);
+			}
+			free(message);
+			message = NULL;
 	/*
 		} else if (strcmp(line, "broadcast") == 0) {
 			printf("Type the message to be broadcast: \n");
@@ -507,24 +550,27 @@ void client_append(chat_client_t *client, char *s)
 }
 
 /** 
- *	Receive a queue of usernames and display them to the standard
+ *	Receive a list of user ips and display them to the standard
  *	io interface of the client.
  *
  *	@param[in] client:	The client structure of the currently running
  *						client
- *	@param[in] users_q: The names of the users to be displayed
+ *	@param[in] ips:		The ips of the users to be displayed, 4 bytes
+ *						each
+ *	@param[in] count:	The number of ips
  */
-void client_show_online_users(chat_client_t *client, queue_t *users_q)
+void client_show_online_users(chat_client_t *client, unsigned char *ips, 
+		int count)
 {
+	int i;
 	unsigned char *user_ip;
-	node_t *node = NULL;
 	printf("Online Users being shown to %d.%d.%d.%d:\n", 
 			client->client_ip[0], 
 			client->client_ip[1], 
 			client->client_ip[2], 
 			client->client_ip[3]);
-	for (node = users_q->head; node; node = node->next) {
-		user_ip = (unsigned char *)node->data;
+	for (i = 0; i < count; i++) {
+		user_ip = ips + (4 * i);
 		printf("\t- %d.%d.%d.%d\n", (int)user_ip[0], (int)user_ip[1], 
 				(int)user_ip[2], (int)user_ip[3]);
 	}
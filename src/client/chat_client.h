@@ -59,13 +59,16 @@ void disconnect_client(chat_client_t *client);
 void client_append(chat_client_t *client, char *s);
 
 /** 
- *	Receive a queue of usernames and display them to the standard
+ *	Receive a list of user ips and display them to the standard
  *	io interface of the client.
  *
  *	@param[in] client:	The client structure of the currently running
  *						client
- *	@param[in] users_q: The names of the users to be displayed
+ *	@param[in] ips:		The ips of the users to be displayed, 4 bytes
+ *						each
+ *	@param[in] count:	The number of ips
  */
-void client_show_online_users(chat_client_t *client, queue_t *users_q);
+void client_show_online_users(chat_client_t *client, unsigned char *ips, 
+		int count);
 
 #endif
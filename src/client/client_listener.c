@@ -34,6 +34,7 @@ char *listen_strdup(char *s);
 unsigned char *listen_ipdup(unsigned char *s);
 int listener_is_running(client_listener_t *listener);
 int listen_ipcmp(unsigned char *a, unsigned char *b);
+void listener_show_fragment(client_listener_t *listener, packet_t *packet);
 
 /*** Functions ***********************************************************/
 
@@ -59,8 +60,9 @@ client_listener_t *new_client_listener(int sd, void *client, unsigned char *clie
 		listener->chat_client = client;
 		listener->client_ip = listen_ipdup(client_ip);
 		listener->running = TRUE;
+		listener->fragments = new_fragments();
 		listener->listen_mutex = malloc(sizeof(client_listener_t));
-		if (listener->listen_mutex) {
+		if ((listener->listen_mutex) && (listener->fragments)) {
 			pthread_mutex_init(listener->listen_mutex, NULL);
 		} else {
 			free_client_listener(listener);
@@ -93,6 +95,10 @@ void free_client_listener(client_listener_t *listener)
 		listener->client_ip = NULL;
 	}
 	listener->running = TRUE;
+	if (listener->fragments) {
+		free_fragments(listener->fragments);
+		listener->fragments = NULL;
+	}
 	if (listener->listen_mutex) {
 		pthread_mutex_destroy(listener->listen_mutex);
 		free(listener->listen_mutex);
@@ -185,15 +191,19 @@ void listener_go(client_listener_t *listener)
 			printf("Server went offline\n");
 			disconnect_client(listener->chat_client);
 			break;
+		} else if ((packet->code == SEND) && (packet_is_fragment(packet))) {
+			listener_show_fragment(listener, packet);
 		} else if(packet->code == SEND) {
-			sprintf(s, "%d.%d.%d.%d:%d:: %s\n", 
+			sprintf(s, "%d.%d.%d.%d:%d:: ", 
 					(int)packet->header.src_ip[0], 
 					(int)packet->header.src_ip[1], 
 					(int)packet->header.src_ip[2], 
 					(int)packet->header.src_ip[3],
-					packet->header.src_port,
-					(char *)packet->data);
+					packet->header.src_port);
 			client_append((chat_client_t *)listener->chat_client, s);
+			client_append((chat_client_t *)listener->chat_client, 
+					packet->data ? packet->data : "");
+			client_append((chat_client_t *)listener->chat_client, "\n");
 		} else if(packet->code == ECHO) {
 			sprintf(s, "YOU echoed: %s\n", packet->data);
 			client_append((chat_client_t *)listener->chat_client, s);
@@ -210,7 +220,8 @@ void listener_go(client_listener_t *listener)
 			client_append((chat_client_t *)listener->chat_client, s);
 		} else if(packet->code == GET_ULIST) {
 			printf("showing users\n");
-			client_show_online_users((chat_client_t *)listener->chat_client, packet->users);
+			client_show_online_users((chat_client_t *)listener->chat_client, 
+					packet->ips, packet->list_len);
 		} else {
 			printf("The server did something unorthodox\n");
 		}
@@ -221,6 +232,38 @@ void listener_go(client_listener_t *listener)
 	}
 }
 
+/* show a fragment of a long message as soon as it comes, so that
+ * nothing more than the one fragment is held */
+void listener_show_fragment(client_listener_t *listener, packet_t *packet)
+{
+	char s[MAX_LINE];
+	chat_client_t *client = (chat_client_t *)listener->chat_client;
+	int flags = fragments_accept(listener->fragments, packet);
+
+	if (flags & FRAGMENT_CUT) {
+		client_append(client, "\n[the message before was cut short]\n");
+	}
+	if (flags & FRAGMENT_SKIP) {
+		return;
+	}
+	if (flags & FRAGMENT_FIRST) {
+		sprintf(s, "%d.%d.%d.%d:%d:: (%ld characters)\n", 
+				(int)packet->header.src_ip[0], 
+				(int)packet->header.src_ip[1], 
+				(int)packet->header.src_ip[2], 
+				(int)packet->header.src_ip[3],
+				(int)(unsigned short)packet->header.src_port,
+				(long)packet->header.ack_no);
+		client_append(client, s);
+	}
+	if (packet->data) {
+		client_append(client, packet->data);
+	}
+	if (flags & FRAGMENT_LAST) {
+		client_append(client, "\n");
+	}
+}
+
 /* strdup is not ansi c, hence defined explicitly here */
 char *listen_strdup(char *s)
 {
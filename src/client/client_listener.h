@@ -1,6 +1,8 @@
 #ifndef CLIENT_LISTENER_H
 #define CLIENT_LISTENER_H
 
+#include "../packet/fragments.h"
+
 #define MAX_LINE 1024
 
 /*** Struct Definitions **************************************************/
@@ -14,6 +16,7 @@ typedef struct client_listener {
 	unsigned char *client_ip;		/* The username of the client */
 	int running;					/* Integer that functions as boolean */
 	pthread_mutex_t *listen_mutex;	/* A mutex for protecting the running boolean */
+	fragments_t *fragments;			/* Where each long message being received is at */
 } client_listener_t;
 
 /*** Function Prototypes *************************************************/
@@ -34,6 +34,8 @@ char *speaker_strdup(char *s);
 unsigned char *speaker_ipdup(unsigned char *s);
 int speaker_send_packet(client_speaker_t *speaker, packet_t *packet);
 int connect_speaker(client_speaker_t *speaker);
+int send_fragments(client_speaker_t *speaker, char *s, long len, 
+		unsigned char *dst_ip, int port);
 
 /*** Functions ***********************************************************/
 
@@ -152,8 +154,13 @@ void get_online_names(client_speaker_t *speaker)
 int send_string(client_speaker_t *speaker, char *s, unsigned char *dst_ip, 
 		int port)
 {
-	packet_t *packet = new_packet(SEND, speaker->client_ip, 
-			speaker_strdup(s), dst_ip, 8002, port);
+	packet_t *packet = NULL;
+	long len = strlen(s);
+
+	if (len > PACKET_CHUNK_CHARS) {
+		return send_fragments(speaker, s, len, dst_ip, port);
+	}
+	packet = new_packet(SEND, speaker->client_ip, s, dst_ip, 8002, port);
 	if (packet) {
 		if (!speaker_send_packet(speaker, packet)) {
 			fprintf(stderr, "Failed to send message packet\n");
@@ -169,6 +176,71 @@ int send_string(client_speaker_t *speaker, char *s, unsigned char *dst_ip,
 	return FALSE;
 }
 
+/**
+ * Send the contents of a file as a message to another user.  The file
+ * is read and sent a fragment at a time, so its size does not matter.
+ *
+ * @param[in] speaker:	The struct containing the socket descriptor to
+ *						be sent to.
+ * @param[in] path:		The file to be sent.
+ * @param[in] dst_ip:	The ip of the recipient.
+ * @param[in] port:		The port of the recipient.
+ *
+ * @return TRUE(1) if successful, FALSE(0) otherwise.
+ */
+int send_file(client_speaker_t *speaker, char *path, unsigned char *dst_ip,
+		int port)
+{
+	FILE *f = NULL;
+	long total;
+	long offset = 0;
+	int len;
+	char chunk[PACKET_CHUNK_CHARS];
+	packet_t *packet = NULL;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "could not open %s\n", path);
+		return FALSE;
+	}
+	if ((fseek(f, 0, SEEK_END) != 0) || ((total = ftell(f)) < 0) 
+			|| (total > 0x7fffffffL) || (fseek(f, 0, SEEK_SET) != 0)) {
+		fprintf(stderr, "could not tell the size of %s\n", path);
+		fclose(f);
+		return FALSE;
+	}
+
+	/* room for the largest chunk, which each one reuses */
+	packet = packet_reserve(new_packet(SEND, speaker->client_ip, NULL, 
+				dst_ip, 8002, port), PACKET_CHUNK_CHARS + 1);
+	if (!packet) {
+		fprintf(stderr, "could not make a packet to send the file with\n");
+		fclose(f);
+		return FALSE;
+	}
+	/* an empty file is a message of no fragments, so send it whole */
+	if (total == 0) {
+		speaker_send_packet(speaker, packet);
+	}
+	while (offset < total) {
+		len = (int)fread(chunk, 1, PACKET_CHUNK_CHARS, f);
+		if (len <= 0) {
+			/* the file shrunk, the recipient sees it cut short */
+			break;
+		}
+		if (len > total - offset) {
+			len = (int)(total - offset);
+		}
+		set_data_len(packet, chunk, len);
+		packet_set_fragment(packet, offset, total);
+		speaker_send_packet(speaker, packet);
+		offset += len;
+	}
+	free_packet(packet);
+	fclose(f);
+	return offset == total;
+}
+
 /**
  * Send a string to the server to be echoed back. 
  * @param[in] speaker:	The struct containing the socket descriptor to
@@ -179,7 +251,7 @@ int send_string(client_speaker_t *speaker, char *s, unsigned char *dst_ip,
 int echo_string(client_speaker_t *speaker, char *s)
 {
 	packet_t *packet = new_packet(ECHO, speaker->client_ip, 
-			speaker_strdup(s), NULL, 8002, 8002);
+			s, NULL, 8002, 8002);
 	if (packet) {
 		if (!speaker_send_packet(speaker, packet)) {
 			fprintf(stderr, "Failed to send packet for echoing\n");
@@ -206,7 +278,7 @@ int echo_string(client_speaker_t *speaker, char *s)
 int broadcast_string(client_speaker_t *speaker, char *s)
 {
 	packet_t *packet = new_packet(BROADCAST, speaker->client_ip, 
-			speaker_strdup(s), NULL, 8002, 8002);
+			s, NULL, 8002, 8002);
 	if (packet) {
 		if (!speaker_send_packet(speaker, packet)) {
 			fprintf(stderr, "Failed to send packet to broadcast with\n");
@@ -259,7 +331,7 @@ int speaker_login(client_speaker_t *speaker, char *pw)
 	printf("in client login function of speaker\n");
 
 	packet = new_packet(LOGIN, speaker->client_ip, 
-			speaker_strdup(pw), NULL, 8002, 8002);
+			pw, NULL, 8002, 8002);
 	printf("%d.%d.%d.%d\n", speaker->client_ip[0], speaker->client_ip[1], speaker->client_ip[2], speaker->client_ip[3]);
 
 	printf("Sending log in packet\n");
@@ -362,6 +434,33 @@ int speaker_send_packet(client_speaker_t *speaker, packet_t *packet)
 	return TRUE;
 }
 
+/* send a message too long for one packet as fragments, each copied
+ * into the same packet in turn */
+int send_fragments(client_speaker_t *speaker, char *s, long len, 
+		unsigned char *dst_ip, int port)
+{
+	long offset;
+	int n;
+	packet_t *packet = NULL;
+
+	/* room for the largest chunk, which each one reuses */
+	packet = packet_reserve(new_packet(SEND, speaker->client_ip, NULL, 
+				dst_ip, 8002, port), PACKET_CHUNK_CHARS + 1);
+	if (!packet) {
+		fprintf(stderr, "could not make a packet to send message with\n");
+		return FALSE;
+	}
+	for (offset = 0; offset < len; offset += n) {
+		n = (len - offset > PACKET_CHUNK_CHARS) 
+			? PACKET_CHUNK_CHARS : (int)(len - offset);
+		set_data_len(packet, s + offset, n);
+		packet_set_fragment(packet, offset, len);
+		speaker_send_packet(speaker, packet);
+	}
+	free_packet(packet);
+	return TRUE;
+}
+
 /* Get a socket and connect it to the server */
 int connect_speaker(client_speaker_t *speaker)
 {
@@ -55,6 +55,21 @@ void get_online_names(client_speaker_t *speaker);
 int send_string(client_speaker_t *speaker, char *s, unsigned char *dst_ip,
 		int port);
 
+/**
+ * Send the contents of a file as a message to another user.  The file
+ * is read and sent a fragment at a time, so its size does not matter.
+ *
+ * @param[in] speaker:	The struct containing the socket descriptor to
+ *						be sent to.
+ * @param[in] path:		The file to be sent.
+ * @param[in] dst_ip:	The ip of the recipient.
+ * @param[in] port:		The port of the recipient.
+ *
+ * @return TRUE(1) if successful, FALSE(0) otherwise.
+ */
+int send_file(client_speaker_t *speaker, char *path, unsigned char *dst_ip,
+		int port);
+
 /**
  * Send a string to the server to be echoed back. 
  * @param[in] speaker:	The struct containing the socket descriptor to
@@ -0,0 +1,51 @@
+/*
+ * A coarse, process wide monotonic clock.
+ *
+ * Nothing is kept between calls, so any thread may read the time.
+ */
+#define _GNU_SOURCE
+
+#include <time.h>
+
+#include "clock.h"
+
+/*** Helper Function Prototypes ******************************************/
+
+void clock_read(struct timespec *now);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Get the monotonic time in whole seconds.
+ */
+long clock_seconds()
+{
+	struct timespec now;
+
+	clock_read(&now);
+	return (long)now.tv_sec;
+}
+
+/**
+ * Get the monotonic time in milliseconds, as coarse as the scheduler
+ * tick.
+ */
+unsigned long clock_millis()
+{
+	struct timespec now;
+
+	clock_read(&now);
+	return (unsigned long)now.tv_sec * 1000UL 
+		+ (unsigned long)(now.tv_nsec / 1000000L);
+}
+
+/*** Helper Functions ****************************************************/
+
+/* read the time from the vdso, falling back on the fine clock where the
+ * coarse one is missing */
+void clock_read(struct timespec *now)
+{
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, now) != 0) {
+		clock_gettime(CLOCK_MONOTONIC, now);
+	}
+}
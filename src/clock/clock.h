@@ -0,0 +1,27 @@
+/*
+ * A coarse, process wide monotonic clock.
+ *
+ * The time is read from CLOCK_MONOTONIC_COARSE, which the vdso answers
+ * without a call into the kernel, so threads on the forwarding path can
+ * read it as often as they like.  It is as coarse as the scheduler tick.
+ *
+ * The time counts from an unspecified point, so it is only good for
+ * measuring intervals within one run of the server.
+ */
+#ifndef CLOCK_H
+#define CLOCK_H
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Get the monotonic time in whole seconds.
+ */
+long clock_seconds();
+
+/**
+ * Get the monotonic time in milliseconds, as coarse as the scheduler
+ * tick.
+ */
+unsigned long clock_millis();
+
+#endif
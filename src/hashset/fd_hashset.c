@@ -31,7 +31,6 @@ int cmp_fd_strings(void *a, void *b);
 void fd_val2str(void *key, void *val, char *buffer);
 void fd_dud_free(void *);
 unsigned char *fd_ipdup(unsigned char *s);
-void *copy_fd_key(void *a);
 int cmp_fds(void *a, void *b);
 
 /*** Functions ***********************************************************/
@@ -194,19 +193,8 @@ void free_fd_hashset(fd_hashset_ptr hs)
 	free(hs);
 }
 
-queue_t *fdhs_get_keys(fd_hashset_ptr fd_hs)
-{
-	return get_keys(fd_hs->ht, copy_fd_key, cmp_fds, fd_dud_free);
-}
-
 /*** Helper Functions ****************************************************/
 
-void *copy_fd_key(void *a)
-{
-	long b = (long)a;
-	return (void *)b;
-}
-
 int cmp_fds(void *a, void *b) 
 {
 	long A, B;
@@ -272,7 +260,8 @@ void fd_dud_free(void *key)
  */
 unsigned long hash_fd(void *key, unsigned int size)
 {
-	long fd = (long)key;
+	/* the channels of datagram sessions are negative */
+	unsigned long fd = (unsigned long)(long)key;
 
 	return (fd % size);
 }
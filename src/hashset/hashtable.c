@@ -15,10 +15,12 @@
 
 #include "hashtable.h"
 #include "../queue/queue.h"
+#include "../log/log.h"
 
 #define INITIAL_DELTA 10
 #define INITIAL_DIFF 2
 #define BUFFER_SIZE 1024
+#define MIGRATE_BUCKETS 16	/* old buckets moved per insert or remove */
 
 /*** Some Structs ********************************************************/
 
@@ -38,6 +40,11 @@ typedef struct hashtable {
 	int delta_diff;
 	unsigned long (*hash)(void *, unsigned int);
 	int (*cmp)(void *, void *);
+
+	/* while resizing, the entries not yet moved to the new table */
+	ht_entry_p *old_table;
+	unsigned int old_size;
+	unsigned int migrate_index;	/* the next old bucket to move */
 } hashtable_t;
 
 /*** Delta Table *********************************************************/
@@ -55,7 +62,11 @@ static unsigned int delta[] = { 0, 0, 1, 1, 3, 1, 3, 1, 5, 3, 3, 9, 3, 1,
 unsigned int calculate_table_size(hashtable_p ht);
 ht_entry_p *alloc_table(hashtable_p ht);
 void resize(hashtable_p ht);
-int ht_insert_entry(hashtable_p ht, ht_entry_t *entry);
+void migrate(hashtable_p ht, unsigned int buckets);
+ht_entry_p ht_find(hashtable_p ht, void *key);
+int remove_from_bucket(hashtable_p ht, ht_entry_p *bucket, void *key, 
+		void (*freekey)(void *), void (*freeval)(void *));
+void add_entry(hashtable_p ht, ht_entry_p entry);
 
 /*** Functions ***********************************************************/
 
@@ -90,6 +101,9 @@ hashtable_p ht_init(float factor, int init_delta, int delta_diff,
 	ht->loadfactor = factor;
 	ht->hash = hash;
 	ht->cmp = cmp;
+	ht->old_table = NULL;
+	ht->old_size = 0;
+	ht->migrate_index = 0;
 
 	if(init_delta < 0) {
 		ht->delta_index = INITIAL_DELTA;
@@ -123,17 +137,9 @@ hashtable_p ht_init(float factor, int init_delta, int delta_diff,
  */
 void ht_update(hashtable_p ht, void *key, void *value, void (*val_free)(void *)) 
 {
-	unsigned int hash = -1;
 	ht_entry_p entry = NULL;
 
-	hash = ht->hash(key, ht->size);
-
-	for (entry = ht->table[hash]; entry; entry = entry->next_ptr) {
-		if (ht->cmp(entry->key, key) == 0) {
-			/* found it */
-			break;
-		}
-	}
+	entry = ht_find(ht, key);
 	if (!entry) {
 		return;
 	}
@@ -158,18 +164,11 @@ void ht_update(hashtable_p ht, void *key, void *value, void (*val_free)(void *))
  */
 int ht_insert(hashtable_p ht, void *key, void *value)
 {
-	unsigned int hash = -1;
 	ht_entry_p entry = NULL;
-	float loadfactor = 0.0;
 
-	hash = ht->hash(key, ht->size);
+	migrate(ht, MIGRATE_BUCKETS);
 
-	for (entry = ht->table[hash]; entry; entry = entry->next_ptr) {
-		if (ht->cmp(entry->key, key) == 0) {
-			break;
-		}
-	}
-	if (entry) {
+	if (ht_find(ht, key)) {
 		return KEY_PRESENT_IN_TABLE;
 	}
 
@@ -181,62 +180,24 @@ int ht_insert(hashtable_p ht, void *key, void *value)
 
 	entry->key = key;
 	entry->val = value;
-
-	entry->next_ptr = ht->table[hash];
-	ht->table[hash] = entry;
-	ht->num_entries++;
-
-	loadfactor = (0.0f + ht->num_entries) / ht->size;
-	if (loadfactor > ht->loadfactor) {
-		printf("resize: %d, %f\n", ht->delta_index, loadfactor);
-		resize(ht);
-		loadfactor = (0.0f + ht->num_entries) / ht->size;
-		printf("after resize: %d, %f\n", ht->delta_index, loadfactor);
-	}
+	add_entry(ht, entry);
 	
 	return EXIT_SUCCESS;
 }
 
 void ht_remove(hashtable_p ht, void *key, void (*freekey)(void *), void (*freeval)(void *))
 {
-	unsigned int hash = -1;
-	ht_entry_p entry = NULL;
-	ht_entry_p temp = NULL;
+	migrate(ht, MIGRATE_BUCKETS);
 
-	hash = ht->hash(key, ht->size);
-
-	if (ht->table[hash] == NULL) {
-		printf("Not found for removal\n");
-		return;
-	} else if (ht->cmp((ht->table[hash])->key, key) == 0) {
-		temp = ht->table[hash];
-		ht->table[hash] = (ht->table[hash])->next_ptr;
-		temp->next_ptr = NULL;
-		freekey(temp->key);
-		temp->key = NULL;
-		freeval(temp->val);
-		temp->val = NULL;
-		free(temp);
-		ht->num_entries--;
+	if (remove_from_bucket(ht, &ht->table[ht->hash(key, ht->size)], key, 
+				freekey, freeval)) {
 		return;
 	}
-	for (entry = ht->table[hash]; entry->next_ptr; entry = entry->next_ptr) {
-		if (ht->cmp(entry->next_ptr->key, key) == 0) {
-			ht->num_entries--;
-			break;
-		}
-	}
-
-	if (entry->next_ptr) {
-		temp = entry->next_ptr;
-		entry->next_ptr = entry->next_ptr->next_ptr;
-		temp->next_ptr = NULL;
-		freekey(temp->key);
-		temp->key = NULL;
-		freeval(temp->val);
-		temp->val = NULL;
-		free(temp);
+	if ((ht->old_table) && (remove_from_bucket(ht, 
+				&ht->old_table[ht->hash(key, ht->old_size)], key, freekey, freeval))) {
+		return;
 	}
+	LOG_DEBUG(("Not found for removal\n"));
 }
 
 /**
@@ -252,11 +213,9 @@ void ht_remove(hashtable_p ht, void *key, void (*freekey)(void *), void (*freeva
  */
 int ht_force_insert(hashtable_p ht, void *key, void *value)
 {
-	unsigned int hash = -1;
 	ht_entry_p entry = NULL;
-	float loadfactor = 0.0;
 
-	hash = ht->hash(key, ht->size);
+	migrate(ht, MIGRATE_BUCKETS);
 
 	entry = malloc(sizeof(ht_entry_t));
 
@@ -266,18 +225,7 @@ int ht_force_insert(hashtable_p ht, void *key, void *value)
 
 	entry->key = key;
 	entry->val = value;
-
-	entry->next_ptr = ht->table[hash];
-	ht->table[hash] = entry;
-	ht->num_entries++;
-
-	loadfactor = (0.0f + ht->num_entries) / ht->size;
-	if (loadfactor > ht->loadfactor) {
-		printf("resize: %d, %f\n", ht->delta_index, loadfactor);
-		resize(ht);
-		loadfactor = (0.0f + ht->num_entries) / ht->size;
-		printf("after resize: %d, %f\n", ht->delta_index, loadfactor);
-	}
+	add_entry(ht, entry);
 	
 	return EXIT_SUCCESS;
 }
@@ -309,16 +257,12 @@ int ht_item_count(hashtable_p ht)
  */ 
 int ht_lookup(hashtable_p ht, void *key, void **value)
 {
-	int compare;
-	ht_entry_p entry = NULL;
-	unsigned int hash = ht->hash(key, ht->size);
-	for (entry = ht->table[hash]; entry; entry = entry->next_ptr) {
-		compare = ht->cmp(entry->key, key);
-		if (compare == 0) {
-			/* found it! */
-			*value = entry->val;
-			return SUCCESS;
-		}
+	ht_entry_p entry = ht_find(ht, key);
+
+	if (entry) {
+		/* found it! */
+		*value = entry->val;
+		return SUCCESS;
 	}
 
 	return FAIL;
@@ -340,6 +284,9 @@ void ht_free(hashtable_p ht, void (*freekey)(void *key),
 	ht_entry_p entry = NULL;
 	ht_entry_p temp = NULL;
 
+	/* the old entries move over first */
+	migrate(ht, ht->old_size);
+
 	for (i = 0; i < ht->size; i++) {
 		for (entry = ht->table[i]; entry;) {
 			freekey(entry->key);
@@ -369,6 +316,7 @@ void print_ht(hashtable_p ht, void (*val_to_str)(void *key, void *val,
 	ht_entry_p entry = NULL;
 	char b[BUFFER_SIZE];
 
+	migrate(ht, ht->old_size);
 	for (i = 0; i < ht->size; i++) {
 		printf("socket[%3i]", i);
 		for (entry = ht->table[i]; entry; entry = entry->next_ptr) {
@@ -393,6 +341,7 @@ void print_ht_entries(hashtable_p ht, void (*val_to_str)(void *key, void *val,
 	ht_entry_p entry = NULL;
 	char b[BUFFER_SIZE];
 
+	migrate(ht, ht->old_size);
 	for (i = 0; i < ht->size; i++) {
 		for (entry = ht->table[i]; entry; entry = entry->next_ptr) {
 			val_to_str(entry->key, entry->val, b);
@@ -401,6 +350,43 @@ void print_ht_entries(hashtable_p ht, void (*val_to_str)(void *key, void *val,
 	}
 }
 
+/**
+ * Call visit on every key value pair in the table, without allocating
+ * anything.  visit must not change the table.
+ *
+ * @param[in] ht	The hashtable to walk.
+ * @param[in] visit	Called with each key, its value and arg.  A non-zero
+ *					return stops the walk.
+ * @param[in] arg	Passed through to visit.
+ *
+ * @return The number of pairs visited.
+ */
+int ht_foreach(hashtable_p ht, int (*visit)(void *key, void *val, void *arg), 
+		void *arg)
+{
+	unsigned int i;
+	int count = 0;
+	ht_entry_p entry;
+
+	for (i = 0; i < ht->size; i++) {
+		for (entry = ht->table[i]; entry; entry = entry->next_ptr) {
+			count++;
+			if (visit(entry->key, entry->val, arg)) {
+				return count;
+			}
+		}
+	}
+	/* the entries still waiting to be moved over */
+	for (i = ht->migrate_index; (ht->old_table) && (i < ht->old_size); i++) {
+		for (entry = ht->old_table[i]; entry; entry = entry->next_ptr) {
+			count++;
+			if (visit(entry->key, entry->val, arg)) {
+				return count;
+			}
+		}
+	}
+	return count;
+}
 
 queue_t *get_keys(hashtable_t *ht, void *(*copy_key)(void *key), int (*cmp_k)(void *, void *),
 		void (*free_k)(void *)) 
@@ -416,6 +402,12 @@ queue_t *get_keys(hashtable_t *ht, void *(*copy_key)(void *key), int (*cmp_k)(vo
 			insert_node(q, copy_key(entry->key));
 		}
 	}
+	/* the entries still waiting to be moved over */
+	for (i = ht->migrate_index; (ht->old_table) && (i < ht->old_size); i++) {
+		for(entry = ht->old_table[i]; entry; entry = entry->next_ptr) {
+			insert_node(q, copy_key(entry->key));
+		}
+	}
 	return q;
 }
 
@@ -451,100 +443,158 @@ unsigned int calculate_table_size(hashtable_p ht)
 ht_entry_p *alloc_table(hashtable_p ht)
 {
 	unsigned int size = ht->size;
-	ht_entry_p *p = malloc(size * sizeof(ht_entry_p));
-	unsigned int i = 0;
+	/* large tables come straight from fresh zeroed pages, so that the
+	 * resize does not touch every bucket up front */
+	ht_entry_p *p = calloc(size, sizeof(ht_entry_p));
 
 	if (!p) {
 		fprintf(stderr, "memory error alloc'ing table\n");
 		return NULL;
 	}
-	for (i = 0; i < size; i++) {
-		p[i] = NULL;
-	}
 	return p;
 }
 
 /**
- * More or less double the hashtable size by allocating a new table
- * and carrying the old table's entries over, freeing the old table
- * itself when done.
+ * More or less double the hashtable size by allocating a new table.  The
+ * old table's entries are carried over a few buckets at a time by
+ * migrate, on the inserts and removes that follow, so that no single
+ * operation pays for the whole table.  The old table is free'd once it
+ * is empty.
  *
  * @param[in] ht The table to be resized
  */
 void resize(hashtable_p ht)
 {
-	ht_entry_p *old_table = ht->table, *new_table = NULL;
-	ht_entry_p entry = NULL, temp = NULL;
-	int i = 0, old_size = -1;
+	ht_entry_p *new_table = NULL;
+	unsigned int old_size = ht->size;
 	
-	ht->delta_index += ht->delta_diff;
+	/* a resize still under way is finished first */
+	migrate(ht, ht->old_size);
 
-	old_size = ht->size;
+	ht->delta_index += ht->delta_diff;
 	ht->size = calculate_table_size(ht);
+	if (ht->size == old_size) {
+		/* as big as it gets */
+		ht->delta_index -= ht->delta_diff;
+		return;
+	}
 
 	new_table = alloc_table(ht);
 	if (!new_table) {
-		printf("memory stuffup?\n");
+		/* carry on with the table we have */
+		ht->delta_index -= ht->delta_diff;
+		ht->size = old_size;
+		return;
 	}
+	ht->old_table = ht->table;
+	ht->old_size = old_size;
+	ht->migrate_index = 0;
 	ht->table = new_table;
-	ht->num_entries = 0;
+}
+
+/**
+ * Move up to the given number of buckets of the old table over to the
+ * new one, freeing the old table once all of them have been moved.
+ *
+ * @param[in] ht		The table being resized.
+ * @param[in] buckets	The most old buckets to move.
+ */
+void migrate(hashtable_p ht, unsigned int buckets)
+{
+	ht_entry_p entry = NULL, temp = NULL;
+	unsigned int hash;
 
-	for (i = 0; i < old_size; i++) {
-		for(entry = old_table[i]; entry;) {
+	if (!ht->old_table) {
+		return;
+	}
+	for (; (buckets > 0) && (ht->migrate_index < ht->old_size); buckets--) {
+		for (entry = ht->old_table[ht->migrate_index]; entry;) {
 			temp = entry;
 			entry = entry->next_ptr;
-			temp->next_ptr = NULL;
-			if (ht_insert_entry(ht, temp)) {
-				printf("expect valgrind error\n");
-			}
-			temp = NULL;
+			hash = ht->hash(temp->key, ht->size);
+			temp->next_ptr = ht->table[hash];
+			ht->table[hash] = temp;
 		}
+		ht->old_table[ht->migrate_index] = NULL;
+		ht->migrate_index++;
+	}
+	if (ht->migrate_index == ht->old_size) {
+		free(ht->old_table);
+		ht->old_table = NULL;
+		ht->old_size = 0;
+		ht->migrate_index = 0;
 	}
-
-	free(old_table);
 }
 
 /**
- * Insert a ht_entry_t pointer into the hashtable.
+ * Find the entry of a key, in the new table or in the part of the old
+ * table that has not been moved yet.
  *
- * @param[in] ht The hashtable into which to put entry.
+ * @param[in] ht	The table to look in.
+ * @param[in] key	The key to look for.
  *
- * @param[in] entry The entry to put into the hashtable.
- *
- * @return EXIT_SUCCESS (0) if successfully inserted,
- * 1 if one of the parameters are wrong and KEY_PRESENT_IN_TABLE (-1) if the entry is
- * already inside the table.
+ * @return The entry, NULL if the key is not in the table.
  */
-int ht_insert_entry(hashtable_p ht, ht_entry_t *entry) 
+ht_entry_p ht_find(hashtable_p ht, void *key)
 {
-	unsigned int hash = -1;
-	float loadfactor = 0.0;
+	ht_entry_p entry = NULL;
 
-	/* test if parameters are present */
-	if (!ht) {
-		fprintf(stderr, "Please Provide a valid ht to insert into\n");
-		return 1;
+	for (entry = ht->table[ht->hash(key, ht->size)]; entry; entry = entry->next_ptr) {
+		if (ht->cmp(entry->key, key) == 0) {
+			return entry;
+		}
 	}
-	if (!entry) {
-		fprintf(stderr, "Please Provide a valid entry to insert in ht\n");
-		return 1;
+	if (!ht->old_table) {
+		return NULL;
+	}
+	for (entry = ht->old_table[ht->hash(key, ht->old_size)]; entry; 
+			entry = entry->next_ptr) {
+		if (ht->cmp(entry->key, key) == 0) {
+			return entry;
+		}
 	}
+	return NULL;
+}
 
-	/* hash the entry */
-	hash = ht->hash(entry->key, ht->size);
+/**
+ * Unlink and free the entry of a key from a bucket.
+ *
+ * @return 1 if the key was found in the bucket, 0 if not.
+ */
+int remove_from_bucket(hashtable_p ht, ht_entry_p *bucket, void *key, 
+		void (*freekey)(void *), void (*freeval)(void *))
+{
+	ht_entry_p *link = NULL;
+	ht_entry_p temp = NULL;
 
-	/* check if already present in table */
-	/*
-	for (temp = ht->table[hash]; temp; temp = temp->next_ptr) {
-		if (ht->cmp(temp->key, entry->key) == 0) {
-			break;
+	for (link = bucket; *link; link = &(*link)->next_ptr) {
+		if (ht->cmp((*link)->key, key) == 0) {
+			temp = *link;
+			*link = temp->next_ptr;
+			temp->next_ptr = NULL;
+			freekey(temp->key);
+			temp->key = NULL;
+			freeval(temp->val);
+			temp->val = NULL;
+			free(temp);
+			ht->num_entries--;
+			return 1;
 		}
 	}
-	if (temp) {
-		printf("here\n");
-		return KEY_PRESENT_IN_TABLE;
-	}
-	*/
+	return 0;
+}
+
+/**
+ * Put a new entry in the current table, and start a resize if that
+ * takes the table over its load factor.
+ *
+ * @param[in] ht	The hashtable into which to put entry.
+ * @param[in] entry	The entry to put into the hashtable.
+ */
+void add_entry(hashtable_p ht, ht_entry_p entry)
+{
+	unsigned int hash = ht->hash(entry->key, ht->size);
+	float loadfactor = 0.0;
 
 	entry->next_ptr = ht->table[hash];
 	ht->table[hash] = entry;
@@ -552,13 +602,9 @@ int ht_insert_entry(hashtable_p ht, ht_entry_t *entry)
 
 	loadfactor = (0.0f + ht->num_entries) / ht->size;
 	if (loadfactor > ht->loadfactor) {
-		printf("resize: %d, %f\n", ht->delta_index, loadfactor);
+		LOG_DEBUG(("resize: %d, %f\n", ht->delta_index, loadfactor));
 		resize(ht);
 		loadfactor = (0.0f + ht->num_entries) / ht->size;
-		printf("after resize: %d, %f\n", ht->delta_index, loadfactor);
+		LOG_DEBUG(("after resize: %d, %f\n", ht->delta_index, loadfactor));
 	}
-	
-	return EXIT_SUCCESS;
 }
-
-
@@ -124,5 +124,19 @@ void print_ht(hashtable_p ht, void (*val_to_str)(void *key, void *val,
 void print_ht_entries(hashtable_p ht, void (*val_to_str)(void *key,
 			void *val, char *buffer));
 
+/**
+ * Call visit on every key value pair in the table, without allocating
+ * anything.  visit must not change the table.
+ *
+ * @param[in] ht	The hashtable to walk.
+ * @param[in] visit	Called with each key, its value and arg.  A non-zero
+ *					return stops the walk.
+ * @param[in] arg	Passed through to visit.
+ *
+ * @return The number of pairs visited.
+ */
+int ht_foreach(hashtable_p ht, int (*visit)(void *key, void *val, void *arg), 
+		void *arg);
+
 queue_t *get_keys(hashtable_p ht, void *(*copy_key)(void *key), int (*cmp_k)(void *, void *), void (*free_k)(void *));
 #endif
@@ -17,6 +17,7 @@
 
 #include "hashtable.h"
 #include "ip_hashset.h"
+#include "../log/log.h"
 
 /*** Lookuptable struct Description **************************************/
 
@@ -24,6 +25,13 @@ typedef struct ip_hashset {
 	hashtable_p ht;
 } ip_hashset_t;
 
+/* the state of iphs_copy_keys while it walks the table */
+typedef struct ip_copy {
+	unsigned char *ips;
+	int count;
+	int max;
+} ip_copy_t;
+
 /*** Helper Function Prototypes ******************************************/
 
 unsigned long hash_ip(void *key, unsigned int size);
@@ -31,7 +39,7 @@ int cmp_ips(void *a, void *b);
 void ip_val2str(void *key, void *val, char *buffer);
 void s_dud_free(void *);
 unsigned char *ipdup(unsigned char *s);
-void *copy_ip_key(void *key);
+int copy_ip_visit(void *key, void *val, void *arg);
 
 /*** Functions ***********************************************************/
 
@@ -131,7 +139,7 @@ int ip_hashset_insert(ip_hashset_ptr hs, unsigned char *ipkey, int fdvalue)
 				break;
 		}
 		free(ipcopy);
-		printf("returning fail %d\n", FAIL);
+		LOG_DEBUG(("returning fail %d\n", FAIL));
 		return FAIL;
 	} else {
 		return SUCCESS;
@@ -228,17 +236,40 @@ void free_ip_hashset(ip_hashset_ptr hs)
 	free(hs);
 }
 
-queue_t *iphs_get_keys(ip_hashset_t *s_hs)
+/**
+ * Copy the ips in the ip_hashset into an array provided by the caller,
+ * 4 bytes per ip, without allocating anything.
+ *
+ * @param[in] hs	The ip_hashset to copy from.
+ * @param[out] ips	The array, with room for max ips.
+ * @param[in] max	The most ips to copy.
+ *
+ * @return The number of ips copied.
+ */
+int iphs_copy_keys(ip_hashset_ptr hs, unsigned char *ips, int max)
 {
-	return get_keys(s_hs->ht, copy_ip_key, cmp_ips, free);
+	ip_copy_t copy;
+
+	copy.ips = ips;
+	copy.count = 0;
+	copy.max = max;
+	if (max > 0) {
+		ht_foreach(hs->ht, copy_ip_visit, &copy);
+	}
+	return copy.count;
 }
 
 
 /*** Helper Functions ****************************************************/
 
-void *copy_ip_key(void *key)
+int copy_ip_visit(void *key, void *val, void *arg)
 {
-	return (void *)ipdup((unsigned char *)key);
+	ip_copy_t *copy = (ip_copy_t *)arg;
+
+	(void)val;	/* only the ips are copied */
+	memcpy(copy->ips + (4 * copy->count), key, 4);
+	copy->count++;
+	return copy->count >= copy->max;
 }
 
 /**
@@ -92,6 +92,16 @@ void print_ip_hashset(ip_hashset_ptr hs);
  */
 void free_ip_hashset(ip_hashset_ptr hs);
 
-queue_t *iphs_get_keys(ip_hashset_ptr s_hs);
+/**
+ * Copy the ips in the ip_hashset into an array provided by the caller,
+ * 4 bytes per ip, without allocating anything.
+ *
+ * @param[in] hs	The ip_hashset to copy from.
+ * @param[out] ips	The array, with room for max ips.
+ * @param[in] max	The most ips to copy.
+ *
+ * @return The number of ips copied.
+ */
+int iphs_copy_keys(ip_hashset_ptr hs, unsigned char *ips, int max);
 
 #endif
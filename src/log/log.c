@@ -0,0 +1,305 @@
+/*
+ * Leveled, asynchronous logging.
+ *
+ * Each thread that logs gets a single producer, single consumer ring of
+ * fixed size lines.  The owning thread formats straight into the next
+ * free slot and publishes it by bumping the head; the drain thread is the
+ * only one that moves the tail.  Neither side takes a lock for a message,
+ * the rings_lock is only held while a new ring is registered and while
+ * the drain thread walks the list of rings.
+ *
+ * When a ring is full the message is dropped and counted, rather than
+ * making the caller wait on the drain thread.
+ */
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "log.h"
+
+/*** Macros **************************************************************/
+
+#define TRUE			1
+#define FALSE			0
+#define LOG_RING_SIZE	256			/* entries per thread, a power of two */
+#define LOG_LINE_SIZE	248			/* bytes per entry, including the '\0' */
+#define LOG_IDLE_NSEC	2000000L	/* sleep of the drain thread when idle */
+
+/*** Some Structs ********************************************************/
+
+typedef struct log_entry {
+	int level;
+	int len;
+	char line[LOG_LINE_SIZE];
+} log_entry_t;
+
+typedef struct log_ring {
+	volatile unsigned long head;	/* only moved by the owning thread */
+	volatile unsigned long tail;	/* only moved by the drain thread */
+	log_entry_t entries[LOG_RING_SIZE];
+	struct log_ring *next;
+} log_ring_t;
+
+/*** Globals *************************************************************/
+
+volatile int log_level = LOG_LEVEL_INFO;
+
+static volatile int log_running = FALSE;
+static pthread_t log_thread;
+static pthread_key_t log_key;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_t *rings = NULL;
+static volatile unsigned long dropped_count = 0;
+
+/*** Helper Function Prototypes ******************************************/
+
+void log_vmsg(int level, const char *fmt, va_list ap);
+log_ring_t *log_get_ring();
+int log_drain();
+void *log_run(void *arg);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Start the background thread that drains the per thread rings.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the thread could not be
+ * started, in which case logging stays synchronous.
+ */
+int log_start()
+{
+	if (log_running) {
+		return TRUE;
+	}
+	if (pthread_key_create(&log_key, NULL)) {
+		fprintf(stderr, "failed to create key for log rings\n");
+		return FALSE;
+	}
+	log_running = TRUE;
+	if (pthread_create(&log_thread, NULL, log_run, NULL)) {
+		fprintf(stderr, "failed to start log thread\n");
+		log_running = FALSE;
+		pthread_key_delete(log_key);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Drain whatever is left in the rings, stop the background thread and
+ * free the rings.  Logging falls back to being synchronous.
+ *
+ * This must only be called once the other threads that log have been
+ * joined, as their rings are free'd here.
+ */
+void log_stop()
+{
+	log_ring_t *ring = NULL;
+
+	if (!log_running) {
+		return;
+	}
+	log_running = FALSE;
+	pthread_join(log_thread, NULL);
+
+	pthread_mutex_lock(&rings_lock);
+	while ((ring = rings)) {
+		rings = ring->next;
+		free(ring);
+	}
+	pthread_mutex_unlock(&rings_lock);
+	pthread_key_delete(log_key);
+}
+
+/**
+ * Set the runtime level below which messages are discarded.
+ *
+ * @param[in] level: One of the LOG_LEVEL_* macros.
+ */
+void log_set_level(int level)
+{
+	log_level = level;
+}
+
+/**
+ * Translate a level name ("debug", "info", "warn", "error", "none") to
+ * its LOG_LEVEL_* value.
+ *
+ * @param[in] name: The name of the level.
+ *
+ * @return The level, or -1 if the name is not recognised.
+ */
+int log_level_from_name(char *name)
+{
+	if (strcmp(name, "debug") == 0) {
+		return LOG_LEVEL_DEBUG;
+	} else if (strcmp(name, "info") == 0) {
+		return LOG_LEVEL_INFO;
+	} else if (strcmp(name, "warn") == 0) {
+		return LOG_LEVEL_WARN;
+	} else if (strcmp(name, "error") == 0) {
+		return LOG_LEVEL_ERROR;
+	} else if (strcmp(name, "none") == 0) {
+		return LOG_LEVEL_NONE;
+	}
+	return -1;
+}
+
+/**
+ * Get the number of messages discarded because the ring of the logging
+ * thread was full.
+ */
+unsigned long log_dropped()
+{
+	return dropped_count;
+}
+
+void log_debug_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	log_vmsg(LOG_LEVEL_DEBUG, fmt, ap);
+	va_end(ap);
+}
+
+void log_info_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	log_vmsg(LOG_LEVEL_INFO, fmt, ap);
+	va_end(ap);
+}
+
+void log_warn_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	log_vmsg(LOG_LEVEL_WARN, fmt, ap);
+	va_end(ap);
+}
+
+void log_error_msg(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	log_vmsg(LOG_LEVEL_ERROR, fmt, ap);
+	va_end(ap);
+}
+
+/*** Helper Functions ****************************************************/
+
+/* format a message into the ring of the calling thread */
+void log_vmsg(int level, const char *fmt, va_list ap)
+{
+	log_ring_t *ring = NULL;
+	log_entry_t *entry = NULL;
+	unsigned long head;
+	int len;
+
+	if (log_running) {
+		ring = log_get_ring();
+	}
+	if (!ring) {
+		vfprintf((level >= LOG_LEVEL_WARN) ? stderr : stdout, fmt, ap);
+		return;
+	}
+
+	head = ring->head;
+	if (head - ring->tail >= LOG_RING_SIZE) {
+		__sync_fetch_and_add(&dropped_count, 1);
+		return;
+	}
+
+	entry = &ring->entries[head & (LOG_RING_SIZE - 1)];
+	len = vsnprintf(entry->line, LOG_LINE_SIZE, fmt, ap);
+	if (len < 0) {
+		return;
+	} else if (len >= LOG_LINE_SIZE) {
+		len = LOG_LINE_SIZE - 1;
+	}
+	entry->level = level;
+	entry->len = len;
+
+	/* the entry must be visible before the head that publishes it */
+	__sync_synchronize();
+	ring->head = head + 1;
+}
+
+/* get the ring of the calling thread, registering one if needed */
+log_ring_t *log_get_ring()
+{
+	log_ring_t *ring = pthread_getspecific(log_key);
+
+	if (ring) {
+		return ring;
+	}
+
+	ring = malloc(sizeof(log_ring_t));
+	if (!ring) {
+		return NULL;
+	}
+	ring->head = 0;
+	ring->tail = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&rings_lock);
+
+	pthread_setspecific(log_key, ring);
+	return ring;
+}
+
+/* write out everything currently published, returning the number of
+ * messages written */
+int log_drain()
+{
+	log_ring_t *ring = NULL;
+	log_entry_t *entry = NULL;
+	unsigned long head, tail;
+	int count = 0;
+
+	pthread_mutex_lock(&rings_lock);
+	for (ring = rings; ring; ring = ring->next) {
+		head = ring->head;
+		__sync_synchronize();
+		for (tail = ring->tail; tail != head; tail++) {
+			entry = &ring->entries[tail & (LOG_RING_SIZE - 1)];
+			fwrite(entry->line, 1, entry->len,
+					(entry->level >= LOG_LEVEL_WARN) ? stderr : stdout);
+			count++;
+		}
+		/* done reading the entries before handing them back */
+		__sync_synchronize();
+		ring->tail = tail;
+	}
+	pthread_mutex_unlock(&rings_lock);
+
+	if (count) {
+		fflush(stdout);
+	}
+	return count;
+}
+
+void *log_run(void *arg)
+{
+	struct timespec idle;
+
+	if (arg) {
+		return NULL;
+	}
+	while (log_running) {
+		if (!log_drain()) {
+			idle.tv_sec = 0;
+			idle.tv_nsec = LOG_IDLE_NSEC;
+			nanosleep(&idle, NULL);
+		}
+	}
+	log_drain();
+	return NULL;
+}
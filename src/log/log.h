@@ -0,0 +1,106 @@
+/*
+ * Leveled, asynchronous logging.
+ *
+ * Every thread formats its messages into a ring of its own, which only
+ * that thread ever writes to.  A background thread drains all the rings
+ * and does the actual writing to stdout and stderr, so threads on the
+ * forwarding path never take the stdio locks or wait on a terminal.
+ *
+ * Until log_start has been called (and again after log_stop), messages
+ * are simply written out synchronously, so the client and the test
+ * programs can use the same calls without running the drain thread.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+/*** Macros **************************************************************/
+
+#define LOG_LEVEL_DEBUG	0
+#define LOG_LEVEL_INFO	1
+#define LOG_LEVEL_WARN	2
+#define LOG_LEVEL_ERROR	3
+#define LOG_LEVEL_NONE	4
+
+/*
+ * Messages below this level are compiled out entirely.  Override with
+ * -DLOG_COMPILE_LEVEL=... in the DBGFLAGS of the Makefile.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/*
+ * The logging macros take their printf style arguments in an extra set
+ * of brackets, as ansi C has no variadic macros:
+ *
+ *		LOG_DEBUG(("port %d used to send out of\n", port));
+ *
+ * Neither the arguments nor the format string are evaluated when the
+ * level is disabled, either at compile time or at runtime.
+ */
+#define LOG_ENABLED(level) \
+	(((level) >= LOG_COMPILE_LEVEL) && ((level) >= log_level))
+
+#define LOG_DEBUG(args) \
+	do { if (LOG_ENABLED(LOG_LEVEL_DEBUG)) { log_debug_msg args; } } while (0)
+#define LOG_INFO(args) \
+	do { if (LOG_ENABLED(LOG_LEVEL_INFO)) { log_info_msg args; } } while (0)
+#define LOG_WARN(args) \
+	do { if (LOG_ENABLED(LOG_LEVEL_WARN)) { log_warn_msg args; } } while (0)
+#define LOG_ERROR(args) \
+	do { if (LOG_ENABLED(LOG_LEVEL_ERROR)) { log_error_msg args; } } while (0)
+
+/*** Globals *************************************************************/
+
+/* The runtime level.  Read without locking on every log call. */
+extern volatile int log_level;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Start the background thread that drains the per thread rings.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the thread could not be
+ * started, in which case logging stays synchronous.
+ */
+int log_start();
+
+/**
+ * Drain whatever is left in the rings, stop the background thread and
+ * free the rings.  Logging falls back to being synchronous.
+ */
+void log_stop();
+
+/**
+ * Set the runtime level below which messages are discarded.
+ *
+ * @param[in] level: One of the LOG_LEVEL_* macros.
+ */
+void log_set_level(int level);
+
+/**
+ * Translate a level name ("debug", "info", "warn", "error", "none") to
+ * its LOG_LEVEL_* value.
+ *
+ * @param[in] name: The name of the level.
+ *
+ * @return The level, or -1 if the name is not recognised.
+ */
+int log_level_from_name(char *name);
+
+/**
+ * Get the number of messages discarded because the ring of the logging
+ * thread was full.
+ */
+unsigned long log_dropped();
+
+/*
+ * The functions behind the macros.  Prefer the macros, so that disabled
+ * levels cost nothing.
+ */
+void log_debug_msg(const char *fmt, ...);
+void log_info_msg(const char *fmt, ...);
+void log_warn_msg(const char *fmt, ...);
+void log_error_msg(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,166 @@
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "checksum.h"
+
+/*** Macros **************************************************************/
+
+#define CRC32_POLY	0xedb88320UL	/* IEEE 802.3, bit reversed */
+
+/*** Helper Function Prototypes ******************************************/
+
+void crc32_init_tables();
+
+/* crc_tables[k][b] is the CRC of byte b followed by k zero bytes */
+uint32_t crc_tables[8][256];
+pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/*** Functions ***********************************************************/
+
+/**
+ * Add bytes to a running ones-complement sum, as used by the IP and TCP
+ * checksums.  The bytes are taken as big-endian 16 bit words, the last
+ * one padded with a zero byte if len is odd, so only the last run of a
+ * sum may have an odd length.
+ *
+ * @param[in] bytes:	The bytes to add.
+ * @param[in] len:		The number of bytes.
+ * @param[in] sum:		The sum so far, 0 to start a new one.
+ *
+ * @return The new sum, not yet folded.
+ */
+uint32_t csum_partial(const unsigned char *bytes, int len, uint32_t sum)
+{
+	/*
+	 * The ones-complement sum does not care about byte order (RFC 1071),
+	 * so whole 32 bit words are added in host order into a wide
+	 * accumulator, a loop the compiler can unroll and vectorise, and
+	 * only the folded result is swapped to network order.
+	 */
+	uint64_t acc = 0;
+	uint32_t word;
+	uint16_t half;
+	unsigned char tail[4];
+	int i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		memcpy(&word, bytes + i, 4);
+		acc += word;
+	}
+	if (i < len) {
+		memset(tail, 0, 4);
+		memcpy(tail, bytes + i, len - i);
+		memcpy(&word, tail, 4);
+		acc += word;
+	}
+
+	while (acc >> 16) {
+		acc = (acc & 0xffff) + (acc >> 16);
+	}
+	half = ntohs((uint16_t)acc);
+	/* a carry out of the top goes back in at the bottom */
+	sum += half;
+	return (sum < half) ? sum + 1 : sum;
+}
+
+/**
+ * Fold a running sum to 16 bits and complement it, giving the value to
+ * put in a checksum field.  Over bytes that include a correct checksum,
+ * this gives 0.
+ *
+ * @param[in] sum: The sum from csum_partial.
+ *
+ * @return The checksum.
+ */
+uint16_t csum_finish(uint32_t sum)
+{
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return (uint16_t)(~sum & 0xffff);
+}
+
+/**
+ * Adjust a checksum for some of the bytes it covers changing, without
+ * summing the rest again (RFC 1624).
+ *
+ * @param[in] check:	The checksum before the change.
+ * @param[in] old:		The bytes before the change.
+ * @param[in] new:		The bytes after the change.
+ * @param[in] len:		The number of bytes that changed, which must be
+ *						even and start at an even offset of the sum.
+ *
+ * @return The checksum after the change.
+ */
+uint16_t csum_update(uint16_t check, const unsigned char *old, 
+		const unsigned char *new, int len)
+{
+	/* HC' = ~(~HC + ~m + m') */
+	uint32_t sum = (~check) & 0xffff;
+	int i;
+
+	for (i = 0; i + 1 < len; i += 2) {
+		sum += (~((old[i] << 8) | old[i + 1])) & 0xffff;
+		sum += (new[i] << 8) | new[i + 1];
+	}
+	return csum_finish(sum);
+}
+
+/**
+ * Work out the Ethernet frame check sequence (CRC-32) of some bytes.
+ *
+ * @param[in] bytes:	The bytes.
+ * @param[in] len:		The number of bytes.
+ *
+ * @return The CRC, to be sent least significant byte first.
+ */
+uint32_t crc32_fcs(const unsigned char *bytes, int len)
+{
+	uint32_t crc = 0xffffffffUL;
+	uint32_t lo, hi;
+	int i = 0;
+
+	pthread_once(&crc_once, crc32_init_tables);
+
+	/* slice by 8: one table lookup per byte, but no chain between them */
+	for (; i + 8 <= len; i += 8) {
+		lo = crc ^ ((uint32_t)bytes[i] | ((uint32_t)bytes[i + 1] << 8) 
+				| ((uint32_t)bytes[i + 2] << 16) 
+				| ((uint32_t)bytes[i + 3] << 24));
+		hi = (uint32_t)bytes[i + 4] | ((uint32_t)bytes[i + 5] << 8) 
+				| ((uint32_t)bytes[i + 6] << 16) 
+				| ((uint32_t)bytes[i + 7] << 24);
+		crc = crc_tables[7][lo & 0xff] ^ crc_tables[6][(lo >> 8) & 0xff] 
+			^ crc_tables[5][(lo >> 16) & 0xff] ^ crc_tables[4][lo >> 24] 
+			^ crc_tables[3][hi & 0xff] ^ crc_tables[2][(hi >> 8) & 0xff] 
+			^ crc_tables[1][(hi >> 16) & 0xff] ^ crc_tables[0][hi >> 24];
+	}
+	for (; i < len; i++) {
+		crc = crc_tables[0][(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffffUL;
+}
+
+/*** Helper Functions ****************************************************/
+
+void crc32_init_tables()
+{
+	uint32_t crc;
+	int b, k;
+
+	for (b = 0; b < 256; b++) {
+		crc = b;
+		for (k = 0; k < 8; k++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		}
+		crc_tables[0][b] = crc;
+	}
+	for (b = 0; b < 256; b++) {
+		crc = crc_tables[0][b];
+		for (k = 1; k < 8; k++) {
+			crc = crc_tables[0][crc & 0xff] ^ (crc >> 8);
+			crc_tables[k][b] = crc;
+		}
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Add bytes to a running ones-complement sum, as used by the IP and TCP
+ * checksums.  The bytes are taken as big-endian 16 bit words, the last
+ * one padded with a zero byte if len is odd, so only the last run of a
+ * sum may have an odd length.
+ *
+ * @param[in] bytes:	The bytes to add.
+ * @param[in] len:		The number of bytes.
+ * @param[in] sum:		The sum so far, 0 to start a new one.
+ *
+ * @return The new sum, not yet folded.
+ */
+uint32_t csum_partial(const unsigned char *bytes, int len, uint32_t sum);
+
+/**
+ * Fold a running sum to 16 bits and complement it, giving the value to
+ * put in a checksum field.  Over bytes that include a correct checksum,
+ * this gives 0.
+ *
+ * @param[in] sum: The sum from csum_partial.
+ *
+ * @return The checksum.
+ */
+uint16_t csum_finish(uint32_t sum);
+
+/**
+ * Adjust a checksum for some of the bytes it covers changing, without
+ * summing the rest again (RFC 1624).
+ *
+ * @param[in] check:	The checksum before the change.
+ * @param[in] old:		The bytes before the change.
+ * @param[in] new:		The bytes after the change.
+ * @param[in] len:		The number of bytes that changed, which must be
+ *						even and start at an even offset of the sum.
+ *
+ * @return The checksum after the change.
+ */
+uint16_t csum_update(uint16_t check, const unsigned char *old, 
+		const unsigned char *new, int len);
+
+/**
+ * Work out the Ethernet frame check sequence (CRC-32) of some bytes.
+ *
+ * @param[in] bytes:	The bytes.
+ * @param[in] len:		The number of bytes.
+ *
+ * @return The CRC, to be sent least significant byte first.
+ */
+uint32_t crc32_fcs(const unsigned char *bytes, int len);
+
+#endif
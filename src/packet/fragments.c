@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fragments.h"
+
+/*** Macros **************************************************************/
+
+#define TRUE	1
+#define FALSE	0
+
+/*** Helper Function Prototypes ******************************************/
+
+fragment_flow_t *fragments_find(fragments_t *fragments, unsigned char *ip,
+		int port);
+fragment_flow_t *fragments_claim(fragments_t *fragments);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate a table with no messages in progress.
+ *
+ * @return The new table, NULL on failure.
+ */
+fragments_t *new_fragments()
+{
+	fragments_t *fragments = calloc(1, sizeof(fragments_t));
+
+	if (!fragments) {
+		fprintf(stderr, "failed to malloc fragments\n");
+	}
+	return fragments;
+}
+
+/**
+ * Free the table.
+ *
+ * @param[in] fragments: The table to be free'd.
+ */
+void free_fragments(fragments_t *fragments)
+{
+	free(fragments);
+}
+
+/**
+ * Check that a fragment follows on from the last one of its flow, and
+ * move the flow on past it.  A fragment at offset 0 always starts a new
+ * message.  If every flow is busy, the one that went quiet the longest
+ * makes room.
+ *
+ * @param[in] fragments:	The table.
+ * @param[in] packet:		A packet for which packet_is_fragment holds.
+ *
+ * @return FRAGMENT_ flags.
+ */
+int fragments_accept(fragments_t *fragments, packet_t *packet)
+{
+	int flags = 0;
+	int port = (unsigned short)packet->header.src_port;
+	long offset = packet->header.sequence_no;
+	long total = packet->header.ack_no;
+	fragment_flow_t *flow = NULL;
+
+	flow = fragments_find(fragments, packet->header.src_ip, port);
+	if (offset == 0) {
+		if (flow) {
+			flags |= FRAGMENT_CUT;
+		} else {
+			flow = fragments_claim(fragments);
+			memcpy(flow->ip, packet->header.src_ip, 4);
+			flow->port = port;
+		}
+		flow->used = TRUE;
+		flow->next = 0;
+		flow->total = total;
+		flags |= FRAGMENT_FIRST;
+	}
+
+	if ((!flow) || (flow->total != total) || (flow->next != offset)) {
+		/* lost or out of order, so the rest of it is no good either */
+		if (flow) {
+			flow->used = FALSE;
+			flags |= FRAGMENT_CUT;
+		}
+		return flags | FRAGMENT_SKIP;
+	}
+
+	flow->next += packet->data_len;
+	flow->touched = ++fragments->turn;
+	if (flow->next >= flow->total) {
+		flow->used = FALSE;
+		flags |= FRAGMENT_LAST;
+	}
+	return flags;
+}
+
+/*** Helper Functions ****************************************************/
+
+/* the flow with a message in progress from an address and port */
+fragment_flow_t *fragments_find(fragments_t *fragments, unsigned char *ip,
+		int port)
+{
+	int i;
+	fragment_flow_t *flow = NULL;
+
+	for (i = 0; i < FRAGMENT_FLOWS; i++) {
+		flow = &fragments->flows[i];
+		if ((flow->used) && (flow->port == port)
+				&& (!memcmp(flow->ip, ip, 4))) {
+			return flow;
+		}
+	}
+	return NULL;
+}
+
+/* a flow to start a message in, taken from the quietest if none is free */
+fragment_flow_t *fragments_claim(fragments_t *fragments)
+{
+	int i;
+	fragment_flow_t *oldest = &fragments->flows[0];
+
+	for (i = 0; i < FRAGMENT_FLOWS; i++) {
+		if (!fragments->flows[i].used) {
+			return &fragments->flows[i];
+		}
+		if (fragments->flows[i].touched < oldest->touched) {
+			oldest = &fragments->flows[i];
+		}
+	}
+	return oldest;
+}
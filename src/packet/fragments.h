@@ -0,0 +1,68 @@
+/*
+ * Following the fragments of long messages as they arrive.
+ *
+ * A message too long for one packet is sent as fragments of at most
+ * PACKET_CHUNK_CHARS characters, marked by packet_set_fragment.  The
+ * receiver hands each fragment on as it comes, so it only keeps track of
+ * where every sender is in its message: a fixed number of flows, each
+ * the next offset expected from one source address and port.
+ */
+#ifndef FRAGMENTS_H
+#define FRAGMENTS_H
+
+#include "packet.h"
+
+#define FRAGMENT_FLOWS	32	/* Messages followed at the same time */
+
+/* What fragments_accept made of a fragment, as flags */
+#define FRAGMENT_FIRST	1	/* It starts a message */
+#define FRAGMENT_LAST	2	/* It ends the message */
+#define FRAGMENT_SKIP	4	/* It does not follow on the last one, drop it */
+#define FRAGMENT_CUT	8	/* A message of its flow ended unfinished */
+
+/*** Struct definitions **************************************************/
+
+typedef struct fragment_flow {
+	unsigned char ip[4];
+	int port;
+	long next;					/* The offset expected next */
+	long total;					/* The length of the message */
+	int used;					/* A message is in progress */
+	unsigned long touched;		/* When a fragment last came, in turns */
+} fragment_flow_t;
+
+typedef struct fragments {
+	fragment_flow_t flows[FRAGMENT_FLOWS];
+	unsigned long turn;			/* Counts the fragments accepted */
+} fragments_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate a table with no messages in progress.
+ *
+ * @return The new table, NULL on failure.
+ */
+fragments_t *new_fragments();
+
+/**
+ * Free the table.
+ *
+ * @param[in] fragments: The table to be free'd.
+ */
+void free_fragments(fragments_t *fragments);
+
+/**
+ * Check that a fragment follows on from the last one of its flow, and
+ * move the flow on past it.  A fragment at offset 0 always starts a new
+ * message.  If every flow is busy, the one that went quiet the longest
+ * makes room.
+ *
+ * @param[in] fragments:	The table.
+ * @param[in] packet:		A packet for which packet_is_fragment holds.
+ *
+ * @return FRAGMENT_ flags.
+ */
+int fragments_accept(fragments_t *fragments, packet_t *packet);
+
+#endif
@@ -1,19 +1,83 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <errno.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "packet.h"
 #include "serializer.h"
+#include "checksum.h"
 #include "../queue/queue.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define TRUE			1
+#define FALSE			0
+#define FRAMES_PER_CALL	64	/* iovecs per sendmsg, well below IOV_MAX */
+
+/* where the checksummed parts of a frame start */
+#define MAC_OFFSET		8	/* The FCS covers the frame from here */
+#define IP_OFFSET		22
+#define IP_HEADER_LEN	20
+#define IP_SUM_OFFSET	32
+#define TCP_OFFSET		42	/* Everything before this is single bytes */
+#define SEQ_OFFSET		46
+#define ACK_OFFSET		50
+#define WINDOW_OFFSET	56
+#define TCP_SUM_OFFSET	58
+#define URGENT_OFFSET	60
+
+/* The bytes up to the TCP header lie in a p_header_t just as they do on
+ * the wire, so they are copied in one go */
+typedef char header_layout_check[
+	(offsetof(p_header_t, dst_port) == TCP_OFFSET) ? 1 : -1];
+
+/* set by packet_set_tap, NULL while nothing is captured */
+void (*frame_tap)(char *frame, int size, int direction) = NULL;
+
+/* The header of a new packet, which most packets send unchanged but for
+ * the addresses, ports and checksums */
+static const p_header_t header_template = {
+	{170, 170, 170, 170, 170, 170, 170, 171},	/* preamble and SFD */
+	{0, 0, 0, 0, 0, 0},
+	{0, 0, 0, 0, 0, 0},
+	{16, 0},									/* ethernet type */
+	(4 << 4) | 5,								/* IPv4, 5 words */
+	2,
+	{0, 20},
+	{0, 0},
+	{0, 0},
+	255,										/* time to live */
+	6,											/* TCP */
+	{0, 0},
+	{0, 0, 0, 0},
+	{0, 0, 0, 0},
+	0, 0,
+	0, 0,
+	{0, 0},
+	0,
+	0, 0
+};
 
 /*** Helper Function Prototypes ******************************************/
 
-int cmp_strings(void *a, void *b);
 char *packet_strdup(char *s);
-unsigned char *packet_ipdup(unsigned char *s);
+void decode_header(char *bytes, p_header_t *header);
+int payload_fits(char *payload, int size);
+int read_fully(int fd, char *buffer, int n);
+void put_int16(char *bytes, int16_t value);
+void put_int32(char *bytes, int32_t value);
+char *room_take(packet_t *packet, int len);
+void room_give(packet_t *packet, char *at, int len);
+uint32_t tcp_pseudo_sum(unsigned char *frame, int size);
+void rewrite_sums(packet_t *packet, unsigned char *old_ip, 
+		unsigned char *new_ip, int old_port, int new_port);
 
 /*** Functions ***********************************************************/
 
@@ -21,63 +85,21 @@ unsigned char *packet_ipdup(unsigned char *s);
  * Malloc heap space for a new generic packet.  
  * All values initialized to NULL, 0 or -1.
  *
+ * @param[in] room: The bytes of room to leave after the packet for its
+ *					text and ips.
+ *
  * @return The newly allocated space.
  */
-packet_t *new_empty_packet() 
+packet_t *new_empty_packet(int room) 
 {
-	int i;
 	packet_t *packet = NULL;
-	packet = malloc(sizeof(packet_t));
+	packet = malloc(sizeof(packet_t) + room);
 
 	if (!packet) {
 		return NULL;
 	}
 
-	/* preamble */
-	for (i = 0; i < 7; i++) {
-		packet->header.eth_preamble[i] = (unsigned char)170;
-	}
-	/* SFD - Start frame delimiter */
-	packet->header.eth_preamble[7] = (unsigned char)171;
-
-	bzero(packet->header.dst_mac, 6);
-	bzero(packet->header.src_mac, 6);
-	packet->header.ethernet_type[0] = (unsigned char)16;
-	packet->header.ethernet_type[1] = '\0';
-
-	packet->header.version_ihl = '\0';
-	packet->header.version_ihl += (unsigned char)64;
-	packet->header.version_ihl += (unsigned char)5;
-	packet->header.dscp_ecn = (unsigned char)2;
-	packet->header.total_length[0] = (unsigned char)0;
-	packet->header.total_length[1] = (unsigned char)20;
-
-	packet->header.identification[0] = '\0';
-	packet->header.identification[1] = '\0';
-	packet->header.flags_fragmentoffset[0] = '\0';
-	packet->header.flags_fragmentoffset[1] = '\0';
-
-	packet->header.time_to_live = (unsigned char)255;
-	packet->header.protocol = (unsigned char)6;
-	packet->header.headerchecksum[0] = '\0';
-	packet->header.headerchecksum[1] = '\0';
-
-	bzero(packet->header.src_ip, 4);
-	bzero(packet->header.dst_ip, 4);
-
-	packet->header.src_port = 0;
-	packet->header.dst_port = 0;
-
-	packet->header.sequence_no = 0;
-	packet->header.ack_no = 0;
-
-	packet->header.data_offset_reserved_flags[0] = '\0';
-	packet->header.data_offset_reserved_flags[1] = '\0';
-	packet->header.window_size = 0;
-
-	packet->header.tcpchecksum = 0;
-	packet->header.urgent_pointer = 0;
-	
+	packet->header = header_template;
 
 	packet->code = -1;
 
@@ -90,10 +112,15 @@ packet_t *new_empty_packet()
 	packet->to = NULL;
 	packet->to_len =  0;
 
-	packet->users = NULL;
+	packet->ips = NULL;
 	packet->list_len = 0;
 	packet->list_size = 0;
 
+	bzero(packet->frame_check_sequence, 4);
+	packet->sums_kept = FALSE;
+	packet->room = room;
+	packet->room_used = 0;
+
 	return packet;
 }
 
@@ -113,7 +140,8 @@ packet_t *new_packet(int code, unsigned char *src_ip, char *data, unsigned char
 {
 	int i;
 	packet_t *packet = NULL;
-	packet = new_empty_packet();
+	/* just room enough for the data, which is all it carries */
+	packet = new_empty_packet(data ? strlen(data) + 1 : 0);
 	/*
 	packet = malloc(sizeof(packet_t));
 	*/
@@ -140,8 +168,7 @@ packet_t *new_packet(int code, unsigned char *src_ip, char *data, unsigned char
 	*/
 
 	if (data) {
-		packet->data = data;
-		packet->data_len = strlen(data);
+		set_data(packet, data);
 	} else {
 		packet->data = NULL;
 		packet->data_len = 0;
@@ -161,7 +188,7 @@ packet_t *new_packet(int code, unsigned char *src_ip, char *data, unsigned char
 	packet->to_len = 0;
 	*/
 
-	packet->users = NULL;
+	packet->ips = NULL;
 	packet->list_len = 0;
 	packet->list_size = 0;
 
@@ -180,62 +207,134 @@ void free_packet(void *p)
 		fprintf(stderr, "Null pointer was given to free");
 		return;
 	}
-	if (packet->name) {
-		free(packet->name);
-		packet->name = NULL;
-		packet->name_len = -1;
+	/* the text and ips lie in the same allocation */
+	packet->name = NULL;
+	packet->name_len = -1;
+	packet->data = NULL;
+	packet->data_len = -1;
+	packet->to = NULL;
+	packet->to_len = -1;
+	packet->ips = NULL;
+	packet->list_len = -1;
+	packet->list_size = -1;
+	free(p);
+}
+
+/**
+ * Make sure a packet has a number of bytes of room left for text or ips
+ * set after it was made, moving it if it must grow.
+ *
+ * @param[in] packet:	The packet, NULL to do nothing.
+ * @param[in] len:		The bytes of room needed.
+ *
+ * @return The packet, which may have moved, or NULL on failure, in which
+ * case the packet is free'd.
+ */
+packet_t *packet_reserve(packet_t *packet, int len)
+{
+	packet_t *grown = NULL;
+	char *old = NULL;
+
+	if ((!packet) || (packet->room - packet->room_used >= len)) {
+		return packet;
 	}
-	if (packet->data) {
-		free(packet->data);
-		packet->data = NULL;
-		packet->data_len = -1;
+	old = packet->body;
+	grown = realloc(packet, sizeof(packet_t) + packet->room_used + len);
+	if (!grown) {
+		fprintf(stderr, "failed to grow a packet\n");
+		free(packet);
+		return NULL;
 	}
-	if (packet->to) {
-		free(packet->to);
-		packet->to = NULL;
-		packet->to_len = -1;
+	grown->room = grown->room_used + len;
+
+	/* the fields point into the room, which moved along with the packet */
+	if (grown->name) {
+		grown->name = grown->body + (grown->name - old);
 	}
-	if (packet->users) {
-		free_queue(packet->users);
-		packet->users = NULL;
-		packet->list_len = -1;
-		packet->list_size = -1;
+	if (grown->data) {
+		grown->data = grown->body + (grown->data - old);
 	}
-	free(p);
+	if (grown->to) {
+		grown->to = grown->body + (grown->to - old);
+	}
+	if (grown->ips) {
+		grown->ips = (unsigned char *)grown->body 
+			+ ((char *)grown->ips - old);
+	}
+	return grown;
+}
+
+/**
+ * Take room for a string of text from the room of a packet.  The room is
+ * given back when the packet is free'd.
+ *
+ * @param[in] packet:	The packet the text is for.
+ * @param[in] len:		The number of characters, without the '\0'.
+ *
+ * @return Room for len characters and a '\0', NULL if the packet has no
+ * room left for them.
+ */
+char *packet_text(packet_t *packet, int len)
+{
+	return room_take(packet, len + 1);
 }
 
 /**
- * Set the userlist to the packet, updating values as needed. 
+ * Set the userlist to the packet, updating values as needed.  The ips
+ * are copied into the room of the packet.
  *
  * @param[in] packet:	The packet to set the list to.
- * @param[in] users:	The queue structure with the names users that
- *						the packet must carry.
+ * @param[in] users:	The queue structure with the ips of the users
+ *						that the packet must carry.
  */
 void set_user_list(packet_t *p, queue_t *users) 
 {
+	int i = 0;
 	node_t *n = NULL;
-	queue_t *cusers = NULL;
-	if (p->users) {
-		free_queue(p->users);
-		p->users = NULL;
-	}
-
-	init_queue(&cusers, cmp_strings, free);
 
-	p->list_len = get_node_count(users);
+	room_give(p, (char *)p->ips, p->list_size);
+	p->list_len = 0;
 	p->list_size = 0;
+	p->sums_kept = FALSE;
+	p->ips = (unsigned char *)room_take(p, 4 * get_node_count(users));
+	if (!p->ips) {
+		return;
+	}
+
 	for (n = users->head; n; n = n->next) {
-		/*
-		p->list_size += sizeof(int);
-		*/
 		if (n->data) {
-			p->list_size += 4;
-			insert_node(cusers, packet_ipdup((unsigned char *)n->data));
+			memcpy(p->ips + (4 * i++), n->data, 4);
 		} else {
 			fprintf(stderr, "fault in queue nodes!!\n");
 		}
 	}
-	p->users = cusers;
+	p->list_len = i;
+	p->list_size = 4 * i;
+}
+
+/**
+ * Set the userlist to the packet from an array of ips, 4 bytes each, as
+ * filled in by users_copy_ips.  The ips are copied into the room of the
+ * packet.
+ *
+ * @param[in] packet:	The packet to set the list to.
+ * @param[in] ips:		The ips the packet must carry.
+ * @param[in] count:	The number of ips in the array.
+ */
+void set_user_array(packet_t *p, unsigned char *ips, int count)
+{
+	room_give(p, (char *)p->ips, p->list_size);
+	p->list_len = 0;
+	p->list_size = 0;
+	p->sums_kept = FALSE;
+	p->ips = (unsigned char *)room_take(p, 4 * count);
+	if (!p->ips) {
+		return;
+	}
+
+	memcpy(p->ips, ips, 4 * count);
+	p->list_len = count;
+	p->list_size = 4 * count;
 }
 
 /**
@@ -261,6 +360,7 @@ int get_code(packet_t *p)
 void set_code(packet_t *p, int code)
 {
 	p->code = code;
+	p->sums_kept = FALSE;
 }
 
 /**
@@ -283,12 +383,77 @@ char *get_data(packet_t *p)
  * @param[in] data:		A pointer to the data to be set.
  */
 void set_data(packet_t *p, char *data)
+{
+	int len = data ? strlen(data) : 0;
+
+	if (p->data) {
+		room_give(p, p->data, p->data_len + 1);
+	}
+	p->data = NULL;
+	p->data_len = 0;
+	if (data) {
+		p->data = packet_text(p, len);
+		if (p->data) {
+			memcpy(p->data, data, len + 1);
+			p->data_len = len;
+		}
+	}
+	p->sums_kept = FALSE;
+}
+
+/**
+ * Set the data field of the given packet to a number of characters
+ * that need not end in a null character.
+ *
+ * @param[in] packet:	The packet from which the data must be set.
+ * @param[in] data:		The characters to be set.  They are copied into
+ *						the packet.
+ * @param[in] len:		The number of characters.
+ */
+void set_data_len(packet_t *p, char *data, int len)
 {
 	if (p->data) {
-		free(p->data);
-		p->data = NULL;
+		room_give(p, p->data, p->data_len + 1);
 	}
-	p->data = data;
+	p->data = NULL;
+	p->data_len = 0;
+	if ((data) && (len >= 0)) {
+		p->data = packet_text(p, len);
+		if (p->data) {
+			memcpy(p->data, data, len);
+			p->data[len] = '\0';
+			p->data_len = len;
+		}
+	}
+	p->sums_kept = FALSE;
+}
+
+/**
+ * Mark a packet as a fragment of a message too long to send in one.
+ * The sequence number of the header carries the offset of the first
+ * character of the fragment, and the acknowledgement number the length
+ * of the whole message, so that the fragments stream through the server
+ * one at a time.  Packets that are not fragments keep both at 0.
+ *
+ * @param[in] packet:	The packet carrying the fragment as its data.
+ * @param[in] offset:	The offset of the fragment in the message.
+ * @param[in] total:	The number of characters of the message.
+ */
+void packet_set_fragment(packet_t *packet, long offset, long total)
+{
+	packet->header.sequence_no = (int32_t)offset;
+	packet->header.ack_no = (int32_t)total;
+	packet->sums_kept = FALSE;
+}
+
+/**
+ * Check if a packet is a fragment of a longer message.
+ *
+ * @param[in] packet: The packet.
+ */
+int packet_is_fragment(packet_t *packet)
+{
+	return packet->header.ack_no > 0;
 }
 
 /**
@@ -312,6 +477,7 @@ void send_packet(packet_t *packet, int fd)
 	*/
 
 	buffer = serialize(packet, &size);
+	packet_tap(buffer, size, TAP_OUT);
 	
 	/*
 	*iptr = htonl(size);
@@ -322,154 +488,520 @@ void send_packet(packet_t *packet, int fd)
 	*/
 	for (i = 0; i < size;) {
 		write_bytes = write(fd, (buffer + i), size - i);
+		if (write_bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* the peer went away, the reader will notice */
+			LOG_DEBUG(("write to %d failed\n", fd));
+			break;
+		}
 		i += write_bytes;
 	}
 	free(buffer);
 }
 
+/**
+ * Send several serialized packets over the same socket, gathered into
+ * as few system calls as possible.  A non-blocking socket may take only
+ * part of them.
+ *
+ * @param[in] frames:	The serialized packets, in the order they must go
+ *						out.
+ * @param[in] sizes:	The size of each of the frames.
+ * @param[in] count:	The number of frames.
+ * @param[in] fd:		A file descriptor of the socket over which the
+ *						frames must be sent.
+ *
+ * @return The number of bytes sent, which may end mid frame, or -1 if
+ * the socket failed.
+ */
+int send_frames(char **frames, int *sizes, int count, int fd)
+{
+	struct iovec iov[FRAMES_PER_CALL];
+	struct msghdr msg;
+	int next = 0;		/* the first frame not yet handed to an iovec */
+	int skip = 0;		/* bytes of frames[next] already sent */
+	int total = 0;
+	int n;
+	int flags;
+	ssize_t sent;
+
+	while (next < count) {
+		for (n = 0; (n < FRAMES_PER_CALL) && (next + n < count); n++) {
+			iov[n].iov_base = frames[next + n] + (n ? 0 : skip);
+			iov[n].iov_len = sizes[next + n] - (n ? 0 : skip);
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		/* more is coming, so don't push out a short segment yet */
+		flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+		if (next + n < count) {
+			flags |= MSG_MORE;
+		}
+
+		sent = sendmsg(fd, &msg, flags);
+		if (sent < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				/* the socket is full, the rest is the caller's */
+				break;
+			}
+			/* the peer went away, the reader will notice */
+			LOG_DEBUG(("sendmsg to %d failed\n", fd));
+			return -1;
+		}
+		total += (int)sent;
+
+		/* step past whatever went out, which may end mid frame */
+		sent += skip;
+		skip = 0;
+		while ((next < count) && (sent >= sizes[next])) {
+			sent -= sizes[next];
+			next++;
+		}
+		skip = (int)sent;
+	}
+	return total;
+}
+
 /**
  * Receive data from a given fd and deserialize the data to a packet.
  *
  * @param[in] fd:	A file descriptor of the socket to receive the 
  *					data over.
- * @return The new packet that was received.
+ * @return The new packet that was received, NULL if the peer went away
+ * or sent a frame that can't be read.  The socket is left open for the
+ * caller to close.
  */
 packet_t *receive_packet(int fd) 
 {
-	/* to be continued... */
 	packet_t *packet = NULL;
 	p_header_t header;
 	int size = 0;
-	int r = 0;
-	int i = 0;
-	char sizebuffer[sizeof(int)];
-	char *b = (char *)sizebuffer;
-	int *intp;
-	int16_t port;
 	int32_t int32;
+	char prefix[PACKET_PREFIX_SIZE];
+	char fcs[PACKET_FCS_SIZE];
+	char *b = NULL;
 
-	r = read(fd, (void *)(header.eth_preamble), 8);
-	r = read(fd, (void *)(header.dst_mac), 6);
-	r = read(fd, (void *)(header.src_mac), 6);
-	r = read(fd, (void *)(header.ethernet_type), 2);
-
-	r = read(fd, (void *)(&header.version_ihl), 1);
-	r = read(fd, (void *)(&header.dscp_ecn), 1);
-	r = read(fd, (void *)(header.total_length), 2);
-
-	r = read(fd, (void *)(header.identification), 2);
-	r = read(fd, (void *)(header.flags_fragmentoffset), 2);
-
-	r = read(fd, (void *)(&header.time_to_live), 1);
-	r = read(fd, (void *)(&header.protocol), 1);
-	r = read(fd, (void *)(header.headerchecksum), 2);
-	
-	r = read(fd, (void *)(header.dst_ip), 4);
-	r = read(fd, (void *)(header.src_ip), 4);
-
-	r = read(fd, &port, sizeof(int16_t));
-	header.dst_port = ntohs(port);
-	r = read(fd, &port, sizeof(int16_t));
-	header.src_port = ntohs(port);
-
-	r = read(fd, &int32, sizeof(int32_t));
-	header.sequence_no = ntohl(int32);
-	r = read(fd, &int32, sizeof(int32_t));
-	header.ack_no = ntohl(int32);
-
-	r = read(fd, (void *)(header.data_offset_reserved_flags), 2);
-	r = read(fd, &port, sizeof(int16_t));
-	header.window_size = ntohs(port);
-
-	r = read(fd, &port, sizeof(int16_t));
-	header.tcpchecksum = ntohs(port);
-	r = read(fd, &port, sizeof(int16_t));
-	header.urgent_pointer = ntohs(port);
-
-	r = read(fd, (void *)(b), sizeof(int));
-	
-	if (r == 0) {
-		/*
-		printf("0 disconnect*************\n");
-		printf("Does this ever happen??*************\n");
-		*/
-		close(fd);
-		return NULL;
-	} else if (r == -1) {
+	/* the header and size in one go, rather than a read per field */
+	if (read_fully(fd, prefix, PACKET_PREFIX_SIZE) < PACKET_PREFIX_SIZE) {
 #ifdef PDEBUG
-		printf("-1 disconnect*************\n");
+		printf("disconnect*************\n");
 #endif
-		close(fd);
 		return NULL;
 	}
-
-
-	intp = (int *)b;
-	size = ntohl(*intp);
+	decode_header(prefix, &header);
+	memcpy(&int32, prefix + PACKET_HEADER_SIZE, sizeof(int32_t));
+	size = ntohl(int32);
 	
-	if (size <= 0) {
+	if ((size <= 0) || (size > PACKET_MAX_SIZE)) {
 #ifdef PDEBUG
 		printf("this is objectively weird. Inside receive_packet\n");
 #endif
+		/* the stream can't be trusted past a size like that */
 		return NULL;
 	}
 
-	b = NULL;
 	b = malloc(size);
 	if (!b) {
 		fprintf(stderr, "Failed to malloc a buffer in receive_packet\n");
 		return NULL;
 	}
-	for (i = 0; i < size; i++) {
-		r = read(fd, (b + i), size - i);
-		i += r;
-		if (r == -1) {
-			/*
-			fprintf(stderr, "Potentially weird!\n");
-			*/
-			/*
-			close(fd);
-			*/
-			printf("read -1\n");
-			break;
-		} else if (r == 0) {
-			printf("read 0\n");
-		}
+	if (read_fully(fd, b, size) < size) {
+		/* cut off halfway through the body */
+		LOG_DEBUG(("read of body failed\n"));
+		free(b);
+		return NULL;
+	}
+	if (!payload_fits(b, size)) {
+		LOG_DEBUG(("malformed body\n"));
+		free(b);
+		return NULL;
+	}
+
+	/* the frame check sequence, which is only checked by the server */
+	if (read_fully(fd, fcs, PACKET_FCS_SIZE) < PACKET_FCS_SIZE) {
+		LOG_DEBUG(("read of fcs failed\n"));
 	}
 
 	packet = deserialize(b, &header);
 	free(b);
 
 	return packet;
-	
 }
 
-/*** Helper Functions ****************************************************/
+/**
+ * Work out the length of the frame at the start of a buffer of bytes
+ * received from a socket.
+ *
+ * @param[in] bytes:	The bytes received so far.
+ * @param[in] len:		The number of bytes in the buffer.
+ *
+ * @return The total length of the frame in bytes, 0 if too little of it
+ * has been received to tell, or -1 if the frame is invalid or larger
+ * than PACKET_MAX_SIZE allows.
+ */
+int packet_frame_size(char *bytes, int len)
+{
+	int32_t size;
+
+	if (len < PACKET_PREFIX_SIZE) {
+		return 0;
+	}
+	memcpy(&size, bytes + PACKET_HEADER_SIZE, sizeof(int32_t));
+	size = ntohl(size);
+	if ((size <= 0) || (size > PACKET_MAX_SIZE)) {
+		return -1;
+	}
+	return PACKET_PREFIX_SIZE + size + PACKET_FCS_SIZE;
+}
 
-int cmp_strings(void *a, void *b)
+/**
+ * Write the wire representation of a header.  The bytes up to the TCP
+ * header are copied straight from the struct, and only the fields
+ * wider than a byte are put into network byte order one by one.
+ *
+ * @param[in]  header:	The header.
+ * @param[out] bytes:	Where the PACKET_HEADER_SIZE bytes go.
+ */
+void packet_encode_header(p_header_t *header, char *bytes)
 {
-	return strcmp((char *)a, (char *)b);
+	memcpy(bytes, header, TCP_OFFSET);
+
+	put_int16(bytes + TCP_OFFSET, header->dst_port);
+	put_int16(bytes + TCP_OFFSET + 2, header->src_port);
+	put_int32(bytes + SEQ_OFFSET, header->sequence_no);
+	put_int32(bytes + ACK_OFFSET, header->ack_no);
+	memcpy(bytes + WINDOW_OFFSET - 2, header->data_offset_reserved_flags, 2);
+	put_int16(bytes + WINDOW_OFFSET, header->window_size);
+	put_int16(bytes + TCP_SUM_OFFSET, header->tcpchecksum);
+	put_int16(bytes + URGENT_OFFSET, header->urgent_pointer);
 }
 
-char *packet_strdup(char *s)
+/**
+ * Decode a complete frame, as measured by packet_frame_size.  The
+ * lengths inside the payload are checked against the size of the frame
+ * before anything is read.
+ *
+ * @param[in] bytes: The bytes of the frame.
+ *
+ * @return The new packet, NULL if the frame is malformed.
+ */
+packet_t *packet_from_frame(char *bytes)
 {
-	char *c = malloc(strlen(s) + 1);
-	int i = 0;
-	int j = 0;
+	p_header_t header;
+	packet_t *packet = NULL;
+	int32_t size;
 
-	while((c[i++] = s[j++]));
+	memcpy(&size, bytes + PACKET_HEADER_SIZE, sizeof(int32_t));
+	size = ntohl(size);
+	if (!payload_fits(bytes + PACKET_PREFIX_SIZE, size)) {
+		return NULL;
+	}
+	decode_header(bytes, &header);
+	packet_tap(bytes, PACKET_PREFIX_SIZE + size + PACKET_FCS_SIZE, TAP_IN);
+	packet = deserialize(bytes + PACKET_PREFIX_SIZE, &header);
+	if ((packet) && (size != 5 * 4 + 2 * (packet->name_len 
+					+ packet->data_len + packet->to_len) + packet->list_size)) {
+		/* padded, so it will not serialize back to the same bytes */
+		packet->sums_kept = FALSE;
+	}
+	return packet;
+}
 
-	return c;
+/**
+ * Check the frame check sequence and the IP and TCP checksums of a
+ * complete frame, as measured by packet_frame_size.
+ *
+ * @param[in] bytes:	The bytes of the frame.
+ * @param[in] size:		The size of the frame.
+ *
+ * @return TRUE(1) if they all match, FALSE(0) if the frame was damaged.
+ */
+int packet_frame_intact(char *bytes, int size)
+{
+	unsigned char *frame = (unsigned char *)bytes;
+	unsigned char *fcs = frame + size - PACKET_FCS_SIZE;
+	uint32_t crc;
+
+	crc = crc32_fcs(frame + MAC_OFFSET, size - PACKET_FCS_SIZE - MAC_OFFSET);
+	if ((fcs[0] != (crc & 0xff)) || (fcs[1] != ((crc >> 8) & 0xff)) 
+			|| (fcs[2] != ((crc >> 16) & 0xff)) || (fcs[3] != (crc >> 24))) {
+		return FALSE;
+	}
+	if (csum_finish(csum_partial(frame + IP_OFFSET, IP_HEADER_LEN, 0)) != 0) {
+		return FALSE;
+	}
+	return csum_finish(tcp_pseudo_sum(frame, size)) == 0;
+}
+
+/**
+ * Fill in the checksums and the frame check sequence of a frame just
+ * serialized from a packet.  The checksums of a packet decoded from an
+ * intact frame are kept, as adjusted by any rewrites since, and only
+ * those of a new or changed packet are summed over the whole frame.
+ *
+ * @param[in] packet:	The packet the frame was serialized from.
+ * @param[in] frame:	The serialized frame.
+ * @param[in] size:		The size of the frame, PACKET_FCS_SIZE included.
+ */
+void packet_seal(packet_t *packet, char *frame, int size)
+{
+	unsigned char *bytes = (unsigned char *)frame;
+	uint16_t sum;
+	uint32_t crc;
+
+	if (!packet->sums_kept) {
+		bytes[IP_SUM_OFFSET] = 0;
+		bytes[IP_SUM_OFFSET + 1] = 0;
+		sum = csum_finish(csum_partial(bytes + IP_OFFSET, IP_HEADER_LEN, 0));
+		packet->header.headerchecksum[0] = sum >> 8;
+		packet->header.headerchecksum[1] = sum & 0xff;
+		bytes[IP_SUM_OFFSET] = sum >> 8;
+		bytes[IP_SUM_OFFSET + 1] = sum & 0xff;
+
+		bytes[TCP_SUM_OFFSET] = 0;
+		bytes[TCP_SUM_OFFSET + 1] = 0;
+		sum = csum_finish(tcp_pseudo_sum(bytes, size));
+		packet->header.tcpchecksum = (int16_t)sum;
+		bytes[TCP_SUM_OFFSET] = sum >> 8;
+		bytes[TCP_SUM_OFFSET + 1] = sum & 0xff;
+
+		packet->sums_kept = TRUE;
+	}
+
+	/* like Ethernet, least significant byte first */
+	crc = crc32_fcs(bytes + MAC_OFFSET, size - PACKET_FCS_SIZE - MAC_OFFSET);
+	packet->frame_check_sequence[0] = crc & 0xff;
+	packet->frame_check_sequence[1] = (crc >> 8) & 0xff;
+	packet->frame_check_sequence[2] = (crc >> 16) & 0xff;
+	packet->frame_check_sequence[3] = crc >> 24;
+	memcpy(bytes + size - PACKET_FCS_SIZE, packet->frame_check_sequence, 
+			PACKET_FCS_SIZE);
+}
+
+/**
+ * Change the source address and port of a packet, adjusting its
+ * checksums for the change rather than summing it again.
+ *
+ * @param[in] packet:	The packet.
+ * @param[in] ip:		The new source address.
+ * @param[in] port:		The new source port.
+ */
+void packet_rewrite_src(packet_t *packet, unsigned char *ip, int port)
+{
+	rewrite_sums(packet, packet->header.src_ip, ip, 
+			packet->header.src_port, port);
+	memcpy(packet->header.src_ip, ip, 4);
+	packet->header.src_port = port;
+}
+
+/**
+ * Change the destination address and port of a packet, adjusting its
+ * checksums for the change rather than summing it again.
+ *
+ * @param[in] packet:	The packet.
+ * @param[in] ip:		The new destination address.
+ * @param[in] port:		The new destination port.
+ */
+void packet_rewrite_dst(packet_t *packet, unsigned char *ip, int port)
+{
+	rewrite_sums(packet, packet->header.dst_ip, ip, 
+			packet->header.dst_port, port);
+	memcpy(packet->header.dst_ip, ip, 4);
+	packet->header.dst_port = port;
+}
+
+/**
+ * Set a function to be shown every frame received or sent through this
+ * module, for capturing traffic.  It runs on the thread doing the I/O,
+ * so it must be quick and must not block.
+ *
+ * @param[in] tap: The function, NULL to stop tapping.
+ */
+void packet_set_tap(void (*tap)(char *frame, int size, int direction))
+{
+	frame_tap = tap;
+}
+
+/**
+ * Show a frame to the tap, if one is set.  For frames that are sent
+ * without going through send_packet or send_frames.
+ *
+ * @param[in] frame:		The serialized frame.
+ * @param[in] size:			The size of the frame.
+ * @param[in] direction:	TAP_IN or TAP_OUT.
+ */
+void packet_tap(char *frame, int size, int direction)
+{
+	if (frame_tap) {
+		frame_tap(frame, size, direction);
+	}
 }
 
+/*** Helper Functions ****************************************************/
 
-unsigned char *packet_ipdup(unsigned char *s) 
+/* check that the fields a payload announces lie within its size */
+int payload_fits(char *payload, int size)
 {
 	int i;
-	unsigned char *c = malloc(4 * sizeof(unsigned char));
+	int index = 4;	/* past the code */
+	int32_t len;
 
+	/* name, data and to are 2 bytes per character, the list 4 per ip */
 	for (i = 0; i < 4; i++) {
-		c[i] = s[i];
+		if (index + 4 > size) {
+			return FALSE;
+		}
+		memcpy(&len, payload + index, sizeof(int32_t));
+		len = ntohl(len);
+		index += 4;
+		if ((len < 0) || (len > (size - index) / (i < 3 ? 2 : 4))) {
+			return FALSE;
+		}
+		index += len * (i < 3 ? 2 : 4);
+	}
+	return TRUE;
+}
+
+/* sum the pseudo header, TCP header and payload of a frame, for the 
+ * TCP checksum */
+uint32_t tcp_pseudo_sum(unsigned char *frame, int size)
+{
+	unsigned char pseudo[12];
+	int len = size - PACKET_FCS_SIZE - TCP_OFFSET;
+
+	/* the addresses are in the order of the wire, destination first */
+	memcpy(pseudo, frame + TCP_OFFSET - 8, 8);
+	pseudo[8] = 0;
+	pseudo[9] = frame[IP_OFFSET + 9];
+	pseudo[10] = (len >> 8) & 0xff;
+	pseudo[11] = len & 0xff;
+	return csum_partial(frame + TCP_OFFSET, len, 
+			csum_partial(pseudo, 12, 0));
+}
+
+/* adjust the checksums of a packet for an address and port changing */
+void rewrite_sums(packet_t *packet, unsigned char *old_ip, 
+		unsigned char *new_ip, int old_port, int new_port)
+{
+	unsigned char old_bytes[2];
+	unsigned char new_bytes[2];
+	uint16_t sum;
+
+	if (!packet->sums_kept) {
+		/* they are worked out from scratch when the packet is sent */
+		return;
+	}
+	sum = (packet->header.headerchecksum[0] << 8) 
+		| packet->header.headerchecksum[1];
+	sum = csum_update(sum, old_ip, new_ip, 4);
+	packet->header.headerchecksum[0] = sum >> 8;
+	packet->header.headerchecksum[1] = sum & 0xff;
+
+	old_bytes[0] = (old_port >> 8) & 0xff;
+	old_bytes[1] = old_port & 0xff;
+	new_bytes[0] = (new_port >> 8) & 0xff;
+	new_bytes[1] = new_port & 0xff;
+	sum = (uint16_t)packet->header.tcpchecksum;
+	sum = csum_update(sum, old_ip, new_ip, 4);
+	sum = csum_update(sum, old_bytes, new_bytes, 2);
+	packet->header.tcpchecksum = (int16_t)sum;
+}
+
+/* fill in a header from its wire representation */
+void decode_header(char *bytes, p_header_t *header)
+{
+	int16_t int16;
+	int32_t int32;
+
+	memcpy(header, bytes, TCP_OFFSET);
+
+	memcpy(&int16, bytes + TCP_OFFSET, sizeof(int16_t));
+	header->dst_port = ntohs(int16);
+	memcpy(&int16, bytes + TCP_OFFSET + 2, sizeof(int16_t));
+	header->src_port = ntohs(int16);
+
+	memcpy(&int32, bytes + SEQ_OFFSET, sizeof(int32_t));
+	header->sequence_no = ntohl(int32);
+	memcpy(&int32, bytes + ACK_OFFSET, sizeof(int32_t));
+	header->ack_no = ntohl(int32);
+
+	memcpy(header->data_offset_reserved_flags, bytes + WINDOW_OFFSET - 2, 2);
+	memcpy(&int16, bytes + WINDOW_OFFSET, sizeof(int16_t));
+	header->window_size = ntohs(int16);
+
+	memcpy(&int16, bytes + TCP_SUM_OFFSET, sizeof(int16_t));
+	header->tcpchecksum = ntohs(int16);
+	memcpy(&int16, bytes + URGENT_OFFSET, sizeof(int16_t));
+	header->urgent_pointer = ntohs(int16);
+}
+
+/* read until n bytes have come, the stream ends or it fails, and
+ * return how many came */
+int read_fully(int fd, char *buffer, int n)
+{
+	int i = 0;
+	int r;
+
+	while (i < n) {
+		r = read(fd, buffer + i, n - i);
+		if (r <= 0) {
+			break;
+		}
+		i += r;
 	}
+	return i;
+}
+
+/* store a value in network byte order at a place that need not be
+ * aligned */
+void put_int16(char *bytes, int16_t value)
+{
+	value = htons(value);
+	memcpy(bytes, &value, sizeof(int16_t));
+}
+
+void put_int32(char *bytes, int32_t value)
+{
+	value = htonl(value);
+	memcpy(bytes, &value, sizeof(int32_t));
+}
+
+/* take bytes from the room at the end of a packet */
+char *room_take(packet_t *packet, int len)
+{
+	char *at = NULL;
+
+	if (len > packet->room - packet->room_used) {
+		fprintf(stderr, "no room left in packet for %d bytes\n", len);
+		return NULL;
+	}
+	at = packet->body + packet->room_used;
+	packet->room_used += len;
+	return at;
+}
+
+/* give back bytes taken from the room of a packet, which can only be 
+ * taken again if nothing was taken after them */
+void room_give(packet_t *packet, char *at, int len)
+{
+	if ((at) && (at + len == packet->body + packet->room_used)) {
+		packet->room_used -= len;
+	}
+}
+
+char *packet_strdup(char *s)
+{
+	char *c = malloc(strlen(s) + 1);
+	int i = 0;
+	int j = 0;
+
+	while((c[i++] = s[j++]));
+
 	return c;
 }
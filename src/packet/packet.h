@@ -3,6 +3,17 @@
 #include "../queue/queue.h"
 #include <stdint.h>
 
+/*** Macros **************************************************************/
+
+#define PACKET_HEADER_SIZE	62	/* The bytes of the header on the wire */
+#define PACKET_PREFIX_SIZE	66	/* The header and the payload size field */
+#define PACKET_MAX_SIZE		65536	/* The largest payload a peer may announce */
+#define PACKET_FCS_SIZE		4	/* The frame check sequence after the payload */
+#define PACKET_CHUNK_CHARS	4096	/* Characters carried per fragment */
+
+#define TAP_IN				0	/* A frame decoded by packet_from_frame */
+#define TAP_OUT				1	/* A frame about to be written to a socket */
+
 /*** struct description **************************************************/
 
 typedef struct p_headder {
@@ -53,13 +64,24 @@ typedef struct packet {
 	char *data;			/* The data to be sent in the packet */
 	int to_len;			/* The number of characters in the to field */
 	char *to;			/* The username of the receiving client */
-	int list_len;		/* The number of names in users */
+	int list_len;		/* The number of ips in the list */
 	int list_size;		/* The number of bytes taken up by the list */
-	queue_t *users;		/* The names to be carried in this packet */
+	unsigned char *ips;	/* The ips carried in this packet, 4 bytes each */
 
 	unsigned char frame_check_sequence[4];
 	/* End of Frame */
 
+	int sums_kept;		/* The checksums in header still cover the packet */
+
+	/*
+	 * name, data, to and ips point into the room at the end of the
+	 * packet, which is allocated along with it, so that a packet is a
+	 * single allocation sized to what it carries.
+	 */
+	int room;			/* The bytes of room after the packet */
+	int room_used;		/* The bytes of room taken */
+	char body[1];		/* The room, which runs on past the struct */
+
 } packet_t;
 
 /*** Function Prototypes *************************************************/
@@ -68,9 +90,12 @@ typedef struct packet {
  * Malloc heap space for a new generic packet.  
  * All values initialized to NULL, 0 or -1.
  *
+ * @param[in] room: The bytes of room to leave after the packet for its
+ *					text and ips.
+ *
  * @return The newly allocated space.
  */
-packet_t *new_empty_packet();
+packet_t *new_empty_packet(int room);
 
 /** 
  * Malloc heap space for a new packet.
@@ -78,7 +103,7 @@ packet_t *new_empty_packet();
  * @param[in] code: An integer describing the function of the packet.
  *					See code.h.
  * @param[in] name: The username of the sender.
- * @param[in] data: The message to send.
+ * @param[in] data: The message to send.  It is copied into the packet.
  * @param[in] to:	The message to send.
  *
  * @return	The memory address of the newly allocated packet, or NULL
@@ -86,6 +111,30 @@ packet_t *new_empty_packet();
  */
 packet_t *new_packet(int code, unsigned char *src_ip, char *data, unsigned char *dst_ip, int src_port, int dst_port);
 
+/**
+ * Make sure a packet has a number of bytes of room left for text or ips
+ * set after it was made, moving it if it must grow.
+ *
+ * @param[in] packet:	The packet, NULL to do nothing.
+ * @param[in] len:		The bytes of room needed.
+ *
+ * @return The packet, which may have moved, or NULL on failure, in which
+ * case the packet is free'd.
+ */
+packet_t *packet_reserve(packet_t *packet, int len);
+
+/**
+ * Take room for a string of text from the room of a packet.  The room is
+ * given back when the packet is free'd.
+ *
+ * @param[in] packet:	The packet the text is for.
+ * @param[in] len:		The number of characters, without the '\0'.
+ *
+ * @return Room for len characters and a '\0', NULL if the packet has no
+ * room left for them.
+ */
+char *packet_text(packet_t *packet, int len);
+
 /** 
  * Free the a given packet.
  * 
@@ -94,14 +143,26 @@ packet_t *new_packet(int code, unsigned char *src_ip, char *data, unsigned char
 void free_packet(void *p);
 
 /**
- * Set the userlist to the packet, updating values as needed. 
+ * Set the userlist to the packet, updating values as needed.  The ips
+ * are copied into the room of the packet.
  *
  * @param[in] packet:	The packet to set the list to.
- * @param[in] users:	The queue structure with the names users that
- *						the packet must carry.
+ * @param[in] users:	The queue structure with the ips of the users
+ *						that the packet must carry.
  */
 void set_user_list(packet_t *packet, queue_t *users);
 
+/**
+ * Set the userlist to the packet from an array of ips, 4 bytes each, as
+ * filled in by users_copy_ips.  The ips are copied into the room of the
+ * packet.
+ *
+ * @param[in] packet:	The packet to set the list to.
+ * @param[in] ips:		The ips the packet must carry.
+ * @param[in] count:	The number of ips in the array.
+ */
+void set_user_array(packet_t *packet, unsigned char *ips, int count);
+
 /**
  * Get the code that describes the function of a given packet.
  *
@@ -135,10 +196,43 @@ char *get_data(packet_t *packet);
  * Set the data field of the given packet.
  *
  * @param[in] packet:	The packet from which the data must be set.
- * @param[in] data:		A pointer to the data to be set.
+ * @param[in] data:		A pointer to the data to be set.  It is copied
+ *						into the packet.
  */
 void set_data(packet_t *packet, char *data);
 
+/**
+ * Set the data field of the given packet to a number of characters
+ * that need not end in a null character.
+ *
+ * @param[in] packet:	The packet from which the data must be set.
+ * @param[in] data:		The characters to be set.  They are copied into
+ *						the room of the packet, which the old data gives
+ *						back first when it was the last taken.
+ * @param[in] len:		The number of characters.
+ */
+void set_data_len(packet_t *packet, char *data, int len);
+
+/**
+ * Mark a packet as a fragment of a message too long to send in one.
+ * The sequence number of the header carries the offset of the first
+ * character of the fragment, and the acknowledgement number the length
+ * of the whole message, so that the fragments stream through the server
+ * one at a time.  Packets that are not fragments keep both at 0.
+ *
+ * @param[in] packet:	The packet carrying the fragment as its data.
+ * @param[in] offset:	The offset of the fragment in the message.
+ * @param[in] total:	The number of characters of the message.
+ */
+void packet_set_fragment(packet_t *packet, long offset, long total);
+
+/**
+ * Check if a packet is a fragment of a longer message.
+ *
+ * @param[in] packet: The packet.
+ */
+int packet_is_fragment(packet_t *packet);
+
 /**
  * Send a given packet over the socket specified by fd.
  *
@@ -148,13 +242,128 @@ void set_data(packet_t *packet, char *data);
  */
 void send_packet(packet_t *packet, int fd);
 
+/**
+ * Send several serialized packets over the same socket, gathered into
+ * as few system calls as possible.  A non-blocking socket may take only
+ * part of them.
+ *
+ * @param[in] frames:	The serialized packets, in the order they must go
+ *						out.
+ * @param[in] sizes:	The size of each of the frames.
+ * @param[in] count:	The number of frames.
+ * @param[in] fd:		A file descriptor of the socket over which the
+ *						frames must be sent.
+ *
+ * @return The number of bytes sent, which may end mid frame, or -1 if
+ * the socket failed.
+ */
+int send_frames(char **frames, int *sizes, int count, int fd);
+
 /**
  * Receive data from a given fd and deserialize the data to a packet.
  *
  * @param[in] fd:	A file descriptor of the socket to receive the 
  *					data over.
- * @return The new packet that was received.
+ * @return The new packet that was received, NULL if the peer went away
+ * or sent a frame that can't be read.  The socket is left open for the
+ * caller to close.
  */
 packet_t *receive_packet(int fd);
 
+/**
+ * Work out the length of the frame at the start of a buffer of bytes
+ * received from a socket.
+ *
+ * @param[in] bytes:	The bytes received so far.
+ * @param[in] len:		The number of bytes in the buffer.
+ *
+ * @return The total length of the frame in bytes, 0 if too little of it
+ * has been received to tell, or -1 if the frame is invalid or larger
+ * than PACKET_MAX_SIZE allows.
+ */
+int packet_frame_size(char *bytes, int len);
+
+/**
+ * Write the wire representation of a header.  The bytes up to the TCP
+ * header are copied straight from the struct, and only the fields
+ * wider than a byte are put into network byte order one by one.
+ *
+ * @param[in]  header:	The header.
+ * @param[out] bytes:	Where the PACKET_HEADER_SIZE bytes go.
+ */
+void packet_encode_header(p_header_t *header, char *bytes);
+
+/**
+ * Decode a complete frame, as measured by packet_frame_size.  The
+ * lengths inside the payload are checked against the size of the frame
+ * before anything is read.
+ *
+ * @param[in] bytes: The bytes of the frame.
+ *
+ * @return The new packet, NULL if the frame is malformed.
+ */
+packet_t *packet_from_frame(char *bytes);
+
+/**
+ * Check the frame check sequence and the IP and TCP checksums of a
+ * complete frame, as measured by packet_frame_size.
+ *
+ * @param[in] bytes:	The bytes of the frame.
+ * @param[in] size:		The size of the frame.
+ *
+ * @return TRUE(1) if they all match, FALSE(0) if the frame was damaged.
+ */
+int packet_frame_intact(char *bytes, int size);
+
+/**
+ * Fill in the checksums and the frame check sequence of a frame just
+ * serialized from a packet.  The checksums of a packet decoded from an
+ * intact frame are kept, as adjusted by any rewrites since, and only
+ * those of a new or changed packet are summed over the whole frame.
+ *
+ * @param[in] packet:	The packet the frame was serialized from.
+ * @param[in] frame:	The serialized frame.
+ * @param[in] size:		The size of the frame, PACKET_FCS_SIZE included.
+ */
+void packet_seal(packet_t *packet, char *frame, int size);
+
+/**
+ * Change the source address and port of a packet, adjusting its
+ * checksums for the change rather than summing it again.
+ *
+ * @param[in] packet:	The packet.
+ * @param[in] ip:		The new source address.
+ * @param[in] port:		The new source port.
+ */
+void packet_rewrite_src(packet_t *packet, unsigned char *ip, int port);
+
+/**
+ * Change the destination address and port of a packet, adjusting its
+ * checksums for the change rather than summing it again.
+ *
+ * @param[in] packet:	The packet.
+ * @param[in] ip:		The new destination address.
+ * @param[in] port:		The new destination port.
+ */
+void packet_rewrite_dst(packet_t *packet, unsigned char *ip, int port);
+
+/**
+ * Set a function to be shown every frame received or sent through this
+ * module, for capturing traffic.  It runs on the thread doing the I/O,
+ * so it must be quick and must not block.
+ *
+ * @param[in] tap: The function, NULL to stop tapping.
+ */
+void packet_set_tap(void (*tap)(char *frame, int size, int direction));
+
+/**
+ * Show a frame to the tap, if one is set.  For frames that are sent
+ * without going through send_packet.
+ *
+ * @param[in] frame:		The serialized frame.
+ * @param[in] size:			The size of the frame.
+ * @param[in] direction:	TAP_IN or TAP_OUT.
+ */
+void packet_tap(char *frame, int size, int direction);
+
 #endif
@@ -9,15 +9,19 @@
 #ifdef DEBUG
 #endif
 
+/*** Macros **************************************************************/
+
+#define TRUE	1
+#define FALSE	0
+
 /*** Helper Function Prototypes ******************************************/
 
 int read_int_from_buffer(char *buffer, int *global_index);
-char *read_string_from_buffer(char *buffer, int *global_index, int length);
-unsigned char *read_ip_from_buffer(char *buffer, int *global_index);
-int cmp(void *a, void *b);
+char *read_string_from_buffer(char *buffer, int *global_index, 
+		packet_t *packet, int length, int *canonical);
+int payload_room(char *bytes);
 
 void write_int32_to_buffer(char *buffer, int *global_index, int32_t integer);
-void write_int16_to_buffer(char *buffer, int *global_index, int16_t integer);
 void write_string_to_buffer(char *buffer, int *global_index, int length, char *string);
 void write_n_bytes_to_buffer(char *buffer, int *global_index, int n, unsigned char *bytes);
 
@@ -39,10 +43,9 @@ char *serialize(packet_t *packet, int *psize)
 	int size = 0;
 	int header_size = 0;
 	char *buffer = NULL;
-	node_t *n = NULL;
 
-	/* headers: ethernet + tcp */
-	header_size = 22 + 20 + 20;
+	/* headers: ethernet + ip + tcp */
+	header_size = PACKET_HEADER_SIZE;
 	
 
 	/* payload sizes */
@@ -61,51 +64,21 @@ char *serialize(packet_t *packet, int *psize)
 	size += sizeof(int);
 	size += packet->list_size;
 
-	*psize = size + sizeof(int) + header_size;
+	*psize = size + sizeof(int) + header_size + PACKET_FCS_SIZE;
 
 	/*
 	buffer = malloc(size + sizeof(int));
 	*/
-	buffer = malloc(header_size + sizeof(int) + size);
+	buffer = malloc(*psize);
 	if (!buffer) {
 		return NULL;
 	}
 
 
-	/* TODO: work out checksum, etc */
-	/* header */
-	write_n_bytes_to_buffer(buffer, &global_index, 8, packet->header.eth_preamble);
-	write_n_bytes_to_buffer(buffer, &global_index, 6, packet->header.dst_mac);
-	write_n_bytes_to_buffer(buffer, &global_index, 6, packet->header.src_mac);
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.ethernet_type);
-	
-	write_n_bytes_to_buffer(buffer, &global_index, 1, &(packet->header.version_ihl));
-	write_n_bytes_to_buffer(buffer, &global_index, 1, &(packet->header.dscp_ecn));
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.total_length);
-
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.identification);
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.flags_fragmentoffset);
-
-	write_n_bytes_to_buffer(buffer, &global_index, 1, &(packet->header.time_to_live));
-	write_n_bytes_to_buffer(buffer, &global_index, 1, &(packet->header.protocol));
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.headerchecksum);
-
-	write_n_bytes_to_buffer(buffer, &global_index, 4, packet->header.dst_ip);
-	write_n_bytes_to_buffer(buffer, &global_index, 4, packet->header.src_ip);
+	/* header, its checksums are filled in by packet_seal */
+	packet_encode_header(&packet->header, buffer);
+	global_index = PACKET_HEADER_SIZE;
 
-	write_int16_to_buffer(buffer, &global_index, packet->header.dst_port);
-	write_int16_to_buffer(buffer, &global_index, packet->header.src_port);
-
-	write_int32_to_buffer(buffer, &global_index, packet->header.sequence_no);
-	write_int32_to_buffer(buffer, &global_index, packet->header.ack_no);
-
-	write_n_bytes_to_buffer(buffer, &global_index, 2, packet->header.data_offset_reserved_flags);
-	write_int16_to_buffer(buffer, &global_index, packet->header.window_size);
-
-
-	write_int16_to_buffer(buffer, &global_index, packet->header.tcpchecksum);
-	write_int16_to_buffer(buffer, &global_index, packet->header.urgent_pointer);
-	
 	write_int32_to_buffer(buffer, &global_index, size);
 
 	write_int32_to_buffer(buffer, &global_index, packet->code);
@@ -131,27 +104,24 @@ char *serialize(packet_t *packet, int *psize)
 		write_int32_to_buffer(buffer, &global_index, 0);
 	}
 
-	if (packet->users) {
+	if (packet->ips) {
 		write_int32_to_buffer(buffer, &global_index, packet->list_len);
-		for (n = packet->users->head; n; n = n->next) {
-			/*
-			len = (int)strlen((char *)n->data);
-			write_int32_to_buffer(buffer, &global_index, len);
-			write_string_to_buffer(buffer, &global_index, len, (char *)n->data);
-			*/
-			write_n_bytes_to_buffer(buffer, &global_index, 4, n->data);
-		}
+		write_n_bytes_to_buffer(buffer, &global_index, 
+				packet->list_size, packet->ips);
 	} else {
 		write_int32_to_buffer(buffer, &global_index, 0);
 	}
 
+	packet_seal(packet, buffer, *psize);
+
 	return buffer;
 }
 
 /**
  * Take a byte buffer and deserialize it to a packet struct.
  *
- * @param[in] bytes: The byte buffer describing the packet.
+ * @param[in] bytes: The byte buffer describing the packet, whose fields
+ *					 must lie within it.
  *
  * @return The packet structure after deserializing.
  */
@@ -159,70 +129,45 @@ packet_t *deserialize(char *bytes, p_header_t *header)
 {
 	packet_t *packet;
 	int global_index = 0;
-	int i			 = 0;
-	/*
-	int slen		 = 0;
-	*/
-	unsigned char *string	 = NULL;
+	int canonical	= TRUE;
 
-	int name_len	= 0;
-	int data_len	= 0;
-	int to_len		= 0;
-	int list_len	= 0;
-	int list_size	= 0;
-	
-	int code   = -1;
-	char *name = NULL;
-	char *data = NULL;
-	char *to   = NULL;
-	queue_t *users = NULL;
+	/* one allocation for the packet along with all it carries */
+	packet = new_empty_packet(payload_room(bytes));
+	if (!packet) {
+		return NULL;
+	}
+	packet->header = *header;
 
-	code = read_int_from_buffer(bytes, &global_index);
+	packet->code = read_int_from_buffer(bytes, &global_index);
 
-	name_len = read_int_from_buffer(bytes, &global_index);
-	if (name_len) {
-		name = read_string_from_buffer(bytes, &global_index, name_len);
+	/* the text and ips go straight into the room of the packet */
+	packet->name_len = read_int_from_buffer(bytes, &global_index);
+	if (packet->name_len) {
+		packet->name = read_string_from_buffer(bytes, &global_index, 
+				packet, packet->name_len, &canonical);
 	}
 
-	data_len = read_int_from_buffer(bytes, &global_index);
-	if (data_len) {
-		data = read_string_from_buffer(bytes, &global_index, data_len);
+	packet->data_len = read_int_from_buffer(bytes, &global_index);
+	if (packet->data_len) {
+		packet->data = read_string_from_buffer(bytes, &global_index, 
+				packet, packet->data_len, &canonical);
 	}
 
-	to_len = read_int_from_buffer(bytes, &global_index);
-	if (to_len) {
-		to = read_string_from_buffer(bytes, &global_index, to_len);
+	packet->to_len = read_int_from_buffer(bytes, &global_index);
+	if (packet->to_len) {
+		packet->to = read_string_from_buffer(bytes, &global_index, 
+				packet, packet->to_len, &canonical);
 	}
 
-	list_len = read_int_from_buffer(bytes, &global_index);
-	if (list_len) {
-		init_queue(&users, cmp, free);
-	}
-	for (i = 0; i < list_len; i++) {
-		/*
-		slen = read_int_from_buffer(bytes, &global_index);
-		*/
-		list_size += 4;
-		string = read_ip_from_buffer(bytes, &global_index);
-		insert_node(users, string);
+	packet->list_len = read_int_from_buffer(bytes, &global_index);
+	if (packet->list_len) {
+		set_user_array(packet, (unsigned char *)bytes + global_index, 
+				packet->list_len);
 	}
 
-	packet = new_empty_packet();
-	packet->header = *header;
-	packet->code = code;
-
-	packet->name_len = name_len;
-	packet->name = name;
-
-	packet->data_len = data_len;
-	packet->data = data;
-
-	packet->to_len = to_len;
-	packet->to = to;
-
-	packet->list_len = list_len;
-	packet->list_size = list_size;
-	packet->users = users;
+	/* the checksums that came with it hold for the packet sent on, as
+	 * long as serializing it again gives back the same bytes */
+	packet->sums_kept = canonical;
 
 	return packet;
 }
@@ -240,17 +185,25 @@ int read_int_from_buffer(char *bytes, int *global_index)
 	return read_val;
 }
 
-char *read_string_from_buffer(char *bytes, int *global_index, int length)
+char *read_string_from_buffer(char *bytes, int *global_index, 
+		packet_t *packet, int length, int *canonical)
 {
 	int i = 0;
 	char *string = NULL;
 	short *temp = 0;;
 
-	string = malloc(length + 1);
+	string = packet_text(packet, length);
+	if (!string) {
+		*global_index += length * 2;
+		return NULL;
+	}
 
 	for (i = 0; i < length; i++) {
 		temp = (short *)&bytes[*global_index + (2 * i)];
 		string[i] = (char) ntohs(*temp);
+		if (ntohs(*temp) > 0xff) {
+			*canonical = FALSE;
+		}
 	}
 
 	string[length] = '\0';
@@ -258,28 +211,22 @@ char *read_string_from_buffer(char *bytes, int *global_index, int length)
 	return string;
 }
 
-unsigned char *read_ip_from_buffer(char *buffer, int *global_index)
+/* the bytes of room a packet needs for the text and ips of a payload,
+ * which payload_fits has found to lie within it */
+int payload_room(char *bytes)
 {
-	int i = 0;
-	unsigned char *ip = NULL;
-
-	ip = malloc(4);
-
-	for (i = 0; i < 4; i++) {
-		ip[i] = (unsigned char)buffer[*global_index + i];
-	}
-
-	*global_index += 4;
-	return ip;
-}
-
-int cmp(void *a, void *b) 
-{
-	if (a == b) {
-		return 0;
-	} else {
-		return 0;
+	int i;
+	int len;
+	int room = 0;
+	int global_index = sizeof(int);	/* past the code */
+
+	/* name, data and to, each with a '\0' unless it is left out */
+	for (i = 0; i < 3; i++) {
+		len = read_int_from_buffer(bytes, &global_index);
+		global_index += len * 2;
+		room += len ? len + 1 : 0;
 	}
+	return room + 4 * read_int_from_buffer(bytes, &global_index);
 }
 
 void write_int32_to_buffer(char *buffer, int *global_index, int32_t integer)
@@ -290,14 +237,6 @@ void write_int32_to_buffer(char *buffer, int *global_index, int32_t integer)
 	*global_index += sizeof(int32_t);
 }
 
-void write_int16_to_buffer(char *buffer, int *global_index, int16_t integer)
-{
-	int16_t *iptr = NULL;
-	iptr = (int16_t *)(buffer + *global_index);
-	*iptr = htons(integer);
-	*global_index += sizeof(int16_t);
-}
-
 
 void write_string_to_buffer(char *buffer, int *global_index, int length, char *string)
 {
@@ -305,7 +244,7 @@ void write_string_to_buffer(char *buffer, int *global_index, int length, char *s
 	short *ch;
 	for (i = 0; i < length; i++) {
 		ch = (short *)(buffer + *global_index + (2 * i));
-		*ch = htons((short)string[i]);
+		*ch = htons((unsigned char)string[i]);
 		/*
 		buffer[*global_index + (2 * i)] = ch;
 		*/
@@ -315,12 +254,6 @@ void write_string_to_buffer(char *buffer, int *global_index, int length, char *s
 
 void write_n_bytes_to_buffer(char *buffer, int *global_index, int n, unsigned char *bytes)
 {
-	int i;
-	unsigned char *ch;
-	for (i = 0; i < n; i++) {
-		ch = (unsigned char *)(buffer + *global_index + i);
-		*ch = bytes[i];
-	}
-	*global_index += i;
-
+	memcpy(buffer + *global_index, bytes, n);
+	*global_index += n;
 }
@@ -15,7 +15,8 @@ char *serialize(packet_t *packet, int *psize);
 /**
  * Take a byte buffer and deserialize it to a packet struct.
  *
- * @param[in] bytes: The byte buffer describing the packet.
+ * @param[in] bytes: The byte buffer describing the packet, whose fields
+ *					 must lie within it.
  *
  * @return The packet structure after deserializing.
  */
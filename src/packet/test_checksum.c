@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "checksum.h"
+#include "packet.h"
+#include "serializer.h"
+#include "code.h"
+
+#define BUF_SIZE	1024
+#define MAX_LEN		300	/* Longest run summed, past every unrolled loop */
+#define MAX_SHIFT	8	/* Offsets tried from an aligned address */
+
+uint16_t ref_sum(const unsigned char *bytes, int len, uint32_t sum);
+uint32_t ref_crc(const unsigned char *bytes, int len);
+int test_crc(unsigned char *buf);
+int test_sums(unsigned char *buf);
+int test_rewrite(unsigned char *src, int src_port, unsigned char *dst,
+		int dst_port);
+
+int main(void)
+{
+	int fails = 0;
+	unsigned char *buf = malloc(BUF_SIZE);
+	unsigned char zero[4] = {0, 0, 0, 0};
+	unsigned char ones[4] = {255, 255, 255, 255};
+	unsigned char pool[4] = {10, 0, 0, 7};
+	unsigned char outside[4] = {203, 0, 113, 200};
+	int i;
+
+	if (!buf) {
+		fprintf(stderr, "failed to set up the test\n");
+		return 1;
+	}
+	srand(42);
+	for (i = 0; i < BUF_SIZE; i++) {
+		buf[i] = rand() & 0xff;
+	}
+
+	fails += test_crc(buf);
+	fails += test_sums(buf);
+
+	/* rewritten as the NAT workers do, including the words that carry */
+	fails += test_rewrite(outside, 40000, pool, 8001);
+	fails += test_rewrite(zero, 0, ones, 0xffff);
+	fails += test_rewrite(ones, 0xffff, zero, 0);
+	fails += test_rewrite(pool, 8002, pool, 8002);
+
+	printf("%d failures\n", fails);
+
+	free(buf);
+	return fails ? 1 : 0;
+}
+
+/* the check value of CRC-32, and the sliced loop against a bit at a time
+ * over every length and alignment */
+int test_crc(unsigned char *buf)
+{
+	int fails = 0;
+	int len, shift;
+	uint32_t crc;
+
+	crc = crc32_fcs((const unsigned char *)"123456789", 9);
+	if (crc != 0xcbf43926UL) {
+		printf("crc of \"123456789\" is %08lx, not cbf43926\n",
+				(unsigned long)crc);
+		fails++;
+	}
+	for (shift = 0; shift < MAX_SHIFT; shift++) {
+		for (len = 0; len <= MAX_LEN; len++) {
+			if (crc32_fcs(buf + shift, len) != ref_crc(buf + shift, len)) {
+				printf("crc of %d bytes at offset %d is wrong\n", len, shift);
+				fails++;
+			}
+		}
+	}
+	return fails;
+}
+
+/* the sum over every length, odd ones included, from every alignment,
+ * whole and split in two */
+int test_sums(unsigned char *buf)
+{
+	int fails = 0;
+	int len, shift, split;
+	uint32_t start[3] = {0, 0x1234, 0xfffffffeUL};
+	uint32_t sum;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		for (shift = 0; shift < MAX_SHIFT; shift++) {
+			for (len = 0; len <= MAX_LEN; len++) {
+				sum = csum_partial(buf + shift, len, start[i]);
+				if (csum_finish(sum) != ref_sum(buf + shift, len, start[i])) {
+					printf("sum of %d bytes at offset %d from %lx is wrong\n",
+							len, shift, (unsigned long)start[i]);
+					fails++;
+				}
+				/* only the last run of a sum may be odd */
+				split = (len / 3) & ~1;
+				sum = csum_partial(buf + shift, split, start[i]);
+				sum = csum_partial(buf + shift + split, len - split, sum);
+				if (csum_finish(sum) != ref_sum(buf + shift, len, start[i])) {
+					printf("sum of %d bytes at offset %d split at %d is wrong\n",
+							len, shift, split);
+					fails++;
+				}
+			}
+		}
+	}
+	return fails;
+}
+
+/* rewrite a frame that kept its checksums, and check them against the
+ * ones worked out again from scratch */
+int test_rewrite(unsigned char *src, int src_port, unsigned char *dst,
+		int dst_port)
+{
+	int fails = 0;
+	unsigned char from[4] = {192, 168, 1, 20};
+	unsigned char to[4] = {10, 0, 0, 1};
+	char *frame = NULL;
+	char *kept = NULL;
+	char *fresh = NULL;
+	int size;
+	packet_t *packet = NULL;
+
+	packet = new_packet(SEND, from, "rewritten on the way", to, 8002, 8001);
+	frame = serialize(packet, &size);
+	free_packet(packet);
+	packet = packet_from_frame(frame);
+	if ((!packet) || (!packet->sums_kept)) {
+		printf("a frame read back did not keep its checksums\n");
+		free(frame);
+		return 1;
+	}
+
+	packet_rewrite_src(packet, src, src_port);
+	packet_rewrite_dst(packet, dst, dst_port);
+	kept = serialize(packet, &size);
+	if (!packet_frame_intact(kept, size)) {
+		printf("rewrite to %d.%d.%d.%d:%d -> %d.%d.%d.%d:%d broke a sum\n",
+				src[0], src[1], src[2], src[3], src_port,
+				dst[0], dst[1], dst[2], dst[3], dst_port);
+		fails++;
+	}
+
+	packet->sums_kept = 0;
+	fresh = serialize(packet, &size);
+	if (memcmp(kept, fresh, size)) {
+		printf("rewrite to %d.%d.%d.%d:%d -> %d.%d.%d.%d:%d differs from "
+				"a full sum\n", src[0], src[1], src[2], src[3], src_port,
+				dst[0], dst[1], dst[2], dst[3], dst_port);
+		fails++;
+	}
+
+	free(frame);
+	free(kept);
+	free(fresh);
+	free_packet(packet);
+	return fails;
+}
+
+/* a 16 bit word at a time, folding as it goes */
+uint16_t ref_sum(const unsigned char *bytes, int len, uint32_t sum)
+{
+	unsigned long s;
+	int i;
+
+	s = (sum & 0xffff) + (sum >> 16);
+	for (i = 0; i + 1 < len; i += 2) {
+		s += (bytes[i] << 8) | bytes[i + 1];
+		s = (s & 0xffff) + (s >> 16);
+	}
+	if (len & 1) {
+		s += bytes[len - 1] << 8;
+		s = (s & 0xffff) + (s >> 16);
+	}
+	s = (s & 0xffff) + (s >> 16);
+	return (uint16_t)~s;
+}
+
+/* the reflected CRC-32 a bit at a time */
+uint32_t ref_crc(const unsigned char *bytes, int len)
+{
+	uint32_t crc = 0xffffffffUL;
+	int i, bit;
+
+	for (i = 0; i < len; i++) {
+		crc ^= bytes[i];
+		for (bit = 0; bit < 8; bit++) {
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xedb88320UL : 0);
+		}
+	}
+	return ~crc;
+}
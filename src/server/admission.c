@@ -0,0 +1,327 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "admission.h"
+#include "../clock/clock.h"
+
+/*** Macros **************************************************************/
+
+#define TOKEN			1000	/* The tokens a packet takes */
+#define MAX_IDLE_MS		3600000UL	/* Longer idle refills no further */
+
+/*** Helper Function Prototypes ******************************************/
+
+int bucket_take(bucket_t *bucket, long rate, long burst, unsigned long now);
+int admit_ip(admission_t *admit, unsigned char *ip, unsigned long now);
+admit_ip_t *admit_ip_find(admit_set_t *set, unsigned char *ip);
+unsigned long admit_hash(unsigned char *ip);
+
+char *reason_names[DROP_REASONS] = {
+	"connection rate",
+	"address rate",
+	"queue full",
+	"wrong source"
+};
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate the admission control, with the rates unlimited and the
+ * queues capped at DEFAULT_QUEUE_CAP, dropping beyond that.
+ *
+ * @return The new admission control, NULL on failure.
+ */
+admission_t *new_admission()
+{
+	int i;
+	admission_t *admit = malloc(sizeof(admission_t));
+
+	if (!admit) {
+		fprintf(stderr, "failed to malloc admission\n");
+		return NULL;
+	}
+	admit->sets = calloc(ADMIT_SETS, sizeof(admit_set_t));
+	if (!admit->sets) {
+		fprintf(stderr, "failed to malloc admission sets\n");
+		free(admit);
+		return NULL;
+	}
+	for (i = 0; i < ADMIT_SETS; i++) {
+		pthread_mutex_init(&admit->sets[i].lock, NULL);
+	}
+	admit->conn_rate = 0;
+	admit->conn_burst = 0;
+	admit->ip_rate = 0;
+	admit->ip_burst = 0;
+	admit->queue_cap = DEFAULT_QUEUE_CAP;
+	admit->overload = OVERLOAD_DROP;
+	admit->backlog = 0;
+	for (i = 0; i < DROP_REASONS; i++) {
+		admit->drops[i] = 0;
+	}
+	return admit;
+}
+
+/**
+ * Free the admission control.
+ *
+ * @param[in] admit: The admission control to be free'd.
+ */
+void free_admission(admission_t *admit)
+{
+	int i;
+
+	if (!admit) {
+		return;
+	}
+	for (i = 0; i < ADMIT_SETS; i++) {
+		pthread_mutex_destroy(&admit->sets[i].lock);
+	}
+	free(admit->sets);
+	admit->sets = NULL;
+	free(admit);
+}
+
+/**
+ * Set the rate limit of every connection.  Takes effect for the
+ * connections accepted from then on.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] rate:		Packets per second, 0 for no limit.
+ * @param[in] burst:	Packets let through back to back, 0 for one
+ *						second's worth.
+ */
+void admission_set_conn_rate(admission_t *admit, long rate, long burst)
+{
+	admit->conn_rate = (rate > 0) ? rate : 0;
+	admit->conn_burst = (burst > 0) ? burst : admit->conn_rate;
+}
+
+/**
+ * Set the rate limit of every source address.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] rate:		Packets per second, 0 for no limit.
+ * @param[in] burst:	Packets let through back to back, 0 for one
+ *						second's worth.
+ */
+void admission_set_ip_rate(admission_t *admit, long rate, long burst)
+{
+	admit->ip_rate = (rate > 0) ? rate : 0;
+	admit->ip_burst = (burst > 0) ? burst : admit->ip_rate;
+}
+
+/**
+ * Fill the bucket of a new connection.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] bucket:	The bucket of the connection.
+ */
+void admission_conn_init(admission_t *admit, bucket_t *bucket)
+{
+	bucket->tokens = admit->conn_burst * TOKEN;
+	bucket->refilled = clock_millis();
+}
+
+/**
+ * Decide whether a packet is let in.  A packet that is let in takes a
+ * token from the bucket of its connection and of its source address.
+ * Drops are counted, deferrals are not.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] bucket:	The bucket of the connection it came in on.
+ * @param[in] ip:		The address of the sender, as the server knows
+ *						it rather than as the packet claims it.
+ * @param[in] queued:	The packet ends up in a queue, so it is subject
+ *						to the cap.
+ *
+ * @return ADMIT_PASS, ADMIT_DROP or ADMIT_DEFER.
+ */
+int admission_check(admission_t *admit, bucket_t *bucket,
+		unsigned char *ip, int queued)
+{
+	unsigned long now;
+
+	if ((queued) && (admission_overloaded(admit))) {
+		if (admit->overload == OVERLOAD_DEFER) {
+			return ADMIT_DEFER;
+		}
+		admission_count_drop(admit, DROP_QUEUE_FULL);
+		return ADMIT_DROP;
+	}
+	if ((!admit->conn_rate) && (!admit->ip_rate)) {
+		return ADMIT_PASS;
+	}
+
+	now = clock_millis();
+	if ((admit->conn_rate) &&
+			(!bucket_take(bucket, admit->conn_rate, admit->conn_burst, now))) {
+		admission_count_drop(admit, DROP_CONN_RATE);
+		return ADMIT_DROP;
+	}
+	if ((admit->ip_rate) && (!admit_ip(admit, ip, now))) {
+		admission_count_drop(admit, DROP_IP_RATE);
+		return ADMIT_DROP;
+	}
+	return ADMIT_PASS;
+}
+
+/**
+ * Decide whether work from an address that has no connection yet is
+ * taken on, by the bucket of the address alone.  Drops are counted.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] ip:		The address of the sender, as the server knows
+ *						it rather than as the packet claims it.
+ *
+ * @return ADMIT_PASS or ADMIT_DROP.
+ */
+int admission_check_address(admission_t *admit, unsigned char *ip)
+{
+	if ((admit->ip_rate) && (!admit_ip(admit, ip, clock_millis()))) {
+		admission_count_drop(admit, DROP_IP_RATE);
+		return ADMIT_DROP;
+	}
+	return ADMIT_PASS;
+}
+
+/**
+ * Check if the queues are at the cap.
+ *
+ * @param[in] admit: The admission control.
+ */
+int admission_overloaded(admission_t *admit)
+{
+	return (admit->queue_cap > 0) &&
+		(__atomic_load_n(&admit->backlog, __ATOMIC_RELAXED) >= admit->queue_cap);
+}
+
+/**
+ * Count packets going into, or taken out of, the queues.
+ *
+ * @param[in] admit:	The admission control, may be NULL.
+ * @param[in] count:	The number of packets, negative when taken out.
+ */
+void admission_queued(admission_t *admit, int count)
+{
+	if (admit) {
+		__atomic_add_fetch(&admit->backlog, count, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Count a packet dropped for a reason decided outside admission_check.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] reason:	One of the DROP_ reasons.
+ */
+void admission_count_drop(admission_t *admit, int reason)
+{
+	__atomic_add_fetch(&admit->drops[reason], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the number of packets dropped for a reason.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] reason:	One of the DROP_ reasons.
+ */
+unsigned long admission_dropped(admission_t *admit, int reason)
+{
+	return __atomic_load_n(&admit->drops[reason], __ATOMIC_RELAXED);
+}
+
+/**
+ * Get a name for a drop reason, for reporting.
+ *
+ * @param[in] reason: One of the DROP_ reasons.
+ */
+const char *admission_reason_name(int reason)
+{
+	if ((reason < 0) || (reason >= DROP_REASONS)) {
+		return "unknown";
+	}
+	return reason_names[reason];
+}
+
+/*** Helper Functions ****************************************************/
+
+/* refill a bucket for the time since it was last refilled, and take a
+ * packet's worth of tokens from it if it has them */
+int bucket_take(bucket_t *bucket, long rate, long burst, unsigned long now)
+{
+	unsigned long idle = now - bucket->refilled;
+
+	if (idle > MAX_IDLE_MS) {
+		idle = MAX_IDLE_MS;
+	}
+	/* rate packets a second is rate thousandths of a packet a ms */
+	bucket->tokens += (long)idle * rate;
+	if (bucket->tokens > burst * TOKEN) {
+		bucket->tokens = burst * TOKEN;
+	}
+	bucket->refilled = now;
+
+	if (bucket->tokens < TOKEN) {
+		return FALSE;
+	}
+	bucket->tokens -= TOKEN;
+	return TRUE;
+}
+
+/* take a token from the bucket of a source address */
+int admit_ip(admission_t *admit, unsigned char *ip, unsigned long now)
+{
+	admit_set_t *set = &admit->sets[admit_hash(ip) % ADMIT_SETS];
+	admit_ip_t *way = NULL;
+	int ok;
+
+	pthread_mutex_lock(&set->lock);
+	way = admit_ip_find(set, ip);
+	if (!way->used) {
+		memcpy(way->ip, ip, 4);
+		way->used = TRUE;
+		way->bucket.tokens = admit->ip_burst * TOKEN;
+		way->bucket.refilled = now;
+	}
+	ok = bucket_take(&way->bucket, admit->ip_rate, admit->ip_burst, now);
+	pthread_mutex_unlock(&set->lock);
+	return ok;
+}
+
+/* the way of an address in its set, or else the way to put it in,
+ * cleared, with the lock of the set held */
+admit_ip_t *admit_ip_find(admit_set_t *set, unsigned char *ip)
+{
+	int i;
+	admit_ip_t *oldest = &set->ways[0];
+
+	for (i = 0; i < ADMIT_WAYS; i++) {
+		if ((set->ways[i].used) && (!memcmp(set->ways[i].ip, ip, 4))) {
+			return &set->ways[i];
+		}
+	}
+	for (i = 0; i < ADMIT_WAYS; i++) {
+		if (!set->ways[i].used) {
+			return &set->ways[i];
+		}
+		if (set->ways[i].bucket.refilled < oldest->bucket.refilled) {
+			oldest = &set->ways[i];
+		}
+	}
+	oldest->used = FALSE;
+	return oldest;
+}
+
+/* FNV-1a over the 4 bytes of an ip */
+unsigned long admit_hash(unsigned char *ip)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		h = ((h ^ ip[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	return h ^ (h >> 16);
+}
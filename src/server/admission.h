@@ -0,0 +1,196 @@
+/*
+ * Admission control for the packets the listeners take in.
+ *
+ * Every connection, and every source address over all its connections,
+ * gets a token bucket that refills at a set rate of packets per second,
+ * up to a burst.  The address is the one the server knows the sender by,
+ * never the one a packet claims, and a packet claiming any other source
+ * than its sender is dropped.  A packet that finds its bucket empty is
+ * dropped as well.  On
+ * top of that, the packets waiting in the queues of the speaker and the
+ * NAT workers are counted, and once they reach a cap, new work is either
+ * dropped or deferred: left undecoded in the receive buffer of its
+ * connection, which is not read again until the queues drain, so that
+ * TCP pushes back on the sender.
+ */
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <pthread.h>
+
+#define TRUE	1
+#define FALSE	0
+
+#define DEFAULT_QUEUE_CAP	65536	/* Packets queued at most, by default */
+#define ADMIT_SETS			1024	/* Sets of the source address table */
+#define ADMIT_WAYS			4		/* Addresses per set */
+#define ADMIT_PARK_LIMIT	(1 << 20)	/* Bytes a deferred connection may
+										 * hold before its work is dropped */
+
+/* What to do with a packet, as decided by admission_check */
+#define ADMIT_PASS		0
+#define ADMIT_DROP		1
+#define ADMIT_DEFER		2
+
+/* What to do with new work once the queues are at the cap */
+#define OVERLOAD_DROP	0
+#define OVERLOAD_DEFER	1
+
+/* Why a packet was dropped */
+#define DROP_CONN_RATE	0	/* The bucket of its connection was empty */
+#define DROP_IP_RATE	1	/* The bucket of its source address was empty */
+#define DROP_QUEUE_FULL	2	/* The queues were at the cap */
+#define DROP_SPOOFED	3	/* Its source was not that of its sender */
+#define DROP_REASONS	4
+
+/*** Struct definitions **************************************************/
+
+/*
+ * A token bucket, in thousandths of a packet.
+ */
+typedef struct bucket {
+	long tokens;
+	unsigned long refilled;		/* The clock_millis of the last refill */
+} bucket_t;
+
+typedef struct admit_ip {
+	unsigned char ip[4];
+	int used;
+	bucket_t bucket;
+} admit_ip_t;
+
+/*
+ * A set of the source address table.  Addresses hash to a set, and
+ * the least recently refilled of its ways makes room for a new one.
+ */
+typedef struct admit_set {
+	pthread_mutex_t lock;
+	admit_ip_t ways[ADMIT_WAYS];
+} admit_set_t;
+
+typedef struct admission {
+	long conn_rate;				/* Packets per second, 0 for no limit */
+	long conn_burst;			/* Packets let through back to back */
+	long ip_rate;				/* Packets per second, 0 for no limit */
+	long ip_burst;
+	int queue_cap;				/* Packets queued at most, 0 for no cap */
+	int overload;				/* OVERLOAD_DROP or OVERLOAD_DEFER */
+	int backlog;				/* Packets queued right now, atomic */
+	unsigned long drops[DROP_REASONS];	/* Atomic */
+	admit_set_t *sets;
+} admission_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate the admission control, with the rates unlimited and the
+ * queues capped at DEFAULT_QUEUE_CAP, dropping beyond that.
+ *
+ * @return The new admission control, NULL on failure.
+ */
+admission_t *new_admission();
+
+/**
+ * Free the admission control.
+ *
+ * @param[in] admit: The admission control to be free'd.
+ */
+void free_admission(admission_t *admit);
+
+/**
+ * Set the rate limit of every connection.  Takes effect for the
+ * connections accepted from then on.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] rate:		Packets per second, 0 for no limit.
+ * @param[in] burst:	Packets let through back to back, 0 for one
+ *						second's worth.
+ */
+void admission_set_conn_rate(admission_t *admit, long rate, long burst);
+
+/**
+ * Set the rate limit of every source address.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] rate:		Packets per second, 0 for no limit.
+ * @param[in] burst:	Packets let through back to back, 0 for one
+ *						second's worth.
+ */
+void admission_set_ip_rate(admission_t *admit, long rate, long burst);
+
+/**
+ * Fill the bucket of a new connection.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] bucket:	The bucket of the connection.
+ */
+void admission_conn_init(admission_t *admit, bucket_t *bucket);
+
+/**
+ * Decide whether a packet is let in.  A packet that is let in takes a
+ * token from the bucket of its connection and of its source address.
+ * Drops are counted, deferrals are not.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] bucket:	The bucket of the connection it came in on.
+ * @param[in] ip:		The address of the sender, as the server knows
+ *						it rather than as the packet claims it.
+ * @param[in] queued:	The packet ends up in a queue, so it is subject
+ *						to the cap.
+ *
+ * @return ADMIT_PASS, ADMIT_DROP or ADMIT_DEFER.
+ */
+int admission_check(admission_t *admit, bucket_t *bucket,
+		unsigned char *ip, int queued);
+
+/**
+ * Decide whether work from an address that has no connection yet is
+ * taken on, by the bucket of the address alone.  Drops are counted.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] ip:		The address of the sender, as the server knows
+ *						it rather than as the packet claims it.
+ *
+ * @return ADMIT_PASS or ADMIT_DROP.
+ */
+int admission_check_address(admission_t *admit, unsigned char *ip);
+
+/**
+ * Check if the queues are at the cap.
+ *
+ * @param[in] admit: The admission control.
+ */
+int admission_overloaded(admission_t *admit);
+
+/**
+ * Count packets going into, or taken out of, the queues.
+ *
+ * @param[in] admit:	The admission control, may be NULL.
+ * @param[in] count:	The number of packets, negative when taken out.
+ */
+void admission_queued(admission_t *admit, int count);
+
+/**
+ * Count a packet dropped for a reason decided outside admission_check.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] reason:	One of the DROP_ reasons.
+ */
+void admission_count_drop(admission_t *admit, int reason);
+
+/**
+ * Get the number of packets dropped for a reason.
+ *
+ * @param[in] admit:	The admission control.
+ * @param[in] reason:	One of the DROP_ reasons.
+ */
+unsigned long admission_dropped(admission_t *admit, int reason);
+
+/**
+ * Get a name for a drop reason, for reporting.
+ *
+ * @param[in] reason: One of the DROP_ reasons.
+ */
+const char *admission_reason_name(int reason);
+
+#endif
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "capture.h"
+#include "../packet/packet.h"
+
+/*** Macros **************************************************************/
+
+#define PCAP_MAGIC		0xa1b2c3d4UL
+#define LINKTYPE_USER0	147
+#define DST_IP_OFFSET	34
+#define SRC_IP_OFFSET	38
+#define DST_PORT_OFFSET	42
+#define SRC_PORT_OFFSET	44
+
+/*** Struct definitions **************************************************/
+
+typedef struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t network;
+} pcap_header_t;
+
+typedef struct pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+} pcap_record_t;
+
+/*** Helper Function Prototypes ******************************************/
+
+void capture_tap(char *frame, int size, int direction);
+int capture_wanted(capture_t *capture, unsigned char *frame, int size);
+unsigned long ip_number(unsigned char *ip);
+
+/* the ring that capture_tap copies into */
+capture_t *installed = NULL;
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate a capture ring.
+ *
+ * @param[in] slot_count: The number of frames the ring holds.
+ *
+ * @return The new ring, NULL on failure.
+ */
+capture_t *new_capture(unsigned long slot_count)
+{
+	capture_t *capture = NULL;
+
+	if (slot_count == 0) {
+		return NULL;
+	}
+	capture = malloc(sizeof(capture_t));
+	if (!capture) {
+		fprintf(stderr, "failed to malloc capture\n");
+		return NULL;
+	}
+	capture->slots = mmap(NULL, slot_count * sizeof(capture_slot_t), 
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (capture->slots == MAP_FAILED) {
+		perror("failed to map the capture ring");
+		free(capture);
+		return NULL;
+	}
+	capture->slot_count = slot_count;
+	capture->head = 0;
+	capture->net = 0;
+	capture->mask = 0;
+	capture->port = -1;
+	return capture;
+}
+
+/**
+ * Free a capture ring.  It must not be installed anymore.
+ *
+ * @param[in] capture: The ring to be free'd.
+ */
+void free_capture(capture_t *capture)
+{
+	if (!capture) {
+		return;
+	}
+	munmap(capture->slots, capture->slot_count * sizeof(capture_slot_t));
+	capture->slots = NULL;
+	free(capture);
+}
+
+/**
+ * Only capture frames from or to an address in a prefix.
+ *
+ * @param[in] capture:		The ring.
+ * @param[in] prefix:		The address of the prefix.
+ * @param[in] prefix_len:	The length of the prefix.
+ */
+void capture_filter_ip(capture_t *capture, unsigned char *prefix, 
+		int prefix_len)
+{
+	capture->mask = (prefix_len <= 0) ? 0 
+		: (0xffffffffUL << (32 - prefix_len)) & 0xffffffffUL;
+	capture->net = ip_number(prefix) & capture->mask;
+}
+
+/**
+ * Only capture frames from or to a port.
+ *
+ * @param[in] capture:	The ring.
+ * @param[in] port:		The port.
+ */
+void capture_filter_port(capture_t *capture, int port)
+{
+	capture->port = port;
+}
+
+/**
+ * Start capturing every frame the packet module sends or receives into
+ * a ring.  Only one ring can be installed at a time.
+ *
+ * @param[in] capture: The ring, NULL to stop capturing.
+ */
+void capture_install(capture_t *capture)
+{
+	installed = capture;
+	packet_set_tap(capture ? capture_tap : NULL);
+}
+
+/**
+ * Copy a frame into the ring, if it passes the filters.
+ *
+ * @param[in] capture:		The ring.
+ * @param[in] frame:		The serialized frame.
+ * @param[in] size:			The size of the frame.
+ * @param[in] direction:	TAP_IN or TAP_OUT.
+ */
+void capture_frame(capture_t *capture, char *frame, int size, int direction)
+{
+	unsigned long ticket, seq;
+	capture_slot_t *slot = NULL;
+	struct timeval now;
+
+	if (!capture_wanted(capture, (unsigned char *)frame, size)) {
+		return;
+	}
+	ticket = __sync_fetch_and_add(&capture->head, 1);
+	slot = &capture->slots[ticket % capture->slot_count];
+
+	/* take the slot only from a complete, older frame.  A writer a lap
+	 * ahead or behind that holds it or took it since wins, and this
+	 * frame is left out, rather than mixed with its frame */
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	do {
+		if ((seq & 1) || (seq >= 2 * ticket + 1)) {
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&slot->seq, &seq, 2 * ticket + 1,
+			0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	gettimeofday(&now, NULL);
+	slot->ts_sec = now.tv_sec;
+	slot->ts_usec = now.tv_usec;
+	slot->orig_len = size;
+	slot->len = (size < CAPTURE_SNAP) ? size : CAPTURE_SNAP;
+	slot->direction = direction;
+	memcpy(slot->data, frame, slot->len);
+	__atomic_store_n(&slot->seq, 2 * ticket + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Write the frames in the ring to a pcap file, oldest first.  The frames
+ * are in the wire format of this project, so the file uses the
+ * LINKTYPE_USER0 link type.  Writers keep going meanwhile; frames they
+ * overwrite during the export are left out.
+ *
+ * @param[in] capture:	The ring.
+ * @param[in] path:		The file to write.
+ *
+ * @return The number of frames written, -1 if the file can't be written.
+ */
+int capture_export(capture_t *capture, char *path)
+{
+	unsigned long ticket, head, seq;
+	int written = 0;
+	capture_slot_t *slot = NULL;
+	capture_slot_t *copy = NULL;
+	pcap_header_t header;
+	pcap_record_t record;
+	FILE *f = NULL;
+
+	copy = malloc(sizeof(capture_slot_t));
+	f = fopen(path, "wb");
+	if ((!f) || (!copy)) {
+		perror("failed to open the capture file");
+		free(copy);
+		if (f) {
+			fclose(f);
+		}
+		return -1;
+	}
+	header.magic = PCAP_MAGIC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = CAPTURE_SNAP;
+	header.network = LINKTYPE_USER0;
+	fwrite(&header, sizeof(header), 1, f);
+
+	head = __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+	ticket = (head > capture->slot_count) ? head - capture->slot_count : 0;
+	for (; ticket < head; ticket++) {
+		slot = &capture->slots[ticket % capture->slot_count];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq != 2 * ticket + 2) {
+			/* still being written, or already overwritten */
+			continue;
+		}
+		memcpy(copy, slot, sizeof(capture_slot_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+			continue;
+		}
+		record.ts_sec = (uint32_t)copy->ts_sec;
+		record.ts_usec = (uint32_t)copy->ts_usec;
+		record.incl_len = copy->len;
+		record.orig_len = copy->orig_len;
+		fwrite(&record, sizeof(record), 1, f);
+		fwrite(copy->data, 1, copy->len, f);
+		written++;
+	}
+
+	free(copy);
+	if (fclose(f) != 0) {
+		perror("failed to write the capture file");
+		return -1;
+	}
+	return written;
+}
+
+/*** Helper Functions ****************************************************/
+
+void capture_tap(char *frame, int size, int direction)
+{
+	capture_t *capture = installed;
+
+	if (capture) {
+		capture_frame(capture, frame, size, direction);
+	}
+}
+
+/* check a frame against the filters of the ring */
+int capture_wanted(capture_t *capture, unsigned char *frame, int size)
+{
+	int dport, sport;
+
+	if ((capture->mask == 0) && (capture->port < 0)) {
+		return 1;
+	}
+	if (size < SRC_PORT_OFFSET + 2) {
+		return 0;
+	}
+	if ((capture->mask) 
+			&& ((ip_number(frame + DST_IP_OFFSET) & capture->mask) != capture->net) 
+			&& ((ip_number(frame + SRC_IP_OFFSET) & capture->mask) != capture->net)) {
+		return 0;
+	}
+	dport = (frame[DST_PORT_OFFSET] << 8) | frame[DST_PORT_OFFSET + 1];
+	sport = (frame[SRC_PORT_OFFSET] << 8) | frame[SRC_PORT_OFFSET + 1];
+	if ((capture->port >= 0) && (dport != capture->port) 
+			&& (sport != capture->port)) {
+		return 0;
+	}
+	return 1;
+}
+
+unsigned long ip_number(unsigned char *ip)
+{
+	return ((unsigned long)ip[0] << 24) | ((unsigned long)ip[1] << 16) 
+		| ((unsigned long)ip[2] << 8) | (unsigned long)ip[3];
+}
@@ -0,0 +1,106 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#define CAPTURE_SNAP	2048	/* Bytes kept of each frame */
+#define CAPTURE_SLOTS	4096	/* Frames the ring holds by default */
+
+/*** Struct definitions **************************************************/
+
+/*
+ * One captured frame.  seq is a seqlock: odd while a writer fills the
+ * slot, and 2 * (ticket + 1) once the frame of that ticket is complete.
+ * A writer only takes a slot whose frame is complete and of an older
+ * ticket, so two writers a lap apart never fill it at once.
+ */
+typedef struct capture_slot {
+	unsigned long seq;
+	long ts_sec;
+	long ts_usec;
+	int len;				/* The bytes of the frame kept in data */
+	int orig_len;			/* The size of the frame on the wire */
+	int direction;			/* TAP_IN or TAP_OUT */
+	char data[CAPTURE_SNAP];
+} capture_slot_t;
+
+/*
+ * A ring of the most recent frames, in memory only.  Threads doing I/O
+ * take a ticket by bumping head, and copy their frame into the slot of
+ * the ticket; nothing ever waits for a reader or for the disk.
+ */
+typedef struct capture {
+	capture_slot_t *slots;	/* mmap'd, slot_count of them */
+	unsigned long slot_count;
+	unsigned long head;		/* The next ticket */
+	unsigned long net;		/* Frames to or from net/mask only, */
+	unsigned long mask;		/* all frames if mask is 0 */
+	int port;				/* Frames to or from port only, -1 for all */
+} capture_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate a capture ring.
+ *
+ * @param[in] slot_count: The number of frames the ring holds.
+ *
+ * @return The new ring, NULL on failure.
+ */
+capture_t *new_capture(unsigned long slot_count);
+
+/**
+ * Free a capture ring.  It must not be installed anymore.
+ *
+ * @param[in] capture: The ring to be free'd.
+ */
+void free_capture(capture_t *capture);
+
+/**
+ * Only capture frames from or to an address in a prefix.
+ *
+ * @param[in] capture:		The ring.
+ * @param[in] prefix:		The address of the prefix.
+ * @param[in] prefix_len:	The length of the prefix.
+ */
+void capture_filter_ip(capture_t *capture, unsigned char *prefix, 
+		int prefix_len);
+
+/**
+ * Only capture frames from or to a port.
+ *
+ * @param[in] capture:	The ring.
+ * @param[in] port:		The port.
+ */
+void capture_filter_port(capture_t *capture, int port);
+
+/**
+ * Start capturing every frame the packet module sends or receives into
+ * a ring.  Only one ring can be installed at a time.
+ *
+ * @param[in] capture: The ring, NULL to stop capturing.
+ */
+void capture_install(capture_t *capture);
+
+/**
+ * Copy a frame into the ring, if it passes the filters.
+ *
+ * @param[in] capture:		The ring.
+ * @param[in] frame:		The serialized frame.
+ * @param[in] size:			The size of the frame.
+ * @param[in] direction:	TAP_IN or TAP_OUT.
+ */
+void capture_frame(capture_t *capture, char *frame, int size, int direction);
+
+/**
+ * Write the frames in the ring to a pcap file, oldest first.  The frames
+ * are in the wire format of this project, so the file uses the
+ * LINKTYPE_USER0 link type.  Writers keep going meanwhile; frames they
+ * overwrite during the export are left out.
+ *
+ * @param[in] capture:	The ring.
+ * @param[in] path:		The file to write.
+ *
+ * @return The number of frames written, -1 if the file can't be written.
+ */
+int capture_export(capture_t *capture, char *path);
+
+#endif
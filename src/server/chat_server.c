@@ -2,13 +2,39 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
+#include <signal.h>
 
 #include "users.h"
 #include "server_listener.h"
 #include "server_speaker.h"
+#include "capture.h"
+#include "udp.h"
+#include "../log/log.h"
+#include "../clock/clock.h"
 
 char ch = '\0';
 int ip_timeout = 600;
+int listener_count = 1;
+int backlog = DEFAULT_BACKLOG;
+long ulist_window = DEFAULT_ULIST_WINDOW;
+int io_backend = IO_SELECT;
+unsigned char pool_base[4];
+int pool_prefix = 0;		/* 0 keeps the default pool */
+char *policy_path = NULL;
+char *nat_path = NULL;
+int nat_workers = DEFAULT_NAT_WORKERS;
+long capture_slots = 0;	/* 0 leaves capturing off */
+unsigned char capture_net[4];
+int capture_prefix = 0;
+int capture_port = -1;
+long conn_rate = 0;		/* 0 leaves the rates unlimited */
+long conn_burst = 0;
+long ip_rate = 0;
+long ip_burst = 0;
+int queue_cap = DEFAULT_QUEUE_CAP;
+int overload = OVERLOAD_DROP;
+int use_udp = FALSE;		/* Also take the frames as datagrams */
+long udp_idle = DEFAULT_UDP_IDLE;
 unsigned char serv_ip[4];
 unsigned char default_ip[4] = {
 	1,
@@ -27,23 +53,34 @@ void set_defaults();
 
 int main (int argc, char *argv[]) 
 {
-	pthread_t listen_thread;
+	pthread_t *listen_threads;
 	pthread_t speak_thread;
 	users_t *users = NULL;
 	server_speaker_t *speaker;
-	server_listener_t *listener;
+	server_listener_t **listeners;
+	capture_t *capture = NULL;
+	nat_t *nat = NULL;
+	udp_t *udp = NULL;
 	/*
 	char *end_ptr;
 	char *next_ptr;
 	int i;
 	*/
 	int *ports;
+	int i;
+	int status = 0;			/* Set once setting up failed */
 	char line[100];
 
+	/* a client hanging up must not take the server down with it */
+	signal(SIGPIPE, SIG_IGN);
+
 	set_defaults();
 
 	get_args(argc, argv);	
 
+	/* from here on, log messages are written by a background thread */
+	log_start();
+
 	printf("Server IP: %d.%d.%d.%d\n",
 					serv_ip[0],
 					serv_ip[1],
@@ -64,22 +101,108 @@ int main (int argc, char *argv[])
 	/* data structures for the threads that listen for incomming data */
 	/* and connections and sends out data to the various different users */
 	speaker = new_server_speaker(users, serv_ip);
-	listener = new_server_listener(ports, 2, users, speaker);
+	listeners = malloc(listener_count * sizeof(server_listener_t *));
+	listen_threads = malloc(listener_count * sizeof(pthread_t));
+	listeners[0] = new_server_listener(ports, 2, users, speaker);
 
 	printf("Using ip timeout period of %d seconds\n", ip_timeout);
-	speaker->ip_timeout = ip_timeout;
-	listener->ip_timeout = ip_timeout;
+	speaker->ulist_window = ulist_window;
+	nat = new_nat(users, serv_ip, nat_workers, nat_path);
+	if (!nat) {
+		printf("Failed to set up the NAT workers, shutting down\n");
+		status = 1;
+	} else {
+		nat->ip_timeout = ip_timeout;
+		nat->admit = speaker->admit;
+		speaker->nat = nat;
+		printf("Using %d NAT worker(s)\n", nat_workers);
+		if (nat_path) {
+			printf("Keeping the NAT tables in %s, %d binding(s) restored\n", 
+					nat_path, nat_count(nat));
+		}
+	}
+	admission_set_conn_rate(speaker->admit, conn_rate, conn_burst);
+	admission_set_ip_rate(speaker->admit, ip_rate, ip_burst);
+	speaker->admit->queue_cap = queue_cap;
+	speaker->admit->overload = overload;
+	if (conn_rate || ip_rate) {
+		printf("Limiting each connection to %ld and each address to %ld "
+				"packet(s) a second (0 is no limit)\n", conn_rate, ip_rate);
+	}
+	printf("Capping the queues at %d packet(s), %s beyond that\n", queue_cap,
+			(overload == OVERLOAD_DEFER) ? "deferring" : "dropping");
+	listeners[0]->backlog = backlog;
+	listeners[0]->io_backend = io_backend;
+	if ((!status) && (policy_path)) {
+		i = policy_load(speaker->policy, policy_path);
+		if (i < 0) {
+			printf("Failed to load the policy, shutting down\n");
+			status = 1;
+		} else {
+			printf("Loaded %d policy rule(s) from %s\n", i, policy_path);
+		}
+	}
+	if (pool_prefix) {
+		free_address_allocator(listeners[0]->ip_allocator);
+		listeners[0]->ip_allocator = new_address_pool(pool_base, pool_prefix);
+		if (!listeners[0]->ip_allocator) {
+			printf("Using the default address pool\n");
+			listeners[0]->ip_allocator = new_address_allocator();
+		} else {
+			printf("Using address pool %d.%d.%d.%d/%d\n", pool_base[0], 
+					pool_base[1], pool_base[2], pool_base[3], pool_prefix);
+		}
+	}
+
+	if ((!status) && (capture_slots)) {
+		capture = new_capture(capture_slots);
+		if (!capture) {
+			printf("Failed to set up packet capture, carrying on without it\n");
+		} else {
+			if (capture_prefix) {
+				capture_filter_ip(capture, capture_net, capture_prefix);
+			}
+			capture_filter_port(capture, capture_port);
+			capture_install(capture);
+			printf("Capturing the last %ld packets\n", capture_slots);
+		}
+	}
 
-	/* Launch the two threads */
+	/* the other listeners share the ports and allocators of the first */
+	for (i = 1; i < listener_count; i++) {
+		listeners[i] = new_server_listener_peer(listeners[0]);
+	}
+	printf("Using %d listener thread(s)\n", listener_count);
+
+	if ((!status) && (use_udp)) {
+		udp = new_udp(listeners[0], ports, 2);
+		if (!udp) {
+			printf("Failed to set up the udp transport, carrying on without it\n");
+		} else {
+			udp->idle_timeout = udp_idle;
+			users->udp = udp;
+			printf("Closing udp sessions after %ld quiet second(s)\n", udp_idle);
+		}
+	}
+
+	/* Launch the threads */
 	/* args are: the thread, unused attribute, start function, and argument for
 	 * start function */
-	pthread_create(&listen_thread, NULL, listener_run, (void *)listener);
-	pthread_create(&speak_thread, NULL, speaker_run, (void *)speaker);
+	if (!status) {
+		nat_start(nat);
+		for (i = 0; i < listener_count; i++) {
+			pthread_create(&listen_threads[i], NULL, listener_run, (void *)listeners[i]);
+		}
+		pthread_create(&speak_thread, NULL, speaker_run, (void *)speaker);
+		if (udp) {
+			udp_start(udp);
+		}
 
-	printf("Server running\n");
+		printf("Server running\n");
+	}
 
-	/* handle input */
-	while(TRUE) {
+	/* handle input, unless setting up failed */
+	while(!status) {
 		read_line(stdin, line);
 		if (strcmp(line, "quit") == 0) {
 			break;
@@ -87,6 +210,25 @@ int main (int argc, char *argv[])
 			break;
 		} else if(strcmp(line, "status") == 0) {
 			printf("Server running\n");
+			printf("Log messages dropped: %lu\n", log_dropped());
+			printf("Packets queued: %d\n", speaker->admit->backlog);
+			if (udp) {
+				printf("Udp sessions: %d\n", udp_count(udp));
+			}
+			for (i = 0; i < DROP_REASONS; i++) {
+				printf("Packets dropped, %s: %lu\n", 
+						admission_reason_name(i), 
+						admission_dropped(speaker->admit, i));
+			}
+		} else if(strncmp(line, "capture ", 8) == 0) {
+			if (!capture) {
+				printf("Packet capture is off, start with --capture=SLOTS\n");
+			} else {
+				i = capture_export(capture, line + 8);
+				if (i >= 0) {
+					printf("Wrote %d packet(s) to %s\n", i, line + 8);
+				}
+			}
 		} else {
 			if (ch == EOF) {
 				printf("exit\n");
@@ -99,28 +241,57 @@ int main (int argc, char *argv[])
 	}
 
 	/* shut down server */
-	/* signal stop to threads to break out of while loops*/
-	listener_stop(listener);
-	speaker_stop(speaker);
-	/* join(stop) threads */
-	printf("Joining speaker\n");
-	pthread_join(speak_thread, NULL);
-	printf("Joined listener\n");
-	printf("Joining listener\n");
-	pthread_join(listen_thread, NULL);
-	printf("Joined listener\n");
+	if (!status) {
+		/* the sessions log out while the speaker still runs */
+		if (udp) {
+			udp_stop(udp);
+		}
+		/* signal stop to threads to break out of while loops*/
+		for (i = 0; i < listener_count; i++) {
+			listener_stop(listeners[i]);
+		}
+		speaker_stop(speaker);
+		/* join(stop) threads */
+		printf("Joining speaker\n");
+		pthread_join(speak_thread, NULL);
+		printf("Joined listener\n");
+		printf("Joining listeners\n");
+		for (i = 0; i < listener_count; i++) {
+			pthread_join(listen_threads[i], NULL);
+		}
+		printf("Joined listeners\n");
+		/* nobody hands the workers packets anymore */
+		nat_stop(nat);
+	}
+	capture_install(NULL);
+
+	/* flush and stop the log thread, now that nobody else is logging */
+	log_stop();
 
 	/* Free all datastructures */
 	free_users(users);
 	users = NULL;
-	server_listener_free(listener);
-	listener = NULL;
+	/* peers first, as the first listener owns the shared allocators */
+	for (i = listener_count - 1; i >= 0; i--) {
+		server_listener_free(listeners[i]);
+		listeners[i] = NULL;
+	}
+	free(listeners);
+	free(listen_threads);
 	server_speaker_free(speaker);
 	speaker = NULL;
+	free_nat(nat);
+	nat = NULL;
+
+	free_capture(capture);
+	capture = NULL;
+
+	free_udp(udp);
+	udp = NULL;
 
 	free(ports);
 
-	return 0;
+	return status;
 }
 
 /*** Helper Functions ****************************************************/
@@ -185,6 +356,127 @@ DEFAULT_IP:
 				ip_timeout = j;
 			}
 
+		} else if (strncmp(argv[i], "--listeners=", 12) == 0) {
+			next_ptr = argv[i] + 12;
+			j = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (j < 1)) {
+				printf("invalid listener count provided.  Using default value\n");
+			} else {
+				listener_count = j;
+			}
+		} else if (strncmp(argv[i], "--backlog=", 10) == 0) {
+			next_ptr = argv[i] + 10;
+			j = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (j < 1)) {
+				printf("invalid backlog provided.  Using default value\n");
+			} else {
+				backlog = j;
+			}
+		} else if (strncmp(argv[i], "--ulist-window=", 15) == 0) {
+			next_ptr = argv[i] + 15;
+			j = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (j < 0)) {
+				printf("invalid user list window provided.  Using default value\n");
+			} else {
+				ulist_window = j;
+			}
+		} else if (strncmp(argv[i], "--pool=", 7) == 0) {
+			if (!parse_prefix(argv[i] + 7, pool_base, &pool_prefix)) {
+				printf("invalid address pool provided.  Using default value\n");
+				pool_prefix = 0;
+			}
+		} else if (strncmp(argv[i], "--nat-workers=", 14) == 0) {
+			next_ptr = argv[i] + 14;
+			j = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (j < 1) || (j > MAX_NAT_WORKERS)) {
+				printf("invalid NAT worker count provided.  Using default value\n");
+			} else {
+				nat_workers = j;
+			}
+		} else if (strncmp(argv[i], "--nat-file=", 11) == 0) {
+			nat_path = argv[i] + 11;
+		} else if (strncmp(argv[i], "--policy=", 9) == 0) {
+			policy_path = argv[i] + 9;
+		} else if (strncmp(argv[i], "--capture=", 10) == 0) {
+			next_ptr = argv[i] + 10;
+			capture_slots = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (capture_slots < 0)) {
+				printf("invalid capture size provided.  Capture is off\n");
+				capture_slots = 0;
+			}
+		} else if (strncmp(argv[i], "--capture-ip=", 13) == 0) {
+			if (!parse_prefix(argv[i] + 13, capture_net, &capture_prefix)) {
+				printf("invalid capture prefix provided.  Capturing all addresses\n");
+				capture_prefix = 0;
+			}
+		} else if (strncmp(argv[i], "--capture-port=", 15) == 0) {
+			next_ptr = argv[i] + 15;
+			capture_port = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (capture_port < 0) 
+					|| (capture_port > 65535)) {
+				printf("invalid capture port provided.  Capturing all ports\n");
+				capture_port = -1;
+			}
+		} else if (strncmp(argv[i], "--conn-rate=", 12) == 0) {
+			next_ptr = argv[i] + 12;
+			conn_rate = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (conn_rate < 0)) {
+				printf("invalid connection rate provided.  Not limiting it\n");
+				conn_rate = 0;
+			}
+		} else if (strncmp(argv[i], "--conn-burst=", 13) == 0) {
+			next_ptr = argv[i] + 13;
+			conn_burst = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (conn_burst < 0)) {
+				printf("invalid connection burst provided.  Using default value\n");
+				conn_burst = 0;
+			}
+		} else if (strncmp(argv[i], "--ip-rate=", 10) == 0) {
+			next_ptr = argv[i] + 10;
+			ip_rate = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (ip_rate < 0)) {
+				printf("invalid address rate provided.  Not limiting it\n");
+				ip_rate = 0;
+			}
+		} else if (strncmp(argv[i], "--ip-burst=", 11) == 0) {
+			next_ptr = argv[i] + 11;
+			ip_burst = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (ip_burst < 0)) {
+				printf("invalid address burst provided.  Using default value\n");
+				ip_burst = 0;
+			}
+		} else if (strncmp(argv[i], "--queue-cap=", 12) == 0) {
+			next_ptr = argv[i] + 12;
+			j = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (j < 0)) {
+				printf("invalid queue cap provided.  Using default value\n");
+			} else {
+				queue_cap = j;
+			}
+		} else if (strcmp(argv[i], "--overload=drop") == 0) {
+			overload = OVERLOAD_DROP;
+		} else if (strcmp(argv[i], "--overload=defer") == 0) {
+			overload = OVERLOAD_DEFER;
+		} else if (strcmp(argv[i], "--udp") == 0) {
+			use_udp = TRUE;
+		} else if (strncmp(argv[i], "--udp-idle=", 11) == 0) {
+			next_ptr = argv[i] + 11;
+			udp_idle = strtol(next_ptr, &end_ptr, 10);
+			if ((end_ptr == next_ptr) || (udp_idle < 1)) {
+				printf("invalid udp idle timeout provided.  Using default value\n");
+				udp_idle = DEFAULT_UDP_IDLE;
+			}
+		} else if (strcmp(argv[i], "--io=uring") == 0) {
+			io_backend = IO_URING;
+		} else if (strcmp(argv[i], "--io=select") == 0) {
+			io_backend = IO_SELECT;
+		} else if (strncmp(argv[i], "--log-level=", 12) == 0) {
+			j = log_level_from_name(argv[i] + 12);
+			if (j < 0) {
+				printf("invalid log level provided.  Using default value\n");
+			} else {
+				log_set_level(j);
+			}
 		} else {
 			printf("argument '%s; not recognized\n", argv[i]);
 		}
@@ -195,6 +487,25 @@ void set_defaults()
 {
 	int i;
 	ip_timeout = 600;
+	listener_count = 1;
+	backlog = DEFAULT_BACKLOG;
+	ulist_window = DEFAULT_ULIST_WINDOW;
+	io_backend = IO_SELECT;
+	pool_prefix = 0;
+	policy_path = NULL;
+	nat_path = NULL;
+	nat_workers = DEFAULT_NAT_WORKERS;
+	capture_slots = 0;
+	capture_prefix = 0;
+	capture_port = -1;
+	conn_rate = 0;
+	conn_burst = 0;
+	ip_rate = 0;
+	ip_burst = 0;
+	queue_cap = DEFAULT_QUEUE_CAP;
+	overload = OVERLOAD_DROP;
+	use_udp = FALSE;
+	udp_idle = DEFAULT_UDP_IDLE;
 	for (i = 0; i < 4; i++) {
 		serv_ip[i] = default_ip[i];
 	}
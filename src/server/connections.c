@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "connections.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define INITIAL_CAPACITY	64
+#define INITIAL_RBUF		512
+#define TRUE				1
+#define FALSE				0
+
+/*** Helper Function Prototypes ******************************************/
+
+int conn_table_grow(conn_table_t *table, int fd);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate an empty connection table.
+ *
+ * @return The new table, NULL on failure.
+ */
+conn_table_t *new_conn_table()
+{
+	int i;
+	conn_table_t *table = malloc(sizeof(conn_table_t));
+
+	if (!table) {
+		fprintf(stderr, "failed to malloc conn_table\n");
+		return NULL;
+	}
+	table->conns = malloc(INITIAL_CAPACITY * sizeof(conn_t *));
+	if (!table->conns) {
+		fprintf(stderr, "failed to malloc conns for conn_table\n");
+		free(table);
+		return NULL;
+	}
+	for (i = 0; i < INITIAL_CAPACITY; i++) {
+		table->conns[i] = NULL;
+	}
+	table->capacity = INITIAL_CAPACITY;
+	table->count = 0;
+	table->max_fd = -1;
+	table->next_gen = 0;
+
+	return table;
+}
+
+/**
+ * Free the table and all the connections still in it.  The sockets are
+ * not closed.
+ *
+ * @param[in] table: The table to be free'd.
+ */
+void free_conn_table(conn_table_t *table)
+{
+	int i;
+
+	if (!table) {
+		return;
+	}
+	for (i = 0; i <= table->max_fd; i++) {
+		if (table->conns[i]) {
+			free(table->conns[i]->rbuf);
+			free(table->conns[i]);
+			table->conns[i] = NULL;
+		}
+	}
+	free(table->conns);
+	table->conns = NULL;
+	free(table);
+}
+
+/**
+ * Add a newly accepted socket to the table.
+ *
+ * @param[in] table:		The table to add to.
+ * @param[in] fd:			The socket file descriptor.
+ * @param[in] port_index:	The index of the listening port it was
+ *							accepted on.
+ *
+ * @return The new connection, NULL on failure.
+ */
+conn_t *conn_table_add(conn_table_t *table, int fd, int port_index)
+{
+	conn_t *conn = NULL;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if ((fd >= table->capacity) && (!conn_table_grow(table, fd))) {
+		return NULL;
+	}
+	if (table->conns[fd]) {
+		LOG_WARN(("fd %d was already in the connection table\n", fd));
+		conn_table_remove(table, fd);
+	}
+
+	conn = malloc(sizeof(conn_t));
+	if (!conn) {
+		fprintf(stderr, "failed to malloc conn\n");
+		return NULL;
+	}
+	conn->fd = fd;
+	conn->port_index = port_index;
+	conn->login_pending = FALSE;
+	conn->gen = table->next_gen++;
+	conn->rbuf = NULL;
+	conn->rlen = 0;
+	conn->rcap = 0;
+	conn->need = 0;
+	conn->has_mac = FALSE;
+	conn->has_ip = FALSE;
+	memset(conn->peer, 0, 4);
+	conn->has_src = FALSE;
+	conn->bucket.tokens = 0;
+	conn->bucket.refilled = 0;
+	conn->parked = FALSE;
+	conn->writing = FALSE;
+
+	table->conns[fd] = conn;
+	table->count++;
+	if (fd > table->max_fd) {
+		table->max_fd = fd;
+	}
+	return conn;
+}
+
+/**
+ * Look up the connection of a given socket.
+ *
+ * @param[in] table:	The table to look in.
+ * @param[in] fd:		The socket file descriptor.
+ *
+ * @return The connection, NULL if the socket is not in the table.
+ */
+conn_t *conn_table_get(conn_table_t *table, int fd)
+{
+	if ((fd < 0) || (fd > table->max_fd)) {
+		return NULL;
+	}
+	return table->conns[fd];
+}
+
+/**
+ * Remove a socket from the table and free its connection.  The socket
+ * is not closed.
+ *
+ * @param[in] table:	The table to remove from.
+ * @param[in] fd:		The socket file descriptor.
+ */
+void conn_table_remove(conn_table_t *table, int fd)
+{
+	if (!conn_table_get(table, fd)) {
+		return;
+	}
+	free(table->conns[fd]->rbuf);
+	free(table->conns[fd]);
+	table->conns[fd] = NULL;
+	table->count--;
+
+	while ((table->max_fd >= 0) && (!table->conns[table->max_fd])) {
+		table->max_fd--;
+	}
+}
+
+/**
+ * Append received bytes to the buffer of a connection.
+ *
+ * @param[in] conn:		The connection the bytes came in on.
+ * @param[in] bytes:	The bytes received.
+ * @param[in] len:		The number of bytes.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the buffer could not grow.
+ */
+int conn_append(conn_t *conn, char *bytes, int len)
+{
+	int cap = conn->rcap ? conn->rcap : INITIAL_RBUF;
+	char *rbuf = NULL;
+
+	while (cap < conn->rlen + len) {
+		cap *= 2;
+	}
+	if (cap != conn->rcap) {
+		rbuf = realloc(conn->rbuf, cap);
+		if (!rbuf) {
+			fprintf(stderr, "failed to grow receive buffer\n");
+			return FALSE;
+		}
+		conn->rbuf = rbuf;
+		conn->rcap = cap;
+	}
+	memcpy(conn->rbuf + conn->rlen, bytes, len);
+	conn->rlen += len;
+	return TRUE;
+}
+
+/**
+ * Drop the first len bytes from the buffer of a connection, once they
+ * have been decoded.
+ *
+ * @param[in] conn:	The connection.
+ * @param[in] len:	The number of bytes consumed.
+ */
+void conn_consume(conn_t *conn, int len)
+{
+	if (len >= conn->rlen) {
+		conn->rlen = 0;
+		return;
+	}
+	memmove(conn->rbuf, conn->rbuf + len, conn->rlen - len);
+	conn->rlen -= len;
+}
+
+/*** Helper Functions ****************************************************/
+
+/* make the table big enough to index fd */
+int conn_table_grow(conn_table_t *table, int fd)
+{
+	int i;
+	int capacity = table->capacity;
+	conn_t **conns = NULL;
+
+	while (capacity <= fd) {
+		capacity *= 2;
+	}
+	conns = realloc(table->conns, capacity * sizeof(conn_t *));
+	if (!conns) {
+		fprintf(stderr, "failed to grow conn_table\n");
+		return 0;
+	}
+	for (i = table->capacity; i < capacity; i++) {
+		conns[i] = NULL;
+	}
+	table->conns = conns;
+	table->capacity = capacity;
+	return 1;
+}
@@ -0,0 +1,114 @@
+#ifndef CONNECTIONS_H
+#define CONNECTIONS_H
+
+#include "admission.h"
+
+/*** Struct definitions **************************************************/
+
+/*
+ * A connection accepted by a listener thread.  It is owned by that
+ * thread alone, so nothing in here is locked.
+ */
+typedef struct conn {
+	int fd;					/* The socket file descriptor */
+	int port_index;			/* The listening port it came in on */
+	int login_pending;		/* Accepted, but not yet sent its LOGIN */
+	unsigned int gen;		/* Tells apart connections that reused an fd */
+	char *rbuf;				/* Bytes received, not yet decoded */
+	int rlen;				/* The number of bytes in rbuf */
+	int rcap;				/* The size of rbuf */
+	int need;				/* Bytes rbuf must hold before decoding again */
+	unsigned char mac[6];	/* The mac address handed out at LOGIN */
+	int has_mac;			/* mac is set, and must be released */
+	unsigned char ip[4];	/* The address handed out from the pool */
+	int has_ip;				/* ip is set, and must be released */
+	unsigned char peer[4];	/* Whose address bucket its packets take from:
+							 * ip for internal users, the remote end of
+							 * the socket for external ones */
+	unsigned char src[4];	/* The source its packets must carry */
+	int has_src;			/* src is set, it is logged in */
+	bucket_t bucket;		/* Limits the rate of packets taken in */
+	int parked;				/* Work is deferred until the queues drain */
+	int writing;			/* A poll for room to write is armed */
+} conn_t;
+
+/*
+ * The connections of one listener thread, indexed by file descriptor.
+ */
+typedef struct conn_table {
+	conn_t **conns;			/* conns[fd], NULL if fd is not ours */
+	int capacity;			/* The number of slots in conns */
+	int count;				/* The number of connections in the table */
+	int max_fd;				/* The highest fd in the table, -1 if empty */
+	unsigned int next_gen;	/* The gen of the next connection added */
+} conn_table_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate an empty connection table.
+ *
+ * @return The new table, NULL on failure.
+ */
+conn_table_t *new_conn_table();
+
+/**
+ * Free the table and all the connections still in it.  The sockets are
+ * not closed.
+ *
+ * @param[in] table: The table to be free'd.
+ */
+void free_conn_table(conn_table_t *table);
+
+/**
+ * Add a newly accepted socket to the table.
+ *
+ * @param[in] table:		The table to add to.
+ * @param[in] fd:			The socket file descriptor.
+ * @param[in] port_index:	The index of the listening port it was
+ *							accepted on.
+ *
+ * @return The new connection, NULL on failure.
+ */
+conn_t *conn_table_add(conn_table_t *table, int fd, int port_index);
+
+/**
+ * Look up the connection of a given socket.
+ *
+ * @param[in] table:	The table to look in.
+ * @param[in] fd:		The socket file descriptor.
+ *
+ * @return The connection, NULL if the socket is not in the table.
+ */
+conn_t *conn_table_get(conn_table_t *table, int fd);
+
+/**
+ * Remove a socket from the table and free its connection.  The socket
+ * is not closed.
+ *
+ * @param[in] table:	The table to remove from.
+ * @param[in] fd:		The socket file descriptor.
+ */
+void conn_table_remove(conn_table_t *table, int fd);
+
+/**
+ * Append received bytes to the buffer of a connection.
+ *
+ * @param[in] conn:		The connection the bytes came in on.
+ * @param[in] bytes:	The bytes received.
+ * @param[in] len:		The number of bytes.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the buffer could not grow.
+ */
+int conn_append(conn_t *conn, char *bytes, int len);
+
+/**
+ * Drop the first len bytes from the buffer of a connection, once they
+ * have been decoded.
+ *
+ * @param[in] conn:	The connection.
+ * @param[in] len:	The number of bytes consumed.
+ */
+void conn_consume(conn_t *conn, int len);
+
+#endif
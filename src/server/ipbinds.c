@@ -1,44 +1,117 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ipbinds.h"
-#include "../hashset/ip_hashset.h"
-#include "../hashset/fd_hashset.h"
-#include "../queue/queue.h"
-
-/*
-typedef struct ipbinds {
-	ip_hashset_ptr ips;
-	ip_hashset_ptr timestamps;
-	fd_hashset_ptr ports;
-	pthread_mutex_t *hs_protect;
-} ipbinds_t;
-*/
+#include "../log/log.h"
+#include "../clock/clock.h"
+
+/*** Macros **************************************************************/
+
+#define INDEX_MASK	(NAT_INDEX - 1)
+#define TRUE		1
+#define FALSE		0
+
+/*** Helper Function Prototypes ******************************************/
+
+ipbinds_t *ipbinds_wrap(nat_table_t *table, int fd);
+void table_init(nat_table_t *table);
+void table_reindex(nat_table_t *table);
+int index_hash(unsigned char *ip);
+int index_find(nat_table_t *table, unsigned char *ip);
+void index_insert(nat_table_t *table, int port);
+void index_delete(nat_table_t *table, int slot);
+void unbind_port(ipbinds_t *ipbinds, int port);
+int bind_locked(ipbinds_t *ipbinds, unsigned char *ip, int port);
+
+/*** Functions ***********************************************************/
 
 ipbinds_t *new_ipbinds()
 {
-	ipbinds_t *ipbinds = NULL;
-	ip_hashset_ptr ips = NULL;
-	ip_hashset_ptr timestamps = NULL;
-	fd_hashset_ptr ports = NULL;
-
-	ipbinds = malloc(sizeof(ipbinds_t));
+	nat_table_t *table = calloc(1, sizeof(nat_table_t));
 
-	if (!ipbinds) {
+	if (!table) {
 		perror("Memory error\n");
 		return NULL;
 	}
-	fd_hashset_init_defaults(&ports);
-	ip_hashset_init_defaults(&ips);
-	ip_hashset_init_defaults(&timestamps);
-	ipbinds->ips = ips;
-	ipbinds->timestamps = timestamps;
-	ipbinds->ports = ports;
+	table_init(table);
+	return ipbinds_wrap(table, -1);
+}
 
-	ipbinds->hs_protect = malloc(sizeof(pthread_mutex_t));
-	pthread_mutex_init(ipbinds->hs_protect, NULL);
+/**
+ * Allocate an ipbinds_t struct with the bindings kept in a file mapped
+ * into memory.  The bindings already in the file are taken on, so that
+ * translations outlive a restart of the server.  Changes reach the file
+ * page by page as the kernel writes them back, and in full at
+ * ipbinds_sync and free_ipbinds.
+ *
+ * @param[in] path: The file, created if it does not exist.
+ *
+ * @return The new struct, NULL if the file can't be used.
+ */
+ipbinds_t *new_ipbinds_file(char *path)
+{
+	int fd;
+	int fresh;
+	struct stat st;
+	nat_table_t *table = NULL;
+	ipbinds_t *ipbinds = NULL;
+
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		perror("failed to open the NAT table file");
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror("failed to stat the NAT table file");
+		close(fd);
+		return NULL;
+	}
+	fresh = (st.st_size == 0);
+	if ((!fresh) && (st.st_size != (off_t)sizeof(nat_table_t))) {
+		fprintf(stderr, "%s is not a NAT table file\n", path);
+		close(fd);
+		return NULL;
+	}
+	if ((fresh) && (ftruncate(fd, sizeof(nat_table_t)) < 0)) {
+		perror("failed to size the NAT table file");
+		close(fd);
+		return NULL;
+	}
+
+	table = mmap(NULL, sizeof(nat_table_t), PROT_READ | PROT_WRITE, 
+			MAP_SHARED, fd, 0);
+	if (table == MAP_FAILED) {
+		perror("failed to map the NAT table file");
+		close(fd);
+		return NULL;
+	}
+	if (fresh) {
+		table_init(table);
+	} else if ((memcmp(table->magic, NAT_MAGIC, sizeof(NAT_MAGIC)) != 0) 
+			|| (table->ports != NAT_PORTS)) {
+		fprintf(stderr, "%s is not a NAT table file\n", path);
+		munmap(table, sizeof(nat_table_t));
+		close(fd);
+		return NULL;
+	} else {
+		/* the index may be half written if the server died, so it is
+		 * rebuilt from the entries, in place */
+		table_reindex(table);
+		LOG_INFO(("Restored %d NAT bindings from %s\n", table->count, path));
+	}
 
+	ipbinds = ipbinds_wrap(table, fd);
+	if (!ipbinds) {
+		munmap(table, sizeof(nat_table_t));
+		close(fd);
+	}
 	return ipbinds;
 }
 
@@ -47,18 +120,15 @@ void free_ipbinds(ipbinds_t *ipbinds)
 	if (!ipbinds) {
 		return;
 	}
-	if (ipbinds->ips) {
-		free_ip_hashset(ipbinds->ips);
-		ipbinds->ips = NULL;
-	}
-	if(ipbinds->timestamps) {
-		free_ip_hashset(ipbinds->timestamps);
-		ipbinds->timestamps = NULL;
-	}
-	if (ipbinds->ports) {
-		free_fd_hashset(ipbinds->ports);
-		ipbinds->ports = NULL;
+	if (ipbinds->fd >= 0) {
+		msync(ipbinds->table, sizeof(nat_table_t), MS_SYNC);
+		munmap(ipbinds->table, sizeof(nat_table_t));
+		close(ipbinds->fd);
+		ipbinds->fd = -1;
+	} else {
+		free(ipbinds->table);
 	}
+	ipbinds->table = NULL;
 	if (ipbinds->hs_protect) {
 		pthread_mutex_destroy(ipbinds->hs_protect);
 		free(ipbinds->hs_protect);
@@ -67,131 +137,418 @@ void free_ipbinds(ipbinds_t *ipbinds)
 	free(ipbinds);
 }
 
-/* remember to free this queue appropriately */
-queue_t *ipbinds_get_ips(ipbinds_t *ipbinds)
+/**
+ * Start writing the bindings back to their file, without waiting.  Does
+ * nothing for bindings kept in memory.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+void ipbinds_sync(ipbinds_t *ipbinds)
+{
+	if (ipbinds->fd >= 0) {
+		msync(ipbinds->table, sizeof(nat_table_t), MS_ASYNC);
+	}
+}
+
+/**
+ * The number of ports bound.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+int ipbinds_count(ipbinds_t *ipbinds)
+{
+	int count;
+
+	pthread_mutex_lock(ipbinds->hs_protect);
+	count = ipbinds->table->count;
+	pthread_mutex_unlock(ipbinds->hs_protect);
+	return count;
+}
+
+/**
+ * Remove the bindings of the ips that have not been used for longer
+ * than the timeout.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] now:		The current time, in seconds.
+ * @param[in] timeout:	The seconds a binding may go unused.
+ *
+ * @return The number of bindings removed.
+ */
+int ipbinds_expire(ipbinds_t *ipbinds, long now, long timeout)
 {
-	queue_t *q = NULL;
+	int port;
+	int removed = 0;
+	nat_entry_t *entry = NULL;
 
 	pthread_mutex_lock(ipbinds->hs_protect);
-	q = iphs_get_keys(ipbinds->ips);
+	for (port = 1; (port < NAT_PORTS) && (ipbinds->table->count > 0); port++) {
+		entry = &ipbinds->table->entries[port];
+		if ((entry->used) && (now - entry->time > timeout)) {
+			LOG_INFO(("Removed %d.%d.%d.%d\n", 
+					entry->ip[0],
+					entry->ip[1],
+					entry->ip[2],
+					entry->ip[3]
+					));
+			unbind_port(ipbinds, port);
+			removed++;
+		}
+	}
 	pthread_mutex_unlock(ipbinds->hs_protect);
 
-	return q;
+	return removed;
 }
 
 int ip_get_bound_port(ipbinds_t *ipbinds, unsigned char *ip)
 {
-	int port = ip_get_fd(ipbinds->ips, ip);
-	int last_time, this_time;
-	if (port) {
-		this_time = (int)time(NULL);
-		last_time = ip_get_time(ipbinds, ip);
-		printf("%d %d\n", this_time, last_time);
-		printf("time since last lookup: %d seconds\n", 
-				this_time - last_time);
-		ip_hashset_update(ipbinds->timestamps, ip, (int)time(NULL));
+	int slot;
+	int port = 0;
+	nat_table_t *table = ipbinds->table;
+
+	pthread_mutex_lock(ipbinds->hs_protect);
+	slot = index_find(table, ip);
+	if (slot >= 0) {
+		port = table->index[slot];
+		LOG_DEBUG(("time since last lookup: %d seconds\n", 
+				(int)clock_seconds() - table->entries[port].time));
+		table->entries[port].time = (int)clock_seconds();
 	}
+	pthread_mutex_unlock(ipbinds->hs_protect);
 	return port;
 }
 
 int ip_get_time(ipbinds_t *ipbinds, unsigned char *ip)
 {
-	return ip_get_fd(ipbinds->timestamps, ip);
+	int slot;
+	int stamp = 0;
+
+	pthread_mutex_lock(ipbinds->hs_protect);
+	slot = index_find(ipbinds->table, ip);
+	if (slot >= 0) {
+		stamp = ipbinds->table->entries[ipbinds->table->index[slot]].time;
+	}
+	pthread_mutex_unlock(ipbinds->hs_protect);
+	return stamp;
 }
+
+/* remember to free the ip returned */
 unsigned char *port_get_bound_ip(ipbinds_t *ipbinds, int port)
 {
-	unsigned char *ip = fd_get_ip(ipbinds->ports, port);
-	if (ip) {
-		ip_hashset_update(ipbinds->timestamps, ip, (int)time(NULL));
+	unsigned char *ip = NULL;
+	nat_entry_t *entry = NULL;
+
+	if ((port <= 0) || (port >= NAT_PORTS)) {
+		return NULL;
+	}
+	pthread_mutex_lock(ipbinds->hs_protect);
+	entry = &ipbinds->table->entries[port];
+	if ((entry->used) && ((ip = malloc(4)))) {
+		memcpy(ip, entry->ip, 4);
+		entry->time = (int)clock_seconds();
 	}
+	pthread_mutex_unlock(ipbinds->hs_protect);
 	return ip;
 }
 
+/**
+ * Look up the ip bound to a port, without allocating a copy.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] port:		The port.
+ * @param[out] ip:		The 4 bytes of the ip, if the port is bound.
+ *
+ * @return TRUE(1) if the port is bound, FALSE(0) otherwise.
+ */
+int ipbinds_port_ip(ipbinds_t *ipbinds, int port, unsigned char *ip)
+{
+	int found = FALSE;
+	nat_entry_t *entry = NULL;
 
+	if ((port <= 0) || (port >= NAT_PORTS)) {
+		return FALSE;
+	}
+	pthread_mutex_lock(ipbinds->hs_protect);
+	entry = &ipbinds->table->entries[port];
+	if (entry->used) {
+		memcpy(ip, entry->ip, 4);
+		entry->time = (int)clock_seconds();
+		found = TRUE;
+	}
+	pthread_mutex_unlock(ipbinds->hs_protect);
+	return found;
+}
+
+/**
+ * Mark the binding of a port as used just now, for a translation taken
+ * from a cache rather than looked up.  This skips the lock, so it is
+ * only safe on a table that a single thread binds, looks up and expires,
+ * as the table of a NAT worker.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] port:		A bound port.
+ */
+void ipbinds_touch(ipbinds_t *ipbinds, int port)
+{
+	ipbinds->table->entries[port].time = (int)clock_seconds();
+}
+
+/**
+ * Get the generation of the bindings, which changes whenever a binding
+ * is removed.  A translation cached under one generation holds for as
+ * long as the generation stays the same.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+unsigned long ipbinds_generation(ipbinds_t *ipbinds)
+{
+	return __atomic_load_n(&ipbinds->generation, __ATOMIC_ACQUIRE);
+}
 
 void ipbinds_remove_port(ipbinds_t *ipbinds, int port)
 {
-	unsigned char *ip = NULL;
 	pthread_mutex_lock(ipbinds->hs_protect);
-
-	ip = fd_get_ip(ipbinds->ports, port);
-	if (ip) {
-		ip_hashset_remove(ipbinds->ips, ip);
-		ip_hashset_remove(ipbinds->timestamps, ip);
-	} else {
+	if ((port <= 0) || (port >= NAT_PORTS) 
+			|| (!ipbinds->table->entries[port].used)) {
 		fprintf(stderr, "this is weird when removing port\n");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		return;
+	} else {
+		unbind_port(ipbinds, port);
 	}
-	fd_hashset_remove(ipbinds->ports, port);
-
-	free(ip);
 	pthread_mutex_unlock(ipbinds->hs_protect);
 }
 
 void ipbinds_remove_ip(ipbinds_t *ipbinds, unsigned char *ip)
 {
-	int port;
+	int slot;
 
 	pthread_mutex_lock(ipbinds->hs_protect);
-
-	port = ip_get_fd(ipbinds->ips, ip);
-	if (port) {
-		fd_hashset_remove(ipbinds->ports, port);
-	} else {
+	slot = index_find(ipbinds->table, ip);
+	if (slot < 0) {
 		fprintf(stderr, "this is weird when removing ip\n");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		return;
+	} else {
+		unbind_port(ipbinds, ipbinds->table->index[slot]);
 	}
-	ip_hashset_remove(ipbinds->ips, ip);
-	ip_hashset_remove(ipbinds->timestamps, ip);
-
 	pthread_mutex_unlock(ipbinds->hs_protect);
 }
 
 int bind_ip_to_port(ipbinds_t *ipbinds, unsigned char *ip, int port)
 {
+	int bound;
+
 	pthread_mutex_lock(ipbinds->hs_protect);
+	bound = bind_locked(ipbinds, ip, port);
+	pthread_mutex_unlock(ipbinds->hs_protect);
+	return bound;
+}
 
-	if (!fd_hashset_insert(ipbinds->ports, port, ip)) {
-		printf("failed to insert into port list");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		return 0;
+/**
+ * Limit the ports handed out by ipbinds_bind to a range, for tables that
+ * share the port space with others.  Bindings outside the range, such
+ * as those restored from a file written with other ranges, are dropped.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] lo:		The first port of the range, at least 1.
+ * @param[in] hi:		One past the last port, at most NAT_PORTS.
+ */
+void ipbinds_set_range(ipbinds_t *ipbinds, int lo, int hi)
+{
+	int port;
+
+	pthread_mutex_lock(ipbinds->hs_protect);
+	ipbinds->port_lo = (lo < 1) ? 1 : lo;
+	ipbinds->port_hi = ((hi > NAT_PORTS) || (hi <= ipbinds->port_lo)) 
+		? NAT_PORTS : hi;
+	ipbinds->next_port = ipbinds->port_lo;
+	for (port = 1; port < NAT_PORTS; port++) {
+		if ((ipbinds->table->entries[port].used) 
+				&& ((port < ipbinds->port_lo) || (port >= ipbinds->port_hi))) {
+			unbind_port(ipbinds, port);
+		}
 	}
-	if (!ip_hashset_insert(ipbinds->ips, ip, port)) {
-		printf("failed to insert into ip list\n");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		ipbinds_remove_port(ipbinds, port);
-		return 0;
+	pthread_mutex_unlock(ipbinds->hs_protect);
+}
+
+/**
+ * Bind an ip to a free port, picked round robin so that a port that was
+ * just released is not handed out again straight away.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] ip:		The internal ip to bind.
+ *
+ * @return The port, 0 if every port of the range is bound.
+ */
+int ipbinds_bind(ipbinds_t *ipbinds, unsigned char *ip)
+{
+	int i;
+	int port = 0;
+	int lo = ipbinds->port_lo;
+	int span = ipbinds->port_hi - ipbinds->port_lo;
+
+	pthread_mutex_lock(ipbinds->hs_protect);
+	if (index_find(ipbinds->table, ip) < 0) {
+		for (i = 0; i < span; i++) {
+			if (bind_locked(ipbinds, ip, ipbinds->next_port)) {
+				port = ipbinds->next_port;
+			}
+			ipbinds->next_port = lo + ((ipbinds->next_port - lo + 1) % span);
+			if (port) {
+				break;
+			}
+		}
 	}
-	if (!ip_hashset_insert(ipbinds->timestamps, ip, (int)time(NULL))) {
-		printf("failed to insert into timestamps\n");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		ipbinds_remove_port(ipbinds, port);
-		ipbinds_remove_ip(ipbinds, ip);
-		return 0;
+	pthread_mutex_unlock(ipbinds->hs_protect);
+	return port;
+}
+
+/*** Helper Functions ****************************************************/
+
+ipbinds_t *ipbinds_wrap(nat_table_t *table, int fd)
+{
+	ipbinds_t *ipbinds = malloc(sizeof(ipbinds_t));
+
+	if (!ipbinds) {
+		perror("Memory error\n");
+		if (fd < 0) {
+			free(table);
+		}
+		return NULL;
 	}
+	ipbinds->table = table;
+	ipbinds->fd = fd;
+	ipbinds->next_port = 1;
+	ipbinds->port_lo = 1;
+	ipbinds->port_hi = NAT_PORTS;
+	ipbinds->generation = 0;
+	ipbinds->hs_protect = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(ipbinds->hs_protect, NULL);
 
-	pthread_mutex_unlock(ipbinds->hs_protect);
-	return 1;
+	return ipbinds;
 }
 
-/*
-int login_connection(ipbinds_t *ipbinds, int port, unsigned char *ip)
+/* set up the header of a zeroed table */
+void table_init(nat_table_t *table)
 {
-	pthread_mutex_lock(ipbinds->hs_protect);
+	memcpy(table->magic, NAT_MAGIC, sizeof(NAT_MAGIC));
+	table->ports = NAT_PORTS;
+	table->count = 0;
+}
 
-	if (!ip_hashset_insert(ipbinds->ips, ip, port)) {
-		printf("failed to insert into ip list\n");
-		pthread_mutex_unlock(ipbinds->hs_protect);
-		return 0;
+/* rebuild the index and the count from the entries, dropping any entry
+ * whose ip is already bound to a lower port.  The times are from the
+ * clock of an earlier run, so every binding counts as just used */
+void table_reindex(nat_table_t *table)
+{
+	int port;
+	int now = (int)clock_seconds();
+
+	memset(table->index, 0, sizeof(table->index));
+	table->count = 0;
+	table->entries[0].used = 0;
+	for (port = 1; port < NAT_PORTS; port++) {
+		if (!table->entries[port].used) {
+			continue;
+		}
+		if (index_find(table, table->entries[port].ip) >= 0) {
+			table->entries[port].used = 0;
+			continue;
+		}
+		table->entries[port].time = now;
+		index_insert(table, port);
+		table->count++;
 	}
-	
+}
 
-	fd_hashset_update(ipbinds->ports, port, ip);
+int index_hash(unsigned char *ip)
+{
+	unsigned long key = ((unsigned long)ip[0] << 24) | ((unsigned long)ip[1] << 16) 
+		| ((unsigned long)ip[2] << 8) | (unsigned long)ip[3];
 
+	return (int)(((key * 2654435761UL) & 0xffffffffUL) >> 15) & INDEX_MASK;
+}
 
-	pthread_mutex_unlock(ipbinds->hs_protect);
+/* the slot of the index holding the port of ip, -1 if it is not bound */
+int index_find(nat_table_t *table, unsigned char *ip)
+{
+	int slot = index_hash(ip);
+	int port;
+
+	while ((port = table->index[slot]) != 0) {
+		if (memcmp(table->entries[port].ip, ip, 4) == 0) {
+			return slot;
+		}
+		slot = (slot + 1) & INDEX_MASK;
+	}
+	return -1;
+}
+
+/* there are at most NAT_PORTS - 1 ports in NAT_INDEX slots, so an empty
+ * slot is always found */
+void index_insert(nat_table_t *table, int port)
+{
+	int slot = index_hash(table->entries[port].ip);
+
+	while (table->index[slot] != 0) {
+		slot = (slot + 1) & INDEX_MASK;
+	}
+	table->index[slot] = (unsigned short)port;
+}
+
+/* empty a slot, moving later entries of the same run back so that no
+ * lookup stops short of them */
+void index_delete(nat_table_t *table, int slot)
+{
+	int next = slot;
+	int home;
+
+	while (TRUE) {
+		next = (next + 1) & INDEX_MASK;
+		if (table->index[next] == 0) {
+			break;
+		}
+		home = index_hash(table->entries[table->index[next]].ip);
+		/* leave it if its home lies cyclically in (slot, next] */
+		if ((slot <= next) ? ((slot < home) && (home <= next)) 
+				: ((slot < home) || (home <= next))) {
+			continue;
+		}
+		table->index[slot] = table->index[next];
+		slot = next;
+	}
+	table->index[slot] = 0;
+}
+
+/* remove the binding of a bound port, with hs_protect already held */
+void unbind_port(ipbinds_t *ipbinds, int port)
+{
+	nat_table_t *table = ipbinds->table;
+	int slot = index_find(table, table->entries[port].ip);
+
+	if (slot >= 0) {
+		index_delete(table, slot);
+	}
+	table->entries[port].used = 0;
+	table->count--;
+	/* translations cached from this binding are stale now */
+	__atomic_add_fetch(&ipbinds->generation, 1, __ATOMIC_RELEASE);
+}
+
+/* bind ip to port with hs_protect already held */
+int bind_locked(ipbinds_t *ipbinds, unsigned char *ip, int port)
+{
+	nat_table_t *table = ipbinds->table;
+
+	if ((port <= 0) || (port >= NAT_PORTS) || (table->entries[port].used)) {
+		LOG_DEBUG(("failed to insert into port list\n"));
+		return 0;
+	}
+	if (index_find(table, ip) >= 0) {
+		LOG_WARN(("failed to insert into ip list\n"));
+		return 0;
+	}
+	memcpy(table->entries[port].ip, ip, 4);
+	table->entries[port].time = (int)clock_seconds();
+	table->entries[port].used = 1;
+	index_insert(table, port);
+	table->count++;
 	return 1;
 }
-*/
@@ -4,58 +4,132 @@
 #include <stdlib.h>
 #include <pthread.h>
 
-#include "../hashset/ip_hashset.h"
-#include "../hashset/fd_hashset.h"
-#include "../queue/queue.h"
+#define NAT_MAGIC	"NBNAT01"	/* Marks a file laid out as nat_table_t */
+#define NAT_PORTS	65536		/* Port 0 is never bound */
+#define NAT_INDEX	(2 * NAT_PORTS)	/* Slots of the ip to port index */
+
 /*
-#include "../packet/packet.h"
-*/
+ * The binding of one port, kept in the slot of that port.
+ */
+typedef struct nat_entry {
+	unsigned char ip[4];	/* The internal ip bound to the port */
+	int time;				/* When the binding was last used, in
+							 * clock_seconds */
+	int used;				/* The port is bound */
+} nat_entry_t;
+
+/*
+ * The bindings, in a fixed layout with no pointers, so that the table
+ * can live in a file mapped into memory and survive a restart as is.
+ * The index is an open addressing hash of the ips, holding the port of
+ * each, 0 for an empty slot.
+ */
+typedef struct nat_table {
+	char magic[8];
+	int ports;					/* NAT_PORTS, to catch other layouts */
+	int count;					/* The number of ports bound */
+	nat_entry_t entries[NAT_PORTS];
+	unsigned short index[NAT_INDEX];
+} nat_table_t;
 
 typedef struct ipbinds {
-	ip_hashset_ptr ips;
-	ip_hashset_ptr timestamps;
-	fd_hashset_ptr ports;
+	nat_table_t *table;
+	int fd;						/* The file backing table, -1 if none */
+	int next_port;				/* Where the search for a free port starts */
+	int port_lo;				/* The first port ipbinds_bind hands out */
+	int port_hi;				/* One past the last */
+	unsigned long generation;	/* Bumped whenever a binding is removed */
 	pthread_mutex_t *hs_protect;
 } ipbinds_t;
 
 /**
- * Allocate heap space for the ipbinds_t struct.
+ * Allocate heap space for the ipbinds_t struct, with the bindings kept
+ * in memory only.
  */
 ipbinds_t *new_ipbinds();
 
 /**
- * Free a ipbinds_t struct heap space.
+ * Allocate an ipbinds_t struct with the bindings kept in a file mapped
+ * into memory.  The bindings already in the file are taken on, so that
+ * translations outlive a restart of the server.  Changes reach the file
+ * page by page as the kernel writes them back, and in full at
+ * ipbinds_sync and free_ipbinds.
+ *
+ * @param[in] path: The file, created if it does not exist.
+ *
+ * @return The new struct, NULL if the file can't be used.
+ */
+ipbinds_t *new_ipbinds_file(char *path);
+
+/**
+ * Free a ipbinds_t struct heap space, writing the bindings back to their
+ * file if they have one.
  *
  * @param[in] ipbinds: The struct to be free'd.
  */
 void free_ipbinds(ipbinds_t *ipbinds);
 
 /**
- * Get a queue of the userips of all online ipbinds.
+ * Start writing the bindings back to their file, without waiting.  Does
+ * nothing for bindings kept in memory.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+void ipbinds_sync(ipbinds_t *ipbinds);
+
+/**
+ * The number of ports bound.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+int ipbinds_count(ipbinds_t *ipbinds);
+
+/**
+ * Remove the bindings of the ips that have not been used for longer
+ * than the timeout.
  *
- * @param[in] ipbinds: The struct maintaining a list of online ipbinds.
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] now:		The current time, from clock_seconds.
+ * @param[in] timeout:	The seconds a binding may go unused.
  *
- * @return A queue of all the currently online userips.
+ * @return The number of bindings removed.
  */
-queue_t *ipbinds_get_ips(ipbinds_t *ipbinds);
+int ipbinds_expire(ipbinds_t *ipbinds, long now, long timeout);
 
 int ip_get_bound_port(ipbinds_t *ipbinds, unsigned char *ip);
 int ip_get_time(ipbinds_t *ipbinds, unsigned char *ip);
 unsigned char *port_get_bound_ip(ipbinds_t *ipbinds, int port);
 
 /**
- * Get the socket file descriptors of all online ipbinds.
+ * Look up the ip bound to a port, without allocating a copy.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] port:		The port.
+ * @param[out] ip:		The 4 bytes of the ip, if the port is bound.
+ *
+ * @return TRUE(1) if the port is bound, FALSE(0) otherwise.
  */
-/*
-queue_t *get_ports(ipbinds_t *ipbinds);
-*/
+int ipbinds_port_ip(ipbinds_t *ipbinds, int port, unsigned char *ip);
 
 /**
- * Send a packet.
+ * Mark the binding of a port as used just now, for a translation taken
+ * from a cache rather than looked up.  This skips the lock, so it is
+ * only safe on a table that a single thread binds, looks up and expires,
+ * as the table of a NAT worker.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] port:		A bound port.
  */
-/*
-void ipbinds_send_packet(ipbinds_t *ipbinds, packet_t *packet);
-*/
+void ipbinds_touch(ipbinds_t *ipbinds, int port);
+
+/**
+ * Get the generation of the bindings, which changes whenever a binding
+ * is removed.  A translation cached under one generation holds for as
+ * long as the generation stays the same.
+ *
+ * @param[in] ipbinds: The struct maintaining the bindings.
+ */
+unsigned long ipbinds_generation(ipbinds_t *ipbinds);
 
 /**
  * Remove a file descriptor from ipbinds.
@@ -73,10 +147,25 @@ void ipbinds_remove_ip(ipbinds_t *ipbinds, unsigned char *ip);
 int bind_ip_to_port(ipbinds_t *ipbinds, unsigned char *ip, int port);
 
 /**
- * process the overhead of a newly logged in user.
+ * Limit the ports handed out by ipbinds_bind to a range, for tables that
+ * share the port space with others.  Bindings outside the range, such
+ * as those restored from a file written with other ranges, are dropped.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] lo:		The first port of the range, at least 1.
+ * @param[in] hi:		One past the last port, at most NAT_PORTS.
  */
-/*
-int login_connection(ipbinds_t *ipbinds, int port, unsigned char *ip);
-*/
+void ipbinds_set_range(ipbinds_t *ipbinds, int lo, int hi);
+
+/**
+ * Bind an ip to a free port, picked round robin so that a port that was
+ * just released is not handed out again straight away.
+ *
+ * @param[in] ipbinds:	The struct maintaining the bindings.
+ * @param[in] ip:		The internal ip to bind.
+ *
+ * @return The port, 0 if every port of the range is bound.
+ */
+int ipbinds_bind(ipbinds_t *ipbinds, unsigned char *ip);
 
 #endif
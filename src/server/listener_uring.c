@@ -0,0 +1,585 @@
+/*
+ * The io_uring backend of the listener threads.
+ *
+ * Instead of a select over all sockets and a read per field, each master
+ * socket has one multishot accept and each connection one multishot
+ * receive in flight.  Received bytes land in the provided buffers of the
+ * ring, are appended to the buffer of their connection and decoded there.
+ * The replies of the listener are queued as sends, and everything queued
+ * in one pass of the loop goes to the kernel in a single submit.  A send
+ * stays in flight while the loop goes on, and holds its socket until it
+ * completes, so that other writes to the socket queue behind it.  Output
+ * other threads could not write straight away waits in the users, and a
+ * one-shot poll for room is armed for each socket it waits for.  Those
+ * sockets come from the outwake of the listener, whose eventfd has a
+ * multishot poll of its own, so that the loop hears of such output while
+ * it waits, and only the sockets it was told of are looked at.
+ *
+ * Only the replies of the listener go through the ring.  What the speaker
+ * and the NAT workers send, in batches or otherwise, is still written by
+ * those threads with sendmsg, and only what the socket does not take
+ * straight away is left for the ring to wait for.  A multishot accept that
+ * ends for want of fds is only armed again once accepting rested.
+ *
+ * The user_data of an entry says what it was for.  The low three bits
+ * are a tag, the rest is the index of the port for accepts, the fd and
+ * gen of the connection for receives and polls for room, or the send
+ * for sends.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "listener_uring.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define URING_ENTRIES	256		/* The size of the submission queue */
+#define URING_BUFFERS	256		/* The number of provided buffers */
+#define URING_BUF_SIZE	4096	/* The size of a provided buffer */
+#define URING_WAIT_MS	1000	/* The longest a pass of the loop waits */
+#define URING_DRAIN		5		/* Passes given to the last sends to finish */
+
+#define TAG_BITS		3
+#define TAG_MASK		7UL
+#define TAG_ACCEPT		1UL
+#define TAG_RECV		2UL
+#define TAG_SEND		3UL
+#define TAG_WAKE		4UL
+#define TAG_WRITE		5UL
+
+/* The fd of a connection, from the user_data of its entries */
+#define CONN_FD(data)	((int)(((data) >> TAG_BITS) & 0x1fffffff))
+#define CONN_GEN(data)	((unsigned int)((data) >> 32))
+
+/*** Struct definitions **************************************************/
+
+/*
+ * A send in flight.  Its socket is only given back if the connection is
+ * still the one it was sent to.
+ */
+typedef struct uring_send {
+	char *frame;
+	int fd;
+	unsigned int gen;
+} uring_send_t;
+
+/*** Helper Function Prototypes ******************************************/
+
+listener_uring_t *new_listener_uring(int port_count);
+void free_listener_uring(listener_uring_t *uring);
+int uring_arm_accept(server_listener_t *listener, int port_index);
+int uring_arm_accepts(server_listener_t *listener);
+int uring_arm_recv(server_listener_t *listener, conn_t *conn);
+int uring_arm_wake(server_listener_t *listener);
+void uring_arm_writes(server_listener_t *listener);
+int uring_arm_write(server_listener_t *listener, int sd);
+void uring_want_write(server_listener_t *listener, int sd);
+void uring_reap(server_listener_t *listener);
+void uring_drain(server_listener_t *listener);
+void uring_complete(server_listener_t *listener, struct io_uring_cqe *cqe);
+void uring_on_accept(server_listener_t *listener, struct io_uring_cqe *cqe);
+void uring_on_recv(server_listener_t *listener, struct io_uring_cqe *cqe);
+void uring_on_send(server_listener_t *listener, struct io_uring_cqe *cqe);
+void uring_on_wake(server_listener_t *listener, struct io_uring_cqe *cqe);
+void uring_on_write(server_listener_t *listener, struct io_uring_cqe *cqe);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Serve the bound master sockets of a listener with io_uring until it is
+ * stopped.  Every master keeps a multishot accept in flight, and every
+ * connection a multishot receive into the provided buffers of the ring.
+ *
+ * @param[in] listener: The listener, with its masters bound.
+ *
+ * @return TRUE(1) once the listener was stopped, FALSE(0) if io_uring
+ * could not be set up, in which case nothing was done.
+ */
+int listener_uring_go(server_listener_t *listener)
+{
+	int ret;
+	int resting;
+	long wait_ms;
+
+	listener->uring = new_listener_uring(listener->port_count);
+	if (!listener->uring) {
+		return FALSE;
+	}
+	LOG_INFO(("Listener using io_uring\n"));
+
+	uring_arm_wake(listener);
+
+	while (listener_running(listener)) {
+		/* ports that ran out of fds get their accept back once they
+		 * rested, and are looked at again until then */
+		resting = uring_arm_accepts(listener);
+		wait_ms = listener->parked ? PARK_RETRY_MS : URING_WAIT_MS;
+		if ((resting) && (wait_ms > ACCEPT_REST_MS)) {
+			wait_ms = ACCEPT_REST_MS;
+		}
+
+		/* submit what the last pass queued, and wait for more work,
+		 * unless there are logins left to send */
+		ret = uring_submit_and_wait(listener->uring->ring, 
+				get_node_count(listener->pending) ? 0 : 1, wait_ms);
+		if (ret < 0) {
+			LOG_ERROR(("io_uring_enter failed: %s\n", strerror(-ret)));
+		}
+
+		uring_reap(listener);
+		listener_login_pending(listener);
+		listener_unpark(listener);
+		uring_arm_writes(listener);
+	}
+
+	/* give the last replies a chance before the ring goes */
+	uring_drain(listener);
+	free_listener_uring(listener->uring);
+	listener->uring = NULL;
+
+	return TRUE;
+}
+
+/**
+ * Queue a send of a frame on the ring of a listener.  It only goes on
+ * the ring if nothing else is being written to the socket, as the frame
+ * must not overtake what waits for it.
+ *
+ * @param[in] listener:	The listener, running with io_uring.
+ * @param[in] frame:	The serialized packet, which is free'd once sent
+ *						if the send was queued.
+ * @param[in] size:		The size of the frame.
+ * @param[in] sd:		The socket to send it over.
+ *
+ * @return TRUE(1) if the send was queued, FALSE(0) if the ring was full
+ * or the socket is busy, in which case the frame is left to the caller.
+ */
+int listener_uring_send(server_listener_t *listener, char *frame, int size,
+		int sd)
+{
+	struct io_uring_sqe *sqe = NULL;
+	uring_send_t *send = NULL;
+	conn_t *conn = conn_table_get(listener->conns, sd);
+
+	if ((!conn) || (!users_claim(listener->users, sd))) {
+		return FALSE;
+	}
+	send = malloc(sizeof(uring_send_t));
+	sqe = send ? uring_get_sqe(listener->uring->ring) : NULL;
+	if (!sqe) {
+		/* hand the socket back, with whatever came for it meanwhile */
+		free(send);
+		users_release(listener->users, sd, FALSE);
+		return FALSE;
+	}
+	send->frame = frame;
+	send->fd = sd;
+	send->gen = conn->gen;
+	packet_tap(frame, size, TAP_OUT);
+
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = sd;
+	sqe->addr = (unsigned long)frame;
+	sqe->len = size;
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	/* malloc'd memory leaves the tag bits free */
+	sqe->user_data = (unsigned long)send | TAG_SEND;
+	listener->uring->sends++;
+
+	return TRUE;
+}
+
+/**
+ * Submit whatever is queued on the ring of a listener, without waiting,
+ * so that the sends queued for a socket are on their way before it is
+ * closed.
+ *
+ * @param[in] listener:	The listener, running with io_uring.
+ */
+void listener_uring_flush(server_listener_t *listener)
+{
+	int ret = uring_submit_and_wait(listener->uring->ring, 0, 0);
+
+	if (ret < 0) {
+		LOG_ERROR(("io_uring_enter failed: %s\n", strerror(-ret)));
+	}
+}
+
+/*** Helper Functions ****************************************************/
+
+listener_uring_t *new_listener_uring(int port_count)
+{
+	listener_uring_t *uring = malloc(sizeof(listener_uring_t));
+
+	if (!uring) {
+		fprintf(stderr, "failed to malloc listener_uring\n");
+		return NULL;
+	}
+	uring->accepts = calloc(port_count, sizeof(int));
+	uring->ring = uring->accepts ? 
+		new_uring(URING_ENTRIES, URING_BUFFERS, URING_BUF_SIZE) : NULL;
+	if (!uring->ring) {
+		free(uring->accepts);
+		free(uring);
+		return NULL;
+	}
+	uring->sends = 0;
+	uring->writes = NULL;
+	uring->write_count = 0;
+	uring->write_cap = 0;
+	return uring;
+}
+
+void free_listener_uring(listener_uring_t *uring)
+{
+	if (!uring) {
+		return;
+	}
+	free_uring(uring->ring);
+	uring->ring = NULL;
+	free(uring->accepts);
+	uring->accepts = NULL;
+	free(uring->writes);
+	uring->writes = NULL;
+	free(uring);
+}
+
+/* keep accepting connections on the master of a port */
+int uring_arm_accept(server_listener_t *listener, int port_index)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(listener->uring->ring);
+
+	if (!sqe) {
+		LOG_ERROR(("no room to accept on port %d\n", 
+				listener->ports[port_index]));
+		return FALSE;
+	}
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listener->masters[port_index];
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = ((unsigned long)port_index << TAG_BITS) | TAG_ACCEPT;
+	listener->uring->accepts[port_index] = TRUE;
+	return TRUE;
+}
+
+/* arm the accepts of the ports that have none, unless accepting rests.
+ * Returns the number of ports left without one */
+int uring_arm_accepts(server_listener_t *listener)
+{
+	int i;
+	int resting = 0;
+	int accepting = listener_accepting(listener);
+
+	for (i = 0; i < listener->port_count; i++) {
+		if ((!listener->uring->accepts[i]) && 
+				((!accepting) || (!uring_arm_accept(listener, i)))) {
+			resting++;
+		}
+	}
+	return resting;
+}
+
+/* keep receiving on a connection, into whichever buffer is free */
+int uring_arm_recv(server_listener_t *listener, conn_t *conn)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(listener->uring->ring);
+
+	if (!sqe) {
+		LOG_ERROR(("no room to receive on %d\n", conn->fd));
+		return FALSE;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = ((unsigned long)conn->gen << 32) | 
+		((unsigned long)conn->fd << TAG_BITS) | TAG_RECV;
+	return TRUE;
+}
+
+/* keep listening for the wakeups of other threads */
+int uring_arm_wake(server_listener_t *listener)
+{
+	struct io_uring_sqe *sqe = NULL;
+
+	if (!listener->wake) {
+		return FALSE;
+	}
+	sqe = uring_get_sqe(listener->uring->ring);
+	if (!sqe) {
+		LOG_ERROR(("no room to poll the wakeups\n"));
+		return FALSE;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = listener->wake->fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = TAG_WAKE;
+	return TRUE;
+}
+
+/* wait for room in the sockets output started to wait for, unless a
+ * wait is already armed.  Those the ring has no room for yet are kept
+ * for the next pass */
+void uring_arm_writes(server_listener_t *listener)
+{
+	listener_uring_t *uring = listener->uring;
+	int sd;
+	int i;
+
+	if ((listener->wake) && (!outwake_take(listener->wake, &uring->writes, 
+			&uring->write_count, &uring->write_cap))) {
+		/* some were lost, so look at all of them once */
+		for (sd = 0; sd <= listener->conns->max_fd; sd++) {
+			if (conn_table_get(listener->conns, sd)) {
+				uring_want_write(listener, sd);
+			}
+		}
+	}
+
+	for (i = 0; i < uring->write_count; i++) {
+		if (!uring_arm_write(listener, uring->writes[i])) {
+			break;
+		}
+	}
+	uring->write_count -= i;
+	memmove(uring->writes, uring->writes + i, 
+			uring->write_count * sizeof(int));
+}
+
+/* wait for room in a socket, if output waits for it.  FALSE if the ring
+ * has no room for the wait */
+int uring_arm_write(server_listener_t *listener, int sd)
+{
+	struct io_uring_sqe *sqe = NULL;
+	conn_t *conn = conn_table_get(listener->conns, sd);
+
+	if ((!conn) || (conn->writing) || 
+			(!users_has_output(listener->users, sd))) {
+		return TRUE;
+	}
+	sqe = uring_get_sqe(listener->uring->ring);
+	if (!sqe) {
+		return FALSE;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = sd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = ((unsigned long)conn->gen << 32) | 
+		((unsigned long)sd << TAG_BITS) | TAG_WRITE;
+	conn->writing = TRUE;
+	return TRUE;
+}
+
+/* have uring_arm_writes look at a socket on its next pass */
+void uring_want_write(server_listener_t *listener, int sd)
+{
+	listener_uring_t *uring = listener->uring;
+	int *grown = NULL;
+	int cap;
+
+	if (uring->write_count == uring->write_cap) {
+		cap = uring->write_cap ? uring->write_cap * 2 : 64;
+		grown = realloc(uring->writes, cap * sizeof(int));
+		if (!grown) {
+			fprintf(stderr, "failed to grow the sockets to write\n");
+			return;
+		}
+		uring->writes = grown;
+		uring->write_cap = cap;
+	}
+	uring->writes[uring->write_count++] = sd;
+}
+
+/* handle every completion that is ready */
+void uring_reap(server_listener_t *listener)
+{
+	uring_t *ring = listener->uring->ring;
+	struct io_uring_cqe *cqe = NULL;
+	struct io_uring_cqe copy;
+
+	while ((cqe = uring_peek_cqe(ring))) {
+		/* done with the slot before handling it, as handling may queue
+		 * more entries */
+		copy = *cqe;
+		uring_cqe_seen(ring);
+		uring_complete(listener, &copy);
+	}
+}
+
+/* wait a few passes for the sends still in flight, once the loop is
+ * stopped.  The rest of the completions no longer matter */
+void uring_drain(server_listener_t *listener)
+{
+	uring_t *ring = listener->uring->ring;
+	struct io_uring_cqe *cqe = NULL;
+	struct io_uring_cqe copy;
+	int pass;
+
+	for (pass = 0; (pass < URING_DRAIN) && (listener->uring->sends > 0); 
+			pass++) {
+		if (uring_submit_and_wait(ring, 1, URING_WAIT_MS / URING_DRAIN) < 0) {
+			break;
+		}
+		while ((cqe = uring_peek_cqe(ring))) {
+			copy = *cqe;
+			uring_cqe_seen(ring);
+			if ((copy.user_data & TAG_MASK) == TAG_SEND) {
+				uring_on_send(listener, &copy);
+			}
+		}
+	}
+	if (listener->uring->sends > 0) {
+		LOG_WARN(("%d send(s) still in flight at shutdown\n", 
+				listener->uring->sends));
+	}
+}
+
+/* handle a completion by what it was for */
+void uring_complete(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	switch (cqe->user_data & TAG_MASK) {
+		case TAG_ACCEPT:
+			uring_on_accept(listener, cqe);
+			break;
+		case TAG_RECV:
+			uring_on_recv(listener, cqe);
+			break;
+		case TAG_SEND:
+			uring_on_send(listener, cqe);
+			break;
+		case TAG_WAKE:
+			uring_on_wake(listener, cqe);
+			break;
+		case TAG_WRITE:
+			uring_on_write(listener, cqe);
+			break;
+		default:
+			break;
+	}
+}
+
+void uring_on_accept(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	int port_index = (int)(cqe->user_data >> TAG_BITS);
+	int rest = FALSE;
+	conn_t *conn = NULL;
+
+	if (cqe->res >= 0) {
+		LOG_INFO(("New connection: \nsocket fd: \t%d\nport:\t%d\n",
+				cqe->res, listener->ports[port_index]));
+		conn = listener_register(listener, cqe->res, port_index);
+		if (conn) {
+			uring_arm_recv(listener, conn);
+		}
+	} else if (cqe->res != -ECANCELED) {
+		rest = listener_accept_failed(listener, port_index, -cqe->res);
+	}
+
+	/* out of fds, the accept is armed again by the loop once accepting
+	 * rested, instead of failing straight away once more */
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		listener->uring->accepts[port_index] = FALSE;
+		if (!rest) {
+			uring_arm_accept(listener, port_index);
+		}
+	}
+}
+
+void uring_on_recv(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	uring_t *ring = listener->uring->ring;
+	int sd = CONN_FD(cqe->user_data);
+	unsigned int gen = CONN_GEN(cqe->user_data);
+	unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	int has_buffer = cqe->flags & IORING_CQE_F_BUFFER;
+	int appended = TRUE;
+	conn_t *conn = conn_table_get(listener->conns, sd);
+
+	if ((!conn) || (conn->gen != gen)) {
+		/* the tail end of a connection that is already gone */
+		if (has_buffer) {
+			uring_recycle_buffer(ring, bid);
+		}
+		return;
+	}
+
+	if (cqe->res > 0) {
+		appended = conn_append(conn, uring_buffer(ring, bid), cqe->res);
+	}
+	if (has_buffer) {
+		uring_recycle_buffer(ring, bid);
+	}
+
+	if ((cqe->res == 0) || ((cqe->res < 0) && (cqe->res != -ENOBUFS)) || 
+			(!appended)) {
+		/* closed by the peer, or broken */
+		listener_drop(listener, sd, TRUE);
+		return;
+	}
+
+	if (cqe->res > 0) {
+		listener_consume(listener, conn);
+		conn = conn_table_get(listener->conns, sd);
+		if ((!conn) || (conn->gen != gen)) {
+			return;
+		}
+	}
+
+	/* the kernel stopped the multishot, out of buffers or otherwise */
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		uring_arm_recv(listener, conn);
+	}
+}
+
+void uring_on_send(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	uring_send_t *send = (uring_send_t *)(unsigned long)(cqe->user_data & 
+			~TAG_MASK);
+	conn_t *conn = conn_table_get(listener->conns, send->fd);
+
+	if (cqe->res < 0) {
+		/* the peer went away, the receive will notice */
+		LOG_DEBUG(("send failed: %s\n", strerror(-cqe->res)));
+	}
+	/* a socket closed meanwhile may be someone else's by now */
+	if ((conn) && (conn->gen == send->gen)) {
+		users_release(listener->users, send->fd, cqe->res < 0);
+		/* what came meanwhile and did not fit waits for room */
+		uring_want_write(listener, send->fd);
+	}
+	free(send->frame);
+	free(send);
+	listener->uring->sends--;
+}
+
+void uring_on_wake(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	/* the sockets are looked at by uring_arm_writes, after the reap */
+	listener_woken(listener);
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		uring_arm_wake(listener);
+	}
+}
+
+void uring_on_write(server_listener_t *listener, struct io_uring_cqe *cqe)
+{
+	int sd = CONN_FD(cqe->user_data);
+	conn_t *conn = conn_table_get(listener->conns, sd);
+
+	if ((!conn) || (conn->gen != CONN_GEN(cqe->user_data))) {
+		return;
+	}
+	conn->writing = FALSE;
+	/* whatever is left gets another poll after the reap */
+	if (users_flush(listener->users, sd)) {
+		uring_want_write(listener, sd);
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef LISTENER_URING_H
+#define LISTENER_URING_H
+
+#include <linux/io_uring.h>
+
+#include "server_listener.h"
+#include "uring.h"
+
+/*** Struct definitions **************************************************/
+
+/*
+ * The io_uring state of one listener thread.
+ */
+typedef struct listener_uring {
+	uring_t *ring;
+	int sends;			/* Sends queued and not yet completed */
+	int *accepts;		/* Per port, whether an accept is armed */
+	int *writes;		/* The sockets to wait for room in */
+	int write_count;
+	int write_cap;		/* The room in writes */
+} listener_uring_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Serve the bound master sockets of a listener with io_uring until it is
+ * stopped.  Every master keeps a multishot accept in flight, and every
+ * connection a multishot receive into the provided buffers of the ring.
+ *
+ * @param[in] listener: The listener, with its masters bound.
+ *
+ * @return TRUE(1) once the listener was stopped, FALSE(0) if io_uring
+ * could not be set up, in which case nothing was done.
+ */
+int listener_uring_go(server_listener_t *listener);
+
+/**
+ * Queue a send of a frame on the ring of a listener.  It only goes on
+ * the ring if nothing else is being written to the socket, as the frame
+ * must not overtake what waits for it.
+ *
+ * @param[in] listener:	The listener, running with io_uring.
+ * @param[in] frame:	The serialized packet, which is free'd once sent
+ *						if the send was queued.
+ * @param[in] size:		The size of the frame.
+ * @param[in] sd:		The socket to send it over.
+ *
+ * @return TRUE(1) if the send was queued, FALSE(0) if the ring was full
+ * or the socket is busy, in which case the frame is left to the caller.
+ */
+int listener_uring_send(server_listener_t *listener, char *frame, int size,
+		int sd);
+
+/**
+ * Submit whatever is queued on the ring of a listener, without waiting,
+ * so that the sends queued for a socket are on their way before it is
+ * closed.
+ *
+ * @param[in] listener:	The listener, running with io_uring.
+ */
+void listener_uring_flush(server_listener_t *listener);
+
+#endif
@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "nat.h"
+#include "policy.h"
+#include "../log/log.h"
+#include "../clock/clock.h"
+
+/*** Macros **************************************************************/
+
+#define TRUE		1
+#define FALSE		0
+#define NAT_TICK	1		/* Seconds a worker sleeps at most, to expire */
+#define LOCAL_PORT	8001	/* The port internal users are reached on */
+
+/*** Helper Function Prototypes ******************************************/
+
+int nat_worker_init(nat_t *nat, nat_worker_t *worker, int i, char *path);
+void nat_worker_destroy(nat_worker_t *worker);
+void *nat_run(void *arg);
+void nat_wait(nat_worker_t *worker);
+int nat_running(nat_worker_t *worker);
+packet_t *nat_take(nat_worker_t *worker, int *verdict);
+packet_t *nat_translate(nat_worker_t *worker, packet_t *packet, int verdict);
+int nat_lookup_out(nat_worker_t *worker, unsigned char *ip);
+int nat_lookup_in(nat_worker_t *worker, int port, unsigned char *ip);
+void nat_expire(nat_worker_t *worker);
+int nat_owner_of_ip(nat_t *nat, unsigned char *ip);
+unsigned long nat_hash_ip(unsigned char *ip);
+void nat_clear_macs(packet_t *packet);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate the translator workers, without starting them.
+ *
+ * @param[in] users:	The users currently online.
+ * @param[in] serv_ip:	The public address of the server.
+ * @param[in] count:	The number of workers.
+ * @param[in] path:		The file to keep the bindings in, NULL to keep
+ *						them in memory.  With more than one worker, each
+ *						keeps its own file, path with ".<worker>" added.
+ *
+ * @return The new workers, NULL on failure.
+ */
+nat_t *new_nat(users_t *users, unsigned char *serv_ip, int count, 
+		char *path)
+{
+	int i;
+	nat_t *nat = NULL;
+
+	if ((count < 1) || (count > MAX_NAT_WORKERS)) {
+		fprintf(stderr, "invalid number of nat workers: %d\n", count);
+		return NULL;
+	}
+	nat = malloc(sizeof(nat_t));
+	if (!nat) {
+		fprintf(stderr, "failed to malloc nat\n");
+		return NULL;
+	}
+	nat->workers = calloc(count, sizeof(nat_worker_t));
+	if (!nat->workers) {
+		fprintf(stderr, "failed to malloc nat workers\n");
+		free(nat);
+		return NULL;
+	}
+	nat->count = count;
+	nat->span = (NAT_PORTS - 1 + count - 1) / count;
+	nat->users = users;
+	memcpy(nat->serv_ip, serv_ip, 4);
+	nat->ip_timeout = 600;
+	nat->admit = NULL;
+
+	for (i = 0; i < count; i++) {
+		if (!nat_worker_init(nat, &nat->workers[i], i, path)) {
+			while (--i >= 0) {
+				nat_worker_destroy(&nat->workers[i]);
+			}
+			free(nat->workers);
+			free(nat);
+			return NULL;
+		}
+	}
+	return nat;
+}
+
+/**
+ * Free the workers, once they are stopped.
+ *
+ * @param[in] nat: The workers.
+ */
+void free_nat(nat_t *nat)
+{
+	int i;
+
+	if (!nat) {
+		return;
+	}
+	for (i = 0; i < nat->count; i++) {
+		nat_worker_destroy(&nat->workers[i]);
+	}
+	free(nat->workers);
+	nat->workers = NULL;
+	free(nat);
+}
+
+/**
+ * Start the threads of the workers.
+ *
+ * @param[in] nat: The workers.
+ *
+ * @return TRUE(1) on success, FALSE(0) if a thread could not be started.
+ */
+int nat_start(nat_t *nat)
+{
+	int i;
+
+	for (i = 0; i < nat->count; i++) {
+		nat->workers[i].run_status = TRUE;
+		nat->workers[i].refreshed = clock_seconds();
+		if (pthread_create(&nat->workers[i].thread, NULL, nat_run, 
+					&nat->workers[i])) {
+			fprintf(stderr, "failed to start nat worker %d\n", i);
+			nat->workers[i].run_status = FALSE;
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Stop the threads of the workers and wait for them to finish.
+ *
+ * @param[in] nat: The workers.
+ */
+void nat_stop(nat_t *nat)
+{
+	int i;
+	int running;
+	nat_worker_t *worker = NULL;
+
+	for (i = 0; i < nat->count; i++) {
+		worker = &nat->workers[i];
+		pthread_mutex_lock(worker->queue_lock);
+		running = worker->run_status;
+		worker->run_status = FALSE;
+		pthread_mutex_unlock(worker->queue_lock);
+		if (running) {
+			sem_post(worker->queue_sem);
+			pthread_join(worker->thread, NULL);
+		}
+	}
+}
+
+/**
+ * Hand a packet to the worker that translates it.  The packet is
+ * consumed.
+ *
+ * @param[in] nat:		The workers.
+ * @param[in] packet:	The packet.
+ * @param[in] verdict:	VERDICT_NAT_OUT or VERDICT_NAT_IN.
+ */
+void nat_submit(nat_t *nat, packet_t *packet, int verdict)
+{
+	int owner;
+	int queued;
+	int port = (unsigned short)packet->header.dst_port;
+	nat_worker_t *worker = NULL;
+
+	if (verdict == VERDICT_NAT_OUT) {
+		owner = nat_owner_of_ip(nat, packet->header.src_ip);
+	} else if ((verdict == VERDICT_NAT_IN) && (port >= 1)) {
+		owner = (port - 1) / nat->span;
+	} else {
+		LOG_INFO(("This port is unbound.\n"));
+		free_packet(packet);
+		return;
+	}
+	worker = &nat->workers[owner];
+
+	pthread_mutex_lock(worker->queue_lock);
+	queued = sched_push((verdict == VERDICT_NAT_OUT) 
+			? worker->outbound : worker->inbound, packet);
+	pthread_mutex_unlock(worker->queue_lock);
+	if (!queued) {
+		return;
+	}
+	admission_queued(nat->admit, 1);
+	sem_post(worker->queue_sem);
+}
+
+/**
+ * The number of ports bound, over all the workers.
+ *
+ * @param[in] nat: The workers.
+ */
+int nat_count(nat_t *nat)
+{
+	int i;
+	int count = 0;
+
+	for (i = 0; i < nat->count; i++) {
+		count += ipbinds_count(nat->workers[i].iptable);
+	}
+	return count;
+}
+
+/*** Helper Functions ****************************************************/
+
+/* set up worker i, with the bindings of its range of ports */
+int nat_worker_init(nat_t *nat, nat_worker_t *worker, int i, char *path)
+{
+	char *file = NULL;
+
+	worker->nat = nat;
+	worker->port_lo = 1 + i * nat->span;
+	worker->port_hi = worker->port_lo + nat->span;
+	if (worker->port_hi > NAT_PORTS) {
+		worker->port_hi = NAT_PORTS;
+	}
+
+	if ((path) && (nat->count > 1)) {
+		file = malloc(strlen(path) + 16);
+		if (file) {
+			sprintf(file, "%s.%d", path, i);
+		}
+	} else if (path) {
+		file = path;
+	}
+	worker->iptable = file ? new_ipbinds_file(file) : NULL;
+	if ((file) && (!worker->iptable)) {
+		printf("Keeping the NAT table of worker %d in memory only\n", i);
+	}
+	if (file != path) {
+		free(file);
+	}
+	if (!worker->iptable) {
+		worker->iptable = new_ipbinds();
+	}
+	if (!worker->iptable) {
+		return FALSE;
+	}
+	ipbinds_set_range(worker->iptable, worker->port_lo, worker->port_hi);
+
+	worker->outbound = new_sched();
+	worker->inbound = new_sched();
+	worker->turn = VERDICT_NAT_OUT;
+	worker->queue_sem = malloc(sizeof(sem_t));
+	worker->queue_lock = malloc(sizeof(pthread_mutex_t));
+	if ((!worker->outbound) || (!worker->inbound) || (!worker->queue_sem) 
+			|| (!worker->queue_lock)) {
+		fprintf(stderr, "failed to malloc nat worker\n");
+		free(worker->queue_sem);
+		worker->queue_sem = NULL;
+		free(worker->queue_lock);
+		worker->queue_lock = NULL;
+		nat_worker_destroy(worker);
+		return FALSE;
+	}
+	sem_init(worker->queue_sem, 0, 0);
+	pthread_mutex_init(worker->queue_lock, NULL);
+	worker->run_status = FALSE;
+	return TRUE;
+}
+
+void nat_worker_destroy(nat_worker_t *worker)
+{
+	if (worker->queue_sem) {
+		sem_destroy(worker->queue_sem);
+		free(worker->queue_sem);
+		worker->queue_sem = NULL;
+	}
+	if (worker->queue_lock) {
+		pthread_mutex_destroy(worker->queue_lock);
+		free(worker->queue_lock);
+		worker->queue_lock = NULL;
+	}
+	if (worker->outbound) {
+		free_sched(worker->outbound);
+		worker->outbound = NULL;
+	}
+	if (worker->inbound) {
+		free_sched(worker->inbound);
+		worker->inbound = NULL;
+	}
+	if (worker->iptable) {
+		free_ipbinds(worker->iptable);
+		worker->iptable = NULL;
+	}
+}
+
+/* The loop of a worker thread */
+void *nat_run(void *arg)
+{
+	nat_worker_t *worker = (nat_worker_t *)arg;
+	packet_t *packet = NULL;
+	int verdict;
+	int taken;
+	int count;
+	int i;
+
+	while (TRUE) {
+		nat_wait(worker);
+		if (!nat_running(worker)) {
+			break;
+		}
+
+		/* take whatever else is already queued along with it */
+		count = 0;
+		taken = 0;
+		do {
+			packet = nat_take(worker, &verdict);
+			if (!packet) {
+				break;
+			}
+			admission_queued(worker->nat->admit, -1);
+			taken++;
+			packet = nat_translate(worker, packet, verdict);
+			if (packet) {
+				worker->batch[count++] = packet;
+			}
+		} while ((taken < NAT_BATCH) && (sem_trywait(worker->queue_sem) == 0));
+
+		users_send_batch(worker->nat->users, worker->batch, count);
+		for (i = 0; i < count; i++) {
+			free_packet(worker->batch[i]);
+			worker->batch[i] = NULL;
+		}
+		nat_expire(worker);
+	}
+	return NULL;
+}
+
+/* wait for a packet, or for NAT_TICK to pass */
+void nat_wait(nat_worker_t *worker)
+{
+	struct timespec due;
+
+	clock_gettime(CLOCK_REALTIME, &due);
+	due.tv_sec += NAT_TICK;
+	while ((sem_timedwait(worker->queue_sem, &due) != 0) && (errno == EINTR));
+}
+
+int nat_running(nat_worker_t *worker)
+{
+	int status;
+
+	pthread_mutex_lock(worker->queue_lock);
+	status = worker->run_status;
+	pthread_mutex_unlock(worker->queue_lock);
+	return status;
+}
+
+/* pop the next packet, the two directions taking turns */
+packet_t *nat_take(nat_worker_t *worker, int *verdict)
+{
+	packet_t *packet = NULL;
+	sched_t *first = NULL;
+	sched_t *second = NULL;
+
+	pthread_mutex_lock(worker->queue_lock);
+	if (worker->turn == VERDICT_NAT_OUT) {
+		first = worker->outbound;
+		second = worker->inbound;
+	} else {
+		first = worker->inbound;
+		second = worker->outbound;
+	}
+	*verdict = worker->turn;
+	packet = sched_pop(first);
+	if (!packet) {
+		packet = sched_pop(second);
+		*verdict = (second == worker->outbound) 
+			? VERDICT_NAT_OUT : VERDICT_NAT_IN;
+	}
+	worker->turn = (*verdict == VERDICT_NAT_OUT) 
+		? VERDICT_NAT_IN : VERDICT_NAT_OUT;
+	pthread_mutex_unlock(worker->queue_lock);
+	return packet;
+}
+
+/* translate a packet in place, returning it, or NULL if it is dropped */
+packet_t *nat_translate(nat_worker_t *worker, packet_t *packet, int verdict)
+{
+	int port;
+	unsigned char ip[4];
+
+	if (verdict == VERDICT_NAT_OUT) {
+		port = nat_lookup_out(worker, packet->header.src_ip);
+		if (!port) {
+			LOG_WARN(("Dropping packet, every port is bound\n"));
+			free_packet(packet);
+			return NULL;
+		}
+		LOG_DEBUG(("port %d used to send out of\n", port));
+		packet_rewrite_src(packet, worker->nat->serv_ip, port);
+	} else {
+		port = (unsigned short)packet->header.dst_port;
+		if (!nat_lookup_in(worker, port, ip)) {
+			LOG_INFO(("This port is unbound.\n"));
+			free_packet(packet);
+			return NULL;
+		}
+		packet_rewrite_dst(packet, ip, LOCAL_PORT);
+	}
+	nat_clear_macs(packet);
+
+	LOG_DEBUG(("Sending message: %d.%d.%d.%d -> %d.%d.%d.%d %s\n", 
+			(int)packet->header.src_ip[0], 
+			(int)packet->header.src_ip[1], 
+			(int)packet->header.src_ip[2], 
+			(int)packet->header.src_ip[3], 
+			(int)packet->header.dst_ip[0], 
+			(int)packet->header.dst_ip[1], 
+			(int)packet->header.dst_ip[2], 
+			(int)packet->header.dst_ip[3], 
+			packet->data));
+	return packet;
+}
+
+/* the port an ip sends out of, bound now if it has none, 0 if every
+ * port is taken */
+int nat_lookup_out(nat_worker_t *worker, unsigned char *ip)
+{
+	unsigned long gen = ipbinds_generation(worker->iptable);
+	nat_flow_t *flow = NULL;
+	int port;
+
+	/* the hash modulo the worker count picked this worker, so the low
+	 * bits are alike here: index by higher ones */
+	flow = &worker->out_cache[(nat_hash_ip(ip) >> 8) & (NAT_CACHE_SIZE - 1)];
+
+	if (flow->port && (flow->gen == gen) && !memcmp(flow->ip, ip, 4)) {
+		ipbinds_touch(worker->iptable, flow->port);
+		return flow->port;
+	}
+
+	port = ip_get_bound_port(worker->iptable, ip);
+	if (!port) {
+		port = ipbinds_bind(worker->iptable, ip);
+		if (!port) {
+			return 0;
+		}
+		LOG_INFO(("%d.%d.%d.%d bound to %d\n", 
+				ip[0], ip[1], ip[2], ip[3], port));
+	}
+	memcpy(flow->ip, ip, 4);
+	flow->port = port;
+	flow->gen = gen;
+	return port;
+}
+
+/* the ip bound to a port, FALSE if it is unbound */
+int nat_lookup_in(nat_worker_t *worker, int port, unsigned char *ip)
+{
+	unsigned long gen = ipbinds_generation(worker->iptable);
+	nat_flow_t *flow = &worker->in_cache[port & (NAT_CACHE_SIZE - 1)];
+
+	if ((flow->port == port) && (flow->gen == gen)) {
+		ipbinds_touch(worker->iptable, port);
+		memcpy(ip, flow->ip, 4);
+		return TRUE;
+	}
+
+	if (!ipbinds_port_ip(worker->iptable, port, ip)) {
+		return FALSE;
+	}
+	memcpy(flow->ip, ip, 4);
+	flow->port = port;
+	flow->gen = gen;
+	return TRUE;
+}
+
+/* drop the bindings that went unused for too long, once per timeout */
+void nat_expire(nat_worker_t *worker)
+{
+	long now = clock_seconds();
+
+	if (now - worker->refreshed <= worker->nat->ip_timeout) {
+		return;
+	}
+	worker->refreshed = now;
+	LOG_DEBUG(("refreshing ip port table of ports %d to %d\n", 
+			worker->port_lo, worker->port_hi - 1));
+	ipbinds_expire(worker->iptable, now, worker->nat->ip_timeout);
+	ipbinds_sync(worker->iptable);
+}
+
+/* pick the worker that translates the outbound packets of an ip */
+int nat_owner_of_ip(nat_t *nat, unsigned char *ip)
+{
+	return (int)(nat_hash_ip(ip) % (unsigned long)nat->count);
+}
+
+/* FNV-1a over the 4 bytes of an ip, folded */
+unsigned long nat_hash_ip(unsigned char *ip)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		h = ((h ^ ip[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	return h ^ (h >> 16);
+}
+
+/* a translated packet starts a new hop, so it carries neither of the
+ * mac addresses of the old one */
+void nat_clear_macs(packet_t *packet)
+{
+	memset(packet->header.dst_mac, 0, 6);
+	memset(packet->header.src_mac, 0, 6);
+}
@@ -0,0 +1,128 @@
+#ifndef NAT_H
+#define NAT_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include "../queue/queue.h"
+#include "../packet/packet.h"
+#include "ipbinds.h"
+#include "users.h"
+#include "admission.h"
+#include "sched.h"
+
+#define DEFAULT_NAT_WORKERS	1	/* Translator threads, unless told otherwise */
+#define MAX_NAT_WORKERS		64
+#define NAT_BATCH			64	/* Packets translated per wakeup */
+#define NAT_CACHE_SIZE		256	/* Flows remembered per direction, a power of 2 */
+
+/*** Struct definitions **************************************************/
+
+/*
+ * A translation remembered by a worker, so that the next packet of the
+ * same flow skips the binding table.  It holds only while the bindings
+ * are still at generation gen.
+ */
+typedef struct nat_flow {
+	unsigned char ip[4];		/* The private address */
+	int port;					/* The public port it is bound to, 0 if unused */
+	unsigned long gen;
+} nat_flow_t;
+
+/*
+ * A translator thread.  It owns a range of the public ports, with a
+ * binding table of its own, so nothing it translates is shared with the
+ * other workers.  Only its queues are touched by other threads.  Each
+ * direction is scheduled by DSCP class and source address, like the
+ * speaker queue, and the two directions take turns.
+ */
+typedef struct nat_worker {
+	struct nat *nat;
+	int port_lo;				/* The first public port of this worker */
+	int port_hi;				/* One past the last */
+	ipbinds_t *iptable;			/* The bindings of those ports */
+	sched_t *outbound;			/* Packets to translate on the way out */
+	sched_t *inbound;			/* Packets to translate on the way in */
+	int turn;					/* The direction served next */
+	sem_t *queue_sem;
+	pthread_mutex_t *queue_lock;
+	int run_status;				/* Under queue_lock */
+	long refreshed;				/* When the bindings were last expired */
+	pthread_t thread;
+	packet_t *batch[NAT_BATCH];
+	nat_flow_t out_cache[NAT_CACHE_SIZE];	/* By private address */
+	nat_flow_t in_cache[NAT_CACHE_SIZE];	/* By public port */
+} nat_worker_t;
+
+/*
+ * The translator threads, with the public port space split between
+ * them.  Outbound packets go to the worker picked by a hash of their
+ * source, inbound packets to the worker owning their destination port.
+ */
+typedef struct nat {
+	nat_worker_t *workers;
+	int count;
+	int span;					/* The ports of each range */
+	users_t *users;
+	unsigned char serv_ip[4];
+	int ip_timeout;				/* The seconds a binding may go unused */
+	admission_t *admit;			/* Counts the packets queued, not owned */
+} nat_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate the translator workers, without starting them.
+ *
+ * @param[in] users:	The users currently online.
+ * @param[in] serv_ip:	The public address of the server.
+ * @param[in] count:	The number of workers.
+ * @param[in] path:		The file to keep the bindings in, NULL to keep
+ *						them in memory.  With more than one worker, each
+ *						keeps its own file, path with ".<worker>" added.
+ *
+ * @return The new workers, NULL on failure.
+ */
+nat_t *new_nat(users_t *users, unsigned char *serv_ip, int count, 
+		char *path);
+
+/**
+ * Free the workers, once they are stopped.
+ *
+ * @param[in] nat: The workers.
+ */
+void free_nat(nat_t *nat);
+
+/**
+ * Start the threads of the workers.
+ *
+ * @param[in] nat: The workers.
+ *
+ * @return TRUE(1) on success, FALSE(0) if a thread could not be started.
+ */
+int nat_start(nat_t *nat);
+
+/**
+ * Stop the threads of the workers and wait for them to finish.
+ *
+ * @param[in] nat: The workers.
+ */
+void nat_stop(nat_t *nat);
+
+/**
+ * Hand a packet to the worker that translates it.  The packet is
+ * consumed.
+ *
+ * @param[in] nat:		The workers.
+ * @param[in] packet:	The packet.
+ * @param[in] verdict:	VERDICT_NAT_OUT or VERDICT_NAT_IN.
+ */
+void nat_submit(nat_t *nat, packet_t *packet, int verdict);
+
+/**
+ * The number of ports bound, over all the workers.
+ *
+ * @param[in] nat: The workers.
+ */
+int nat_count(nat_t *nat);
+
+#endif
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "outbuf.h"
+#include "../packet/packet.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define INITIAL_OUTBUF	4096
+#define INITIAL_WAKES	64		/* Sockets an outwake has room for at first */
+#define OUTBUF_KEEP		65536	/* Larger buffers are let go once drained */
+#define TRUE			1
+#define FALSE			0
+
+/*** Helper Function Prototypes ******************************************/
+
+int outbuf_append(outbuf_t *out, char *bytes, int len);
+int outwake_grow(int **fds, int *cap, int need);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate the outwake of a listener, with its eventfd.
+ *
+ * @return The new outwake, NULL on failure.
+ */
+outwake_t *new_outwake()
+{
+	outwake_t *wake = malloc(sizeof(outwake_t));
+
+	if (!wake) {
+		fprintf(stderr, "failed to malloc outwake\n");
+		return NULL;
+	}
+	wake->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake->fd < 0) {
+		perror("eventfd\n");
+		free(wake);
+		return NULL;
+	}
+	pthread_mutex_init(&wake->lock, NULL);
+	wake->fds = NULL;
+	wake->count = 0;
+	wake->cap = 0;
+	wake->lost = FALSE;
+	return wake;
+}
+
+/**
+ * Free an outwake, and close its eventfd.
+ *
+ * @param[in] wake: The outwake to be free'd.
+ */
+void free_outwake(outwake_t *wake)
+{
+	if (!wake) {
+		return;
+	}
+	close(wake->fd);
+	pthread_mutex_destroy(&wake->lock);
+	free(wake->fds);
+	wake->fds = NULL;
+	free(wake);
+}
+
+/**
+ * Take the sockets output started to wait for, since the last take.
+ * They are appended to a buffer owned by the caller, which is grown as
+ * needed.  With a NULL buffer they are only cleared.
+ *
+ * @param[in] wake:			The outwake of the listener.
+ * @param[in,out] fds:		The buffer, may point to NULL at first.
+ * @param[in,out] count:	The number of sockets in the buffer.
+ * @param[in,out] cap:		The number of sockets it has room for.
+ *
+ * @return TRUE(1) if every socket told was taken, FALSE(0) if some were
+ * lost for want of memory, and every socket must be looked at.
+ */
+int outwake_take(outwake_t *wake, int **fds, int *count, int *cap)
+{
+	int taken = TRUE;
+
+	pthread_mutex_lock(&wake->lock);
+	if ((fds) && (wake->count)) {
+		if (outwake_grow(fds, cap, *count + wake->count)) {
+			memcpy(*fds + *count, wake->fds, wake->count * sizeof(int));
+			*count += wake->count;
+		} else {
+			taken = FALSE;
+		}
+	}
+	wake->count = 0;
+	if (wake->lost) {
+		wake->lost = FALSE;
+		taken = FALSE;
+	}
+	pthread_mutex_unlock(&wake->lock);
+	return taken;
+}
+
+/**
+ * Allocate an empty output buffer.
+ *
+ * @param[in] wake: The outwake to tell when bytes start to wait, NULL for
+ *					none.
+ *
+ * @return The new buffer, NULL on failure.
+ */
+outbuf_t *new_outbuf(outwake_t *wake)
+{
+	outbuf_t *out = malloc(sizeof(outbuf_t));
+
+	if (!out) {
+		fprintf(stderr, "failed to malloc outbuf\n");
+		return NULL;
+	}
+	out->data = NULL;
+	out->start = 0;
+	out->len = 0;
+	out->cap = 0;
+	out->wake = wake;
+	out->inflight = FALSE;
+	return out;
+}
+
+/**
+ * Free an output buffer, along with the bytes still waiting in it.
+ *
+ * @param[in] out: The buffer to be free'd.
+ */
+void free_outbuf(outbuf_t *out)
+{
+	if (!out) {
+		return;
+	}
+	free(out->data);
+	out->data = NULL;
+	free(out);
+}
+
+/**
+ * Get the number of bytes waiting to be written.
+ *
+ * @param[in] out: The buffer.
+ */
+int outbuf_pending(outbuf_t *out)
+{
+	return out->len - out->start;
+}
+
+/**
+ * Write frames to a non-blocking socket, behind whatever is already
+ * waiting, and keep the part the kernel did not take.  While a write is
+ * in flight all of them are kept.  The frames are not free'd.
+ *
+ * @param[in] out:		The buffer of the socket.
+ * @param[in] fd:		The socket.
+ * @param[in] frames:	The frames, in the order they must go out.
+ * @param[in] sizes:	The size of each frame.
+ * @param[in] count:	The number of frames.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the socket failed or the
+ * reader fell more than OUTBUF_MAX bytes behind.
+ */
+int outbuf_send(outbuf_t *out, int fd, char **frames, int *sizes, int count)
+{
+	int i;
+	int sent = 0;
+
+	if ((outbuf_pending(out)) && (outbuf_flush(out, fd) < 0)) {
+		return FALSE;
+	}
+	/* only once nothing waits may new frames go straight out */
+	if ((!out->inflight) && (!outbuf_pending(out))) {
+		sent = send_frames(frames, sizes, count, fd);
+		if (sent < 0) {
+			return FALSE;
+		}
+	}
+
+	/* keep what the kernel did not take, which may start mid frame */
+	for (i = 0; i < count; i++) {
+		if (sent >= sizes[i]) {
+			sent -= sizes[i];
+			continue;
+		}
+		if (!outbuf_append(out, frames[i] + sent, sizes[i] - sent)) {
+			return FALSE;
+		}
+		sent = 0;
+	}
+	return TRUE;
+}
+
+/**
+ * Write as much of what is waiting as the socket takes.  Nothing is
+ * written while a write is in flight.
+ *
+ * @param[in] out:	The buffer of the socket.
+ * @param[in] fd:	The socket.
+ *
+ * @return The number of bytes still waiting, -1 if the socket failed.
+ */
+int outbuf_flush(outbuf_t *out, int fd)
+{
+	ssize_t r;
+
+	while ((!out->inflight) && (out->start < out->len)) {
+		r = send(fd, out->data + out->start, out->len - out->start,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			} else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				break;
+			}
+			LOG_DEBUG(("send to %d failed: %s\n", fd, strerror(errno)));
+			return -1;
+		}
+		out->start += (int)r;
+	}
+
+	if (out->start == out->len) {
+		out->start = 0;
+		out->len = 0;
+		if (out->cap > OUTBUF_KEEP) {
+			free(out->data);
+			out->data = NULL;
+			out->cap = 0;
+		}
+	}
+	return out->len - out->start;
+}
+
+/**
+ * Tell the listener serving the socket that bytes are waiting, so that
+ * it watches the socket for room to write them.
+ *
+ * @param[in] out:	The buffer.
+ * @param[in] fd:	The socket.
+ */
+void outbuf_wake(outbuf_t *out, int fd)
+{
+	outwake_t *wake = out->wake;
+	uint64_t one = 1;
+
+	if (!wake) {
+		return;
+	}
+	/* on the list before the eventfd, so that a listener it wakes
+	 * finds the socket there */
+	pthread_mutex_lock(&wake->lock);
+	if (outwake_grow(&wake->fds, &wake->cap, wake->count + 1)) {
+		wake->fds[wake->count++] = fd;
+	} else {
+		wake->lost = TRUE;
+	}
+	pthread_mutex_unlock(&wake->lock);
+
+	/* the count only has to be non-zero, so a full one is fine */
+	if (write(wake->fd, &one, sizeof(one)) < 0) {
+		LOG_DEBUG(("failed to wake the listener: %s\n", strerror(errno)));
+	}
+}
+
+/*** Helper Functions ****************************************************/
+
+/* queue bytes behind those already waiting, moving the waiting ones to
+ * the front first if that makes room */
+int outbuf_append(outbuf_t *out, char *bytes, int len)
+{
+	int cap;
+	char *data = NULL;
+
+	if (outbuf_pending(out) + len > OUTBUF_MAX) {
+		LOG_WARN(("reader fell %d bytes behind\n", outbuf_pending(out) + len));
+		return FALSE;
+	}
+	if ((out->start > 0) && (out->len + len > out->cap)) {
+		memmove(out->data, out->data + out->start, out->len - out->start);
+		out->len -= out->start;
+		out->start = 0;
+	}
+	if (out->len + len > out->cap) {
+		cap = out->cap ? out->cap : INITIAL_OUTBUF;
+		while (cap < out->len + len) {
+			cap *= 2;
+		}
+		data = realloc(out->data, cap);
+		if (!data) {
+			fprintf(stderr, "failed to grow output buffer\n");
+			return FALSE;
+		}
+		out->data = data;
+		out->cap = cap;
+	}
+	memcpy(out->data + out->len, bytes, len);
+	out->len += len;
+	return TRUE;
+}
+
+/* make room for need sockets in a list of them */
+int outwake_grow(int **fds, int *cap, int need)
+{
+	int size;
+	int *grown = NULL;
+
+	if (need <= *cap) {
+		return TRUE;
+	}
+	size = *cap ? *cap : INITIAL_WAKES;
+	while (size < need) {
+		size *= 2;
+	}
+	grown = realloc(*fds, size * sizeof(int));
+	if (!grown) {
+		fprintf(stderr, "failed to grow the sockets to wake for\n");
+		return FALSE;
+	}
+	*fds = grown;
+	*cap = size;
+	return TRUE;
+}
@@ -0,0 +1,142 @@
+/*
+ * The output buffer of a connection.
+ *
+ * The sockets of the clients are non-blocking, so a write may take only
+ * part of what it is given.  Whatever the kernel did not take waits here,
+ * in order, and everything written to the socket afterwards is queued
+ * behind it until the listener serving the socket finds it writable and
+ * flushes the buffer.  A reader that falls more than OUTBUF_MAX bytes
+ * behind is cut off, rather than held on to forever.
+ *
+ * A write the listener hands to its ring marks the buffer as in flight.
+ * Until it completes nothing else is written to the socket, and all that
+ * comes meanwhile waits behind it.
+ *
+ * When bytes start to wait for a socket, its listener is told through an
+ * outwake: the socket goes on a list of the listener, and an eventfd
+ * wakes its loop, which takes the list and watches those sockets.
+ */
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <pthread.h>
+
+#define OUTBUF_MAX	(4 * 1024 * 1024)	/* Bytes held for a slow reader */
+
+/*** Struct definitions **************************************************/
+
+/*
+ * The sockets of one listener that output started to wait for, added to
+ * by any thread and taken by the listener.
+ */
+typedef struct outwake {
+	int fd;					/* The eventfd the listener waits on */
+	pthread_mutex_t lock;
+	int *fds;				/* The sockets, in the order they were told */
+	int count;
+	int cap;				/* The room in fds */
+	int lost;				/* Some did not fit, look at every socket */
+} outwake_t;
+
+typedef struct outbuf {
+	char *data;
+	int start;				/* The first byte not yet written */
+	int len;				/* The end of the bytes queued */
+	int cap;				/* The size of data */
+	outwake_t *wake;		/* Of the listener serving the socket, told
+							 * when bytes start to wait */
+	int inflight;			/* A write of the ring is not yet complete */
+} outbuf_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate the outwake of a listener, with its eventfd.
+ *
+ * @return The new outwake, NULL on failure.
+ */
+outwake_t *new_outwake();
+
+/**
+ * Free an outwake, and close its eventfd.
+ *
+ * @param[in] wake: The outwake to be free'd.
+ */
+void free_outwake(outwake_t *wake);
+
+/**
+ * Take the sockets output started to wait for, since the last take.
+ * They are appended to a buffer owned by the caller, which is grown as
+ * needed.  With a NULL buffer they are only cleared.
+ *
+ * @param[in] wake:			The outwake of the listener.
+ * @param[in,out] fds:		The buffer, may point to NULL at first.
+ * @param[in,out] count:	The number of sockets in the buffer.
+ * @param[in,out] cap:		The number of sockets it has room for.
+ *
+ * @return TRUE(1) if every socket told was taken, FALSE(0) if some were
+ * lost for want of memory, and every socket must be looked at.
+ */
+int outwake_take(outwake_t *wake, int **fds, int *count, int *cap);
+
+/**
+ * Allocate an empty output buffer.
+ *
+ * @param[in] wake: The outwake to tell when bytes start to wait, NULL for
+ *					none.
+ *
+ * @return The new buffer, NULL on failure.
+ */
+outbuf_t *new_outbuf(outwake_t *wake);
+
+/**
+ * Free an output buffer, along with the bytes still waiting in it.
+ *
+ * @param[in] out: The buffer to be free'd.
+ */
+void free_outbuf(outbuf_t *out);
+
+/**
+ * Get the number of bytes waiting to be written.
+ *
+ * @param[in] out: The buffer.
+ */
+int outbuf_pending(outbuf_t *out);
+
+/**
+ * Write frames to a non-blocking socket, behind whatever is already
+ * waiting, and keep the part the kernel did not take.  While a write is
+ * in flight all of them are kept.  The frames are not free'd.
+ *
+ * @param[in] out:		The buffer of the socket.
+ * @param[in] fd:		The socket.
+ * @param[in] frames:	The frames, in the order they must go out.
+ * @param[in] sizes:	The size of each frame.
+ * @param[in] count:	The number of frames.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the socket failed or the
+ * reader fell more than OUTBUF_MAX bytes behind.
+ */
+int outbuf_send(outbuf_t *out, int fd, char **frames, int *sizes, int count);
+
+/**
+ * Write as much of what is waiting as the socket takes.  Nothing is
+ * written while a write is in flight.
+ *
+ * @param[in] out:	The buffer of the socket.
+ * @param[in] fd:	The socket.
+ *
+ * @return The number of bytes still waiting, -1 if the socket failed.
+ */
+int outbuf_flush(outbuf_t *out, int fd);
+
+/**
+ * Tell the listener serving the socket that bytes are waiting, so that
+ * it watches the socket for room to write them.
+ *
+ * @param[in] out:	The buffer.
+ * @param[in] fd:	The socket.
+ */
+void outbuf_wake(outbuf_t *out, int fd);
+
+#endif
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "policy.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define NO_CLASS		-1
+#define NO_CHILD		0	/* Node 0 is the root, never anyone's child */
+#define INITIAL_NODES	64
+#define LINE_SIZE		256
+
+/*** Struct definitions **************************************************/
+
+/*
+ * A node of a binary trie over the bits of the address, most significant
+ * first.  Nodes live in one array and refer to each other by index.
+ */
+typedef struct trie_node {
+	int child[2];
+	int class;			/* The class of the prefix ending here, or NO_CLASS */
+} trie_node_t;
+
+struct policy {
+	trie_node_t *nodes;
+	int count;
+	int capacity;
+};
+
+/*** Helper Function Prototypes ******************************************/
+
+int new_node(policy_t *policy);
+int class_from_name(char *name);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate a policy with the default rules: the three private ranges
+ * may egress through NAT, everything else is external.
+ *
+ * @return The new policy, NULL on failure.
+ */
+policy_t *new_policy()
+{
+	unsigned char a[4] = {10, 0, 0, 0};
+	unsigned char b[4] = {172, 16, 0, 0};
+	unsigned char c[4] = {192, 168, 0, 0};
+	policy_t *policy = malloc(sizeof(policy_t));
+
+	if (!policy) {
+		fprintf(stderr, "failed to malloc policy\n");
+		return NULL;
+	}
+	policy->nodes = NULL;
+	policy->count = 0;
+	policy->capacity = 0;
+	if ((new_node(policy) < 0) 
+			|| (!policy_add_rule(policy, a, 8, POLICY_EGRESS))
+			|| (!policy_add_rule(policy, b, 12, POLICY_EGRESS))
+			|| (!policy_add_rule(policy, c, 16, POLICY_EGRESS))) {
+		free_policy(policy);
+		return NULL;
+	}
+	return policy;
+}
+
+/**
+ * Free the policy.
+ *
+ * @param[in] policy: The policy to be free'd.
+ */
+void free_policy(policy_t *policy)
+{
+	if (!policy) {
+		return;
+	}
+	free(policy->nodes);
+	policy->nodes = NULL;
+	free(policy);
+}
+
+/**
+ * Put a prefix in a class, overriding any rule for the same prefix.
+ *
+ * @param[in] policy:		The policy.
+ * @param[in] prefix:		The address of the prefix.
+ * @param[in] prefix_len:	The length of the prefix, 0 to 32.
+ * @param[in] class:		One of the POLICY_ classes.
+ *
+ * @return TRUE(1) on success, FALSE(0) on failure.
+ */
+int policy_add_rule(policy_t *policy, unsigned char *prefix, int prefix_len, 
+		int class)
+{
+	int i, bit, child;
+	int node = 0;
+
+	if ((prefix_len < 0) || (prefix_len > 32) || (class < POLICY_EXTERNAL) 
+			|| (class > POLICY_DENY)) {
+		return FALSE;
+	}
+	for (i = 0; i < prefix_len; i++) {
+		bit = (prefix[i / 8] >> (7 - (i % 8))) & 1;
+		child = policy->nodes[node].child[bit];
+		if (child == NO_CHILD) {
+			child = new_node(policy);
+			if (child < 0) {
+				return FALSE;
+			}
+			policy->nodes[node].child[bit] = child;
+		}
+		node = child;
+	}
+	policy->nodes[node].class = class;
+	return TRUE;
+}
+
+/**
+ * Read rules from a file, one per line, in the form
+ *
+ *     egress|internal|nonat|deny|external a.b.c.d/len
+ *
+ * Blank lines and lines starting with # are skipped.
+ *
+ * @param[in] policy:	The policy to add the rules to.
+ * @param[in] path:		The file to read.
+ *
+ * @return The number of rules read, -1 if the file could not be read or
+ * has a malformed line.
+ */
+int policy_load(policy_t *policy, char *path)
+{
+	char line[LINE_SIZE];
+	char name[LINE_SIZE];
+	char prefix_str[LINE_SIZE];
+	unsigned char prefix[4];
+	int prefix_len;
+	int class;
+	int line_no = 0;
+	int rules = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror("failed to open policy file");
+		return -1;
+	}
+	while (fgets(line, LINE_SIZE, f)) {
+		line_no++;
+		if (sscanf(line, "%255s", name) != 1) {
+			continue;
+		}
+		if (name[0] == '#') {
+			continue;
+		}
+		if ((sscanf(line, "%255s %255s", name, prefix_str) != 2) 
+				|| ((class = class_from_name(name)) < 0) 
+				|| (!parse_prefix(prefix_str, prefix, &prefix_len)) 
+				|| (!policy_add_rule(policy, prefix, prefix_len, class))) {
+			fprintf(stderr, "%s:%d: malformed policy rule\n", path, line_no);
+			fclose(f);
+			return -1;
+		}
+		rules++;
+	}
+	fclose(f);
+	return rules;
+}
+
+/**
+ * Find the class of an address, by the longest prefix that covers it.
+ * Costs at most 32 steps, however many rules there are.
+ *
+ * @param[in] policy:	The policy.
+ * @param[in] ip:		The address.
+ *
+ * @return One of the POLICY_ classes.
+ */
+int policy_lookup(policy_t *policy, unsigned char *ip)
+{
+	int i;
+	int node = 0;
+	int class = POLICY_EXTERNAL;
+	trie_node_t *nodes = policy->nodes;
+
+	for (i = 0; ; i++) {
+		if (nodes[node].class != NO_CLASS) {
+			class = nodes[node].class;
+		}
+		if (i == 32) {
+			break;
+		}
+		node = nodes[node].child[(ip[i / 8] >> (7 - (i % 8))) & 1];
+		if (node == NO_CHILD) {
+			break;
+		}
+	}
+	return class;
+}
+
+/**
+ * Decide what to do with a packet from src to dst.
+ *
+ * @param[in] policy:	The policy.
+ * @param[in] src:		The source address of the packet.
+ * @param[in] dst:		The destination address of the packet.
+ * @param[in] serv_ip:	The external address of the server.
+ *
+ * @return One of the VERDICT_ values.
+ */
+int policy_decide(policy_t *policy, unsigned char *src, unsigned char *dst, 
+		unsigned char *serv_ip)
+{
+	int from = policy_lookup(policy, src);
+	int to = policy_lookup(policy, dst);
+	int to_internal = (to == POLICY_EGRESS) || (to == POLICY_INTERNAL);
+
+	if ((from == POLICY_DENY) || (to == POLICY_DENY)) {
+		LOG_INFO(("Dropping packet, address blocked by policy\n"));
+		return VERDICT_DROP;
+	}
+
+	if ((from == POLICY_EGRESS) || (from == POLICY_INTERNAL)) {
+		if (to_internal) {
+			/* internal to internal, nothing to do */
+			return VERDICT_FORWARD;
+		}
+		if (from == POLICY_INTERNAL) {
+			LOG_INFO(("Dropping packet, source may not leave the network\n"));
+			return VERDICT_DROP;
+		}
+		return (to == POLICY_NO_NAT) ? VERDICT_FORWARD : VERDICT_NAT_OUT;
+	}
+
+	if (memcmp(dst, serv_ip, 4) == 0) {
+		return VERDICT_NAT_IN;
+	}
+	if ((to == POLICY_EGRESS) && (from == POLICY_NO_NAT)) {
+		return VERDICT_FORWARD;
+	}
+	if (to_internal) {
+		LOG_INFO(("Invalid target address from external domain\n"));
+		LOG_INFO(("Dropping packet\n"));
+	} else {
+		LOG_INFO(("Dropping packet, not allowed to route from extern to extern\n"));
+	}
+	return VERDICT_DROP;
+}
+
+/**
+ * Read a prefix such as 10.1.0.0/16.
+ *
+ * @param[in] s:			The string to read.
+ * @param[out] prefix:		The 4 bytes of the address.
+ * @param[out] prefix_len:	The length of the prefix.
+ *
+ * @return TRUE(1) on success, FALSE(0) if s is malformed.
+ */
+int parse_prefix(char *s, unsigned char *prefix, int *prefix_len)
+{
+	int j;
+	long value;
+	char *next_ptr = s;
+	char *end_ptr;
+
+	for (j = 0; j < 4; j++) {
+		value = strtol(next_ptr, &end_ptr, 10);
+		if ((end_ptr == next_ptr) || (value < 0) || (value > 255)) {
+			return FALSE;
+		}
+		if (*end_ptr != ((j != 3) ? '.' : '/')) {
+			return FALSE;
+		}
+		prefix[j] = (unsigned char)value;
+		next_ptr = end_ptr + 1;
+	}
+	value = strtol(next_ptr, &end_ptr, 10);
+	if ((end_ptr == next_ptr) || (*end_ptr != '\0') || (value < 0) 
+			|| (value > 32)) {
+		return FALSE;
+	}
+	*prefix_len = (int)value;
+	return TRUE;
+}
+
+/*** Helper Functions ****************************************************/
+
+/* add an empty node to the trie, returning its index or -1 */
+int new_node(policy_t *policy)
+{
+	int capacity;
+	trie_node_t *grown = NULL;
+
+	if (policy->count == policy->capacity) {
+		capacity = policy->capacity ? 2 * policy->capacity : INITIAL_NODES;
+		grown = realloc(policy->nodes, capacity * sizeof(trie_node_t));
+		if (!grown) {
+			fprintf(stderr, "failed to grow policy trie\n");
+			return -1;
+		}
+		policy->nodes = grown;
+		policy->capacity = capacity;
+	}
+	policy->nodes[policy->count].child[0] = NO_CHILD;
+	policy->nodes[policy->count].child[1] = NO_CHILD;
+	policy->nodes[policy->count].class = NO_CLASS;
+	return policy->count++;
+}
+
+int class_from_name(char *name)
+{
+	if (strcmp(name, "egress") == 0) {
+		return POLICY_EGRESS;
+	} else if (strcmp(name, "internal") == 0) {
+		return POLICY_INTERNAL;
+	} else if (strcmp(name, "nonat") == 0) {
+		return POLICY_NO_NAT;
+	} else if (strcmp(name, "deny") == 0) {
+		return POLICY_DENY;
+	} else if (strcmp(name, "external") == 0) {
+		return POLICY_EXTERNAL;
+	}
+	return -1;
+}
@@ -0,0 +1,103 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#define TRUE	1
+#define FALSE	0
+
+/*
+ * The class a prefix is put in by a rule.  An address gets the class of
+ * the longest prefix that covers it, POLICY_EXTERNAL if none does.
+ */
+#define POLICY_EXTERNAL	0	/* Reachable through the server address only */
+#define POLICY_EGRESS	1	/* Internal, may reach external hosts via NAT */
+#define POLICY_INTERNAL	2	/* Internal, may not leave the network */
+#define POLICY_NO_NAT	3	/* External, but reached without translation */
+#define POLICY_DENY		4	/* Nothing to or from here is forwarded */
+
+/* What the speaker does with a packet, as decided by policy_decide */
+#define VERDICT_DROP		0
+#define VERDICT_FORWARD		1	/* Send on unchanged */
+#define VERDICT_NAT_OUT		2	/* Translate to the server address */
+#define VERDICT_NAT_IN		3	/* Translate back to the bound internal ip */
+
+typedef struct policy policy_t;
+
+/**
+ * Allocate a policy with the default rules: the three private ranges
+ * may egress through NAT, everything else is external.
+ *
+ * @return The new policy, NULL on failure.
+ */
+policy_t *new_policy();
+
+/**
+ * Free the policy.
+ *
+ * @param[in] policy: The policy to be free'd.
+ */
+void free_policy(policy_t *policy);
+
+/**
+ * Put a prefix in a class, overriding any rule for the same prefix.
+ *
+ * @param[in] policy:		The policy.
+ * @param[in] prefix:		The address of the prefix.
+ * @param[in] prefix_len:	The length of the prefix, 0 to 32.
+ * @param[in] class:		One of the POLICY_ classes.
+ *
+ * @return TRUE(1) on success, FALSE(0) on failure.
+ */
+int policy_add_rule(policy_t *policy, unsigned char *prefix, int prefix_len, 
+		int class);
+
+/**
+ * Read rules from a file, one per line, in the form
+ *
+ *     egress|internal|nonat|deny|external a.b.c.d/len
+ *
+ * Blank lines and lines starting with # are skipped.
+ *
+ * @param[in] policy:	The policy to add the rules to.
+ * @param[in] path:		The file to read.
+ *
+ * @return The number of rules read, -1 if the file could not be read or
+ * has a malformed line.
+ */
+int policy_load(policy_t *policy, char *path);
+
+/**
+ * Find the class of an address, by the longest prefix that covers it.
+ * Costs at most 32 steps, however many rules there are.
+ *
+ * @param[in] policy:	The policy.
+ * @param[in] ip:		The address.
+ *
+ * @return One of the POLICY_ classes.
+ */
+int policy_lookup(policy_t *policy, unsigned char *ip);
+
+/**
+ * Decide what to do with a packet from src to dst.
+ *
+ * @param[in] policy:	The policy.
+ * @param[in] src:		The source address of the packet.
+ * @param[in] dst:		The destination address of the packet.
+ * @param[in] serv_ip:	The external address of the server.
+ *
+ * @return One of the VERDICT_ values.
+ */
+int policy_decide(policy_t *policy, unsigned char *src, unsigned char *dst, 
+		unsigned char *serv_ip);
+
+/**
+ * Read a prefix such as 10.1.0.0/16.
+ *
+ * @param[in] s:			The string to read.
+ * @param[out] prefix:		The 4 bytes of the address.
+ * @param[out] prefix_len:	The length of the prefix.
+ *
+ * @return TRUE(1) on success, FALSE(0) if s is malformed.
+ */
+int parse_prefix(char *s, unsigned char *prefix, int *prefix_len);
+
+#endif
@@ -0,0 +1,374 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sched.h"
+#include "../packet/code.h"
+
+/*** Macros **************************************************************/
+
+#define BODY_FIELDS		20	/* The code and four length fields of a body */
+
+/*** Helper Function Prototypes ******************************************/
+
+int sched_is_control(packet_t *packet);
+long sched_cost(packet_t *packet);
+sched_flow_t *sched_flow(sched_t *sched, packet_t *packet, int class);
+void sched_flow_free(sched_t *sched, sched_flow_t *flow);
+void sched_class_join(sched_t *sched, int class);
+void sched_class_leave(sched_t *sched);
+void sched_class_rotate(sched_t *sched);
+int sched_hash(unsigned char *ip, int class);
+int sched_cmp_dummy(void *a, void *b);
+
+/* How many quanta each class gets per turn */
+int class_weights[SCHED_CLASSES] = {
+	8,		/* SCHED_EXPEDITED */
+	4,		/* SCHED_ASSURED */
+	2,		/* SCHED_DEFAULT */
+	1		/* SCHED_BULK */
+};
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate an empty scheduler.
+ *
+ * @return The new scheduler, NULL on failure.
+ */
+sched_t *new_sched()
+{
+	int i;
+	sched_t *sched = malloc(sizeof(sched_t));
+
+	if (!sched) {
+		fprintf(stderr, "failed to malloc sched\n");
+		return NULL;
+	}
+	sched->control = NULL;
+	init_queue(&sched->control, sched_cmp_dummy, free_packet);
+	for (i = 0; i < SCHED_CLASSES; i++) {
+		sched->classes[i].quantum = (long)class_weights[i] * SCHED_QUANTUM;
+		sched->classes[i].deficit = 0;
+		sched->classes[i].started = FALSE;
+		sched->classes[i].head = NULL;
+		sched->classes[i].tail = NULL;
+		sched->classes[i].active = FALSE;
+		sched->classes[i].next = -1;
+	}
+	sched->head = -1;
+	sched->tail = -1;
+	for (i = 0; i < SCHED_BUCKETS; i++) {
+		sched->table[i] = NULL;
+	}
+	sched->count = 0;
+	return sched;
+}
+
+/**
+ * Free the scheduler, along with the packets it still holds.
+ *
+ * @param[in] sched: The scheduler to be free'd.
+ */
+void free_sched(sched_t *sched)
+{
+	int i;
+	sched_flow_t *flow = NULL;
+
+	if (!sched) {
+		return;
+	}
+	free_queue(sched->control);
+	sched->control = NULL;
+	for (i = 0; i < SCHED_BUCKETS; i++) {
+		while (sched->table[i]) {
+			flow = sched->table[i];
+			sched->table[i] = flow->chain;
+			free_queue(flow->packets);
+			free(flow);
+		}
+	}
+	free(sched);
+}
+
+/**
+ * Add a packet to its lane.  The packet is consumed.
+ *
+ * @param[in] sched:	The scheduler.
+ * @param[in] packet:	The packet.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the packet had to be dropped.
+ */
+int sched_push(sched_t *sched, packet_t *packet)
+{
+	int class;
+	sched_flow_t *flow = NULL;
+	sched_class_t *c = NULL;
+
+	if (sched_is_control(packet)) {
+		if (!insert_node(sched->control, (void *)packet)) {
+			free_packet(packet);
+			return FALSE;
+		}
+		sched->count++;
+		return TRUE;
+	}
+
+	class = sched_class_of(packet->header.dscp_ecn >> 2);
+	flow = sched_flow(sched, packet, class);
+	if ((!flow) || (!insert_node(flow->packets, (void *)packet))) {
+		free_packet(packet);
+		return FALSE;
+	}
+	sched->count++;
+
+	if (get_node_count(flow->packets) == 1) {
+		/* it just became active, so it joins the end of the ring */
+		c = &sched->classes[class];
+		flow->next = NULL;
+		if (c->tail) {
+			c->tail->next = flow;
+		} else {
+			c->head = flow;
+		}
+		c->tail = flow;
+		if (!c->active) {
+			sched_class_join(sched, class);
+		}
+	}
+	return TRUE;
+}
+
+/**
+ * Take the packet that is to be sent next.
+ *
+ * @param[in] sched: The scheduler.
+ *
+ * @return The packet, NULL if there are none.
+ */
+packet_t *sched_pop(sched_t *sched)
+{
+	long cost;
+	sched_class_t *c = NULL;
+	sched_flow_t *flow = NULL;
+	packet_t *packet = NULL;
+
+	if (get_node_count(sched->control)) {
+		sched->count--;
+		return (packet_t *)pop_first(sched->control);
+	}
+
+	/* every pass adds a quantum somewhere, so this ends */
+	while (sched->head >= 0) {
+		c = &sched->classes[sched->head];
+		if (!c->started) {
+			c->deficit += c->quantum;
+			c->started = TRUE;
+		}
+		flow = c->head;
+		if (!flow->started) {
+			flow->deficit += SCHED_QUANTUM;
+			flow->started = TRUE;
+		}
+		cost = sched_cost((packet_t *)flow->packets->head->data);
+
+		if (cost > flow->deficit) {
+			/* the flow's turn is over, the next one in the class goes */
+			flow->started = FALSE;
+			if (flow != c->tail) {
+				c->head = flow->next;
+				flow->next = NULL;
+				c->tail->next = flow;
+				c->tail = flow;
+			}
+			continue;
+		}
+		if (cost > c->deficit) {
+			/* the class's turn is over */
+			sched_class_rotate(sched);
+			continue;
+		}
+
+		packet = (packet_t *)pop_first(flow->packets);
+		sched->count--;
+		flow->deficit -= cost;
+		c->deficit -= cost;
+		if (!get_node_count(flow->packets)) {
+			c->head = flow->next;
+			if (!c->head) {
+				c->tail = NULL;
+			}
+			sched_flow_free(sched, flow);
+			if (!c->head) {
+				sched_class_leave(sched);
+			}
+		}
+		return packet;
+	}
+	return NULL;
+}
+
+/**
+ * Get the number of packets held by the scheduler.
+ *
+ * @param[in] sched: The scheduler.
+ */
+int sched_count(sched_t *sched)
+{
+	return sched->count;
+}
+
+/**
+ * Get the class of a DSCP code point.
+ *
+ * @param[in] dscp: The upper six bits of the DSCP/ECN byte.
+ *
+ * @return One of the SCHED_ classes.
+ */
+int sched_class_of(int dscp)
+{
+	if (dscp >= 32) {
+		return SCHED_EXPEDITED;
+	} else if ((dscp >= 16) || (dscp == 10) || (dscp == 12) || (dscp == 14)) {
+		return SCHED_ASSURED;
+	} else if ((dscp == 8) || (dscp == 1)) {
+		return SCHED_BULK;
+	}
+	return SCHED_DEFAULT;
+}
+
+/*** Helper Functions ****************************************************/
+
+/* the packets that keep the users in touch with the server go first */
+int sched_is_control(packet_t *packet)
+{
+	switch (packet->code) {
+		case GET_ULIST:
+		case LOGIN:
+		case QUIT:
+		case ACCEPT:
+		case DENIAL:
+			return TRUE;
+		default:
+			return FALSE;
+	}
+}
+
+/* the bytes a packet takes on the wire, near enough */
+long sched_cost(packet_t *packet)
+{
+	return PACKET_PREFIX_SIZE + BODY_FIELDS + PACKET_FCS_SIZE
+		+ 2L * (packet->name_len + packet->data_len + packet->to_len)
+		+ packet->list_size;
+}
+
+/* find the flow of the source of a packet in a class, making it if
+ * there is none */
+sched_flow_t *sched_flow(sched_t *sched, packet_t *packet, int class)
+{
+	int h = sched_hash(packet->header.src_ip, class);
+	sched_flow_t *flow = NULL;
+
+	for (flow = sched->table[h]; flow; flow = flow->chain) {
+		if ((flow->class == class)
+				&& (!memcmp(flow->ip, packet->header.src_ip, 4))) {
+			return flow;
+		}
+	}
+
+	flow = malloc(sizeof(sched_flow_t));
+	if (!flow) {
+		fprintf(stderr, "failed to malloc sched flow\n");
+		return NULL;
+	}
+	flow->packets = NULL;
+	init_queue(&flow->packets, sched_cmp_dummy, free_packet);
+	memcpy(flow->ip, packet->header.src_ip, 4);
+	flow->class = class;
+	flow->deficit = 0;
+	flow->started = FALSE;
+	flow->next = NULL;
+	flow->chain = sched->table[h];
+	sched->table[h] = flow;
+	return flow;
+}
+
+/* take an emptied flow out of the table and free it */
+void sched_flow_free(sched_t *sched, sched_flow_t *flow)
+{
+	sched_flow_t **link = &sched->table[sched_hash(flow->ip, flow->class)];
+
+	while (*link != flow) {
+		link = &(*link)->chain;
+	}
+	*link = flow->chain;
+	free_queue(flow->packets);
+	free(flow);
+}
+
+/* add a class that got packets to the end of the ring of classes */
+void sched_class_join(sched_t *sched, int class)
+{
+	sched_class_t *c = &sched->classes[class];
+
+	c->active = TRUE;
+	c->started = FALSE;
+	c->deficit = 0;
+	c->next = -1;
+	if (sched->tail >= 0) {
+		sched->classes[sched->tail].next = class;
+	} else {
+		sched->head = class;
+	}
+	sched->tail = class;
+}
+
+/* take the class at the head of the ring out, as it has no packets */
+void sched_class_leave(sched_t *sched)
+{
+	sched_class_t *c = &sched->classes[sched->head];
+
+	c->active = FALSE;
+	c->started = FALSE;
+	c->deficit = 0;
+	sched->head = c->next;
+	c->next = -1;
+	if (sched->head < 0) {
+		sched->tail = -1;
+	}
+}
+
+/* end the turn of the class at the head of the ring */
+void sched_class_rotate(sched_t *sched)
+{
+	int class = sched->head;
+	sched_class_t *c = &sched->classes[class];
+
+	c->started = FALSE;
+	if (sched->tail == class) {
+		return;
+	}
+	sched->head = c->next;
+	c->next = -1;
+	sched->classes[sched->tail].next = class;
+	sched->tail = class;
+}
+
+int sched_hash(unsigned char *ip, int class)
+{
+	unsigned long h = 2166136261UL;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		h = ((h ^ ip[i]) * 16777619UL) & 0xffffffffUL;
+	}
+	h = ((h ^ (unsigned long)class) * 16777619UL) & 0xffffffffUL;
+	return (int)((h ^ (h >> 16)) & (SCHED_BUCKETS - 1));
+}
+
+int sched_cmp_dummy(void *a, void *b)
+{
+	(void)a;
+	(void)b;
+	return 1;
+}
@@ -0,0 +1,121 @@
+/*
+ * The scheduler of the speaker queue.
+ *
+ * Control packets (user lists, logins and the like) go in a lane of
+ * their own that is always served first.  Everything else is put in one
+ * of four classes by the DSCP field of its IP header, and the classes
+ * share the speaker by deficit round robin, weighted in favour of the
+ * interactive ones.  Within a class, the packets of each source address
+ * form a flow, and the flows again take turns by deficit round robin, so
+ * that a few hosts pushing bulk data cannot hold up the others.
+ *
+ * The NAT workers schedule each of their two queues the same way.
+ *
+ * Nothing in here is locked, the owner keeps it under its queue lock.
+ */
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "../queue/queue.h"
+#include "../packet/packet.h"
+
+#define TRUE	1
+#define FALSE	0
+
+/* The classes, from the DSCP of a packet */
+#define SCHED_EXPEDITED	0	/* EF, AF4x and CS4 to CS7 */
+#define SCHED_ASSURED	1	/* AF1x to AF3x, CS2 and CS3 */
+#define SCHED_DEFAULT	2	/* Best effort, and anything unknown */
+#define SCHED_BULK		3	/* CS1 and lower effort */
+#define SCHED_CLASSES	4
+
+#define SCHED_QUANTUM	1024	/* Bytes a flow may send per turn */
+#define SCHED_BUCKETS	256		/* Chains of the flow table, a power of 2 */
+
+/*** Struct definitions **************************************************/
+
+/*
+ * The packets of one source address in one class.  It exists while it
+ * has packets, and takes its turn in the ring of its class.
+ */
+typedef struct sched_flow {
+	unsigned char ip[4];
+	int class;
+	queue_t *packets;
+	long deficit;				/* Bytes it may still send this turn */
+	int started;				/* Its quantum for this turn was added */
+	struct sched_flow *next;	/* The next flow in the ring of its class */
+	struct sched_flow *chain;	/* The next flow in its chain of the table */
+} sched_flow_t;
+
+typedef struct sched_class {
+	long quantum;				/* Bytes the class may send per turn */
+	long deficit;
+	int started;
+	sched_flow_t *head;			/* The flow whose turn it is */
+	sched_flow_t *tail;
+	int active;					/* The class is in the ring of classes */
+	int next;					/* The next class in the ring */
+} sched_class_t;
+
+typedef struct sched {
+	queue_t *control;			/* Served before any class */
+	sched_class_t classes[SCHED_CLASSES];
+	int head;					/* The class whose turn it is, -1 if none */
+	int tail;
+	sched_flow_t *table[SCHED_BUCKETS];
+	int count;					/* The packets held, control included */
+} sched_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate an empty scheduler.
+ *
+ * @return The new scheduler, NULL on failure.
+ */
+sched_t *new_sched();
+
+/**
+ * Free the scheduler, along with the packets it still holds.
+ *
+ * @param[in] sched: The scheduler to be free'd.
+ */
+void free_sched(sched_t *sched);
+
+/**
+ * Add a packet to its lane.  The packet is consumed.
+ *
+ * @param[in] sched:	The scheduler.
+ * @param[in] packet:	The packet.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the packet had to be dropped.
+ */
+int sched_push(sched_t *sched, packet_t *packet);
+
+/**
+ * Take the packet that is to be sent next.
+ *
+ * @param[in] sched: The scheduler.
+ *
+ * @return The packet, NULL if there are none.
+ */
+packet_t *sched_pop(sched_t *sched);
+
+/**
+ * Get the number of packets held by the scheduler.
+ *
+ * @param[in] sched: The scheduler.
+ */
+int sched_count(sched_t *sched);
+
+/**
+ * Get the class of a DSCP code point.
+ *
+ * @param[in] dscp: The upper six bits of the DSCP/ECN byte.
+ *
+ * @return One of the SCHED_ classes.
+ */
+int sched_class_of(int dscp);
+
+#endif
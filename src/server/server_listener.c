@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,13 +9,19 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 
 #include "server_listener.h"
 #include "users.h"
 #include "ipbinds.h"
+#include "listener_uring.h"
 #include "../packet/code.h"
+#include "../packet/serializer.h"
 #include "../hashset/fd_hashset.h"
 #include "../hashset/ip_hashset.h"
+#include "../clock/clock.h"
+#include "../log/log.h"
 
 /*** Macros **************************************************************/
 
@@ -22,14 +30,25 @@
 #define TRUE			1
 #define FALSE			0
 #define MAX_CLIENTS		(int) sizeof(long)
+#define READ_CHUNK		4096	/* Bytes asked for per recv */
+#define READ_CHUNKS		4		/* recvs per readable socket per pass */
 
 	
 
 /*** Helper Function Prototypes ******************************************/
 
 void listener_go(server_listener_t *listener);
+void listener_select_go(server_listener_t *listener);
+int listener_bind(server_listener_t *listener, int port);
+void listener_accept(server_listener_t *listener, int port_index);
+int listener_login(server_listener_t *listener, conn_t *conn);
+void listener_forget(server_listener_t *listener, int sd);
+int listen_cmp_dummy(void *a, void *b);
+void listen_dud_free(void *a);
+void listener_read(server_listener_t *listener, int sd);
+int listener_admit(server_listener_t *listener, conn_t *conn, 
+		packet_t *packet);
 int check_user_password(unsigned char *name, char *pw);
-char *listen_strdup(char *s);
 unsigned char *listen_ipdup(unsigned char *s);
 int l_is_server_address(unsigned char *ip, unsigned char *sip);
 
@@ -86,8 +105,10 @@ server_listener_t *new_server_listener(int *ports, int port_count, users_t *user
 		return NULL;
 	}
 	listener->ports = malloc(sizeof(int) * port_count);
+	listener->masters = malloc(sizeof(int) * port_count);
 	for (i = 0; i < port_count; i++) {
 		listener->ports[i] = ports[i];
+		listener->masters[i] = -1;
 	}
 	listener->port_count = port_count;
 	listener->run_status = TRUE;
@@ -95,17 +116,89 @@ server_listener_t *new_server_listener(int *ports, int port_count, users_t *user
 	pthread_mutex_init(listener->status_lock, NULL);
 	listener->users = users;
 	listener->speaker = speaker;
-	listener->time_stamp = (long)time(NULL);
-	listener->ip_timeout = 600; /* default: 10 minutes */
+	listener->conns = new_conn_table();
+	listener->pending = NULL;
+	init_queue(&listener->pending, listen_cmp_dummy, listen_dud_free);
+	listener->backlog = DEFAULT_BACKLOG;
+	listener->io_backend = IO_SELECT;
+	listener->uring = NULL;
+	listener->reuseport = FALSE;
+	listener->primary = TRUE;
+	listener->parked = 0;
+	listener->accept_after = 0;
+	listener->wake = new_outwake();
 
+	listener->alloc_lock = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(listener->alloc_lock, NULL);
 	listener->ip_allocator = new_address_allocator();
 	listener->mac_allocator = new_mac_list();
 
 	return listener;
 }
 
+/**
+ * Allocate another listener that shares the users, speaker and address
+ * allocators of primary, for running several listener threads on the
+ * same ports.  Both listeners are switched to binding with SO_REUSEPORT,
+ * so that the kernel spreads new connections over them.
+ *
+ * @param[in] primary: A listener made by new_server_listener.
+ *
+ * @return A pointer to the newly allocated datastructure. NULL on 
+ * failure.
+ */
+server_listener_t *new_server_listener_peer(server_listener_t *primary)
+{
+	int i;
+	server_listener_t *listener = NULL;
+
+	if (!primary) {
+		fprintf(stderr, "Error: no primary listener provided\n");
+		return NULL;
+	}
+
+	listener = malloc(sizeof(server_listener_t));
+	if (!listener) {
+		fprintf(stderr, "error mallocing listener\n");
+		return NULL;
+	}
+	listener->ports = malloc(sizeof(int) * primary->port_count);
+	listener->masters = malloc(sizeof(int) * primary->port_count);
+	for (i = 0; i < primary->port_count; i++) {
+		listener->ports[i] = primary->ports[i];
+		listener->masters[i] = -1;
+	}
+	listener->port_count = primary->port_count;
+	listener->run_status = TRUE;
+	listener->status_lock = malloc(sizeof(pthread_mutex_t));
+	pthread_mutex_init(listener->status_lock, NULL);
+	listener->users = primary->users;
+	listener->speaker = primary->speaker;
+	listener->conns = new_conn_table();
+	listener->pending = NULL;
+	init_queue(&listener->pending, listen_cmp_dummy, listen_dud_free);
+	listener->backlog = primary->backlog;
+	listener->io_backend = primary->io_backend;
+	listener->uring = NULL;
+	listener->reuseport = TRUE;
+	listener->primary = FALSE;
+	listener->parked = 0;
+	listener->accept_after = 0;
+	listener->wake = new_outwake();
+
+	/* shared with the primary, which frees them */
+	listener->alloc_lock = primary->alloc_lock;
+	listener->ip_allocator = primary->ip_allocator;
+	listener->mac_allocator = primary->mac_allocator;
+
+	primary->reuseport = TRUE;
+
+	return listener;
+}
+
 /**
  * Free the data structure allocated by new_server_listener.
+ * Peers must be free'd before their primary.
  * 
  * @param[in] listener: The listener structure to be free'd.
  */
@@ -118,6 +211,22 @@ void server_listener_free(server_listener_t *listener)
 		free(listener->ports);
 		listener->ports = NULL;
 	}
+	if (listener->masters) {
+		free(listener->masters);
+		listener->masters = NULL;
+	}
+	if (listener->conns) {
+		free_conn_table(listener->conns);
+		listener->conns = NULL;
+	}
+	if (listener->pending) {
+		free_queue(listener->pending);
+		listener->pending = NULL;
+	}
+	if (listener->wake) {
+		free_outwake(listener->wake);
+		listener->wake = NULL;
+	}
 	if (listener->status_lock) {
 		pthread_mutex_destroy(listener->status_lock);
 		free(listener->status_lock);
@@ -135,6 +244,19 @@ void server_listener_free(server_listener_t *listener)
 		listener->speaker = NULL;
 	}
 
+	if (!listener->primary) {
+		/* these belong to the primary listener */
+		listener->alloc_lock = NULL;
+		listener->ip_allocator = NULL;
+		listener->mac_allocator = NULL;
+	}
+
+	if (listener->alloc_lock) {
+		pthread_mutex_destroy(listener->alloc_lock);
+		free(listener->alloc_lock);
+		listener->alloc_lock = NULL;
+	}
+
 	if (listener->ip_allocator) {
 		free_address_allocator(listener->ip_allocator);
 		listener->ip_allocator = NULL;
@@ -198,291 +320,752 @@ int listener_running(server_listener_t *listener)
 /* the actual workhorse function */
 void listener_go(server_listener_t *listener)
 {
-	int master_socket = -1, new_socket = -1, i = 0;
+	int i = 0;
+
+	/* bind to the different ports for listening */
+	for (i = 0; i < listener->port_count; i++) {
+		listener->masters[i] = listener_bind(listener, listener->ports[i]);
+	}
+
+	/* Accept incoming connections */
+	printf("Waiting for incoming connections...\n");
+	if (listener->io_backend == IO_URING) {
+		if (!listener_uring_go(listener)) {
+			LOG_WARN(("io_uring is not available, falling back to select\n"));
+			listener_select_go(listener);
+		}
+	} else {
+		listener_select_go(listener);
+	}
+
+	for (i = 0; i < listener->port_count; i++) {
+		close(listener->masters[i]);
+		listener->masters[i] = -1;
+	}
+}
+
+/* serve the sockets by waiting on them with select */
+void listener_select_go(server_listener_t *listener)
+{
+	int i = 0;
 	int sd = 0;
-	int opt = TRUE;
-	int addrlen = -1;
 	int activity;
 	int max_sd;
-	struct sockaddr_in address;
+	int accepting;
 	fd_set readfds;
+	fd_set writefds;
 	int port_count;
-	queue_t *online_list2 = NULL;
-	node_t *n = NULL;
 	struct timeval tv;
-	unsigned char *ip_add = NULL;
-	unsigned char *mac_add = NULL;
-
-	packet_t *packet = NULL;
-	packet_t *p = NULL;
+	conn_t *conn = NULL;
 
 	port_count = listener->port_count;
 
-	/* bind to the different ports for listening */
-	for (i = 0; i < port_count; i++) {
-	/* Create master sockets */
-		if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
-			perror("socket failed\n");
-			exit(EXIT_FAILURE);
-		}
-		printf("Port %d selected\n", listener->ports[i]);
-		/* good habit, not necessary: set master socket to allow multiple
-		 * connections/
-		 */
-		if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0) {
-			perror("setsockopt\n");
-			exit(EXIT_FAILURE);
-		}
-	
-		address.sin_family = AF_INET;
-		address.sin_addr.s_addr = htonl(INADDR_ANY);
-		address.sin_port = htons(listener->ports[i]);
-	
-		/* Bind */
-		if (bind(master_socket, (struct sockaddr *)&address, 
-					sizeof(address)) < 0) {
-			perror("bind failed\n");
-			exit(EXIT_FAILURE);
-		}
-		printf("Bind to %d done\n", listener->ports[i]);
-	
-		/* listen */
-		if (listen(master_socket, 3) < 0) {
-			perror("listen\n");
-			exit(EXIT_FAILURE);
-		}
-
-		listener->ports[i] = master_socket;
-	}
-
-
-	/* Accept incoming connections */
-	printf("Waiting for incoming connections...\n");
-	addrlen = sizeof(address);
 	while (listener_running(listener)) {
-		
-		if (((long)time(NULL) - listener->time_stamp) > listener->ip_timeout) {
-			listener->time_stamp = (long)time(NULL);
-			refresh_ip_binds(listener->speaker);
-		}
 
 		/* clear the socket set */
 		FD_ZERO(&readfds);
+		FD_ZERO(&writefds);
 
+		/* other threads say so when output waits for a socket */
 		max_sd = 0;
-		for (i = 0; i < port_count; i++) {
-		/* add masters for listening */
-			FD_SET(listener->ports[i], &readfds);
-			if (max_sd < listener->ports[i]) {
-				max_sd = listener->ports[i];
+		if (listener->wake) {
+			FD_SET(listener->wake->fd, &readfds);
+			max_sd = listener->wake->fd;
+		}
+		/* add masters for listening, unless out of fds */
+		accepting = listener_accepting(listener);
+		for (i = 0; (accepting) && (i < port_count); i++) {
+			FD_SET(listener->masters[i], &readfds);
+			if (max_sd < listener->masters[i]) {
+				max_sd = listener->masters[i];
 			}
 		}
 
-		/* all sockets currently opened added to set */
-		online_list2 = get_fds(listener->users);
-		for (n = online_list2->head; n; n = n->next) {
-			sd = (int)((long)n->data);
-			if (sd <= 0) {
-				printf("this shouldn't be possible when translating a name to an sd.\n");
+		/* all sockets opened by this thread added to set */
+		for (sd = 0; sd <= listener->conns->max_fd; sd++) {
+			conn = conn_table_get(listener->conns, sd);
+			if (!conn) {
 				continue;
 			}
-			FD_SET(sd, &readfds);
-
+			if (users_has_output(listener->users, sd)) {
+				FD_SET(sd, &writefds);
+			}
 			if (max_sd < sd) {
 				max_sd = sd;
 			}
+			/* a parked socket is left unread, to push back */
+			if (!conn->parked) {
+				FD_SET(sd, &readfds);
+			}
 		}
-		free_queue(online_list2);
-		online_list2 = NULL;
 
 		/* ret	 = select(nfds, readfds, writefds, exceptfds, timeout); */
-		tv.tv_sec = 1;
+		/* don't wait while there are logins left to send */
+		tv.tv_sec = get_node_count(listener->pending) ? 0 : 1;
 		tv.tv_usec = 0;
-		activity = select(max_sd + 1, &readfds, NULL, NULL, &tv);
+		if ((!accepting) && (tv.tv_sec)) {
+			tv.tv_sec = 0;
+			tv.tv_usec = ACCEPT_REST_MS * 1000;
+		}
+		if (listener->parked) {
+			tv.tv_sec = 0;
+			tv.tv_usec = PARK_RETRY_MS * 1000;
+		}
+		activity = select(max_sd + 1, &readfds, &writefds, NULL, &tv);
 
 		if ((activity < 0) && (errno != EINTR)) {
-			printf("select error\n");
+			LOG_ERROR(("select error\n"));
 		}
-		if (activity == 0) {
+		if (activity <= 0) {
+			listener_login_pending(listener);
+			listener_unpark(listener);
 			continue;
 		}
 
-		online_list2 = get_fds(listener->users);
-		
-		for (i = 0; i < port_count; i++) {
+		if ((listener->wake) && (FD_ISSET(listener->wake->fd, &readfds))) {
+			listener_woken(listener);
+		}
+
+		/* IO on other sockets, before accepting adds new ones */
+		for (sd = 0; sd <= listener->conns->max_fd; sd++) {
+			if ((conn_table_get(listener->conns, sd)) && (FD_ISSET(sd, &writefds))) {
+				users_flush(listener->users, sd);
+			}
+			if ((conn_table_get(listener->conns, sd)) && (FD_ISSET(sd, &readfds))) {
+				listener_read(listener, sd);
+			}
+		}
+
+		for (i = 0; (accepting) && (i < port_count); i++) {
 			/* master socket, => incoming connection */
-			if (FD_ISSET(listener->ports[i], &readfds)) {
-				if ((new_socket = accept(listener->ports[i], 
-								(struct sockaddr *)&address,
-								(socklen_t *)&addrlen)) < 0) {
-					perror("accept\n");
-					exit(EXIT_FAILURE);
-				}
-
-				/* Inform user of socket number - useful in send 
-				* and receive actions */
-				printf("New connection: \nsocket fd: \t%d\nip: \t%s\nport:\t%d\n",
-						new_socket, inet_ntoa(address.sin_addr), 
-						ntohs(address.sin_port));
-
-				/* add to users */
-				add_connection(listener->users, new_socket);
-
-				if (i == 0) {
-					/* internal user */
-					/* generate ip */
-					ip_add = allocate_address(listener->ip_allocator);
-
-					/* check if ip available */
-					while (!login_connection(listener->users, new_socket, ip_add)) {
-						free(ip_add);
-						ip_add = allocate_address(listener->ip_allocator);
-					}
-
-					/* generate mac */
-					mac_add = gen_mac(listener->mac_allocator);
-					packet = new_packet(LOGIN, ip_add, NULL, ip_add, 8001, 8001);
-					packet->header.dst_mac[0] = mac_add[0];
-					packet->header.dst_mac[1] = mac_add[1];
-					packet->header.dst_mac[2] = mac_add[2];
-					packet->header.dst_mac[3] = mac_add[3];
-					packet->header.dst_mac[4] = mac_add[4];
-					packet->header.dst_mac[5] = mac_add[5];
-
-					/* send to user */
-					send_packet(packet, new_socket);
-					free_packet(packet);
-					packet = NULL;
-					free(ip_add);
-					ip_add = NULL;
-					push_user_list(listener->speaker);
-					
-				} else {
-					/* external user */
-					/* generate mac */
-					mac_add = gen_mac(listener->mac_allocator);
-					packet = new_packet(LOGIN, NULL, NULL, NULL, 8001, 8001);
-					packet->header.dst_mac[0] = mac_add[0];
-					packet->header.dst_mac[1] = mac_add[1];
-					packet->header.dst_mac[2] = mac_add[2];
-					packet->header.dst_mac[3] = mac_add[3];
-					packet->header.dst_mac[4] = mac_add[4];
-					packet->header.dst_mac[5] = mac_add[5];
-
-					/* send to user */
-					send_packet(packet, new_socket);
-					free_packet(packet);
-					packet = NULL;
-					/*
-					free(mac_add);
-					*/
-					mac_add = NULL;
-				}
+			if (FD_ISSET(listener->masters[i], &readfds)) {
+				listener_accept(listener, i);
 			}
 		}
 
-		/* IO on other sockets */
-		for (n = online_list2->head; n; n = n->next) {
-			sd = (int)((long)n->data);
-			if (sd <= 0) {
-				printf("this shouldn't be possible when translating a name to an sd.\n");
+		listener_login_pending(listener);
+		listener_unpark(listener);
+	}
+}
+
+/* create a listening socket for the given port */
+int listener_bind(server_listener_t *listener, int port)
+{
+	int master_socket = -1;
+	int opt = TRUE;
+	struct sockaddr_in address;
+
+	/* Create master sockets */
+	if ((master_socket = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
+		perror("socket failed\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Port %d selected\n", port);
+	/* good habit, not necessary: set master socket to allow multiple
+	 * connections/
+	 */
+	if (setsockopt(master_socket, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) < 0) {
+		perror("setsockopt\n");
+		exit(EXIT_FAILURE);
+	}
+	/* several listener threads each bind their own socket to the port,
+	 * and the kernel spreads the new connections between them */
+	if ((listener->reuseport) && 
+			(setsockopt(master_socket, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) < 0)) {
+		perror("setsockopt\n");
+		exit(EXIT_FAILURE);
+	}
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+
+	/* Bind */
+	if (bind(master_socket, (struct sockaddr *)&address, 
+				sizeof(address)) < 0) {
+		perror("bind failed\n");
+		exit(EXIT_FAILURE);
+	}
+	printf("Bind to %d done\n", port);
+
+	/* listen */
+	if (listen(master_socket, listener->backlog) < 0) {
+		perror("listen\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* so that the accept loop can drain it until EAGAIN */
+	if (fcntl(master_socket, F_SETFL, 
+				fcntl(master_socket, F_GETFL, 0) | O_NONBLOCK) < 0) {
+		perror("fcntl\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return master_socket;
+}
+
+/* accept every connection waiting on the master socket of the given
+ * port, leaving the LOGIN work for listener_login_pending */
+void listener_accept(server_listener_t *listener, int port_index)
+{
+	int new_socket = -1;
+	socklen_t addrlen;
+	struct sockaddr_in address;
+
+	while (TRUE) {
+		addrlen = sizeof(address);
+		new_socket = accept4(listener->masters[port_index], 
+				(struct sockaddr *)&address, &addrlen, 
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (new_socket < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				/* drained */
+				break;
+			} else if ((errno == EINTR) || (errno == ECONNABORTED)) {
 				continue;
 			}
-			if (FD_ISSET(sd, &readfds)) {
-				/* boom */
-				packet = NULL;
-				packet = receive_packet(sd);
-				if (!packet) {
-					remove_channel(listener->users, sd);
-					push_user_list(listener->speaker);
-					/*
-					close(sd);
-					*/
-				} else if (packet->code == QUIT) {
-					remove_channel(listener->users, sd);
-					push_user_list(listener->speaker);
-					close(sd);
-				} else if (packet->code == SEND) {
-					add_packet_to_queue(listener->speaker, packet);
-					packet = NULL;
-				} else if (packet->code == ECHO) {
-					send_packet(packet, sd);
-				} else if (packet->code == BROADCAST) {
-					broadcast(listener->speaker, packet);
-				} else if (packet->code == LOGIN) {
-					printf("got login packet\n");
-
-					if (is_private_address(packet->header.src_ip)) {
-						printf("Invalid external ip address\n");
-						p = new_packet(SEND, null_address, listen_strdup("denial"), packet->header.src_ip, 8002, packet->header.src_port);
-						send_packet(p, sd);
-						free_packet(p);
-						p = NULL;
-					} else if (l_is_server_address(packet->header.src_ip, listener->speaker->serv_ip)) {
-						printf("Someone with server ip address tried to connect\n");
-						p = new_packet(SEND, null_address, listen_strdup("denial"), packet->header.src_ip, 8002, packet->header.src_port);
-						send_packet(p, sd);
-						free_packet(p);
-						p = NULL;
-					} else if ((check_user_password(packet->header.src_ip, packet->data)) && 
-							login_connection(listener->users, sd, packet->header.src_ip)) {
-						push_user_list(listener->speaker);
-						/* !!!!!!!!!!!!!! */
-						p = new_packet(SEND, null_address, listen_strdup("accept"), packet->header.src_ip, 8002, packet->header.src_port);
-						send_packet(p, sd);
-						free_packet(p);
-						p = NULL;
-					} else {
-						/* !!!!!!!!!!!!!! */
-						p = new_packet(SEND, null_address, listen_strdup("denial"), packet->header.src_ip, 8002, packet->header.src_port);
-						send_packet(p, sd);
-						free_packet(p);
-						p = NULL;
-						close(sd);
-						printf("closed\n");
-						fd_hashset_remove(listener->users->sockets, sd);
-						printf("removed\n");
-					}
-
-				} else if (packet->code == GET_ULIST) {
-					add_packet_to_queue(listener->speaker, packet);
-					packet = NULL;
-				} else {
-					fprintf(stderr, "Packet with code %d came.  this is weird\n", 
-							packet->code);
-				}
-				if (packet) {
-					free_packet(packet);
-				}
-			}
+			/* out of fds or memory: leave the rest in the backlog 
+			 * until some are free'd */
+			listener_accept_failed(listener, port_index, errno);
+			break;
 		}
-		free_queue(online_list2);
-		online_list2 = NULL;
+
+		/* Inform user of socket number - useful in send 
+		* and receive actions */
+		LOG_INFO(("New connection: \nsocket fd: \t%d\nip: \t%s\nport:\t%d\n",
+				new_socket, inet_ntoa(address.sin_addr), 
+				ntohs(address.sin_port)));
+
+		listener_register(listener, new_socket, port_index);
 	}
 }
 
-/* at this point not implemented */
-int check_user_password(unsigned char *name, char *pw)
+/**
+ * Take on a newly accepted socket: add it to the users and to the
+ * connections of this thread, and queue it for its LOGIN packet.  The
+ * socket is closed if that fails, or if it is too high for select to
+ * wait on while the select backend runs.
+ *
+ * @param[in] listener:		The listener that accepted the socket.
+ * @param[in] sd:			The socket file descriptor.
+ * @param[in] port_index:	The index of the port it was accepted on.
+ *
+ * @return The new connection, NULL on failure.
+ */
+conn_t *listener_register(server_listener_t *listener, int sd, int port_index)
 {
-	if ((char *)name == pw) {
+	conn_t *conn = NULL;
+	struct sockaddr_in peer;
+	socklen_t len = sizeof(peer);
+
+	/* select can't wait on it */
+	if ((!listener->uring) && (sd >= FD_SETSIZE)) {
+		LOG_WARN(("socket %d is past FD_SETSIZE, closing it\n", sd));
+		close(sd);
+		return NULL;
+	}
+	conn = conn_table_add(listener->conns, sd, port_index);
+	if ((!conn) || (!add_connection(listener->users, sd, listener->wake))) {
+		conn_table_remove(listener->conns, sd);
+		close(sd);
+		return NULL;
+	}
+	conn->login_pending = TRUE;
+	/* until an internal user is given its own, the remote end it is */
+	if ((getpeername(sd, (struct sockaddr *)&peer, &len) == 0) 
+			&& (peer.sin_family == AF_INET)) {
+		memcpy(conn->peer, &peer.sin_addr.s_addr, 4);
+	}
+	admission_conn_init(listener->speaker->admit, &conn->bucket);
+	insert_node(listener->pending, (void *)((long)sd));
+	return conn;
+}
+
+/**
+ * Take note of an accept that failed.  If it failed for want of fds or
+ * memory, accepting rests for ACCEPT_REST_MS, as the master stays
+ * readable until some are free'd and would be retried over and over.
+ *
+ * @param[in] listener:		The listener.
+ * @param[in] port_index:	The index of the port accepted on.
+ * @param[in] err:			The errno of the accept.
+ *
+ * @return TRUE(1) if accepting rests, FALSE(0) if it may go on.
+ */
+int listener_accept_failed(server_listener_t *listener, int port_index, 
+		int err)
+{
+	LOG_ERROR(("accept on port %d failed: %s\n", 
+			listener->ports[port_index], strerror(err)));
+	if ((err != EMFILE) && (err != ENFILE) && (err != ENOBUFS) && 
+			(err != ENOMEM)) {
+		return FALSE;
+	}
+	/* 0 means not resting */
+	listener->accept_after = (clock_millis() + ACCEPT_REST_MS) | 1;
+	return TRUE;
+}
+
+/**
+ * Check whether the listener accepts connections, or rests after
+ * running out of fds.
+ *
+ * @param[in] listener: The listener.
+ *
+ * @return TRUE(1) if it accepts, FALSE(0) if it rests.
+ */
+int listener_accepting(server_listener_t *listener)
+{
+	if (!listener->accept_after) {
 		return TRUE;
+	}
+	if ((long)(clock_millis() - listener->accept_after) < 0) {
+		return FALSE;
+	}
+	listener->accept_after = 0;
+	return TRUE;
+}
+
+/**
+ * Send the LOGIN packets of up to LOGIN_BATCH accepted connections.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_login_pending(server_listener_t *listener)
+{
+	int i;
+	int sd;
+	int internal = 0;
+	conn_t *conn = NULL;
+
+	for (i = 0; (i < LOGIN_BATCH) && (get_node_count(listener->pending)); i++) {
+		sd = (int)((long)pop_first(listener->pending));
+		conn = conn_table_get(listener->conns, sd);
+		if ((!conn) || (!conn->login_pending)) {
+			/* went away before we got to it */
+			continue;
+		}
+		conn->login_pending = FALSE;
+		if ((listener_login(listener, conn)) && (conn->port_index == 0)) {
+			internal++;
+		}
+	}
+
+	/* one list for the whole batch */
+	if (internal) {
+		push_user_list(listener->speaker);
+	}
+}
+
+/* allocate addresses for a new connection and send it its LOGIN packet.
+ * Returns FALSE if the connection had to be dropped instead. */
+int listener_login(server_listener_t *listener, conn_t *conn)
+{
+	unsigned char *mac_add = conn->mac;
+	packet_t *packet = NULL;
+	int allocated;
+
+	if (!gen_mac(listener->mac_allocator, mac_add)) {
+		listener_drop(listener, conn->fd, TRUE);
+		return FALSE;
+	}
+	conn->has_mac = TRUE;
+
+	if (conn->port_index == 0) {
+		/* internal user */
+		/* take an ip from the pool, which only hands out free ones */
+		pthread_mutex_lock(listener->alloc_lock);
+		allocated = allocate_address(listener->ip_allocator, conn->ip);
+		pthread_mutex_unlock(listener->alloc_lock);
+		if (!allocated) {
+			LOG_WARN(("address pool exhausted, dropping %d\n", conn->fd));
+			listener_drop(listener, conn->fd, TRUE);
+			return FALSE;
+		}
+		conn->has_ip = TRUE;
+		memcpy(conn->peer, conn->ip, 4);
+		memcpy(conn->src, conn->ip, 4);
+		conn->has_src = TRUE;
+		if (!login_connection(listener->users, conn->fd, conn->ip)) {
+			LOG_WARN(("pool address already online, dropping %d\n", 
+					conn->fd));
+			listener_drop(listener, conn->fd, TRUE);
+			return FALSE;
+		}
+
+		packet = new_packet(LOGIN, conn->ip, NULL, conn->ip, 8001, 8001);
+		packet->header.dst_mac[0] = mac_add[0];
+		packet->header.dst_mac[1] = mac_add[1];
+		packet->header.dst_mac[2] = mac_add[2];
+		packet->header.dst_mac[3] = mac_add[3];
+		packet->header.dst_mac[4] = mac_add[4];
+		packet->header.dst_mac[5] = mac_add[5];
+
+		/* send to user */
+		listener_send(listener, packet, conn->fd);
+		free_packet(packet);
+		packet = NULL;
+		
 	} else {
-		return TRUE;
+		/* external user */
+		packet = new_packet(LOGIN, NULL, NULL, NULL, 8001, 8001);
+		packet->header.dst_mac[0] = mac_add[0];
+		packet->header.dst_mac[1] = mac_add[1];
+		packet->header.dst_mac[2] = mac_add[2];
+		packet->header.dst_mac[3] = mac_add[3];
+		packet->header.dst_mac[4] = mac_add[4];
+		packet->header.dst_mac[5] = mac_add[5];
+
+		/* send to user */
+		listener_send(listener, packet, conn->fd);
+		free_packet(packet);
+		packet = NULL;
 	}
+	return TRUE;
 }
 
-/* Ansi doesn't define strdup */
-char *listen_strdup(char *s)
+/* read whatever a socket served by this thread has for us, without
+ * waiting for the rest of a packet, and handle the complete ones */
+void listener_read(server_listener_t *listener, int sd)
 {
-	char *c = malloc(strlen(s) + 1);
-	int i = 0;
-	int j = 0;
+	char buffer[READ_CHUNK];
+	conn_t *conn = conn_table_get(listener->conns, sd);
+	int r;
+	int i;
 
-	while ((c[i++] = s[j++]));
+	/* a few chunks at most, so a fast sender can't starve the others */
+	for (i = 0; i < READ_CHUNKS; i++) {
+		r = recv(sd, buffer, READ_CHUNK, MSG_DONTWAIT);
+		if (r > 0) {
+			if (!conn_append(conn, buffer, r)) {
+				listener_drop(listener, sd, TRUE);
+				return;
+			}
+			if (r < READ_CHUNK) {
+				break;
+			}
+		} else if ((r < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+			break;
+		} else if ((r < 0) && (errno == EINTR)) {
+			continue;
+		} else {
+			/* closed by the peer, or broken */
+			listener_drop(listener, sd, TRUE);
+			return;
+		}
+	}
 
-	return c;
+	listener_consume(listener, conn);
+}
+
+/**
+ * Decode and handle every complete packet in the receive buffer of a
+ * connection.  The connection may be gone by the time this returns.
+ *
+ * The decoder has two states, kept in conn->need: waiting for the
+ * header and size of the next frame, and waiting for the rest of a frame
+ * of known size.  Nothing is parsed until need bytes have arrived.
+ *
+ * @param[in] listener:	The listener serving the connection.
+ * @param[in] conn:		The connection that received more bytes.
+ */
+void listener_consume(server_listener_t *listener, conn_t *conn)
+{
+	int sd = conn->fd;
+	unsigned int gen = conn->gen;
+	int size;
+	int verdict;
+	packet_t *packet = NULL;
+
+	while (conn->rlen >= conn->need) {
+		size = packet_frame_size(conn->rbuf, conn->rlen);
+		if (size == 0) {
+			conn->need = PACKET_PREFIX_SIZE;
+			return;
+		} else if (size > conn->rlen) {
+			conn->need = size;
+			return;
+		}
+
+		if ((size > 0) && (!packet_frame_intact(conn->rbuf, size))) {
+			LOG_WARN(("damaged frame on %d, dropping it\n", sd));
+			conn_consume(conn, size);
+			conn->need = 0;
+			continue;
+		}
+		packet = (size > 0) ? packet_from_frame(conn->rbuf) : NULL;
+		if (!packet) {
+			LOG_WARN(("invalid frame on %d, dropping the connection\n", sd));
+			listener_drop(listener, sd, TRUE);
+			return;
+		}
+		verdict = listener_admit(listener, conn, packet);
+		if (verdict == ADMIT_DEFER) {
+			/* the frame stays put until listener_unpark */
+			free_packet(packet);
+			return;
+		}
+		conn_consume(conn, size);
+		conn->need = 0;
+		if (verdict == ADMIT_DROP) {
+			free_packet(packet);
+			continue;
+		}
+		listener_handle(listener, sd, packet);
+
+		/* the packet may have logged the connection out */
+		conn = conn_table_get(listener->conns, sd);
+		if ((!conn) || (conn->gen != gen)) {
+			return;
+		}
+	}
+}
+
+/**
+ * Retry the deferred work of the connections of this thread, once the
+ * queues have drained below their cap.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_unpark(server_listener_t *listener)
+{
+	int sd;
+	conn_t *conn = NULL;
+
+	if ((!listener->parked) || 
+			(admission_overloaded(listener->speaker->admit))) {
+		return;
+	}
+	/* whatever is still deferred afterwards counts itself in again */
+	listener->parked = 0;
+	for (sd = 0; sd <= listener->conns->max_fd; sd++) {
+		conn = conn_table_get(listener->conns, sd);
+		if ((conn) && (conn->parked)) {
+			conn->parked = FALSE;
+			listener_consume(listener, conn);
+		}
+	}
+}
+
+/**
+ * Handle a packet received on a socket served by this thread.  The
+ * packet is consumed.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] sd:		The socket the packet came in on.
+ * @param[in] packet:	The packet.
+ */
+void listener_handle(server_listener_t *listener, int sd, packet_t *packet)
+{
+	packet_t *p = NULL;
+	conn_t *conn = NULL;
+	int class;
+	int verdict;
+
+	if (packet->code == QUIT) {
+		listener_drop(listener, sd, TRUE);
+	} else if (packet->code == SEND) {
+		verdict = policy_decide(listener->speaker->policy, 
+				packet->header.src_ip, packet->header.dst_ip, 
+				listener->speaker->serv_ip);
+		if (verdict == VERDICT_FORWARD) {
+			/* nothing to translate, so it is written to the
+			 * destination from here, without waiting for room */
+			users_send_packet(listener->users, packet);
+		} else if (verdict != VERDICT_DROP) {
+			/* straight to the worker owning the binding */
+			nat_submit(listener->speaker->nat, packet, verdict);
+			packet = NULL;
+		}
+	} else if (packet->code == ECHO) {
+		listener_send(listener, packet, sd);
+	} else if (packet->code == BROADCAST) {
+		broadcast(listener->speaker, packet);
+		packet = NULL;
+	} else if (packet->code == LOGIN) {
+		LOG_DEBUG(("got login packet\n"));
+
+		class = policy_lookup(listener->speaker->policy, 
+				packet->header.src_ip);
+		if ((class != POLICY_EXTERNAL) && (class != POLICY_NO_NAT)) {
+			LOG_INFO(("Invalid external ip address\n"));
+			p = new_packet(SEND, null_address, "denial", packet->header.src_ip, 8002, packet->header.src_port);
+			listener_send(listener, p, sd);
+			free_packet(p);
+			p = NULL;
+		} else if (l_is_server_address(packet->header.src_ip, listener->speaker->serv_ip)) {
+			LOG_INFO(("Someone with server ip address tried to connect\n"));
+			p = new_packet(SEND, null_address, "denial", packet->header.src_ip, 8002, packet->header.src_port);
+			listener_send(listener, p, sd);
+			free_packet(p);
+			p = NULL;
+		} else if ((check_user_password(packet->header.src_ip, packet->data)) && 
+				login_connection(listener->users, sd, packet->header.src_ip)) {
+			/* from now on its packets must come from that address */
+			conn = conn_table_get(listener->conns, sd);
+			if (conn) {
+				memcpy(conn->src, packet->header.src_ip, 4);
+				conn->has_src = TRUE;
+			}
+			p = new_packet(SEND, null_address, "accept", packet->header.src_ip, 8002, packet->header.src_port);
+			listener_send(listener, p, sd);
+			free_packet(p);
+			p = NULL;
+			push_user_list(listener->speaker);
+		} else {
+			p = new_packet(SEND, null_address, "denial", packet->header.src_ip, 8002, packet->header.src_port);
+			listener_send(listener, p, sd);
+			free_packet(p);
+			p = NULL;
+			listener_drop(listener, sd, TRUE);
+		}
+
+	} else if (packet->code == GET_ULIST) {
+		add_packet_to_queue(listener->speaker, packet);
+		packet = NULL;
+	} else {
+		LOG_WARN(("Packet with code %d came.  this is weird\n", 
+				packet->code));
+	}
+	if (packet) {
+		free_packet(packet);
+	}
+}
+
+/**
+ * Send a packet to a socket served by this thread.  With the io_uring
+ * backend the send is queued on the ring and goes out with the next
+ * submit, if nothing else is being written to the socket.  Otherwise it
+ * is written straight away, as far as the socket has room for it, or
+ * waits behind what is being written.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] packet:	The packet to send.  It is not consumed.
+ * @param[in] sd:		The socket to send it over.
+ */
+void listener_send(server_listener_t *listener, packet_t *packet, int sd)
+{
+	char *frame = NULL;
+	int size;
+
+	frame = serialize(packet, &size);
+	if (!frame) {
+		return;
+	}
+	if ((listener->uring) && (listener_uring_send(listener, frame, size, sd))) {
+		return;
+	}
+	users_send_frame(listener->users, sd, frame, size);
+	free(frame);
 }
 
+/**
+ * Take the wakeups other threads sent the loop of a listener, when
+ * output started to wait for one of its sockets.  The select backend
+ * looks at every socket anyway, so the sockets it was told of are
+ * only cleared.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_woken(server_listener_t *listener)
+{
+	uint64_t count;
+
+	/* the eventfd is non-blocking, and one read clears it */
+	if (read(listener->wake->fd, &count, sizeof(count)) < 0) {
+		return;
+	}
+	if (!listener->uring) {
+		outwake_take(listener->wake, NULL, NULL, NULL);
+	}
+}
+
+/**
+ * Forget a connection that went away, and tell the other users.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] sd:		The socket of the connection.
+ * @param[in] close_fd:	Also close the socket.
+ */
+void listener_drop(server_listener_t *listener, int sd, int close_fd)
+{
+	remove_channel(listener->users, sd);
+	listener_forget(listener, sd);
+	push_user_list(listener->speaker);
+	if (close_fd) {
+		/* the last of its sends go before the socket does */
+		if (listener->uring) {
+			listener_uring_flush(listener);
+		}
+		/* ends a multishot receive still armed on the socket */
+		shutdown(sd, SHUT_RDWR);
+		close(sd);
+	}
+}
+
+/* remove a connection from the table of this thread, giving back its
+ * mac and ip addresses */
+void listener_forget(server_listener_t *listener, int sd)
+{
+	conn_t *conn = conn_table_get(listener->conns, sd);
+
+	if ((conn) && (conn->has_mac)) {
+		release_mac(listener->mac_allocator, conn->mac);
+	}
+	if ((conn) && (conn->has_ip)) {
+		pthread_mutex_lock(listener->alloc_lock);
+		release_address(listener->ip_allocator, conn->ip);
+		pthread_mutex_unlock(listener->alloc_lock);
+	}
+	conn_table_remove(listener->conns, sd);
+}
+
+/* decide whether a packet decoded from a connection is taken in.  Only
+ * the packets that end up queued are held to the cap, logging in or out
+ * is never refused, and anything else must carry the source address of
+ * the connection */
+int listener_admit(server_listener_t *listener, conn_t *conn, 
+		packet_t *packet)
+{
+	admission_t *admit = listener->speaker->admit;
+	int queued;
+	int verdict;
+
+	if ((packet->code == LOGIN) || (packet->code == QUIT)) {
+		return ADMIT_PASS;
+	}
+	/* its source is that of the connection, or it is not taken in */
+	if ((!conn->has_src) || (memcmp(packet->header.src_ip, conn->src, 4))) {
+		LOG_DEBUG(("wrong source on a packet from %d\n", conn->fd));
+		admission_count_drop(admit, DROP_SPOOFED);
+		return ADMIT_DROP;
+	}
+	queued = (packet->code != ECHO);
+	verdict = admission_check(admit, &conn->bucket, conn->peer, queued);
+	if ((verdict == ADMIT_DEFER) && (conn->rlen > ADMIT_PARK_LIMIT)) {
+		/* with io_uring the bytes keep coming, so it can't wait forever */
+		admission_count_drop(admit, DROP_QUEUE_FULL);
+		verdict = ADMIT_DROP;
+	}
+	if ((verdict == ADMIT_DEFER) && (!conn->parked)) {
+		conn->parked = TRUE;
+		listener->parked++;
+	}
+	if (verdict == ADMIT_DROP) {
+		LOG_DEBUG(("not taking in a packet from %d\n", conn->fd));
+	}
+	return verdict;
+}
+
+/* at this point not implemented */
+int check_user_password(unsigned char *name, char *pw)
+{
+	if ((char *)name == pw) {
+		return TRUE;
+	} else {
+		return TRUE;
+	}
+}
 
 unsigned char *listen_ipdup(unsigned char *s)
 {
@@ -506,3 +1089,22 @@ int l_is_server_address(unsigned char *ip, unsigned char *sip)
 	}
 	return TRUE;
 }
+
+int listen_cmp_dummy(void *a, void *b)
+{
+	if ((long)a == (long)b) {
+		return 1;
+	} else {
+		return 1;
+	}
+}
+
+/* the pending queue holds fds, not pointers */
+void listen_dud_free(void *a)
+{
+	if ((long)a & 0) {
+		return;
+	} else {
+		return;
+	}
+}
@@ -4,25 +4,47 @@
 #include <pthread.h>
 #include "server_speaker.h"
 #include "users.h"
+#include "connections.h"
 #include "../address/address_alloc.h"
 #include "../address/macs.h"
 
 #define TRUE	1
 #define FALSE	0
 
+#define DEFAULT_BACKLOG	128	/* The default listen backlog per port */
+#define LOGIN_BATCH		64	/* Logins completed per pass of the loop */
+#define PARK_RETRY_MS	10	/* How often deferred work is retried */
+#define ACCEPT_REST_MS	100	/* How long accepting rests when out of fds */
+
+#define IO_SELECT	0	/* Wait on the sockets with select(2) */
+#define IO_URING	1	/* Keep receives in flight with io_uring */
+
 /*** Struct definitions **************************************************/
 
 typedef struct listener {
 	int *ports;
+	int *masters;				/* The listening socket of each port */
 	int port_count;
 	int run_status;
 	pthread_mutex_t *status_lock;
 	users_t *users;
 	server_speaker_t *speaker;
+	conn_table_t *conns;		/* The connections this thread accepted */
+	queue_t *pending;			/* fds still waiting for their LOGIN */
+	int backlog;				/* The listen backlog of the ports */
+	int io_backend;				/* IO_SELECT or IO_URING */
+	struct listener_uring *uring;	/* Set while the io_uring backend runs */
+	int reuseport;				/* Bind the ports with SO_REUSEPORT */
+	int primary;				/* Owns the allocators */
+	int parked;					/* Connections with deferred work, at most */
+	unsigned long accept_after;	/* The clock_millis accepting rests until,
+								 * after running out of fds, 0 if it does
+								 * not */
+	outwake_t *wake;			/* Other threads wake the loop with, when
+								 * output waits for a socket */
+	pthread_mutex_t *alloc_lock;
 	address_alloc_ptr ip_allocator;
 	mac_list_t *mac_allocator;
-	long time_stamp;
-	long ip_timeout;
 } server_listener_t;
 
 /*** Function Prototypes *************************************************/
@@ -43,8 +65,22 @@ typedef struct listener {
 server_listener_t *new_server_listener(int *ports, int port_count, users_t *users, 
 		server_speaker_t *speaker);
 
+/**
+ * Allocate another listener that shares the users, speaker and address
+ * allocators of primary, for running several listener threads on the
+ * same ports.  Both listeners are switched to binding with SO_REUSEPORT,
+ * so that the kernel spreads new connections over them.
+ *
+ * @param[in] primary: A listener made by new_server_listener.
+ *
+ * @return A pointer to the newly allocated datastructure. NULL on 
+ * failure.
+ */
+server_listener_t *new_server_listener_peer(server_listener_t *primary);
+
 /**
  * Free the data structure allocated by new_server_listener.
+ * Peers must be free'd before their primary.
  * 
  * @param[in] listener: The listener structure to be free'd.
  */
@@ -76,4 +112,117 @@ void listener_stop(server_listener_t *listener);
  */
 int listener_running(server_listener_t *listener);
 
+/*
+ * The functions below are shared by the select and io_uring backends,
+ * and must only be called from the thread running the listener.
+ */
+
+/**
+ * Take on a newly accepted socket: add it to the users and to the
+ * connections of this thread, and queue it for its LOGIN packet.  The
+ * socket is closed if that fails, or if it is too high for select to
+ * wait on while the select backend runs.
+ *
+ * @param[in] listener:		The listener that accepted the socket.
+ * @param[in] sd:			The socket file descriptor.
+ * @param[in] port_index:	The index of the port it was accepted on.
+ *
+ * @return The new connection, NULL on failure.
+ */
+conn_t *listener_register(server_listener_t *listener, int sd, int port_index);
+
+/**
+ * Take note of an accept that failed.  If it failed for want of fds or
+ * memory, accepting rests for ACCEPT_REST_MS, as the master stays
+ * readable until some are free'd and would be retried over and over.
+ *
+ * @param[in] listener:		The listener.
+ * @param[in] port_index:	The index of the port accepted on.
+ * @param[in] err:			The errno of the accept.
+ *
+ * @return TRUE(1) if accepting rests, FALSE(0) if it may go on.
+ */
+int listener_accept_failed(server_listener_t *listener, int port_index, 
+		int err);
+
+/**
+ * Check whether the listener accepts connections, or rests after
+ * running out of fds.
+ *
+ * @param[in] listener: The listener.
+ *
+ * @return TRUE(1) if it accepts, FALSE(0) if it rests.
+ */
+int listener_accepting(server_listener_t *listener);
+
+/**
+ * Send the LOGIN packets of up to LOGIN_BATCH accepted connections.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_login_pending(server_listener_t *listener);
+
+/**
+ * Decode and handle every complete packet in the receive buffer of a
+ * connection.  The connection may be gone by the time this returns.
+ *
+ * The decoder has two states, kept in conn->need: waiting for the
+ * header and size of the next frame, and waiting for the rest of a frame
+ * of known size.  Nothing is parsed until need bytes have arrived.
+ *
+ * @param[in] listener:	The listener serving the connection.
+ * @param[in] conn:		The connection that received more bytes.
+ */
+void listener_consume(server_listener_t *listener, conn_t *conn);
+
+/**
+ * Retry the deferred work of the connections of this thread, once the
+ * queues have drained below their cap.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_unpark(server_listener_t *listener);
+
+/**
+ * Handle a packet received on a socket served by this thread.  The
+ * packet is consumed.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] sd:		The socket the packet came in on.
+ * @param[in] packet:	The packet.
+ */
+void listener_handle(server_listener_t *listener, int sd, packet_t *packet);
+
+/**
+ * Send a packet to a socket served by this thread.  With the io_uring
+ * backend the send is queued on the ring and goes out with the next
+ * submit, if nothing else is being written to the socket.  Otherwise it
+ * is written straight away, as far as the socket has room for it, or
+ * waits behind what is being written.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] packet:	The packet to send.  It is not consumed.
+ * @param[in] sd:		The socket to send it over.
+ */
+void listener_send(server_listener_t *listener, packet_t *packet, int sd);
+
+/**
+ * Take the wakeups other threads sent the loop of a listener, when
+ * output started to wait for one of its sockets.  The select backend
+ * looks at every socket anyway, so the sockets it was told of are
+ * only cleared.
+ *
+ * @param[in] listener: The listener.
+ */
+void listener_woken(server_listener_t *listener);
+
+/**
+ * Forget a connection that went away, and tell the other users.
+ *
+ * @param[in] listener:	The listener serving the socket.
+ * @param[in] sd:		The socket of the connection.
+ * @param[in] close_fd:	Also close the socket.
+ */
+void listener_drop(server_listener_t *listener, int sd, int close_fd);
+
 #endif
@@ -1,10 +1,18 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "../packet/code.h"
 #include "server_speaker.h"
-#include "../address/address_alloc.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define SPEAKER_BATCH	64	/* Queued packets taken per wakeup of the speaker */
+
 /*
 typedef struct speaker {
 	users_t *users;
@@ -17,11 +25,13 @@ typedef struct speaker {
 
 /*** Helper Function Prototypes ******************************************/
 
-int cmp_dummy(void *a, void *b);
-char *speak_strdup(char *s);
 void speaker_go(server_speaker_t *speaker);
+packet_t *speaker_route(server_speaker_t *speaker, packet_t *packet);
+void speaker_expand(server_speaker_t *speaker, packet_t *packet, int *count);
+void speaker_push_due(server_speaker_t *speaker, int *count);
+void speaker_wait(server_speaker_t *speaker);
+int speaker_batch_add(server_speaker_t *speaker, packet_t *packet, int count);
 unsigned char *speak_ipdup(unsigned char *s);
-int is_server_address(unsigned char *ip, unsigned char *sip);
 
 /*** Functions ***********************************************************/
 
@@ -35,7 +45,6 @@ int is_server_address(unsigned char *ip, unsigned char *sip);
 server_speaker_t *new_server_speaker(users_t *users, unsigned char *serv_ip)
 {
 	server_speaker_t *speaker = NULL;
-	queue_t *q = NULL;
 
 	speaker = malloc(sizeof(server_speaker_t));
 	if (!speaker) {
@@ -66,15 +75,22 @@ server_speaker_t *new_server_speaker(users_t *users, unsigned char *serv_ip)
 	}
 	pthread_mutex_init(speaker->queue_lock, NULL);
 
-	init_queue(&q, cmp_dummy, free_packet);
-	speaker->q = q;
+	speaker->sched = new_sched();
 
 	speaker->run_status = TRUE;
 	speaker->status_lock = malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(speaker->status_lock, NULL);
 
-	speaker->iptable = new_ipbinds();
-	speaker->ip_timeout = 600;
+	speaker->nat = NULL;
+	speaker->policy = new_policy();
+	speaker->admit = new_admission();
+	speaker->ulist_window = DEFAULT_ULIST_WINDOW;
+	speaker->ulist_dirty = FALSE;
+
+	speaker->ips = NULL;
+	speaker->ips_cap = 0;
+	speaker->batch = NULL;
+	speaker->batch_cap = 0;
 
 	return speaker;
 }
@@ -98,19 +114,27 @@ void server_speaker_free(server_speaker_t *speaker)
 		free(speaker->queue_lock);
 		speaker->queue_lock = NULL;
 	}
-	if (speaker->q) {
-		free_queue(speaker->q);
-		speaker->q = NULL;
+	if (speaker->sched) {
+		free_sched(speaker->sched);
+		speaker->sched = NULL;
 	}
 	if (speaker->status_lock) {
 		pthread_mutex_destroy(speaker->status_lock);
 		free(speaker->status_lock);
 		speaker->status_lock = NULL;
 	}
-	if (speaker->iptable) {
-		free_ipbinds(speaker->iptable);
-		speaker->iptable = NULL;
+	if (speaker->policy) {
+		free_policy(speaker->policy);
+		speaker->policy = NULL;
+	}
+	if (speaker->admit) {
+		free_admission(speaker->admit);
+		speaker->admit = NULL;
 	}
+	free(speaker->ips);
+	speaker->ips = NULL;
+	free(speaker->batch);
+	speaker->batch = NULL;
 	free(speaker);
 }
 
@@ -123,66 +147,66 @@ void server_speaker_free(server_speaker_t *speaker)
  */
 void add_packet_to_queue(server_speaker_t *speaker, packet_t *packet)
 {
+	int queued;
+
 	pthread_mutex_lock(speaker->queue_lock);
-	insert_node(speaker->q, (void *)packet);
+	queued = sched_push(speaker->sched, packet);
 	pthread_mutex_unlock(speaker->queue_lock);
+	if (!queued) {
+		return;
+	}
+	admission_queued(speaker->admit, 1);
 
 	sem_post(speaker->queue_sem);
 }
 
 /** 
- * Send a list of online users to all online users.
+ * Send a list of online users to all online users.  The push is held
+ * for ulist_window ms, and every call made in that window is answered
+ * by the same single round of lists, taken once for all the users.
  *
  * @param[in] speaker:	The speaker used by this thread.
  */
 void push_user_list(server_speaker_t *speaker)
 {
-	packet_t *packet = NULL;
-	queue_t *ips = NULL;
-	node_t *n = NULL;
-
-	ips = get_ips(speaker->users);
+	int wake = FALSE;
 
-	for (n = ips->head; n; n = n->next) {
-		packet = NULL;
-		packet = new_packet(GET_ULIST,(unsigned char *)n->data, NULL, (unsigned char *)n->data, 8001, 8001);
-		set_user_list(packet, ips);
-
-		add_packet_to_queue(speaker, packet);
+	pthread_mutex_lock(speaker->queue_lock);
+	if (!speaker->ulist_dirty) {
+		speaker->ulist_dirty = TRUE;
+		clock_gettime(CLOCK_REALTIME, &speaker->ulist_due);
+		speaker->ulist_due.tv_sec += speaker->ulist_window / 1000;
+		speaker->ulist_due.tv_nsec += (speaker->ulist_window % 1000) * 1000000L;
+		if (speaker->ulist_due.tv_nsec >= 1000000000L) {
+			speaker->ulist_due.tv_sec++;
+			speaker->ulist_due.tv_nsec -= 1000000000L;
+		}
+		wake = TRUE;
 	}
+	pthread_mutex_unlock(speaker->queue_lock);
 
-	free_queue(ips);
+	/* let the speaker know it has a deadline to wait for */
+	if (wake) {
+		sem_post(speaker->queue_sem);
+	}
 }
 
 /**
- * Send a packet to all online users.
+ * Send a packet to all online users.  The packet is consumed, the
+ * speaker thread makes a copy of it for every user.
  *
  * @param[in] speaker:	The speaker sending packets out.
  * @param[in] packet:	The packet to be broadcast.
  */
 void broadcast(server_speaker_t *speaker, packet_t *packet)
 {
-	packet_t *copy;
-	queue_t *ips = get_ips(speaker->users);
-	node_t *n = NULL;
-	unsigned char *ptr;
-
-	printf("%d.%d.%d.%d is broadcasting %s\n", 
+	LOG_DEBUG(("%d.%d.%d.%d is broadcasting %s\n", 
 			(int)packet->header.src_ip[0], 
 			(int)packet->header.src_ip[1], 
 			(int)packet->header.src_ip[2], 
 			(int)packet->header.src_ip[3], 
-			packet->data);
-	for (n = ips->head; n; n = n->next) {
-		ptr = n->data;
-		printf("%d.%d.%d.%d to be added for broadcasting\n", ptr[0], ptr[1], ptr[2], ptr[3]);
-		copy = NULL;
-		copy = new_packet(packet->code, packet->header.src_ip, 
-				speak_strdup(packet->data), (unsigned char *)n->data, 
-				packet->header.src_port, packet->header.dst_port);
-		add_packet_to_queue(speaker, copy);
-	}
-	free_queue(ips);
+			packet->data));
+	add_packet_to_queue(speaker, packet);
 }
 
 /**
@@ -227,168 +251,197 @@ int speaker_running(server_speaker_t *speaker)
 	return status;
 }
 
-void refresh_ip_binds(server_speaker_t *speaker)
+
+/*** Helper Functions ****************************************************/
+
+/* The workhorse that does the work */
+void speaker_go(server_speaker_t *speaker)
 {
-	int currtime = (long)time(NULL);
-	queue_t *q = ipbinds_get_ips(speaker->iptable);
-	unsigned char *ip = NULL;
-
-	printf("refreshing ip port table\n");
-
-	while ((ip = pop_first(q))) {
-		if (currtime - ip_get_time(speaker->iptable, ip) > speaker->ip_timeout) {
-			ipbinds_remove_ip(speaker->iptable, ip);
-			printf("Removed %d.%d.%d.%d\n", 
-					ip[0],
-					ip[1],
-					ip[2],
-					ip[3]
-					);
+	packet_t *packet = NULL;
+	int taken;
+	int count;
+	int i;
+
+	while(TRUE) {
+		/* wait for the semaphore to be increased, indicating 
+		 * new activity to be processed, or for a push to be due */
+		speaker_wait(speaker);
+		if (!speaker_running(speaker)) {
+			break;
 		}
-		free(ip);
-		ip = NULL;
-	}
 
-	free_queue(q);
-	q = NULL;
-	printf("refresh done\n");
+		/* take whatever else is already queued along with it */
+		count = 0;
+		taken = 0;
+		do {
+			pthread_mutex_lock(speaker->queue_lock);
+			packet = sched_pop(speaker->sched);
+			pthread_mutex_unlock(speaker->queue_lock);
+			if (!packet) {
+				/* the post was speaker_stop's or push_user_list's */
+				break;
+			}
+			admission_queued(speaker->admit, -1);
+			taken++;
+			speaker_expand(speaker, packet, &count);
+		} while ((taken < SPEAKER_BATCH) && (sem_trywait(speaker->queue_sem) == 0));
+		speaker_push_due(speaker, &count);
+
+		users_send_batch(speaker->users, speaker->batch, count);
+		for (i = 0; i < count; i++) {
+			free_packet(speaker->batch[i]);
+			speaker->batch[i] = NULL;
+		}
+	}
 }
 
+/* turn a packet taken off the queue into the packets to send, added to
+ * the batch.  A broadcast is copied for every user here, from one copy
+ * of the online users. */
+void speaker_expand(server_speaker_t *speaker, packet_t *packet, int *count)
+{
+	int i, n;
+	unsigned char *ip;
+	packet_t *copy = NULL;
 
-/*** Helper Functions ****************************************************/
+	if (packet->code != BROADCAST) {
+		packet = speaker_route(speaker, packet);
+		if (packet) {
+			*count = speaker_batch_add(speaker, packet, *count);
+		}
+		return;
+	}
 
-int cmp_dummy(void *a, void *b)
-{
-	if ((long)a == (long)b) {
-		return 1;
-	} else {
-		return 1;
+	n = users_copy_ips(speaker->users, &speaker->ips, &speaker->ips_cap);
+	for (i = 0; i < n; i++) {
+		ip = speaker->ips + (4 * i);
+		LOG_DEBUG(("%d.%d.%d.%d to be added for broadcasting\n", 
+				ip[0], ip[1], ip[2], ip[3]));
+		copy = new_packet(packet->code, packet->header.src_ip, 
+				packet->data, ip, 
+				packet->header.src_port, packet->header.dst_port);
+		if (!copy) {
+			continue;
+		}
+		copy->header.dscp_ecn = packet->header.dscp_ecn;
+		packet_set_fragment(copy, packet->header.sequence_no, 
+				packet->header.ack_no);
+		*count = speaker_batch_add(speaker, copy, *count);
 	}
+	free_packet(packet);
 }
 
-/* ansi */
-char *speak_strdup(char *s)
+/* if a user list push is due, add a list for every user to the batch,
+ * all from one copy of the online users */
+void speaker_push_due(server_speaker_t *speaker, int *count)
 {
-	int i = 0, j = 0;
-	char *c = malloc(strlen(s) + 1);
-	while ((c[i++] = s[j++]));
-	return c;
+	int i, n;
+	int due;
+	unsigned char *ip;
+	struct timespec now;
+	packet_t *list = NULL;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	pthread_mutex_lock(speaker->queue_lock);
+	due = (speaker->ulist_dirty) 
+		&& ((now.tv_sec > speaker->ulist_due.tv_sec) 
+		|| ((now.tv_sec == speaker->ulist_due.tv_sec) 
+		&& (now.tv_nsec >= speaker->ulist_due.tv_nsec)));
+	if (due) {
+		speaker->ulist_dirty = FALSE;
+	}
+	pthread_mutex_unlock(speaker->queue_lock);
+	if (!due) {
+		return;
+	}
+
+	n = users_copy_ips(speaker->users, &speaker->ips, &speaker->ips_cap);
+	LOG_DEBUG(("pushing the user list to %d users\n", n));
+	for (i = 0; i < n; i++) {
+		ip = speaker->ips + (4 * i);
+		list = packet_reserve(new_packet(GET_ULIST, ip, NULL, ip, 
+					8001, 8001), 4 * n);
+		if (!list) {
+			continue;
+		}
+		set_user_array(list, speaker->ips, n);
+		*count = speaker_batch_add(speaker, list, *count);
+	}
 }
 
-/* The workhorse that does the work */
-void speaker_go(server_speaker_t *speaker)
+/* wait for something on the queue, but no longer than until a held
+ * user list push is due */
+void speaker_wait(server_speaker_t *speaker)
 {
-	packet_t *packet = NULL;
-	packet_t *temp = NULL;
-	int port;
-	unsigned char *ip;
+	int dirty;
+	struct timespec due;
 
-	queue_t *online_users = NULL;
-	while(TRUE) {
-		/* wait for the semaphore to be increased, indicating 
-		 * new activity to be processed */
+	pthread_mutex_lock(speaker->queue_lock);
+	dirty = speaker->ulist_dirty;
+	due = speaker->ulist_due;
+	pthread_mutex_unlock(speaker->queue_lock);
+
+	if (!dirty) {
 		sem_wait(speaker->queue_sem);
-		if (!speaker_running(speaker)) {
-			break;
+		return;
+	}
+	while ((sem_timedwait(speaker->queue_sem, &due) != 0) && (errno == EINTR));
+}
+
+/* add a packet to the batch, growing it as needed, and return the new
+ * count.  The packet is dropped if the batch cannot grow. */
+int speaker_batch_add(server_speaker_t *speaker, packet_t *packet, int count)
+{
+	int cap;
+	packet_t **grown = NULL;
+
+	if (count >= speaker->batch_cap) {
+		cap = speaker->batch_cap ? 2 * speaker->batch_cap : SPEAKER_BATCH;
+		grown = realloc(speaker->batch, cap * sizeof(packet_t *));
+		if (!grown) {
+			fprintf(stderr, "failed to grow the speaker batch\n");
+			free_packet(packet);
+			return count;
 		}
-		packet = NULL;
-
-		pthread_mutex_lock(speaker->queue_lock);
-		packet = (packet_t *)pop_first(speaker->q);
-		pthread_mutex_unlock(speaker->queue_lock);
-
-		/* handle packet according to it's code */
-		if (packet->code == SEND) {
-			 if ((is_private_address(packet->header.src_ip)) && (!is_private_address(packet->header.dst_ip))) {
-				temp = packet;
-				packet = NULL;
-				if ((port = ip_get_bound_port(speaker->iptable, temp->header.src_ip)) == FALSE) {
-					for (port = 1; !bind_ip_to_port(speaker->iptable, temp->header.src_ip, port); port++);
-					printf("%d.%d.%d.%d bound to %d\n",
-							temp->header.src_ip[0],
-							temp->header.src_ip[1],
-							temp->header.src_ip[2],
-							temp->header.src_ip[3],
-							port
-							);
-				}
-				printf("port %d used to send out of\n", port);
-
-				packet = new_packet(SEND, speaker->serv_ip, speak_strdup(temp->data), temp->header.dst_ip, port, temp->header.dst_port);
-				/*
-				packet->header.src_port = port;
-				packet->header.dst_port = temp->header.dst_port;
-				*/
-				free_packet(temp);
-			} else if ((!is_private_address(packet->header.src_ip)) && (is_server_address(packet->header.dst_ip, speaker->serv_ip))) {
-				if ((ip = port_get_bound_ip(speaker->iptable, packet->header.dst_port)) == NULL) {
-					printf("This port is unbound.\n");
-					free_packet(packet);
-					packet = NULL;
-				} else {
-					temp = packet;
-					packet = new_packet(SEND, temp->header.src_ip, speak_strdup(temp->data), ip, temp->header.src_port, 8001);
-
-					packet->header.src_port = temp->header.src_port;
-					packet->header.dst_port = 8001;
-					free_packet(temp);
-					temp = NULL;
-					free(ip);
-					ip = NULL;
-				}
-			} else if ((!is_private_address(packet->header.src_ip)) && (is_private_address(packet->header.dst_ip))) {
-				printf("Invalid target address from external domain\n");
-				printf("Dropping packet\n");
-				free_packet(packet);
-				packet = NULL;
-			} else if ((!is_private_address(packet->header.src_ip)) && (!is_private_address(packet->header.dst_ip))) {
-				printf("Dropping packet, not allowed to route from extern to extern\n");
-				free_packet(packet);
-				packet = NULL;
-			} else {
-				/* internal to internal, nothing to do */
-			}
-			if (packet) {
-				printf("Sending message: %d.%d.%d.%d -> %d.%d.%d.%d %s\n", 
-					(int)packet->header.src_ip[0], 
-					(int)packet->header.src_ip[1], 
-					(int)packet->header.src_ip[2], 
-					(int)packet->header.src_ip[3], 
-					(int)packet->header.dst_ip[0], 
-					(int)packet->header.dst_ip[1], 
-					(int)packet->header.dst_ip[2], 
-					(int)packet->header.dst_ip[3], 
-					packet->data);
-			} else {
-				printf("dropped packet\n");
-			}
-		} else if (packet->code == GET_ULIST) {
-			online_users = NULL;
-			if (packet->users == NULL) {
-				online_users = get_ips(speaker->users);
-				set_user_list(packet, online_users);
-				free_queue(online_users);
+		speaker->batch = grown;
+		speaker->batch_cap = cap;
+	}
+	speaker->batch[count] = packet;
+	return count + 1;
+}
+
+/* fill in a packet taken off the queue, returning the packet to send,
+ * or NULL if it is dropped.  The SEND packets are not queued, the thread
+ * that received one decides on it and writes it out itself */
+packet_t *speaker_route(server_speaker_t *speaker, packet_t *packet)
+{
+	int count;
+
+	/* handle packet according to it's code */
+	if (packet->code == GET_ULIST) {
+		if (packet->ips == NULL) {
+			count = users_copy_ips(speaker->users, &speaker->ips, 
+					&speaker->ips_cap);
+			count = (count > 0) ? count : 0;
+			packet = packet_reserve(packet, 4 * count);
+			if (!packet) {
+				return NULL;
 			}
-			/*
-			packet->name = NULL;
-			packet->name_len = 0;
-			*/
-			packet->header.dst_ip[0] = packet->header.src_ip[0];
-			packet->header.dst_ip[1] = packet->header.src_ip[1];
-			packet->header.dst_ip[2] = packet->header.src_ip[2];
-			packet->header.dst_ip[3] = packet->header.src_ip[3];
-			printf("Sending list of online users to %d.%d.%d.%d\n", 
-					packet->header.src_ip[0], 
-					packet->header.src_ip[1], 
-					packet->header.src_ip[2], 
-					packet->header.src_ip[3]);
-		}
-		if (packet) {
-			users_send_packet(speaker->users, packet);
-			free_packet(packet);
-			packet = NULL;
+			set_user_array(packet, speaker->ips, count);
 		}
+		/*
+		packet->name = NULL;
+		packet->name_len = 0;
+		*/
+		packet_rewrite_dst(packet, packet->header.src_ip, 
+				packet->header.dst_port);
+		LOG_DEBUG(("Sending list of online users to %d.%d.%d.%d\n", 
+				packet->header.src_ip[0], 
+				packet->header.src_ip[1], 
+				packet->header.src_ip[2], 
+				packet->header.src_ip[3]));
 	}
+	return packet;
 }
 
 
@@ -404,14 +457,3 @@ unsigned char *speak_ipdup(unsigned char *s)
 	}
 	return c;
 }
-
-int is_server_address(unsigned char *ip, unsigned char *sip) 
-{
-	int i;
-	for (i = 0; i < 4; i++) {
-		if (ip[i] != sip[i]) {
-			return FALSE;
-		}
-	}
-	return TRUE;
-}
@@ -2,24 +2,38 @@
 #define SERVER_SPEAKER_H
 
 #include <semaphore.h>
+#include <time.h>
 #include "../queue/queue.h"
 #include "../packet/packet.h"
-#include "ipbinds.h"
+#include "nat.h"
 #include "users.h"
+#include "policy.h"
+#include "admission.h"
+#include "sched.h"
 
 #define TRUE	1
 #define FALSE	0
 
+#define DEFAULT_ULIST_WINDOW	50	/* ms that user list pushes are held */
+
 typedef struct speaker {
 	users_t *users;
 	sem_t *queue_sem;
 	pthread_mutex_t *queue_lock;
-	queue_t *q;
+	sched_t *sched;				/* The queued packets, under queue_lock */
 	int run_status;
 	pthread_mutex_t *status_lock;
-	ipbinds_t *iptable;
-	int ip_timeout;
+	nat_t *nat;					/* Translates the SENDs that need it, not owned */
 	unsigned char serv_ip[4];
+	policy_t *policy;			/* Decides how each SEND is routed */
+	admission_t *admit;			/* Decides which packets are taken in */
+	long ulist_window;			/* ms that user list pushes are held */
+	int ulist_dirty;			/* A push is due, under queue_lock */
+	struct timespec ulist_due;	/* When it is due, under queue_lock */
+	unsigned char *ips;			/* The online users, copied per fan-out */
+	int ips_cap;				/* The number of ips that fit in ips */
+	packet_t **batch;			/* The packets of one wakeup, to be sent */
+	int batch_cap;				/* The number of packets batch has room for */
 } server_speaker_t;
 
 /**
@@ -48,14 +62,17 @@ void server_speaker_free(server_speaker_t *speaker);
 void add_packet_to_queue(server_speaker_t *speaker, packet_t *packet);
 
 /** 
- * Send a list of online users to all online users.
+ * Send a list of online users to all online users.  The push is held
+ * for ulist_window ms, and every call made in that window is answered
+ * by the same single round of lists, taken once for all the users.
  *
  * @param[in] speaker:	The speaker used by this thread.
  */
 void push_user_list(server_speaker_t *speaker); 
 
 /**
- * Send a packet to all online users.
+ * Send a packet to all online users.  The packet is consumed, the
+ * speaker thread makes a copy of it for every user.
  *
  * @param[in] speaker:	The speaker sending packets out.
  * @param[in] packet:	The packet to be broadcast.
@@ -84,6 +101,4 @@ void speaker_stop(server_speaker_t *speaker);
  */
 int speaker_running(server_speaker_t *speaker);
 
-void refresh_ip_binds(server_speaker_t *speaker);
-
 #endif
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ipbinds.h"
+
+#define HOMES		5	/* Home slots at either side of the end */
+#define PER_HOME	6	/* Ips sharing each of them */
+#define OTHERS		200	/* Ips hashed anywhere */
+#define IP_COUNT	(HOMES * PER_HOME + OTHERS)
+
+/* a helper of ipbinds.c, to pick ips that collide */
+int index_hash(unsigned char *ip);
+
+int pick_ips(unsigned char *ips);
+int check(ipbinds_t *ipbinds, unsigned char *ips, int *ports, int n);
+void shuffle(int *order, int n);
+
+int main(void)
+{
+	int i, j;
+	int fails = 0;
+	unsigned char ips[4 * IP_COUNT];
+	int ports[IP_COUNT];
+	int order[IP_COUNT];
+	int port;
+	char path[] = "/tmp/test_ipbindsXXXXXX";
+	int fd;
+	ipbinds_t *ipbinds = NULL;
+
+	if (!pick_ips(ips)) {
+		fprintf(stderr, "failed to find colliding ips\n");
+		return 1;
+	}
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror("failed to make a table file");
+		return 1;
+	}
+	close(fd);
+	ipbinds = new_ipbinds_file(path);
+	if (!ipbinds) {
+		unlink(path);
+		return 1;
+	}
+	srand(7);
+
+	/* a run that starts near the end of the index and wraps to its front,
+	 * bound and unbound in a different order each round */
+	printf("Wrap around\n");
+	memset(ports, 0, sizeof(ports));
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < IP_COUNT; i++) {
+			order[i] = i;
+		}
+		shuffle(order, IP_COUNT);
+		for (i = 0; i < IP_COUNT; i++) {
+			if (ports[order[i]]) {
+				continue;
+			}
+			ports[order[i]] = ipbinds_bind(ipbinds, ips + (4 * order[i]));
+			if (!ports[order[i]]) {
+				printf("failed to bind ip %d\n", order[i]);
+				fails++;
+			}
+		}
+		fails += check(ipbinds, ips, ports, IP_COUNT);
+
+		/* unbind most of them, by port and by ip in turn */
+		shuffle(order, IP_COUNT);
+		for (i = 0; i < IP_COUNT - 20; i++) {
+			if (i & 1) {
+				ipbinds_remove_ip(ipbinds, ips + (4 * order[i]));
+			} else {
+				ipbinds_remove_port(ipbinds, ports[order[i]]);
+			}
+			ports[order[i]] = 0;
+			if ((i % 16) == 0) {
+				fails += check(ipbinds, ips, ports, IP_COUNT);
+			}
+		}
+		fails += check(ipbinds, ips, ports, IP_COUNT);
+	}
+
+	/* bind the colliding ones once more, and mess up the index as a
+	 * server that died mid write might have, which the restore rebuilds
+	 * from the entries */
+	printf("Restore\n");
+	for (i = 0; i < HOMES * PER_HOME; i++) {
+		if (!ports[i]) {
+			ports[i] = ipbinds_bind(ipbinds, ips + (4 * i));
+		}
+	}
+	fails += check(ipbinds, ips, ports, IP_COUNT);
+	for (i = 0; i < NAT_INDEX; i += 3) {
+		ipbinds->table->index[i] = (unsigned short)(i & 0xffff);
+	}
+	/* and an ip bound twice, of which the lower port is kept */
+	port = ports[0] + 1;
+	while (ipbinds->table->entries[port].used) {
+		port++;
+	}
+	memcpy(ipbinds->table->entries[port].ip, ips, 4);
+	ipbinds->table->entries[port].used = 1;
+	free_ipbinds(ipbinds);
+
+	ipbinds = new_ipbinds_file(path);
+	if (!ipbinds) {
+		printf("failed to reopen the table\n");
+		unlink(path);
+		return 1;
+	}
+	fails += check(ipbinds, ips, ports, IP_COUNT);
+	if (ipbinds->table->entries[port].used) {
+		printf("an ip bound twice kept both ports\n");
+		fails++;
+	}
+
+	/* and the restored index takes removals as well */
+	for (i = 0; i < HOMES * PER_HOME; i += 2) {
+		ipbinds_remove_ip(ipbinds, ips + (4 * i));
+		ports[i] = 0;
+	}
+	fails += check(ipbinds, ips, ports, IP_COUNT);
+
+	printf("%d failures\n", fails);
+
+	free_ipbinds(ipbinds);
+	unlink(path);
+	return fails ? 1 : 0;
+}
+
+/* the first HOMES * PER_HOME ips hash to the last and first slots of the
+ * index, PER_HOME to each, and the rest are spread out */
+int pick_ips(unsigned char *ips)
+{
+	int found[HOMES];
+	int n = 0;
+	int others = 0;
+	int home;
+	unsigned long i;
+	unsigned char ip[4];
+
+	memset(found, 0, sizeof(found));
+	ip[0] = 10;
+	for (i = 1; (i < 0x1000000UL) && (n < HOMES * PER_HOME); i++) {
+		ip[1] = (i >> 16) & 0xff;
+		ip[2] = (i >> 8) & 0xff;
+		ip[3] = i & 0xff;
+		/* count from HOMES / 2 slots before the end */
+		home = (index_hash(ip) + HOMES / 2) % NAT_INDEX;
+		if ((home < HOMES) && (found[home] < PER_HOME)) {
+			memcpy(ips + (4 * (home * PER_HOME + found[home]++)), ip, 4);
+			n++;
+		} else if ((home >= HOMES) && (others < OTHERS) && (i % 977 == 0)) {
+			memcpy(ips + (4 * (HOMES * PER_HOME + others++)), ip, 4);
+		}
+	}
+	return (n == HOMES * PER_HOME) && (others == OTHERS);
+}
+
+/* every ip with a port must be found at it, and every other not at all */
+int check(ipbinds_t *ipbinds, unsigned char *ips, int *ports, int n)
+{
+	int i;
+	int fails = 0;
+	int bound = 0;
+	unsigned char *ip = NULL;
+
+	for (i = 0; i < n; i++) {
+		if (ip_get_bound_port(ipbinds, ips + (4 * i)) != ports[i]) {
+			printf("ip %d is at port %d, not %d\n", i,
+					ip_get_bound_port(ipbinds, ips + (4 * i)), ports[i]);
+			fails++;
+		}
+		if (ports[i]) {
+			bound++;
+			ip = port_get_bound_ip(ipbinds, ports[i]);
+			if ((!ip) || (memcmp(ip, ips + (4 * i), 4))) {
+				printf("port %d lost ip %d\n", ports[i], i);
+				fails++;
+			}
+			free(ip);
+		}
+	}
+	if (ipbinds_count(ipbinds) != bound) {
+		printf("%d bindings counted, not %d\n", ipbinds_count(ipbinds),
+				bound);
+		fails++;
+	}
+	return fails;
+}
+
+void shuffle(int *order, int n)
+{
+	int i, j, t;
+
+	for (i = n - 1; i > 0; i--) {
+		j = rand() % (i + 1);
+		t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+}
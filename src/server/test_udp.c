@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "udp.h"
+#include "users.h"
+#include "server_speaker.h"
+#include "server_listener.h"
+#include "../packet/packet.h"
+#include "../packet/serializer.h"
+#include "../packet/code.h"
+
+#define INTERNAL_PORT	18001	/* Out of the way of a running server */
+#define EXTERNAL_PORT	18002
+#define WAIT_MS			2000	/* The longest a reply is waited for */
+#define DGRAM_MAX		70000
+
+int udp_peer(int port);
+int send_packet_to(int sock, packet_t *packet);
+packet_t *await(int sock, int code);
+int hello(int sock, char *cookie, unsigned char *ip);
+int round_trip(int from, unsigned char *from_ip, int to,
+		unsigned char *to_ip, char *data);
+
+unsigned char no_ip[4] = {0, 0, 0, 0};
+
+int main(void)
+{
+	int fails = 0;
+	int ports[2];
+	unsigned char serv_ip[4] = {1, 2, 3, 4};
+	unsigned char a_ip[4];
+	unsigned char b_ip[4];
+	char a_cookie[UDP_COOKIE_LEN + 1];
+	char b_cookie[UDP_COOKIE_LEN + 1];
+	int a, b;
+	packet_t *p = NULL;
+	users_t *users = NULL;
+	server_speaker_t *speaker = NULL;
+	server_listener_t *listener = NULL;
+	udp_t *udp = NULL;
+
+	ports[0] = INTERNAL_PORT;
+	ports[1] = EXTERNAL_PORT;
+	users = new_users();
+	speaker = new_server_speaker(users, serv_ip);
+	listener = new_server_listener(ports, 2, users, speaker);
+	udp = listener ? new_udp(listener, ports, 2) : NULL;
+	if (!udp) {
+		fprintf(stderr, "failed to set up the transport\n");
+		return 1;
+	}
+	users->udp = udp;
+	udp_start(udp);
+
+	a = udp_peer(INTERNAL_PORT);
+	b = udp_peer(INTERNAL_PORT);
+	if ((a < 0) || (b < 0)) {
+		return 1;
+	}
+
+	/* a hello without the cookie is answered with one, and opens
+	 * nothing, not even with a cookie made up.  Each peer has its own */
+	printf("Cookie\n");
+	memset(a_cookie, '0', UDP_COOKIE_LEN);
+	a_cookie[UDP_COOKIE_LEN] = 0;
+	memcpy(b_cookie, a_cookie, sizeof(b_cookie));
+	if ((!hello(a, a_cookie, NULL)) || (!hello(b, b_cookie, NULL))) {
+		printf("no cookie for a hello\n");
+		fails++;
+	}
+	if (!memcmp(a_cookie, b_cookie, UDP_COOKIE_LEN)) {
+		printf("two peers got the same cookie\n");
+		fails++;
+	}
+	memset(a_cookie, 'f', UDP_COOKIE_LEN);
+	if (!hello(a, a_cookie, NULL)) {
+		printf("a made up cookie was taken\n");
+		fails++;
+	}
+	if (udp_count(udp) != 0) {
+		printf("%d sessions opened without a cookie\n", udp_count(udp));
+		fails++;
+	}
+
+	/* the cookie given back opens a session, with an address of the
+	 * pool */
+	printf("Handshake\n");
+	if ((!hello(a, a_cookie, a_ip)) || (!hello(b, b_cookie, b_ip))) {
+		printf("no session for a hello with its cookie\n");
+		fails++;
+	} else if (udp_count(udp) != 2) {
+		printf("%d sessions, not 2\n", udp_count(udp));
+		fails++;
+	}
+
+	/* one packet per datagram, either way between the sessions */
+	printf("Round trip\n");
+	fails += round_trip(a, a_ip, b, b_ip, "there");
+	fails += round_trip(b, b_ip, a, a_ip, "and back");
+
+	/* and a quit closes the session */
+	p = new_packet(QUIT, a_ip, NULL, a_ip, INTERNAL_PORT, INTERNAL_PORT);
+	send_packet_to(a, p);
+	free_packet(p);
+	usleep(200 * 1000);
+	if (udp_count(udp) != 1) {
+		printf("%d sessions after a quit, not 1\n", udp_count(udp));
+		fails++;
+	}
+
+	printf("%d failures\n", fails);
+
+	close(a);
+	close(b);
+	udp_stop(udp);
+	users->udp = NULL;
+	free_users(users);
+	server_listener_free(listener);
+	server_speaker_free(speaker);
+	free_udp(udp);
+	return fails ? 1 : 0;
+}
+
+/* a datagram socket talking to a port of the transport */
+int udp_peer(int port)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	struct timeval tv;
+
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	tv.tv_sec = WAIT_MS / 1000;
+	tv.tv_usec = (WAIT_MS % 1000) * 1000;
+	if ((setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+			|| (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+		perror("udp peer");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int send_packet_to(int sock, packet_t *packet)
+{
+	char *frame = NULL;
+	int size;
+	int sent;
+
+	frame = packet ? serialize(packet, &size) : NULL;
+	if (!frame) {
+		return FALSE;
+	}
+	sent = (int)send(sock, frame, size, 0);
+	free(frame);
+	return sent == size;
+}
+
+/* the next intact packet with the given code, NULL if none comes */
+packet_t *await(int sock, int code)
+{
+	char *bytes = malloc(DGRAM_MAX);
+	packet_t *packet = NULL;
+	int len;
+
+	while (bytes) {
+		len = (int)recv(sock, bytes, DGRAM_MAX, 0);
+		if (len <= 0) {
+			break;
+		}
+		if ((packet_frame_size(bytes, len) != len)
+				|| (!packet_frame_intact(bytes, len))) {
+			printf("a damaged datagram came\n");
+			continue;
+		}
+		packet = packet_from_frame(bytes);
+		if ((packet) && (packet->code == code)) {
+			break;
+		}
+		free_packet(packet);
+		packet = NULL;
+	}
+	free(bytes);
+	return packet;
+}
+
+/* say hello with a cookie.  If ip is NULL, a new cookie is expected back
+ * and kept in cookie, else the LOGIN of a new session, whose address is
+ * kept in ip */
+int hello(int sock, char *cookie, unsigned char *ip)
+{
+	packet_t *p = new_packet(LOGIN, no_ip, cookie, no_ip, INTERNAL_PORT,
+			INTERNAL_PORT);
+	int sent = send_packet_to(sock, p);
+
+	free_packet(p);
+	if (!sent) {
+		return FALSE;
+	}
+	p = await(sock, ip ? LOGIN : ECHO);
+	if (!p) {
+		return FALSE;
+	}
+	if (ip) {
+		memcpy(ip, p->header.dst_ip, 4);
+	} else if (p->data_len == UDP_COOKIE_LEN) {
+		memcpy(cookie, p->data, UDP_COOKIE_LEN);
+	} else {
+		free_packet(p);
+		return FALSE;
+	}
+	free_packet(p);
+	return (!ip) || (memcmp(ip, no_ip, 4));
+}
+
+/* send a SEND from one session to the other, which must get it whole */
+int round_trip(int from, unsigned char *from_ip, int to,
+		unsigned char *to_ip, char *data)
+{
+	packet_t *p = new_packet(SEND, from_ip, data, to_ip, INTERNAL_PORT,
+			INTERNAL_PORT);
+	int fails = 0;
+
+	if (!send_packet_to(from, p)) {
+		printf("failed to send \"%s\"\n", data);
+		free_packet(p);
+		return 1;
+	}
+	free_packet(p);
+	p = await(to, SEND);
+	if ((!p) || (strcmp(p->data, data)) || (memcmp(p->header.src_ip,
+			from_ip, 4)) || (memcmp(p->header.dst_ip, to_ip, 4))) {
+		printf("\"%s\" did not come through\n", data);
+		fails++;
+	}
+	if (p) {
+		free_packet(p);
+	}
+	return fails;
+}
@@ -0,0 +1,912 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "udp.h"
+#include "users.h"
+#include "../packet/code.h"
+#include "../packet/serializer.h"
+#include "../clock/clock.h"
+#include "../log/log.h"
+
+/*** Macros **************************************************************/
+
+#define TRUE			1
+#define FALSE			0
+#define POLL_MS			1000	/* The longest wait for a datagram */
+#define SOCKET_BUFFER	(1 << 20)	/* Bytes of datagrams the kernel holds for us */
+
+/* A round of SipHash, which makes the cookies */
+#define SIP_ROTL(x, b)	(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) do { \
+	v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+	v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+	v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+	v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+} while (0)
+
+/*** Helper Function Prototypes ******************************************/
+
+void *udp_run(void *u);
+int udp_bind(int port);
+void udp_receive(udp_t *udp, int port_index);
+void udp_datagram(udp_t *udp, int port_index, struct sockaddr_in *addr,
+		char *bytes, int len);
+void udp_hello(udp_t *udp, int port_index, struct sockaddr_in *addr,
+		char *bytes, int len);
+void udp_cookie(udp_t *udp, struct sockaddr_in *addr, long slot,
+		char *cookie);
+void udp_keygen(udp_t *udp);
+uint64_t udp_siphash(uint64_t *key, unsigned char *bytes, int len);
+void udp_handle(udp_t *udp, int index, packet_t *packet);
+int udp_admit(udp_t *udp, udp_session_t *session, packet_t *packet);
+int udp_session_find(udp_t *udp, struct sockaddr_in *addr);
+int udp_session_open(udp_t *udp, struct sockaddr_in *addr, int port_index);
+int udp_session_login(udp_t *udp, int index);
+void udp_session_close(udp_t *udp, int index);
+void udp_sweep(udp_t *udp);
+void udp_reply(udp_t *udp, int index, packet_t *packet);
+void udp_flush(udp_t *udp);
+unsigned long udp_hash(struct sockaddr_in *addr);
+
+unsigned char udp_null_address[4] = {0, 0, 0, 0};
+
+/*** Functions ***********************************************************/
+
+/**
+ * Allocate the transport and bind a socket to each port.
+ *
+ * @param[in] primary:		The first listener, whose users, speaker and
+ *							address allocators the sessions share.
+ * @param[in] ports:		The ports to take datagrams on.
+ * @param[in] port_count:	The number of ports.  The first one is the
+ *							internal port, as with the listeners.
+ *
+ * @return The new transport, NULL on failure.
+ */
+udp_t *new_udp(server_listener_t *primary, int *ports, int port_count)
+{
+	int i;
+	udp_t *udp = calloc(1, sizeof(udp_t));
+
+	if (!udp) {
+		fprintf(stderr, "failed to malloc udp\n");
+		return NULL;
+	}
+	udp->ports = malloc(port_count * sizeof(int));
+	udp->socks = malloc(port_count * sizeof(int));
+	udp->sessions = calloc(UDP_SESSIONS, sizeof(udp_session_t));
+	udp->rbufs = malloc((long)UDP_BATCH * UDP_FRAME_MAX);
+	udp->rmsgs = calloc(UDP_BATCH, sizeof(struct mmsghdr));
+	udp->riovs = calloc(UDP_BATCH, sizeof(struct iovec));
+	udp->raddrs = calloc(UDP_BATCH, sizeof(struct sockaddr_in));
+	udp->status_lock = malloc(sizeof(pthread_mutex_t));
+	if ((!udp->ports) || (!udp->socks) || (!udp->sessions) || (!udp->rbufs)
+			|| (!udp->rmsgs) || (!udp->riovs) || (!udp->raddrs)
+			|| (!udp->status_lock)) {
+		fprintf(stderr, "failed to malloc udp buffers\n");
+		free(udp->ports);
+		free(udp->socks);
+		free(udp->sessions);
+		free(udp->rbufs);
+		free(udp->rmsgs);
+		free(udp->riovs);
+		free(udp->raddrs);
+		free(udp->status_lock);
+		free(udp);
+		return NULL;
+	}
+	pthread_mutex_init(udp->status_lock, NULL);
+	udp->run_status = FALSE;
+
+	udp->port_count = port_count;
+	for (i = 0; i < port_count; i++) {
+		udp->ports[i] = ports[i];
+		udp->socks[i] = -1;
+	}
+	udp->users = primary->users;
+	udp->speaker = primary->speaker;
+	udp->primary = primary;
+	udp->idle_timeout = DEFAULT_UDP_IDLE;
+	udp_keygen(udp);
+
+	/* every session starts out on the free list */
+	for (i = 0; i < UDP_SESSIONS; i++) {
+		udp->sessions[i].next = (i + 1 < UDP_SESSIONS) ? i + 1 : -1;
+	}
+	udp->free_list = 0;
+	for (i = 0; i < UDP_BUCKETS; i++) {
+		udp->table[i] = -1;
+	}
+	udp->count = 0;
+	udp->swept = 0;
+	udp->out_count = 0;
+
+	/* the receive batch always points at the same buffers */
+	for (i = 0; i < UDP_BATCH; i++) {
+		udp->riovs[i].iov_base = udp->rbufs + (long)i * UDP_FRAME_MAX;
+		udp->riovs[i].iov_len = UDP_FRAME_MAX;
+		udp->rmsgs[i].msg_hdr.msg_iov = &udp->riovs[i];
+		udp->rmsgs[i].msg_hdr.msg_iovlen = 1;
+		udp->rmsgs[i].msg_hdr.msg_name = &udp->raddrs[i];
+	}
+
+	for (i = 0; i < port_count; i++) {
+		udp->socks[i] = udp_bind(ports[i]);
+		if (udp->socks[i] < 0) {
+			free_udp(udp);
+			return NULL;
+		}
+	}
+	return udp;
+}
+
+/**
+ * Close the sockets and free the transport.  The thread must have been
+ * stopped.
+ *
+ * @param[in] udp: The transport to be free'd.
+ */
+void free_udp(udp_t *udp)
+{
+	int i;
+
+	if (!udp) {
+		return;
+	}
+	for (i = 0; i < udp->port_count; i++) {
+		if (udp->socks[i] >= 0) {
+			close(udp->socks[i]);
+		}
+	}
+	free(udp->ports);
+	udp->ports = NULL;
+	free(udp->socks);
+	udp->socks = NULL;
+	free(udp->sessions);
+	udp->sessions = NULL;
+	free(udp->rbufs);
+	udp->rbufs = NULL;
+	free(udp->rmsgs);
+	udp->rmsgs = NULL;
+	free(udp->riovs);
+	udp->riovs = NULL;
+	free(udp->raddrs);
+	udp->raddrs = NULL;
+	pthread_mutex_destroy(udp->status_lock);
+	free(udp->status_lock);
+	udp->status_lock = NULL;
+	free(udp);
+}
+
+/**
+ * Start the thread that serves the sockets.
+ *
+ * @param[in] udp: The transport.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the thread could not start.
+ */
+int udp_start(udp_t *udp)
+{
+	udp->run_status = TRUE;
+	udp->swept = clock_seconds();
+	if (pthread_create(&udp->thread, NULL, udp_run, udp)) {
+		fprintf(stderr, "failed to start the udp thread\n");
+		udp->run_status = FALSE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/**
+ * Stop the thread and wait for it to finish.  The sessions still open
+ * are closed.
+ *
+ * @param[in] udp: The transport.
+ */
+void udp_stop(udp_t *udp)
+{
+	int running;
+
+	pthread_mutex_lock(udp->status_lock);
+	running = udp->run_status;
+	udp->run_status = FALSE;
+	pthread_mutex_unlock(udp->status_lock);
+	if (running) {
+		pthread_join(udp->thread, NULL);
+	}
+}
+
+/**
+ * Send frames to sessions, with as few sendmmsg calls as possible.  The
+ * frames for the same session go out in order.  Any thread but that of
+ * the transport must hold the lock of the users, and only send to
+ * sessions it found in them.
+ *
+ * @param[in] udp:		The transport.
+ * @param[in] channels:	The channel of the session each frame goes to.
+ * @param[in] frames:	The frames, as serialized.  They are not free'd.
+ * @param[in] sizes:	The size of each frame.
+ * @param[in] count:	The number of frames.
+ */
+void udp_send(udp_t *udp, int *channels, char **frames, int *sizes,
+		int count)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iovs[UDP_BATCH];
+	udp_session_t *session = NULL;
+	int p, i, n;
+	int sent;
+	int r;
+
+	for (i = 0; i < count; i++) {
+		packet_tap(frames[i], sizes[i], TAP_OUT);
+	}
+
+	/* one socket per call, so the frames are sorted out by port */
+	for (p = 0; p < udp->port_count; p++) {
+		i = 0;
+		while (i < count) {
+			for (n = 0; (i < count) && (n < UDP_BATCH); i++) {
+				session = &udp->sessions[UDP_SESSION(channels[i])];
+				if (session->port_index != p) {
+					continue;
+				}
+				iovs[n].iov_base = frames[i];
+				iovs[n].iov_len = sizes[i];
+				memset(&msgs[n], 0, sizeof(struct mmsghdr));
+				msgs[n].msg_hdr.msg_iov = &iovs[n];
+				msgs[n].msg_hdr.msg_iovlen = 1;
+				msgs[n].msg_hdr.msg_name = &session->addr;
+				msgs[n].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+				n++;
+			}
+
+			for (sent = 0; sent < n;) {
+				r = sendmmsg(udp->socks[p], msgs + sent, n - sent, 0);
+				if (r < 0) {
+					if (errno == EINTR) {
+						continue;
+					}
+					/* a datagram is lost like any other */
+					LOG_DEBUG(("sendmmsg on port %d failed: %s\n",
+							udp->ports[p], strerror(errno)));
+					break;
+				}
+				sent += r;
+			}
+		}
+	}
+}
+
+/**
+ * Get the number of sessions open.
+ *
+ * @param[in] udp: The transport.
+ */
+int udp_count(udp_t *udp)
+{
+	return __atomic_load_n(&udp->count, __ATOMIC_RELAXED);
+}
+
+/*** Helper Functions ****************************************************/
+
+/* the thread of the transport */
+void *udp_run(void *u)
+{
+	udp_t *udp = (udp_t *)u;
+	struct pollfd *fds = NULL;
+	int count = udp->port_count;
+	int i;
+	int running = TRUE;
+
+	fds = malloc(count * sizeof(struct pollfd));
+	if (!fds) {
+		fprintf(stderr, "failed to malloc udp poll set\n");
+		return NULL;
+	}
+	for (i = 0; i < count; i++) {
+		fds[i].fd = udp->socks[i];
+		fds[i].events = POLLIN;
+	}
+
+	printf("Taking datagrams on %d port(s)\n", count);
+	while (running) {
+		if (poll(fds, count, POLL_MS) > 0) {
+			for (i = 0; i < count; i++) {
+				if (fds[i].revents & POLLIN) {
+					udp_receive(udp, i);
+				}
+			}
+		}
+		udp_flush(udp);
+		if (clock_seconds() != udp->swept) {
+			udp_sweep(udp);
+		}
+
+		pthread_mutex_lock(udp->status_lock);
+		running = udp->run_status;
+		pthread_mutex_unlock(udp->status_lock);
+	}
+
+	free(fds);
+
+	/* whoever is still around is logged out */
+	for (i = 0; i < UDP_SESSIONS; i++) {
+		if (udp->sessions[i].used) {
+			udp_session_close(udp, i);
+		}
+	}
+	udp_flush(udp);
+	return NULL;
+}
+
+/* create a datagram socket for the given port */
+int udp_bind(int port)
+{
+	int sock;
+	int opt = TRUE;
+	struct sockaddr_in address;
+
+	sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("udp socket failed\n");
+		return -1;
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&opt,
+				sizeof(opt)) < 0) {
+		perror("setsockopt\n");
+		close(sock);
+		return -1;
+	}
+
+	/* a burst from many peers has to wait somewhere while we work */
+	opt = SOCKET_BUFFER;
+	if ((setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&opt,
+				sizeof(opt)) < 0) || (setsockopt(sock, SOL_SOCKET, SO_SNDBUF,
+				(char *)&opt, sizeof(opt)) < 0)) {
+		LOG_WARN(("could not grow the buffers of udp port %d\n", port));
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		perror("udp bind failed\n");
+		close(sock);
+		return -1;
+	}
+	printf("Bind to udp %d done\n", port);
+	return sock;
+}
+
+/* take in the datagrams waiting on the socket of a port, a batch at a
+ * time, and only as many batches as were there when we started */
+void udp_receive(udp_t *udp, int port_index)
+{
+	int i;
+	int r;
+
+	do {
+		for (i = 0; i < UDP_BATCH; i++) {
+			udp->rmsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			udp->rmsgs[i].msg_hdr.msg_flags = 0;
+		}
+		r = recvmmsg(udp->socks[port_index], udp->rmsgs, UDP_BATCH,
+				MSG_DONTWAIT, NULL);
+		if (r < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)
+					&& (errno != EINTR)) {
+				LOG_ERROR(("recvmmsg on port %d failed: %s\n",
+						udp->ports[port_index], strerror(errno)));
+			}
+			return;
+		}
+		for (i = 0; i < r; i++) {
+			if (udp->rmsgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				LOG_WARN(("datagram longer than %d bytes, dropping it\n",
+						UDP_FRAME_MAX));
+				continue;
+			}
+			udp_datagram(udp, port_index, &udp->raddrs[i],
+					(char *)udp->riovs[i].iov_base,
+					(int)udp->rmsgs[i].msg_len);
+		}
+	} while (r == UDP_BATCH);
+}
+
+/* make what can be made of one datagram, which is a whole frame or
+ * nothing */
+void udp_datagram(udp_t *udp, int port_index, struct sockaddr_in *addr,
+		char *bytes, int len)
+{
+	int index;
+	packet_t *packet = NULL;
+
+	index = udp_session_find(udp, addr);
+	if (index < 0) {
+		/* this one only says hello */
+		udp_hello(udp, port_index, addr, bytes, len);
+		return;
+	}
+	udp->sessions[index].seen = clock_seconds();
+
+	if ((packet_frame_size(bytes, len) != len)
+			|| (!packet_frame_intact(bytes, len))) {
+		LOG_WARN(("damaged or partial datagram from %s:%d, dropping it\n",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+		return;
+	}
+	packet = packet_from_frame(bytes);
+	if (!packet) {
+		LOG_WARN(("invalid datagram from %s:%d, dropping it\n",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+		return;
+	}
+	if (!udp_admit(udp, &udp->sessions[index], packet)) {
+		free_packet(packet);
+		return;
+	}
+	udp_handle(udp, index, packet);
+}
+
+/* answer the hello of a peer without a session with a cookie, or open
+ * its session if it gave the cookie back.  Nothing else is taken from a
+ * stranger */
+void udp_hello(udp_t *udp, int port_index, struct sockaddr_in *addr,
+		char *bytes, int len)
+{
+	packet_t *packet = NULL;
+	packet_t *reply = NULL;
+	char cookie[UDP_COOKIE_LEN + 1];
+	char *frame = NULL;
+	long slot;
+	int size;
+
+	if ((packet_frame_size(bytes, len) != len)
+			|| (!packet_frame_intact(bytes, len))) {
+		LOG_DEBUG(("damaged hello from %s:%d, dropping it\n",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+		return;
+	}
+	packet = packet_from_frame(bytes);
+	if ((!packet) || (packet->code != LOGIN) 
+			|| (packet->data_len != UDP_COOKIE_LEN)) {
+		LOG_DEBUG(("not a hello from %s:%d, dropping it\n",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+		free_packet(packet);
+		return;
+	}
+	if (admission_check_address(udp->speaker->admit,
+				(unsigned char *)&addr->sin_addr.s_addr) != ADMIT_PASS) {
+		free_packet(packet);
+		return;
+	}
+
+	/* the cookie of this slot, or of the one before */
+	slot = clock_seconds() / UDP_COOKIE_SECS;
+	udp_cookie(udp, addr, slot, cookie);
+	if (!memcmp(packet->data, cookie, UDP_COOKIE_LEN)) {
+		udp_session_open(udp, addr, port_index);
+		free_packet(packet);
+		return;
+	}
+	udp_cookie(udp, addr, slot - 1, cookie);
+	if (!memcmp(packet->data, cookie, UDP_COOKIE_LEN)) {
+		udp_session_open(udp, addr, port_index);
+		free_packet(packet);
+		return;
+	}
+	free_packet(packet);
+
+	/* the cookie of this slot goes back, no larger than the hello */
+	udp_cookie(udp, addr, slot, cookie);
+	reply = new_packet(ECHO, udp_null_address, cookie, udp_null_address,
+			udp->ports[port_index], udp->ports[port_index]);
+	frame = reply ? serialize(reply, &size) : NULL;
+	if ((frame) && (size <= len)) {
+		packet_tap(frame, size, TAP_OUT);
+		if (sendto(udp->socks[port_index], frame, size, MSG_DONTWAIT,
+					(struct sockaddr *)addr, sizeof(*addr)) < 0) {
+			LOG_DEBUG(("failed to send a cookie: %s\n", strerror(errno)));
+		}
+	}
+	free(frame);
+	free_packet(reply);
+}
+
+/* the cookie of a peer for a time slot, UDP_COOKIE_LEN hex characters
+ * with a 0 after them */
+void udp_cookie(udp_t *udp, struct sockaddr_in *addr, long slot,
+		char *cookie)
+{
+	unsigned char bytes[14];
+	uint64_t mac;
+	int i;
+
+	memcpy(bytes, &addr->sin_addr.s_addr, 4);
+	memcpy(bytes + 4, &addr->sin_port, 2);
+	for (i = 0; i < 8; i++) {
+		bytes[6 + i] = (unsigned char)((unsigned long)slot >> (8 * i));
+	}
+	mac = udp_siphash(udp->secret, bytes, sizeof(bytes));
+	for (i = 0; i < UDP_COOKIE_LEN; i++) {
+		cookie[i] = "0123456789abcdef"[(mac >> (4 * i)) & 0xf];
+	}
+	cookie[UDP_COOKIE_LEN] = 0;
+}
+
+/* pick the key of the cookies, from the kernel if it will give one */
+void udp_keygen(udp_t *udp)
+{
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	int got = 0;
+
+	if (fd >= 0) {
+		got = (int)read(fd, udp->secret, sizeof(udp->secret));
+		close(fd);
+	}
+	if (got != (int)sizeof(udp->secret)) {
+		LOG_WARN(("no random key for the udp cookies, making one up\n"));
+		udp->secret[0] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+		udp->secret[1] = (uint64_t)(unsigned long)udp ^ (uint64_t)clock();
+	}
+}
+
+/* SipHash-2-4 of some bytes under a 128 bit key */
+uint64_t udp_siphash(uint64_t *key, unsigned char *bytes, int len)
+{
+	uint64_t v0 = key[0] ^ 0x736f6d6570736575UL;
+	uint64_t v1 = key[1] ^ 0x646f72616e646f6dUL;
+	uint64_t v2 = key[0] ^ 0x6c7967656e657261UL;
+	uint64_t v3 = key[1] ^ 0x7465646279746573UL;
+	uint64_t m;
+	int i, j;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		m = 0;
+		for (j = 0; j < 8; j++) {
+			m |= (uint64_t)bytes[i + j] << (8 * j);
+		}
+		v3 ^= m;
+		SIP_ROUND(v0, v1, v2, v3);
+		SIP_ROUND(v0, v1, v2, v3);
+		v0 ^= m;
+	}
+	/* the last few bytes, with the length in the top one */
+	m = (uint64_t)(len & 0xff) << 56;
+	for (j = 0; i + j < len; j++) {
+		m |= (uint64_t)bytes[i + j] << (8 * j);
+	}
+	v3 ^= m;
+	SIP_ROUND(v0, v1, v2, v3);
+	SIP_ROUND(v0, v1, v2, v3);
+	v0 ^= m;
+
+	v2 ^= 0xff;
+	for (i = 0; i < 4; i++) {
+		SIP_ROUND(v0, v1, v2, v3);
+	}
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* handle a packet from a session, as listener_handle does one from a
+ * connection.  The packet is consumed */
+void udp_handle(udp_t *udp, int index, packet_t *packet)
+{
+	server_speaker_t *speaker = udp->speaker;
+	int channel = UDP_CHANNEL(index);
+	packet_t *p = NULL;
+	int class;
+	int verdict;
+
+	/* replies of this thread go out before those of the speaker */
+	if (packet->code != ECHO) {
+		udp_flush(udp);
+	}
+
+	if (packet->code == QUIT) {
+		udp_session_close(udp, index);
+	} else if (packet->code == SEND) {
+		verdict = policy_decide(speaker->policy, packet->header.src_ip,
+				packet->header.dst_ip, speaker->serv_ip);
+		if (verdict == VERDICT_FORWARD) {
+			users_send_packet(udp->users, packet);
+		} else if (verdict != VERDICT_DROP) {
+			nat_submit(speaker->nat, packet, verdict);
+			packet = NULL;
+		}
+	} else if (packet->code == ECHO) {
+		udp_reply(udp, index, packet);
+	} else if (packet->code == BROADCAST) {
+		broadcast(speaker, packet);
+		packet = NULL;
+	} else if (packet->code == LOGIN) {
+		class = policy_lookup(speaker->policy, packet->header.src_ip);
+		if (((class == POLICY_EXTERNAL) || (class == POLICY_NO_NAT))
+				&& (memcmp(packet->header.src_ip, speaker->serv_ip, 4))
+				&& (login_connection(udp->users, channel,
+						packet->header.src_ip))) {
+			memcpy(udp->sessions[index].src, packet->header.src_ip, 4);
+			udp->sessions[index].has_src = TRUE;
+			p = new_packet(SEND, udp_null_address, "accept",
+					packet->header.src_ip, 8002, packet->header.src_port);
+			udp_reply(udp, index, p);
+			free_packet(p);
+			udp_flush(udp);
+			push_user_list(speaker);
+		} else {
+			LOG_INFO(("Denying the login of %d.%d.%d.%d over udp\n",
+					packet->header.src_ip[0], packet->header.src_ip[1],
+					packet->header.src_ip[2], packet->header.src_ip[3]));
+			p = new_packet(SEND, udp_null_address, "denial",
+					packet->header.src_ip, 8002, packet->header.src_port);
+			udp_reply(udp, index, p);
+			free_packet(p);
+			udp_flush(udp);
+			udp_session_close(udp, index);
+		}
+	} else if (packet->code == GET_ULIST) {
+		add_packet_to_queue(speaker, packet);
+		packet = NULL;
+	} else {
+		LOG_WARN(("Packet with code %d came over udp.  this is weird\n",
+				packet->code));
+	}
+	if (packet) {
+		free_packet(packet);
+	}
+}
+
+/* decide whether a packet from a session is taken in.  A datagram can't
+ * be held back like a stream, so what would be deferred is dropped */
+int udp_admit(udp_t *udp, udp_session_t *session, packet_t *packet)
+{
+	admission_t *admit = udp->speaker->admit;
+	int verdict;
+
+	if ((packet->code == LOGIN) || (packet->code == QUIT)) {
+		return TRUE;
+	}
+	/* its source is that of the session, or it is not taken in */
+	if ((!session->has_src) 
+			|| (memcmp(packet->header.src_ip, session->src, 4))) {
+		admission_count_drop(admit, DROP_SPOOFED);
+		return FALSE;
+	}
+	/* the address bucket is that of the peer, whatever it claims */
+	verdict = admission_check(admit, &session->bucket,
+			(unsigned char *)&session->addr.sin_addr.s_addr,
+			packet->code != ECHO);
+	if (verdict == ADMIT_DEFER) {
+		admission_count_drop(admit, DROP_QUEUE_FULL);
+		verdict = ADMIT_DROP;
+	}
+	return verdict == ADMIT_PASS;
+}
+
+/* the session of a peer, -1 if it has none */
+int udp_session_find(udp_t *udp, struct sockaddr_in *addr)
+{
+	int i;
+	udp_session_t *session = NULL;
+
+	for (i = udp->table[udp_hash(addr)]; i >= 0; i = session->next) {
+		session = &udp->sessions[i];
+		if ((session->addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+				&& (session->addr.sin_port == addr->sin_port)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* give a new peer a session and send it its LOGIN.  Returns the session,
+ * -1 if there was no room for it or its LOGIN failed */
+int udp_session_open(udp_t *udp, struct sockaddr_in *addr, int port_index)
+{
+	int index = udp->free_list;
+	int h = udp_hash(addr);
+	udp_session_t *session = NULL;
+
+	if (index < 0) {
+		LOG_WARN(("no room for a udp session from %s:%d\n",
+				inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+		return -1;
+	}
+	session = &udp->sessions[index];
+	udp->free_list = session->next;
+
+	memset(session, 0, sizeof(udp_session_t));
+	session->addr = *addr;
+	session->port_index = port_index;
+	session->used = TRUE;
+	session->seen = clock_seconds();
+	admission_conn_init(udp->speaker->admit, &session->bucket);
+	session->next = udp->table[h];
+	udp->table[h] = index;
+	__atomic_add_fetch(&udp->count, 1, __ATOMIC_RELAXED);
+
+	LOG_INFO(("New udp session: \nsession:\t%d\nip: \t%s\nport:\t%d\n",
+			index, inet_ntoa(addr->sin_addr), ntohs(addr->sin_port)));
+
+	if ((!add_connection(udp->users, UDP_CHANNEL(index), NULL))
+			|| (!udp_session_login(udp, index))) {
+		udp_session_close(udp, index);
+		return -1;
+	}
+	return index;
+}
+
+/* allocate addresses for a new session and send it its LOGIN packet, as
+ * listener_login does for a connection */
+int udp_session_login(udp_t *udp, int index)
+{
+	udp_session_t *session = &udp->sessions[index];
+	server_listener_t *primary = udp->primary;
+	packet_t *packet = NULL;
+	int allocated;
+
+	if (!gen_mac(primary->mac_allocator, session->mac)) {
+		return FALSE;
+	}
+	session->has_mac = TRUE;
+
+	if (session->port_index == 0) {
+		/* internal user */
+		pthread_mutex_lock(primary->alloc_lock);
+		allocated = allocate_address(primary->ip_allocator, session->ip);
+		pthread_mutex_unlock(primary->alloc_lock);
+		if (!allocated) {
+			LOG_WARN(("address pool exhausted, dropping udp session %d\n",
+					index));
+			return FALSE;
+		}
+		session->has_ip = TRUE;
+		memcpy(session->src, session->ip, 4);
+		session->has_src = TRUE;
+		if (!login_connection(udp->users, UDP_CHANNEL(index), session->ip)) {
+			LOG_WARN(("pool address already online, dropping udp session %d\n",
+					index));
+			return FALSE;
+		}
+		packet = new_packet(LOGIN, session->ip, NULL, session->ip, 8001, 8001);
+	} else {
+		/* external user */
+		packet = new_packet(LOGIN, NULL, NULL, NULL, 8001, 8001);
+	}
+	if (!packet) {
+		return FALSE;
+	}
+	memcpy(packet->header.dst_mac, session->mac, 6);
+	udp_reply(udp, index, packet);
+	free_packet(packet);
+
+	if (session->port_index == 0) {
+		udp_flush(udp);
+		push_user_list(udp->speaker);
+	}
+	return TRUE;
+}
+
+/* take a session out of the users and the table, giving back its mac
+ * and ip addresses */
+void udp_session_close(udp_t *udp, int index)
+{
+	udp_session_t *session = &udp->sessions[index];
+	server_listener_t *primary = udp->primary;
+	int *link = &udp->table[udp_hash(&session->addr)];
+
+	/* its replies go out while it is still there to take them */
+	udp_flush(udp);
+
+	/* once out of the users, no other thread sends to it */
+	remove_channel(udp->users, UDP_CHANNEL(index));
+	if (session->has_mac) {
+		release_mac(primary->mac_allocator, session->mac);
+	}
+	if (session->has_ip) {
+		pthread_mutex_lock(primary->alloc_lock);
+		release_address(primary->ip_allocator, session->ip);
+		pthread_mutex_unlock(primary->alloc_lock);
+	}
+
+	while (*link != index) {
+		link = &udp->sessions[*link].next;
+	}
+	*link = session->next;
+	session->used = FALSE;
+	session->has_mac = FALSE;
+	session->has_ip = FALSE;
+	session->next = udp->free_list;
+	udp->free_list = index;
+	__atomic_sub_fetch(&udp->count, 1, __ATOMIC_RELAXED);
+
+	/* the others get to see the user go */
+	push_user_list(udp->speaker);
+	LOG_DEBUG(("closed udp session %d\n", index));
+}
+
+/* close the sessions that have gone quiet for too long */
+void udp_sweep(udp_t *udp)
+{
+	int i;
+	long now = clock_seconds();
+
+	udp->swept = now;
+	for (i = 0; i < UDP_SESSIONS; i++) {
+		if ((udp->sessions[i].used)
+				&& (now - udp->sessions[i].seen > udp->idle_timeout)) {
+			LOG_INFO(("udp session %d went quiet, closing it\n", i));
+			udp_session_close(udp, i);
+		}
+	}
+}
+
+/* queue a packet for a session, to go out with the next flush.  The
+ * packet is not consumed */
+void udp_reply(udp_t *udp, int index, packet_t *packet)
+{
+	int size;
+	char *frame = NULL;
+
+	if (udp->out_count == UDP_BATCH) {
+		udp_flush(udp);
+	}
+	frame = serialize(packet, &size);
+	if (!frame) {
+		return;
+	}
+	udp->out_frames[udp->out_count] = frame;
+	udp->out_sizes[udp->out_count] = size;
+	udp->out_channels[udp->out_count] = UDP_CHANNEL(index);
+	udp->out_count++;
+}
+
+/* send the replies queued by udp_reply */
+void udp_flush(udp_t *udp)
+{
+	int i;
+
+	if (!udp->out_count) {
+		return;
+	}
+	udp_send(udp, udp->out_channels, udp->out_frames, udp->out_sizes,
+			udp->out_count);
+	for (i = 0; i < udp->out_count; i++) {
+		free(udp->out_frames[i]);
+		udp->out_frames[i] = NULL;
+	}
+	udp->out_count = 0;
+}
+
+/* FNV-1a over the address and port of a peer */
+unsigned long udp_hash(struct sockaddr_in *addr)
+{
+	unsigned char *bytes[2];
+	int lens[2];
+	unsigned long h = 2166136261UL;
+	int i, j;
+
+	bytes[0] = (unsigned char *)&addr->sin_addr.s_addr;
+	lens[0] = sizeof(addr->sin_addr.s_addr);
+	bytes[1] = (unsigned char *)&addr->sin_port;
+	lens[1] = sizeof(addr->sin_port);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < lens[i]; j++) {
+			h = ((h ^ bytes[i][j]) * 16777619UL) & 0xffffffffUL;
+		}
+	}
+	return (h ^ (h >> 16)) & (UDP_BUCKETS - 1);
+}
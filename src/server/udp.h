@@ -0,0 +1,160 @@
+/*
+ * The datagram transport of the server.
+ *
+ * Next to the TCP ports, the server can take the same frames over UDP,
+ * one frame per datagram, on the same port numbers.  A single socket per
+ * port serves every peer: datagrams are taken in batches with recvmmsg,
+ * and each source address and port has a session in a table of its own,
+ * which stands in for the connection a TCP client would have.
+ *
+ * A peer without a session says hello with an intact LOGIN frame whose
+ * data is UDP_COOKIE_LEN characters long.  Nothing is kept for it: it is
+ * answered with an ECHO of the same size, carrying a cookie made from its
+ * address and a secret of the server.  Only a hello that gives the cookie
+ * back opens a session, answered with the LOGIN a TCP client gets when
+ * it connects, so a forged source address can neither take sessions nor
+ * have the server send it more than it was sent.  Hellos take from the
+ * bucket of their source address, as set for the admission control.  A
+ * session that stays quiet for longer than the idle timeout is closed,
+ * so peers keep theirs open with an ECHO now and then.
+ *
+ * A session is known to the users by a negative channel number in place
+ * of a socket, see UDP_CHANNEL, and whatever is sent to it goes out with
+ * sendmmsg in batches of up to UDP_BATCH.
+ */
+#ifndef UDP_H
+#define UDP_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "server_listener.h"
+#include "admission.h"
+
+#define UDP_BATCH			64		/* Datagrams per recvmmsg or sendmmsg */
+#define UDP_FRAME_MAX		16384	/* The longest datagram taken in */
+#define UDP_SESSIONS		4096	/* Peers served at the same time */
+#define UDP_BUCKETS			1024	/* Chains of the session table, a power of 2 */
+#define DEFAULT_UDP_IDLE	60		/* Seconds a quiet session is kept */
+#define UDP_COOKIE_LEN		16		/* Characters of the cookie of a hello */
+#define UDP_COOKIE_SECS		30		/* A cookie holds for one to two of these */
+
+/* The channel of session i in the users, and back */
+#define UDP_CHANNEL(i)		(-(i) - 1)
+#define UDP_SESSION(ch)		(-(ch) - 1)
+#define UDP_IS_CHANNEL(ch)	((ch) < 0)
+
+/*** Struct definitions **************************************************/
+
+/*
+ * The state kept for one peer.  It is only changed by the thread of the
+ * transport, and the other threads only read addr and port_index, under
+ * the lock of the users, while the session is in the users.
+ */
+typedef struct udp_session {
+	struct sockaddr_in addr;	/* The peer, the key of the table */
+	int port_index;				/* The port it talks to */
+	int used;
+	long seen;					/* When its last datagram came, in seconds */
+	unsigned char mac[6];		/* The mac address handed out at LOGIN */
+	int has_mac;				/* mac is set, and must be released */
+	unsigned char ip[4];		/* The address handed out from the pool */
+	int has_ip;					/* ip is set, and must be released */
+	unsigned char src[4];		/* The source its packets must carry */
+	int has_src;				/* src is set, it is logged in */
+	bucket_t bucket;			/* Limits the rate of packets taken in */
+	int next;					/* The next session in its chain, or the
+								 * next free one, -1 at the end */
+} udp_session_t;
+
+typedef struct udp {
+	int *ports;
+	int *socks;					/* The socket bound to each port */
+	int port_count;
+	int run_status;
+	pthread_mutex_t *status_lock;
+	pthread_t thread;
+	users_t *users;
+	server_speaker_t *speaker;
+	server_listener_t *primary;	/* Whose address allocators are shared */
+	long idle_timeout;			/* Seconds a quiet session is kept */
+	uint64_t secret[2];			/* The key the cookies are made with */
+	udp_session_t *sessions;	/* UDP_SESSIONS of them */
+	int table[UDP_BUCKETS];		/* The first session of each chain, or -1 */
+	int free_list;				/* The first unused session, or -1 */
+	int count;					/* The sessions open */
+	long swept;					/* When idle sessions were last closed */
+	char *rbufs;				/* UDP_BATCH receive buffers */
+	struct mmsghdr *rmsgs;
+	struct iovec *riovs;
+	struct sockaddr_in *raddrs;
+	char *out_frames[UDP_BATCH];	/* Replies of the thread, not yet sent */
+	int out_sizes[UDP_BATCH];
+	int out_channels[UDP_BATCH];
+	int out_count;
+} udp_t;
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Allocate the transport and bind a socket to each port.
+ *
+ * @param[in] primary:		The first listener, whose users, speaker and
+ *							address allocators the sessions share.
+ * @param[in] ports:		The ports to take datagrams on.
+ * @param[in] port_count:	The number of ports.  The first one is the
+ *							internal port, as with the listeners.
+ *
+ * @return The new transport, NULL on failure.
+ */
+udp_t *new_udp(server_listener_t *primary, int *ports, int port_count);
+
+/**
+ * Close the sockets and free the transport.  The thread must have been
+ * stopped.
+ *
+ * @param[in] udp: The transport to be free'd.
+ */
+void free_udp(udp_t *udp);
+
+/**
+ * Start the thread that serves the sockets.
+ *
+ * @param[in] udp: The transport.
+ *
+ * @return TRUE(1) on success, FALSE(0) if the thread could not start.
+ */
+int udp_start(udp_t *udp);
+
+/**
+ * Stop the thread and wait for it to finish.  The sessions still open
+ * are closed.
+ *
+ * @param[in] udp: The transport.
+ */
+void udp_stop(udp_t *udp);
+
+/**
+ * Send frames to sessions, with as few sendmmsg calls as possible.  The
+ * frames for the same session go out in order.  Any thread but that of
+ * the transport must hold the lock of the users, and only send to
+ * sessions it found in them.
+ *
+ * @param[in] udp:		The transport.
+ * @param[in] channels:	The channel of the session each frame goes to.
+ * @param[in] frames:	The frames, as serialized.  They are not free'd.
+ * @param[in] sizes:	The size of each frame.
+ * @param[in] count:	The number of frames.
+ */
+void udp_send(udp_t *udp, int *channels, char **frames, int *sizes,
+		int count);
+
+/**
+ * Get the number of sessions open.
+ *
+ * @param[in] udp: The transport.
+ */
+int udp_count(udp_t *udp);
+
+#endif
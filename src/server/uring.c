@@ -0,0 +1,353 @@
+/*
+ * A small wrapper around the raw io_uring system calls.
+ *
+ * The layout of the shared rings follows the io_uring_setup(2) man page.
+ * The head and tail indices are shared with the kernel, so they are read
+ * with acquire and written with release semantics.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/time_types.h>
+
+#include "uring.h"
+#include "../log/log.h"
+
+/*** Helper Function Prototypes ******************************************/
+
+int uring_map(uring_t *ring, struct io_uring_params *params);
+int uring_setup_buffers(uring_t *ring, unsigned buf_count, unsigned buf_size);
+
+/*** Functions ***********************************************************/
+
+/**
+ * Set up a ring and register its provided buffers.
+ *
+ * @param[in] entries:		The size of the submission queue.
+ * @param[in] buf_count:	The number of provided buffers, a power of two.
+ * @param[in] buf_size:		The size of each provided buffer.
+ *
+ * @return The new ring, NULL if io_uring is not available.
+ */
+uring_t *new_uring(unsigned entries, unsigned buf_count, unsigned buf_size)
+{
+	uring_t *ring = NULL;
+	struct io_uring_params params;
+
+	ring = malloc(sizeof(uring_t));
+	if (!ring) {
+		fprintf(stderr, "failed to malloc uring\n");
+		return NULL;
+	}
+	memset(ring, 0, sizeof(uring_t));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		LOG_WARN(("io_uring_setup failed: %s\n", strerror(errno)));
+		free(ring);
+		return NULL;
+	}
+	ring->features = params.features;
+	if (!(ring->features & IORING_FEAT_EXT_ARG)) {
+		LOG_WARN(("io_uring is too old, no IORING_FEAT_EXT_ARG\n"));
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	if (!uring_map(ring, &params)) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	if (!uring_setup_buffers(ring, buf_count, buf_size)) {
+		free_uring(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/**
+ * Tear down a ring.  Requests still in flight are cancelled by the
+ * kernel.
+ *
+ * @param[in] ring: The ring to be free'd.
+ */
+void free_uring(uring_t *ring)
+{
+	if (!ring) {
+		return;
+	}
+	if (ring->fd >= 0) {
+		close(ring->fd);
+		ring->fd = -1;
+	}
+	if (ring->buf_ring) {
+		munmap(ring->buf_ring, ring->buf_count * sizeof(struct io_uring_buf));
+		ring->buf_ring = NULL;
+	}
+	if (ring->bufs) {
+		free(ring->bufs);
+		ring->bufs = NULL;
+	}
+	if (ring->sqes) {
+		munmap(ring->sqes, ring->sqes_size);
+		ring->sqes = NULL;
+	}
+	if ((ring->cq_ptr) && (ring->cq_ptr != ring->sq_ptr)) {
+		munmap(ring->cq_ptr, ring->cq_size);
+	}
+	ring->cq_ptr = NULL;
+	if (ring->sq_ptr) {
+		munmap(ring->sq_ptr, ring->sq_size);
+		ring->sq_ptr = NULL;
+	}
+	free(ring);
+}
+
+/**
+ * Get a zeroed submission queue entry, submitting the ones queued so far
+ * if the queue is full.
+ *
+ * @param[in] ring: The ring.
+ *
+ * @return The entry, NULL if none could be freed up.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring)
+{
+	struct io_uring_sqe *sqe = NULL;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (ring->sqe_tail - head > *ring->sq_mask) {
+		/* full: hand what we have to the kernel first */
+		if (uring_submit_and_wait(ring, 0, 0) < 0) {
+			return NULL;
+		}
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sqe_tail - head > *ring->sq_mask) {
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[ring->sqe_tail & *ring->sq_mask];
+	ring->sq_array[ring->sqe_tail & *ring->sq_mask] = ring->sqe_tail & *ring->sq_mask;
+	ring->sqe_tail++;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	return sqe;
+}
+
+/**
+ * Submit all queued entries and wait for at least wait_nr completions,
+ * or until timeout_ms has passed.
+ *
+ * @param[in] ring:			The ring.
+ * @param[in] wait_nr:		The number of completions to wait for.
+ * @param[in] timeout_ms:	The longest to wait, in milliseconds.
+ *
+ * @return The number of entries submitted, negative errno on failure.
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, long timeout_ms)
+{
+	unsigned tail = *ring->sq_tail;
+	unsigned to_submit = ring->sqe_tail - tail;
+	unsigned flags = IORING_ENTER_EXT_ARG;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	int ret;
+
+	/* publish the new entries */
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+	if (wait_nr) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (unsigned long)&ts;
+
+	do {
+		ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr,
+				flags, &arg, sizeof(arg));
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret < 0) {
+		if (errno == ETIME) {
+			return 0;
+		}
+		return -errno;
+	}
+	return ret;
+}
+
+/**
+ * Get the next completion without waiting.
+ *
+ * @param[in] ring: The ring.
+ *
+ * @return The completion, NULL if there is none.  Hand it back with
+ * uring_cqe_seen when done with it.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		return NULL;
+	}
+	return &ring->cqes[head & *ring->cq_mask];
+}
+
+/**
+ * Mark a completion returned by uring_peek_cqe as consumed.
+ *
+ * @param[in] ring: The ring.
+ */
+void uring_cqe_seen(uring_t *ring)
+{
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Get the data of the provided buffer a receive completed into.
+ *
+ * @param[in] ring:	The ring.
+ * @param[in] bid:	The buffer id from the flags of the completion.
+ */
+char *uring_buffer(uring_t *ring, unsigned bid)
+{
+	return ring->bufs + ((unsigned long)bid * ring->buf_size);
+}
+
+/**
+ * Give a provided buffer back to the kernel for the next receive.
+ *
+ * @param[in] ring:	The ring.
+ * @param[in] bid:	The buffer id from the flags of the completion.
+ */
+void uring_recycle_buffer(uring_t *ring, unsigned bid)
+{
+	struct io_uring_buf *buf = NULL;
+
+	buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+	buf->addr = (unsigned long)uring_buffer(ring, bid);
+	buf->len = ring->buf_size;
+	buf->bid = (unsigned short)bid;
+	ring->buf_tail++;
+	__atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/*** Helper Functions ****************************************************/
+
+/* map the queues the kernel set up for us */
+int uring_map(uring_t *ring, struct io_uring_params *params)
+{
+	ring->sq_size = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+	ring->cq_size = params->cq_off.cqes +
+		params->cq_entries * sizeof(struct io_uring_cqe);
+	if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size) {
+			ring->sq_size = ring->cq_size;
+		}
+		ring->cq_size = ring->sq_size;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		ring->sq_ptr = NULL;
+		LOG_WARN(("failed to map io_uring sq: %s\n", strerror(errno)));
+		return 0;
+	}
+	if (ring->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			ring->cq_ptr = NULL;
+			LOG_WARN(("failed to map io_uring cq: %s\n", strerror(errno)));
+			munmap(ring->sq_ptr, ring->sq_size);
+			ring->sq_ptr = NULL;
+			return 0;
+		}
+	}
+
+	ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		LOG_WARN(("failed to map io_uring sqes: %s\n", strerror(errno)));
+		if (ring->cq_ptr != ring->sq_ptr) {
+			munmap(ring->cq_ptr, ring->cq_size);
+		}
+		munmap(ring->sq_ptr, ring->sq_size);
+		ring->sq_ptr = ring->cq_ptr = NULL;
+		return 0;
+	}
+
+	ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params->sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params->sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params->sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params->sq_off.array);
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params->cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params->cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params->cq_off.cqes);
+
+	return 1;
+}
+
+/* register a ring of provided buffers and hand all of them to the kernel */
+int uring_setup_buffers(uring_t *ring, unsigned buf_count, unsigned buf_size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned i;
+
+	ring->buf_count = buf_count;
+	ring->buf_size = buf_size;
+	ring->buf_tail = 0;
+
+	/* the ring itself must be page aligned */
+	ring->buf_ring = mmap(NULL, buf_count * sizeof(struct io_uring_buf),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->buf_ring == MAP_FAILED) {
+		ring->buf_ring = NULL;
+		LOG_WARN(("failed to map provided buffer ring\n"));
+		return 0;
+	}
+	ring->bufs = malloc((unsigned long)buf_count * buf_size);
+	if (!ring->bufs) {
+		fprintf(stderr, "failed to malloc provided buffers\n");
+		return 0;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)ring->buf_ring;
+	reg.ring_entries = buf_count;
+	reg.bgid = URING_BUF_GROUP;
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) {
+		LOG_WARN(("failed to register provided buffers: %s\n", strerror(errno)));
+		return 0;
+	}
+
+	for (i = 0; i < buf_count; i++) {
+		uring_recycle_buffer(ring, i);
+	}
+	return 1;
+}
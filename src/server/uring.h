@@ -0,0 +1,123 @@
+/*
+ * A small wrapper around the raw io_uring system calls, covering only
+ * what the server needs: a submission and completion queue, and one
+ * registered ring of provided buffers for multishot receives.
+ */
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*** Struct definitions **************************************************/
+
+typedef struct uring {
+	int fd;
+
+	/* submission queue, shared with the kernel */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned sqe_tail;			/* sqes handed out, not yet submitted */
+
+	/* completion queue, shared with the kernel */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ptr;
+	void *cq_ptr;
+	unsigned long sq_size;
+	unsigned long cq_size;
+	unsigned long sqes_size;
+	unsigned features;
+
+	/* provided buffers, picked by the kernel for multishot receives */
+	struct io_uring_buf_ring *buf_ring;
+	char *bufs;
+	unsigned buf_count;
+	unsigned buf_size;
+	unsigned short buf_tail;
+} uring_t;
+
+#define URING_BUF_GROUP	0	/* The group id of the provided buffers */
+
+/*** Function Prototypes *************************************************/
+
+/**
+ * Set up a ring and register its provided buffers.
+ *
+ * @param[in] entries:		The size of the submission queue.
+ * @param[in] buf_count:	The number of provided buffers, a power of two.
+ * @param[in] buf_size:		The size of each provided buffer.
+ *
+ * @return The new ring, NULL if io_uring is not available.
+ */
+uring_t *new_uring(unsigned entries, unsigned buf_count, unsigned buf_size);
+
+/**
+ * Tear down a ring.  Requests still in flight are cancelled by the
+ * kernel.
+ *
+ * @param[in] ring: The ring to be free'd.
+ */
+void free_uring(uring_t *ring);
+
+/**
+ * Get a zeroed submission queue entry, submitting the ones queued so far
+ * if the queue is full.
+ *
+ * @param[in] ring: The ring.
+ *
+ * @return The entry, NULL if none could be freed up.
+ */
+struct io_uring_sqe *uring_get_sqe(uring_t *ring);
+
+/**
+ * Submit all queued entries and wait for at least wait_nr completions,
+ * or until timeout_ms has passed.
+ *
+ * @param[in] ring:			The ring.
+ * @param[in] wait_nr:		The number of completions to wait for.
+ * @param[in] timeout_ms:	The longest to wait, in milliseconds.
+ *
+ * @return The number of entries submitted, negative errno on failure.
+ */
+int uring_submit_and_wait(uring_t *ring, unsigned wait_nr, long timeout_ms);
+
+/**
+ * Get the next completion without waiting.
+ *
+ * @param[in] ring: The ring.
+ *
+ * @return The completion, NULL if there is none.  Hand it back with
+ * uring_cqe_seen when done with it.
+ */
+struct io_uring_cqe *uring_peek_cqe(uring_t *ring);
+
+/**
+ * Mark a completion returned by uring_peek_cqe as consumed.
+ *
+ * @param[in] ring: The ring.
+ */
+void uring_cqe_seen(uring_t *ring);
+
+/**
+ * Get the data of the provided buffer a receive completed into.
+ *
+ * @param[in] ring:	The ring.
+ * @param[in] bid:	The buffer id from the flags of the completion.
+ */
+char *uring_buffer(uring_t *ring, unsigned bid);
+
+/**
+ * Give a provided buffer back to the kernel for the next receive.
+ *
+ * @param[in] ring:	The ring.
+ * @param[in] bid:	The buffer id from the flags of the completion.
+ */
+void uring_recycle_buffer(uring_t *ring, unsigned bid);
+
+#endif
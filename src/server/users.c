@@ -1,11 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
+#include <sys/socket.h>
 
 #include "users.h"
+#include "udp.h"
 #include "../hashset/ip_hashset.h"
 #include "../hashset/fd_hashset.h"
 #include "../queue/queue.h"
+#include "../packet/serializer.h"
+#include "../log/log.h"
+
+#define TRUE	1
+#define FALSE	0
+
+/*** Helper Function Prototypes ******************************************/
+
+outbuf_t *users_output(users_t *users, int fd);
+void users_drop_output(users_t *users, int fd);
+void users_write(users_t *users, int fd, char **frames, int *sizes,
+		int count);
+void users_note_waiting(users_t *users, int fd, outbuf_t *out, int waited);
+void users_cut_off(users_t *users, int fd, outbuf_t *out, int waited);
 
 /*
 typedef struct users {
@@ -34,15 +51,26 @@ users_t *new_users()
 
 	users->hs_protect = malloc(sizeof(pthread_mutex_t));
 	pthread_mutex_init(users->hs_protect, NULL);
+	users->udp = NULL;
+	users->outs = NULL;
+	users->outs_cap = 0;
+	users->backlogged = 0;
 
 	return users;
 }
 
 void free_users(users_t *users)
 {
+	int fd;
+
 	if (!users) {
 		return;
 	}
+	for (fd = 0; fd < users->outs_cap; fd++) {
+		free_outbuf(users->outs[fd]);
+	}
+	free(users->outs);
+	users->outs = NULL;
 	if (users->ips) {
 		free_ip_hashset(users->ips);
 		users->ips = NULL;
@@ -59,48 +87,307 @@ void free_users(users_t *users)
 	free(users);
 }
 
-/* remember to free this queue appropriately */
-queue_t *get_ips(users_t *users)
+/**
+ * Copy the userips of all online users into a buffer owned by the
+ * caller, 4 bytes per ip.  The buffer is only grown when it is too
+ * small, so a caller that keeps it around allocates nothing once it is
+ * big enough.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in,out] ips:	The buffer, may point to NULL at first.
+ * @param[in,out] cap:	The number of ips the buffer has room for.
+ *
+ * @return The number of ips copied, -1 if the buffer could not grow.
+ */
+int users_copy_ips(users_t *users, unsigned char **ips, int *cap)
 {
-	queue_t *q = NULL;
+	int count;
+	int new_cap;
+	unsigned char *grown = NULL;
 
 	pthread_mutex_lock(users->hs_protect);
-	q = iphs_get_keys(users->ips);
+	count = ip_hashset_content_count(users->ips);
+	if (count > *cap) {
+		new_cap = *cap ? *cap : 16;
+		while (new_cap < count) {
+			new_cap *= 2;
+		}
+		grown = realloc(*ips, 4 * new_cap);
+		if (!grown) {
+			pthread_mutex_unlock(users->hs_protect);
+			fprintf(stderr, "failed to grow the user ip buffer\n");
+			return -1;
+		}
+		*ips = grown;
+		*cap = new_cap;
+	}
+	count = iphs_copy_keys(users->ips, *ips, *cap);
 	pthread_mutex_unlock(users->hs_protect);
 
-	return q;
+	return count;
 }
 
-/* remember to free this queue appropriately */
-queue_t *get_fds(users_t *users)
+
+/**
+ * Send a packet to the user its destination ip belongs to, without
+ * waiting for room.  It is serialized before the lock is taken, and
+ * what the socket does not take waits in its output buffer.  The packet
+ * is not consumed.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] packet:	The packet to send.
+ */
+void users_send_packet(users_t *users, packet_t *packet)
 {
-	queue_t *q = NULL;
+	int fd = 0;
+	int size;
+	char *frame = NULL;
+
+	frame = serialize(packet, &size);
+	if (!frame) {
+		return;
+	}
 
 	pthread_mutex_lock(users->hs_protect);
-	q = fdhs_get_keys(users->sockets);
+	fd = ip_get_fd(users->ips, packet->header.dst_ip);
+	if (!fd) {
+		LOG_WARN(("Failed to send message in users.c!!!\n"));
+	} else if (UDP_IS_CHANNEL(fd)) {
+		udp_send(users->udp, &fd, &frame, &size, 1);
+	} else {
+		users_write(users, fd, &frame, &size, 1);
+	}
 	pthread_mutex_unlock(users->hs_protect);
 
-	return q;
+	free(frame);
 }
 
+/**
+ * Send a batch of packets, each to the user its destination ip belongs
+ * to.  The packets for the same user keep their order and go out
+ * together, in as few system calls as possible.  The packets are not
+ * consumed.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] packets:	The packets to send.
+ * @param[in] count:	The number of packets.
+ */
+void users_send_batch(users_t *users, packet_t **packets, int count)
+{
+	int i, j, n;
+	int datagrams = 0;
+	int *fds = NULL;
+	int *sizes = NULL;
+	char **frames = NULL;
+	int *group_sizes = NULL;
+	char **group = NULL;
+
+	if (count <= 0) {
+		return;
+	}
+	fds = malloc(count * sizeof(int));
+	sizes = malloc(count * sizeof(int));
+	frames = malloc(count * sizeof(char *));
+	group_sizes = malloc(count * sizeof(int));
+	group = malloc(count * sizeof(char *));
+	if ((!fds) || (!sizes) || (!frames) || (!group_sizes) || (!group)) {
+		fprintf(stderr, "failed to malloc send batch\n");
+		free(fds);
+		free(sizes);
+		free(frames);
+		free(group_sizes);
+		free(group);
+		for (i = 0; i < count; i++) {
+			users_send_packet(users, packets[i]);
+		}
+		return;
+	}
 
+	/* serialize before taking the lock */
+	for (i = 0; i < count; i++) {
+		frames[i] = serialize(packets[i], &sizes[i]);
+	}
 
-void users_send_packet(users_t *users, packet_t *packet)
+	pthread_mutex_lock(users->hs_protect);
+	for (i = 0; i < count; i++) {
+		fds[i] = ip_get_fd(users->ips, packets[i]->header.dst_ip);
+		if (!fds[i]) {
+			LOG_WARN(("Failed to send message in users.c!!!\n"));
+		}
+	}
+
+	/* one gathered write per destination, in the order of the batch */
+	for (i = 0; i < count; i++) {
+		if (!fds[i]) {
+			continue;
+		}
+		if (UDP_IS_CHANNEL(fds[i])) {
+			/* the datagrams go together at the end, swapped to the
+			 * front of the arrays, which i has already passed */
+			group[0] = frames[datagrams];
+			frames[datagrams] = frames[i];
+			frames[i] = group[0];
+			n = sizes[datagrams];
+			sizes[datagrams] = sizes[i];
+			sizes[i] = n;
+			fds[datagrams] = fds[i];
+			datagrams++;
+			continue;
+		}
+		n = 0;
+		for (j = i; j < count; j++) {
+			if (fds[j] == fds[i]) {
+				group[n] = frames[j];
+				group_sizes[n] = sizes[j];
+				n++;
+				if (j != i) {
+					fds[j] = 0;
+				}
+			}
+		}
+		users_write(users, fds[i], group, group_sizes, n);
+	}
+	if (datagrams) {
+		udp_send(users->udp, fds, frames, sizes, datagrams);
+	}
+	pthread_mutex_unlock(users->hs_protect);
+
+	for (i = 0; i < count; i++) {
+		free(frames[i]);
+	}
+	free(fds);
+	free(sizes);
+	free(frames);
+	free(group_sizes);
+	free(group);
+}
+
+/**
+ * Send a serialized packet over a socket, without waiting for room in
+ * it.  What the socket does not take waits in its output buffer, behind
+ * anything already waiting there.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ * @param[in] frame:	The serialized packet.  It is not free'd.
+ * @param[in] size:		The size of the frame.
+ */
+void users_send_frame(users_t *users, int fd, char *frame, int size)
 {
-	int fd = 0;
+	pthread_mutex_lock(users->hs_protect);
+	users_write(users, fd, &frame, &size, 1);
+	pthread_mutex_unlock(users->hs_protect);
+}
 
+/**
+ * Check whether output waits for room in a socket.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if it does, FALSE(0) if not.
+ */
+int users_has_output(users_t *users, int fd)
+{
+	outbuf_t *out = NULL;
+	int waiting;
+
+	/* the common case, nothing waits anywhere, takes no lock */
+	if (!__atomic_load_n(&users->backlogged, __ATOMIC_ACQUIRE)) {
+		return FALSE;
+	}
 	pthread_mutex_lock(users->hs_protect);
-	fd = ip_get_fd(users->ips, packet->header.dst_ip);
-	if (!fd) {
-		pthread_mutex_unlock(users->hs_protect);
-		fprintf(stderr, "Failed to send message in users.c!!!\n");
-		return;
+	out = users_output(users, fd);
+	/* a write in flight flushes the rest itself once it completes */
+	waiting = (out) && (!out->inflight) && (outbuf_pending(out) > 0);
+	pthread_mutex_unlock(users->hs_protect);
+	return waiting;
+}
+
+/**
+ * Write as much of the output waiting for a socket as it takes, once it
+ * has room.  A socket that failed is shut down, for its listener to drop.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if output still waits, FALSE(0) if not.
+ */
+int users_flush(users_t *users, int fd)
+{
+	outbuf_t *out = NULL;
+	int waited;
+	int left = 0;
+
+	pthread_mutex_lock(users->hs_protect);
+	out = users_output(users, fd);
+	if (out) {
+		waited = outbuf_pending(out);
+		left = outbuf_flush(out, fd);
+		if (left < 0) {
+			users_cut_off(users, fd, out, waited);
+			left = 0;
+		} else {
+			users_note_waiting(users, fd, out, waited);
+		}
 	}
+	pthread_mutex_unlock(users->hs_protect);
+	return left > 0;
+}
 
-	send_packet(packet, fd);
+/**
+ * Take a socket for a write the caller makes outside of the users, such
+ * as a send on the ring of a listener.  Only a socket that nothing waits
+ * for can be taken, and until users_release gives it back, everything
+ * written to it waits in its output buffer.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if the socket was taken, FALSE(0) if output waits for
+ * it, or it is taken already.
+ */
+int users_claim(users_t *users, int fd)
+{
+	outbuf_t *out = NULL;
+	int claimed = FALSE;
 
+	pthread_mutex_lock(users->hs_protect);
+	out = users_output(users, fd);
+	if ((out) && (!out->inflight) && (!outbuf_pending(out))) {
+		out->inflight = TRUE;
+		claimed = TRUE;
+	}
 	pthread_mutex_unlock(users->hs_protect);
+	return claimed;
+}
 
+/**
+ * Give back a socket taken with users_claim, once the write is done, and
+ * write what waited for it meanwhile.  A socket whose write failed is
+ * shut down, for its listener to drop.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ * @param[in] failed:	The write did not go out whole.
+ */
+void users_release(users_t *users, int fd, int failed)
+{
+	outbuf_t *out = NULL;
+	int waited;
+
+	pthread_mutex_lock(users->hs_protect);
+	out = users_output(users, fd);
+	if (out) {
+		out->inflight = FALSE;
+		waited = outbuf_pending(out);
+		if ((failed) || (outbuf_flush(out, fd) < 0)) {
+			users_cut_off(users, fd, out, waited);
+		} else {
+			users_note_waiting(users, fd, out, waited);
+		}
+	}
+	pthread_mutex_unlock(users->hs_protect);
 }
 
 void remove_channel(users_t *users, int fd)
@@ -112,15 +399,16 @@ void remove_channel(users_t *users, int fd)
 	if (ip) {
 		ip_hashset_remove(users->ips, ip);
 	} else {
-		fprintf(stderr, "this is weird when removing fd\n");
+		LOG_WARN(("this is weird when removing fd\n"));
 		pthread_mutex_unlock(users->hs_protect);
 		return;
 	}
 	fd_hashset_remove(users->sockets, fd);
+	users_drop_output(users, fd);
 
-	printf("User %d.%d.%d.%d went offline, %d still online\n", 
+	LOG_INFO(("User %d.%d.%d.%d went offline, %d still online\n", 
 			(int)ip[0], (int)ip[1], (int)ip[2], (int)ip[3],
-			ip_hashset_content_count(users->ips));
+			ip_hashset_content_count(users->ips)));
 
 	free(ip);
 	pthread_mutex_unlock(users->hs_protect);
@@ -135,31 +423,77 @@ void remove_ip(users_t *users, unsigned char *ip)
 	fd = ip_get_fd(users->ips, ip);
 	if (fd) {
 		fd_hashset_remove(users->sockets, fd);
+		users_drop_output(users, fd);
 	} else {
-		fprintf(stderr, "this is weird when removing ip\n");
+		LOG_WARN(("this is weird when removing ip\n"));
 		pthread_mutex_unlock(users->hs_protect);
 		return;
 	}
 	ip_hashset_remove(users->ips, ip);
 
-	printf("User %d.%d.%d.%d went offline, %d still online\n", 
+	LOG_INFO(("User %d.%d.%d.%d went offline, %d still online\n", 
 			(int)ip[0], (int)ip[1], (int)ip[2], (int)ip[3],
-			ip_hashset_content_count(users->ips));
+			ip_hashset_content_count(users->ips)));
 
 	pthread_mutex_unlock(users->hs_protect);
 }
 
-int add_connection(users_t *users,int fd)
+/**
+ * Add a new socket file descriptor to the users.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The channel of the connection.
+ * @param[in] wake:		The outwake of the listener serving the socket,
+ *						told when output starts to wait for it, or NULL
+ *						for a channel that is not a socket.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int add_connection(users_t *users, int fd, outwake_t *wake)
 {
 	unsigned char localhost[4] = {127,
 	0,
 	0,
 	1
 	};
+	outbuf_t **outs = NULL;
+	int cap;
+
 	pthread_mutex_lock(users->hs_protect);
 
 	if (!fd_hashset_insert(users->sockets, fd, localhost)) {
-		printf("failed to insert into socket list");
+		LOG_WARN(("failed to insert into socket list\n"));
+		pthread_mutex_unlock(users->hs_protect);
+		return 0;
+	}
+	if (!wake) {
+		pthread_mutex_unlock(users->hs_protect);
+		return 1;
+	}
+
+	/* the output buffers are indexed by socket, like the connections */
+	if (fd >= users->outs_cap) {
+		cap = users->outs_cap ? users->outs_cap : 64;
+		while (cap <= fd) {
+			cap *= 2;
+		}
+		outs = realloc(users->outs, cap * sizeof(outbuf_t *));
+		if (!outs) {
+			fprintf(stderr, "failed to grow the output buffers\n");
+			fd_hashset_remove(users->sockets, fd);
+			pthread_mutex_unlock(users->hs_protect);
+			return 0;
+		}
+		memset(outs + users->outs_cap, 0, 
+				(cap - users->outs_cap) * sizeof(outbuf_t *));
+		users->outs = outs;
+		users->outs_cap = cap;
+	}
+	users_drop_output(users, fd);
+	users->outs[fd] = new_outbuf(wake);
+	if (!users->outs[fd]) {
+		fd_hashset_remove(users->sockets, fd);
+		pthread_mutex_unlock(users->hs_protect);
 		return 0;
 	}
 
@@ -167,12 +501,26 @@ int add_connection(users_t *users,int fd)
 	return 1;
 }
 
+/**
+ * Remove a socket that never logged in from the users.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket file descriptor.
+ */
+void remove_connection(users_t *users, int fd)
+{
+	pthread_mutex_lock(users->hs_protect);
+	fd_hashset_remove(users->sockets, fd);
+	users_drop_output(users, fd);
+	pthread_mutex_unlock(users->hs_protect);
+}
+
 int login_connection(users_t *users, int fd, unsigned char *ip)
 {
 	pthread_mutex_lock(users->hs_protect);
 
 	if (!ip_hashset_insert(users->ips, ip, fd)) {
-		printf("failed to insert into ip list\n");
+		LOG_DEBUG(("failed to insert into ip list\n"));
 		pthread_mutex_unlock(users->hs_protect);
 		return 0;
 	}
@@ -185,3 +533,79 @@ int login_connection(users_t *users, int fd, unsigned char *ip)
 	return 1;
 }
 
+/*** Helper Functions ****************************************************/
+
+/* the output buffer of a socket, NULL if it has none.  The lock is
+ * held */
+outbuf_t *users_output(users_t *users, int fd)
+{
+	if ((fd < 0) || (fd >= users->outs_cap)) {
+		return NULL;
+	}
+	return users->outs[fd];
+}
+
+/* let go of the output buffer of a socket that went away.  The lock is
+ * held */
+void users_drop_output(users_t *users, int fd)
+{
+	outbuf_t *out = users_output(users, fd);
+
+	if (!out) {
+		return;
+	}
+	if (outbuf_pending(out) > 0) {
+		__atomic_sub_fetch(&users->backlogged, 1, __ATOMIC_RELEASE);
+	}
+	free_outbuf(out);
+	users->outs[fd] = NULL;
+}
+
+/* write frames to a channel without waiting, the lock held */
+void users_write(users_t *users, int fd, char **frames, int *sizes,
+		int count)
+{
+	outbuf_t *out = users_output(users, fd);
+	int waited;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		packet_tap(frames[i], sizes[i], TAP_OUT);
+	}
+	if (!out) {
+		LOG_DEBUG(("no output buffer for %d\n", fd));
+		send_frames(frames, sizes, count, fd);
+		return;
+	}
+	waited = outbuf_pending(out);
+	if (!outbuf_send(out, fd, frames, sizes, count)) {
+		users_cut_off(users, fd, out, waited);
+		return;
+	}
+	users_note_waiting(users, fd, out, waited);
+}
+
+/* keep count of the sockets output waits for, and have the listener
+ * of one watch it once output starts to wait */
+void users_note_waiting(users_t *users, int fd, outbuf_t *out, int waited)
+{
+	int waiting = outbuf_pending(out);
+
+	if ((!waited) && (waiting)) {
+		__atomic_add_fetch(&users->backlogged, 1, __ATOMIC_RELEASE);
+		outbuf_wake(out, fd);
+	} else if ((waited) && (!waiting)) {
+		__atomic_sub_fetch(&users->backlogged, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/* give up on a socket that failed or can't keep up.  Its listener
+ * reads the end of it and drops it */
+void users_cut_off(users_t *users, int fd, outbuf_t *out, int waited)
+{
+	LOG_INFO(("giving up on writing to %d\n", fd));
+	out->start = 0;
+	out->len = 0;
+	users_note_waiting(users, fd, out, waited);
+	shutdown(fd, SHUT_RDWR);
+}
@@ -8,11 +8,23 @@
 #include "../hashset/fd_hashset.h"
 #include "../queue/queue.h"
 #include "../packet/packet.h"
+#include "outbuf.h"
 
+/*
+ * The users are kept by channel: the socket of a TCP connection, or a
+ * negative number for a session of the datagram transport, see udp.h.
+ * The sockets are non-blocking, and each has an output buffer for what
+ * it did not take yet, kept under the same lock as the rest.
+ */
 typedef struct users {
 	ip_hashset_ptr ips;
 	fd_hashset_ptr sockets;
 	pthread_mutex_t *hs_protect;
+	struct udp *udp;			/* Sends to the negative channels, may be NULL */
+	outbuf_t **outs;			/* outs[fd], NULL if fd has none */
+	int outs_cap;				/* The number of slots in outs */
+	int backlogged;				/* The sockets output waits for, read
+								 * without the lock */
 } users_t;
 
 /**
@@ -28,23 +40,99 @@ users_t *new_users();
 void free_users(users_t *users);
 
 /**
- * Get a queue of the userips of all online users.
+ * Copy the userips of all online users into a buffer owned by the
+ * caller, 4 bytes per ip.  The buffer is only grown when it is too
+ * small, so a caller that keeps it around allocates nothing once it is
+ * big enough.
  *
- * @param[in] users: The struct maintaining a list of online users.
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in,out] ips:	The buffer, may point to NULL at first.
+ * @param[in,out] cap:	The number of ips the buffer has room for.
  *
- * @return A queue of all the currently online userips.
+ * @return The number of ips copied, -1 if the buffer could not grow.
  */
-queue_t *get_ips(users_t *users);
+int users_copy_ips(users_t *users, unsigned char **ips, int *cap);
 
 /**
- * Get the socket file descriptors of all online users.
+ * Send a packet to the user its destination ip belongs to, without
+ * waiting for room.  It is serialized before the lock is taken, and
+ * what the socket does not take waits in its output buffer.  The packet
+ * is not consumed.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] packet:	The packet to send.
  */
-queue_t *get_fds(users_t *users);
+void users_send_packet(users_t *users, packet_t *packet);
 
 /**
- * Send a packet.
+ * Send a batch of packets, each to the user its destination ip belongs
+ * to.  The packets for the same user keep their order and go out
+ * together, in as few system calls as possible.  The packets are not
+ * consumed.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] packets:	The packets to send.
+ * @param[in] count:	The number of packets.
  */
-void users_send_packet(users_t *users, packet_t *packet);
+void users_send_batch(users_t *users, packet_t **packets, int count);
+
+/**
+ * Send a serialized packet over a socket, without waiting for room in
+ * it.  What the socket does not take waits in its output buffer, behind
+ * anything already waiting there.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ * @param[in] frame:	The serialized packet.  It is not free'd.
+ * @param[in] size:		The size of the frame.
+ */
+void users_send_frame(users_t *users, int fd, char *frame, int size);
+
+/**
+ * Check whether output waits for room in a socket.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if it does, FALSE(0) if not.
+ */
+int users_has_output(users_t *users, int fd);
+
+/**
+ * Write as much of the output waiting for a socket as it takes, once it
+ * has room.  A socket that failed is shut down, for its listener to drop.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if output still waits, FALSE(0) if not.
+ */
+int users_flush(users_t *users, int fd);
+
+/**
+ * Take a socket for a write the caller makes outside of the users, such
+ * as a send on the ring of a listener.  Only a socket that nothing waits
+ * for can be taken, and until users_release gives it back, everything
+ * written to it waits in its output buffer.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ *
+ * @return TRUE(1) if the socket was taken, FALSE(0) if output waits for
+ * it, or it is taken already.
+ */
+int users_claim(users_t *users, int fd);
+
+/**
+ * Give back a socket taken with users_claim, once the write is done, and
+ * write what waited for it meanwhile.  A socket whose write failed is
+ * shut down, for its listener to drop.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket.
+ * @param[in] failed:	The write did not go out whole.
+ */
+void users_release(users_t *users, int fd, int failed);
 
 /**
  * Remove a file descriptor from users.
@@ -58,8 +146,24 @@ void remove_ip(users_t *users, unsigned char *ip);
 
 /**
  * Add a new socket file descriptor to the users.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The channel of the connection.
+ * @param[in] wake:		The outwake of the listener serving the socket,
+ *						told when output starts to wait for it, or NULL
+ *						for a channel that is not a socket.
+ *
+ * @return 1 on success, 0 on failure.
+ */
+int add_connection(users_t *users, int fd, outwake_t *wake);
+
+/**
+ * Remove a socket that never logged in from the users.
+ *
+ * @param[in] users:	The struct maintaining a list of online users.
+ * @param[in] fd:		The socket file descriptor.
  */
-int add_connection(users_t *users, int fd);
+void remove_connection(users_t *users, int fd);
 
 /**
  * process the overhead of a newly logged in user.